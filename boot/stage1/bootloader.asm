@@ -39,6 +39,7 @@ start:
     ; Jump to second stage if loaded successfully
     mov si, JumpingMsg
     call PrintString
+    mov dl, [DriveId]   ; Stage 2 reads the kernel from the same drive
     jmp 0:0x8000    ; Jump to stage 2 bootloader at 0x8000
 
 ;--------------------------------------------------
@@ -120,7 +121,7 @@ LoadStage2:
     ; Set up disk address packet (DAP) for LBA disk read
     mov si, DAP
     mov word [si], 0x0010       ; DAP size (16 bytes) and zero
-    mov word [si+2], 4          ; Number of sectors to read (2048 bytes)
+    mov word [si+2], 8          ; Number of sectors to read (4096 bytes, STAGE2_SECTORS in stage2.asm)
     mov word [si+4], 0x8000     ; Offset to load to
     mov word [si+6], 0          ; Segment to load to
     mov dword [si+8], 1         ; Starting LBA (sector 1, right after boot sector)
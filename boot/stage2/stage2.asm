@@ -3,12 +3,26 @@
 ;
 ; This is loaded by the first stage bootloader and is responsible for:
 ; 1. Switching from real mode to protected mode
-; 2. Loading the kernel
+; 2. Loading the kernel ELF and staging its segments
 ; 3. Transferring control to the kernel
 
 [BITS 16]                       ; Still in 16-bit Real Mode initially
 [ORG 0x8000]                    ; Stage 2 will be loaded at this address
 
+; Disk layout: stage 1 at LBA 0, stage 2 (STAGE2_SECTORS) from LBA 1, kernel after it
+STAGE2_SECTORS       equ 8
+KERNEL_LBA           equ 1 + STAGE2_SECTORS
+
+; Kernel sectors are read here before being copied to their load addresses
+BOUNCE_SEGMENT       equ 0x2000
+BOUNCE_BASE          equ 0x20000
+
+; Largest sector count every BIOS accepts in one AH=42h read
+MAX_CHUNK_SECTORS    equ 127
+
+; PT_LOAD segments the loader can stage (16 bytes each in KernelSegments)
+MAX_KERNEL_SEGMENTS  equ 8
+
 ;--------------------------------------------------
 ; Stage 2 Entry Point
 ;--------------------------------------------------
@@ -19,11 +33,18 @@ stage2_start:
     mov es, ax
     mov ss, ax
     mov sp, 0x7C00              ; Set stack below our code
+    cld
+    
+    ; Stage 1 passes the boot drive in DL
+    mov [DriveId], dl
     
     ; Print message to confirm stage 2 is loaded
     mov si, Stage2LoadedMsg
     call PrintString
 
+    ; The kernel is copied above 1MB, so A20 must be open before loading it
+    call EnableA20
+    
     ; Load the kernel into memory before switching to protected mode
     call LoadKernel
     
@@ -43,7 +64,12 @@ stage2_start:
 
 ;--------------------------------------------------
 ; Function: LoadKernel
-; Loads the kernel from disk into memory
+; Loads the kernel ELF from disk and stages its PT_LOAD segments
+;
+; The first sector holds the ELF and program headers. They give the
+; file extent, so the image is read in MAX_CHUNK_SECTORS reads through
+; a bounce buffer below 1MB. Each chunk is copied to the physical
+; addresses of the segments it covers, then .bss is zeroed.
 ;--------------------------------------------------
 LoadKernel:
     mov si, LoadingKernelMsg
@@ -51,33 +77,308 @@ LoadKernel:
     
     ; Reset disk system
     xor ax, ax
-    mov dl, [DriveId]           ; DriveId should be passed from stage1
+    mov dl, [DriveId]
     int 0x13
     jc .load_error
     
+    ; Read the ELF header and program headers
+    xor eax, eax
+    mov cx, 1
+    call ReadKernelSectors
+    jc .load_error
+    
+    call ParseKernelHeaders
+    jc .bad_elf
+    
+    ; Stream the file in the largest chunks the BIOS accepts
+    mov dword [ChunkSector], 0
+
+.next_chunk:
+    mov eax, [KernelSectors]
+    sub eax, [ChunkSector]
+    jz .loaded
+    cmp eax, MAX_CHUNK_SECTORS
+    jbe .have_count
+    mov eax, MAX_CHUNK_SECTORS
+
+.have_count:
+    mov cx, ax
+    mov eax, [ChunkSector]
+    call ReadKernelSectors
+    jc .load_error
+    
+    ; File range held by this chunk
+    mov eax, [ChunkSector]
+    shl eax, 9
+    mov [ChunkStart], eax
+    movzx edx, cx
+    shl edx, 9
+    add eax, edx
+    mov [ChunkEnd], eax
+    
+    call CopyChunk
+    
+    movzx eax, cx
+    add [ChunkSector], eax
+    jmp .next_chunk
+
+.loaded:
+    call ZeroKernelBss
+    
+    mov si, KernelLoadedMsg
+    call PrintString
+    ret
+
+.bad_elf:
+    mov si, KernelBadElfMsg
+    call PrintString
+    jmp $                       ; Halt on error
+
+.load_error:
+    mov si, KernelErrorMsg
+    call PrintString
+    jmp $                       ; Halt on error
+
+;--------------------------------------------------
+; Function: ReadKernelSectors
+; Reads kernel sectors into the bounce buffer
+; Input: EAX = First sector (relative to the kernel), CX = Sector count
+; Output: Carry set on error
+;--------------------------------------------------
+ReadKernelSectors:
+    push si
+    
     ; Set up disk address packet for LBA disk read
     mov si, KernelDAP
     mov word [si], 0x0010       ; DAP size (16 bytes) and zero
-    mov word [si+2], 32         ; Number of sectors to read (16KB should be enough for now)
+    mov [si+2], cx              ; Number of sectors to read
     mov word [si+4], 0x0000     ; Offset to load to
-    mov word [si+6], 0x1000     ; Segment to load to (0x10000 physical)
-    mov dword [si+8], 5         ; Starting LBA (sector 5, after bootloaders)
+    mov word [si+6], BOUNCE_SEGMENT
+    add eax, KERNEL_LBA
+    mov [si+8], eax             ; Starting LBA
     mov dword [si+12], 0        ; Upper 32 bits of 48-bit LBA (unused)
     
-    ; Read kernel using LBA
+    ; Read using LBA
     mov ah, 0x42                ; Extended read function
     mov dl, [DriveId]
     int 0x13
-    jc .load_error
     
-    mov si, KernelLoadedMsg
-    call PrintString
+    pop si
     ret
+
+;--------------------------------------------------
+; Function: ParseKernelHeaders
+; Checks the ELF header in the bounce buffer and records the PT_LOAD
+; segments, the entry point and the number of sectors to read
+; Output: Carry set if the image is not a usable ELF file
+;--------------------------------------------------
+ParseKernelHeaders:
+    push fs
+    mov ax, BOUNCE_SEGMENT
+    mov fs, ax
     
-.load_error:
-    mov si, KernelErrorMsg
-    call PrintString
-    jmp $                       ; Halt on error
+    cmp dword [fs:0], 0x464C457F    ; "\x7FELF"
+    jne .bad
+    cmp byte [fs:4], 1              ; ELFCLASS32
+    jne .bad
+    
+    mov eax, [fs:24]                ; e_entry
+    mov [KernelEntry], eax
+    
+    ; The program headers must sit in the first sector
+    mov ebx, [fs:28]                ; e_phoff
+    movzx edx, word [fs:42]         ; e_phentsize
+    movzx ecx, word [fs:44]         ; e_phnum
+    mov eax, edx
+    imul eax, ecx
+    add eax, ebx
+    cmp eax, 512
+    ja .bad
+    
+    mov di, KernelSegments
+    xor ebp, ebp                    ; File extent
+    mov word [KernelSegmentCount], 0
+
+.next_header:
+    jcxz .headers_done
+    cmp dword [fs:bx], 1            ; PT_LOAD
+    jne .skip_header
+    
+    cmp word [KernelSegmentCount], MAX_KERNEL_SEGMENTS
+    jae .bad
+    
+    mov eax, [fs:bx+4]              ; p_offset
+    mov [di], eax
+    mov eax, [fs:bx+12]             ; p_paddr
+    mov [di+4], eax
+    mov eax, [fs:bx+16]             ; p_filesz
+    mov [di+8], eax
+    mov eax, [fs:bx+20]             ; p_memsz
+    mov [di+12], eax
+    
+    ; Track the end of the last file-backed byte
+    mov eax, [di]
+    add eax, [di+8]
+    cmp eax, ebp
+    jbe .counted
+    mov ebp, eax
+
+.counted:
+    add di, 16
+    inc word [KernelSegmentCount]
+
+.skip_header:
+    add bx, dx
+    dec cx
+    jmp .next_header
+
+.headers_done:
+    cmp word [KernelSegmentCount], 0
+    je .bad
+    
+    add ebp, 511
+    shr ebp, 9
+    mov [KernelSectors], ebp
+    
+    pop fs
+    clc
+    ret
+
+.bad:
+    pop fs
+    stc
+    ret
+
+;--------------------------------------------------
+; Function: CopyChunk
+; Copies the bounce buffer to every segment it overlaps
+; Input: ChunkStart/ChunkEnd = File range held by the bounce buffer
+;--------------------------------------------------
+CopyChunk:
+    pushad
+    call EnterUnrealMode
+    
+    mov bx, KernelSegments
+    mov bp, [KernelSegmentCount]
+
+.next_segment:
+    test bp, bp
+    jz .done
+    
+    ; Overlap of [ChunkStart, ChunkEnd) with [p_offset, p_offset + p_filesz)
+    mov eax, [bx]
+    cmp eax, [ChunkStart]
+    jae .have_low
+    mov eax, [ChunkStart]
+
+.have_low:
+    mov edx, [bx]
+    add edx, [bx+8]
+    cmp edx, [ChunkEnd]
+    jbe .have_high
+    mov edx, [ChunkEnd]
+
+.have_high:
+    cmp eax, edx
+    jae .skip_segment
+    
+    mov edi, [bx+4]             ; p_paddr + (low - p_offset)
+    add edi, eax
+    sub edi, [bx]
+    mov ecx, edx                ; high - low bytes
+    sub ecx, eax
+    mov esi, eax                ; Bounce buffer + (low - ChunkStart)
+    sub esi, [ChunkStart]
+    add esi, BOUNCE_BASE
+    
+    ; Whole dwords, then the tail bytes
+    mov edx, ecx
+    shr ecx, 2
+    a32 rep movsd
+    mov ecx, edx
+    and ecx, 3
+    a32 rep movsb
+
+.skip_segment:
+    add bx, 16
+    dec bp
+    jmp .next_segment
+
+.done:
+    popad
+    ret
+
+;--------------------------------------------------
+; Function: ZeroKernelBss
+; Zeroes the part of each segment past its file data
+;--------------------------------------------------
+ZeroKernelBss:
+    pushad
+    call EnterUnrealMode
+    
+    mov bx, KernelSegments
+    mov bp, [KernelSegmentCount]
+    xor eax, eax
+
+.next_segment:
+    test bp, bp
+    jz .done
+    
+    mov edi, [bx+4]             ; p_paddr + p_filesz
+    add edi, [bx+8]
+    mov ecx, [bx+12]            ; p_memsz - p_filesz bytes
+    sub ecx, [bx+8]
+    jbe .skip_segment
+    
+    ; Whole dwords, then the tail bytes
+    mov edx, ecx
+    shr ecx, 2
+    a32 rep stosd
+    mov ecx, edx
+    and ecx, 3
+    a32 rep stosb
+
+.skip_segment:
+    add bx, 16
+    dec bp
+    jmp .next_segment
+
+.done:
+    popad
+    ret
+
+;--------------------------------------------------
+; Function: EnterUnrealMode
+; Gives DS and ES a 4GB limit while staying in real mode
+;
+; Loading the flat data selector in protected mode caches its limit,
+; and returning to real mode keeps that limit. Done again before each
+; copy in case a BIOS call reset the segment caches.
+;--------------------------------------------------
+EnterUnrealMode:
+    pushf
+    cli
+    push ds
+    push es
+    
+    lgdt [GDTDescriptor]
+    mov eax, cr0
+    or al, 1                    ; Set PE
+    mov cr0, eax
+    jmp $+2                     ; Flush the prefetch queue
+    
+    mov bx, 0x10                ; Flat data selector
+    mov ds, bx
+    mov es, bx
+    
+    and al, 0xFE                ; Clear PE
+    mov cr0, eax
+    
+    ; Real-mode segment values, the 4GB limits stay cached
+    pop es
+    pop ds
+    popf
+    ret
 
 ;--------------------------------------------------
 ; Function: PrintString (16-bit mode)
@@ -89,7 +390,7 @@ PrintString:
     
     mov ah, 0x0E                ; BIOS teletype function
     mov bx, 0x07                ; Page 0, text attribute 7 (light gray)
-    
+
 .loop:
     lodsb                       ; Load next character from SI into AL
     test al, al                 ; Check if character is 0 (end of string)
@@ -97,7 +398,7 @@ PrintString:
     
     int 0x10                    ; Print character
     jmp .loop
-    
+
 .done:
     pop bx
     pop ax
@@ -142,12 +443,12 @@ GetMemoryMap:
     ; Increment counter
     inc byte [MemoryMapEntries]
     jmp .next_entry
-    
+
 .error:
     mov si, MemMapErrorMsg
     call PrintString
     ret
-    
+
 .done:
     ; Print success message with entry count
     mov si, MemMapSuccessMsg
@@ -182,9 +483,6 @@ PrepareForProtectedMode:
     ; Load Global Descriptor Table
     lgdt [GDTDescriptor]
     
-    ; Enable A20 line
-    call EnableA20
-    
     ret
 
 ;--------------------------------------------------
@@ -211,10 +509,10 @@ EnableA20:
     out 0x64, al
     
     call .wait_input
-    
+
 .done:
     ret
-    
+
 .wait_input:
     in al, 0x64
     test al, 2                  ; Check if input buffer is empty
@@ -236,7 +534,7 @@ EnterProtectedMode:
     
     ; Far jump to code segment to load CS with proper descriptor
     jmp 0x08:ProtectedModeEntry ; 0x08 is the code segment selector
-    
+
 ;--------------------------------------------------
 ; 32-bit Protected Mode Code
 ;--------------------------------------------------
@@ -262,11 +560,11 @@ ProtectedModeEntry:
     mov esi, KernelJumpMsg
     call Print32
     
-    ; Jump to the kernel at 0x100000 (1MB)
+    ; Jump to the ELF entry point
     ; Pass memory map location in EBX and entry count in ECX
     mov ebx, MemoryMapBuffer
     movzx ecx, byte [MemoryMapEntries]
-    jmp 0x08:0x100000
+    jmp dword [KernelEntry]
 
 ;--------------------------------------------------
 ; Function: Print32 (32-bit Protected Mode)
@@ -276,7 +574,7 @@ ProtectedModeEntry:
 Print32:
     pusha
     mov edi, 0xB8000 + (24 * 80 * 2)  ; Start at the last line
-    
+
 .clear_line:
     ; Clear the line
     mov ecx, 80                       ; 80 columns
@@ -285,7 +583,7 @@ Print32:
     
     ; Reset to beginning of line
     mov edi, 0xB8000 + (24 * 80 * 2)
-    
+
 .loop:
     lodsb                             ; Load next character
     test al, al                       ; Check if end of string
@@ -295,7 +593,7 @@ Print32:
     mov [edi], ax                     ; Write to video memory
     add edi, 2                        ; Next character position
     jmp .loop
-    
+
 .done:
     popa
     ret
@@ -331,12 +629,13 @@ GDTDescriptor:
 ;--------------------------------------------------
 ; Data Section
 ;--------------------------------------------------
-DriveId:             db 0       ; This should be set by stage 1 bootloader
+DriveId:             db 0       ; Boot drive, passed by stage 1 in DL
 
 Stage2LoadedMsg:      db 'Stage 2 bootloader loaded successfully', 13, 10, 0
 LoadingKernelMsg:     db 'Loading kernel...', 13, 10, 0
 KernelLoadedMsg:      db 'Kernel loaded successfully', 13, 10, 0
 KernelErrorMsg:       db 'Error loading kernel', 13, 10, 0
+KernelBadElfMsg:      db 'Kernel is not a loadable ELF file', 13, 10, 0
 MemMapMsg:            db 'Getting memory map...', 13, 10, 0
 MemMapErrorMsg:       db 'Error getting memory map', 13, 10, 0
 MemMapSuccessMsg:     db 'Memory map obtained. Entries: ', 0
@@ -352,8 +651,19 @@ MemoryMapEntries:     db 0
 ; Disk Address Packet for kernel load
 KernelDAP:            times 16 db 0
 
+; Kernel image, from the ELF headers
+KernelEntry:          dd 0
+KernelSectors:        dd 0      ; Sectors up to the end of the last PT_LOAD file data
+KernelSegmentCount:   dw 0
+KernelSegments:       times MAX_KERNEL_SEGMENTS * 16 db 0   ; p_offset, p_paddr, p_filesz, p_memsz
+
+; Chunk being staged
+ChunkSector:          dd 0      ; First sector of the chunk, relative to the kernel
+ChunkStart:           dd 0      ; File offset range held by the bounce buffer
+ChunkEnd:             dd 0
+
 ; Buffer for memory map (24 bytes per entry, max 20 entries = 480 bytes)
 MemoryMapBuffer:      times 480 db 0
 
-; Padding to ensure the file is at least 512 bytes (for testing)
-times 2048-($-$$) db 0
\ No newline at end of file
+; Pad to the size stage 1 loads
+times STAGE2_SECTORS*512-($-$$) db 0
\ No newline at end of file
@@ -13,6 +13,23 @@ YELLOW='\033[0;33m'
 BLUE='\033[0;34m'
 NC='\033[0m' # No Color
 
+# Kernel compiler flags
+# "./build.sh profile" builds with the profiling counters compiled in
+# "./build.sh bench" builds a kernel that runs the benchmarks and exits QEMU
+# "./build.sh tags" records the call site of every live heap allocation
+KERNEL_CFLAGS="-ffreestanding -O2 -Wall -Wextra"
+case "$1" in
+    profile)
+        KERNEL_CFLAGS="$KERNEL_CFLAGS -DNKOF_PROFILE"
+        ;;
+    bench)
+        KERNEL_CFLAGS="$KERNEL_CFLAGS -DNKOF_BENCHMARK"
+        ;;
+    tags)
+        KERNEL_CFLAGS="$KERNEL_CFLAGS -DNKOF_HEAP_TAGS"
+        ;;
+esac
+
 echo -e "${GREEN}Building NKOF Operating System...${NC}"
 
 # Ensure stage1 and stage2 bootloader files exist
@@ -66,18 +83,41 @@ echo -e "${BLUE}Compiling kernel...${NC}"
 # Assemble kernel entry
 echo "Assembling kernel entry..."
 nasm -f elf32 kernel/arch/x86_64/entry.asm -o build/kernel_entry.o
+nasm -f elf32 kernel/arch/x86_64/isr.asm -o build/isr.o
+nasm -f elf32 kernel/arch/x86_64/switch.asm -o build/switch.o
+nasm -f elf32 kernel/arch/x86_64/trampoline.asm -o build/trampoline.o
 
 # Compile C files
 echo "Compiling kernel C files..."
-gcc -m32 -c kernel/kernel.c -o build/kernel.o -ffreestanding -O2 -Wall -Wextra
-gcc -m32 -c kernel/console.c -o build/console.o -ffreestanding -O2 -Wall -Wextra
-gcc -m32 -c kernel/mm/pmm.c -o build/pmm.o -ffreestanding -O2 -Wall -Wextra
-gcc -m32 -c kernel/mm/paging.c -o build/paging.o -ffreestanding -O2 -Wall -Wextra
-gcc -m32 -c kernel/mm/kheap.c -o build/kheap.o -ffreestanding -O2 -Wall -Wextra
+gcc -m32 -c kernel/kernel.c -o build/kernel.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/console.c -o build/console.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/mm/pmm.c -o build/pmm.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/mm/paging.c -o build/paging.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/mm/vmalloc.c -o build/vmalloc.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/mm/kheap.c -o build/kheap.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/mm/slab.c -o build/slab.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/lib/string.c -o build/string.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/lib/klog.c -o build/klog.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/lib/profile.c -o build/profile.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/interrupts.c -o build/interrupts.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/pic.c -o build/pic.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/pit.c -o build/pit.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/serial.c -o build/serial.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/apic.c -o build/apic.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/acpi.c -o build/acpi.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/smp.c -o build/smp.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/multiboot.c -o build/multiboot.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/time/timer.c -o build/timer.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/sched/sched.c -o build/sched.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/bench/bench.c -o build/bench.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/neural/neural.c -o build/neural.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/block/block.c -o build/block.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/pci.c -o build/pci.o $KERNEL_CFLAGS
+gcc -m32 -c kernel/arch/x86_64/ata.c -o build/ata.o $KERNEL_CFLAGS
 
 # Link the kernel
 echo "Linking kernel..."
-ld -m elf_i386 -T kernel/kernel.ld -o build/kernel.bin build/kernel_entry.o build/kernel.o build/console.o build/pmm.o build/paging.o build/kheap.o -nostdlib
+ld -m elf_i386 -T kernel/kernel.ld -o build/kernel.bin build/kernel_entry.o build/isr.o build/switch.o build/trampoline.o build/kernel.o build/console.o build/pmm.o build/paging.o build/vmalloc.o build/kheap.o build/slab.o build/string.o build/klog.o build/profile.o build/interrupts.o build/pic.o build/pit.o build/serial.o build/apic.o build/acpi.o build/smp.o build/multiboot.o build/timer.o build/sched.o build/bench.o build/neural.o build/block.o build/pci.o build/ata.o -nostdlib
 
 # Check if kernel compilation was successful
 if [ $? -ne 0 ]; then
@@ -112,9 +152,9 @@ if [ $? -ne 0 ]; then
     exit 1
 fi
 
-# Write kernel to the disk image (at sector 5)
+# Write kernel to the disk image (at sector 9, KERNEL_LBA in stage2.asm)
 echo -e "${BLUE}Writing kernel to disk image...${NC}"
-dd if=build/kernel.bin of=build/boot.img bs=512 seek=5 conv=notrunc
+dd if=build/kernel.bin of=build/boot.img bs=512 seek=9 conv=notrunc
 
 # Check if write was successful
 if [ $? -ne 0 ]; then
@@ -123,4 +163,11 @@ if [ $? -ne 0 ]; then
 fi
 
 echo -e "${GREEN}Build completed successfully!${NC}"
-echo "To run in Bochs, use: bochs -f bochsrc.txt"
\ No newline at end of file
+echo "To run in Bochs, use: bochs -f bochsrc.txt"
+echo "The kernel log is also written to COM1 (build/serial.log under Bochs)"
+echo "To boot the kernel directly (Multiboot), use: qemu-system-i386 -kernel build/kernel.bin -serial stdio"
+if [ "$1" = "bench" ]; then
+    echo "To run the benchmarks headless, use:"
+    echo "  qemu-system-i386 -drive file=build/boot.img,format=raw -display none -serial file:build/bench.log -device isa-debug-exit,iobase=0xf4,iosize=0x04"
+    echo "QEMU exits with status 33 when every benchmark ran, 35 otherwise"
+fi
\ No newline at end of file
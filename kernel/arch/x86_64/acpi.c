@@ -0,0 +1,220 @@
+/**
+ * NKOF ACPI Tables Implementation
+ *
+ * The RSDP is searched for in the first KB of the EBDA and in the BIOS
+ * area at 0xE0000-0xFFFFF, both inside the identity-mapped first 4MB.
+ * The RSDT and MADT can be anywhere in physical memory, so each table is
+ * mapped in turn through a small fixed virtual window while it's read.
+ */
+
+#include "../../include/acpi.h"
+#include "../../include/paging.h"
+#include "../../include/string.h"
+#include "../../include/klog.h"
+
+// Virtual window for reading tables
+#define ACPI_WINDOW       0xFE800000
+#define ACPI_WINDOW_PAGES 16
+
+// BIOS data area word holding the EBDA segment
+#define BDA_EBDA_SEGMENT 0x40E
+
+// Most RSDT entries looked at
+#define ACPI_MAX_TABLES 64
+
+// MADT entry types
+#define MADT_LOCAL_APIC 0
+
+// Local APIC entry flag: the processor can be used
+#define MADT_APIC_ENABLED (1 << 0)
+
+// Root System Description Pointer (ACPI 1.0 part)
+typedef struct {
+    char signature[8];             // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;         // Physical address of the RSDT
+} __attribute__((packed)) acpi_rsdp_t;
+
+// Header shared by all tables
+typedef struct {
+    char signature[4];
+    uint32_t length;               // Including the header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// Multiple APIC Description Table, followed by variable-length entries
+typedef struct {
+    acpi_header_t header;
+    uint32_t local_apic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+// MADT processor local APIC entry
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed)) madt_local_apic_t;
+
+/**
+ * Check that a structure's bytes sum to zero
+ */
+static bool acpi_checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint8_t sum = 0;
+    
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    
+    return sum == 0;
+}
+
+/**
+ * Map physical memory into the window, returns NULL if it doesn't fit
+ * Replaces whatever the window showed before
+ */
+static void* acpi_map(uint32_t phys, uint32_t length) {
+    uint32_t offset = phys & (PAGE_SIZE - 1);
+    uint32_t pages = (offset + length + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    if (pages > ACPI_WINDOW_PAGES) {
+        return NULL;
+    }
+    
+    if (!paging_map_range(ACPI_WINDOW, phys & 0xFFFFF000, pages, PAGE_PRESENT)) {
+        return NULL;
+    }
+    
+    return (void*)(ACPI_WINDOW + offset);
+}
+
+/**
+ * Remove the window's mappings
+ */
+static void acpi_unmap(void) {
+    paging_unmap_range(ACPI_WINDOW, ACPI_WINDOW_PAGES, false);
+}
+
+/**
+ * Map a whole table, checking its length and checksum
+ */
+static acpi_header_t* acpi_map_table(uint32_t phys) {
+    acpi_header_t* header = (acpi_header_t*)acpi_map(phys, sizeof(acpi_header_t));
+    if (!header) {
+        return NULL;
+    }
+    
+    uint32_t length = header->length;
+    if (length < sizeof(acpi_header_t)) {
+        return NULL;
+    }
+    
+    header = (acpi_header_t*)acpi_map(phys, length);
+    if (!header || !acpi_checksum_ok(header, length)) {
+        return NULL;
+    }
+    
+    return header;
+}
+
+/**
+ * Search a physical range for the RSDP on 16-byte boundaries
+ */
+static acpi_rsdp_t* acpi_scan_rsdp(uint32_t start, uint32_t length) {
+    for (uint32_t addr = start; addr + sizeof(acpi_rsdp_t) <= start + length; addr += 16) {
+        acpi_rsdp_t* rsdp = (acpi_rsdp_t*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+            acpi_checksum_ok(rsdp, sizeof(acpi_rsdp_t))) {
+            return rsdp;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Find the RSDP in the EBDA or the BIOS area
+ */
+static acpi_rsdp_t* acpi_find_rsdp(void) {
+    // The BIOS data area holds the EBDA segment. The address is hidden from
+    // the compiler, which treats pointers into the first page as NULL-based.
+    uint32_t bda_ebda = BDA_EBDA_SEGMENT;
+    asm ("" : "+r" (bda_ebda));
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t*)bda_ebda) << 4;
+    
+    acpi_rsdp_t* rsdp = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        rsdp = acpi_scan_rsdp(ebda, 1024);
+    }
+    if (!rsdp) {
+        rsdp = acpi_scan_rsdp(0xE0000, 0x20000);
+    }
+    
+    return rsdp;
+}
+
+/**
+ * Get the local APIC IDs of the enabled processors listed in the MADT
+ */
+uint32_t acpi_find_cpus(uint32_t* apic_ids, uint32_t max) {
+    acpi_rsdp_t* rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        kprintf("WARNING: No ACPI RSDP found\n");
+        return 0;
+    }
+    
+    acpi_header_t* rsdt = acpi_map_table(rsdp->rsdt_address);
+    if (!rsdt || memcmp(rsdt->signature, "RSDT", 4) != 0) {
+        kprintf("WARNING: Invalid ACPI RSDT\n");
+        acpi_unmap();
+        return 0;
+    }
+    
+    // Copy the table addresses out, the window is reused for each table
+    uint32_t tables[ACPI_MAX_TABLES];
+    uint32_t table_count = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    if (table_count > ACPI_MAX_TABLES) {
+        table_count = ACPI_MAX_TABLES;
+    }
+    memcpy(tables, rsdt + 1, table_count * 4);
+    
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < table_count; i++) {
+        acpi_header_t* header = acpi_map_table(tables[i]);
+        if (!header || memcmp(header->signature, "APIC", 4) != 0) {
+            continue;
+        }
+        
+        // Walk the variable-length entries after the fixed part
+        uint8_t* entry = (uint8_t*)header + sizeof(acpi_madt_t);
+        uint8_t* table_end = (uint8_t*)header + header->length;
+        
+        while (entry + 2 <= table_end && entry[1] >= 2 && entry + entry[1] <= table_end) {
+            if (entry[0] == MADT_LOCAL_APIC && entry[1] >= sizeof(madt_local_apic_t)) {
+                madt_local_apic_t* lapic = (madt_local_apic_t*)entry;
+                if (lapic->flags & MADT_APIC_ENABLED) {
+                    if (count < max) {
+                        apic_ids[count] = lapic->apic_id;
+                    }
+                    count++;
+                }
+            }
+            entry += entry[1];
+        }
+        break;
+    }
+    
+    acpi_unmap();
+    return count;
+}
\ No newline at end of file
@@ -0,0 +1,180 @@
+/**
+ * NKOF Local APIC Driver Implementation
+ *
+ * The local APIC registers are memory mapped (normally at 0xFEE00000) and
+ * are identity-mapped uncached here. The timer runs in one-shot mode with
+ * a divider of 16; its rate is calibrated by the timer subsystem.
+ */
+
+#include "../../include/apic.h"
+#include "../../include/cpu.h"
+#include "../../include/paging.h"
+#include "../../include/interrupts.h"
+
+// APIC base MSR and its enable bit
+#define IA32_APIC_BASE_MSR 0x1B
+#define APIC_BASE_ENABLE   (1 << 11)
+
+// Register offsets
+#define APIC_REG_ID            0x020
+#define APIC_REG_EOI           0x0B0
+#define APIC_REG_SPURIOUS      0x0F0
+#define APIC_REG_ICR_LOW       0x300
+#define APIC_REG_ICR_HIGH      0x310
+#define APIC_REG_LVT_TIMER     0x320
+#define APIC_REG_TIMER_INITIAL 0x380
+#define APIC_REG_TIMER_CURRENT 0x390
+#define APIC_REG_TIMER_DIVIDE  0x3E0
+
+// Register bits
+#define APIC_SOFTWARE_ENABLE (1 << 8)  // In the spurious vector register
+#define APIC_LVT_MASKED      (1 << 16)
+#define APIC_TIMER_DIVIDE_16 0x3
+
+// Interrupt command register bits
+#define APIC_ICR_INIT        (5 << 8)
+#define APIC_ICR_STARTUP     (6 << 8)
+#define APIC_ICR_PENDING     (1 << 12)
+#define APIC_ICR_ASSERT      (1 << 14)
+#define APIC_ICR_LEVEL       (1 << 15)
+
+// Mapped register base, NULL until apic_init succeeds
+static volatile uint32_t* apic_base = NULL;
+
+static inline uint32_t apic_read(uint32_t reg) {
+    return apic_base[reg / 4];
+}
+
+static inline void apic_write(uint32_t reg, uint32_t value) {
+    apic_base[reg / 4] = value;
+}
+
+/**
+ * Spurious interrupts need no EOI
+ */
+static void apic_spurious_handler(interrupt_frame_t* frame) {
+    (void)frame;
+}
+
+/**
+ * Enable the local APIC
+ * Every CPU calls this for its own APIC, the registers sit at the same address
+ */
+bool apic_init(void) {
+    if (!(cpu_features_edx() & CPUID_EDX_APIC) || !(cpu_features_edx() & CPUID_EDX_MSR)) {
+        return false;
+    }
+    
+    uint64_t base_msr = rdmsr(IA32_APIC_BASE_MSR);
+    uint32_t base = (uint32_t)base_msr & 0xFFFFF000;
+    wrmsr(IA32_APIC_BASE_MSR, base_msr | APIC_BASE_ENABLE);
+    
+    // Device registers must not be cached
+    paging_map_page(base, base, PAGE_KERNEL | PAGE_CACHE_DISABLE | PAGE_WRITETHROUGH);
+    if (paging_get_physical_address(base) != base) {
+        return false;
+    }
+    apic_base = (volatile uint32_t*)base;
+    
+    interrupts_register_handler(APIC_SPURIOUS_VECTOR, apic_spurious_handler);
+    apic_write(APIC_REG_SPURIOUS, APIC_SOFTWARE_ENABLE | APIC_SPURIOUS_VECTOR);
+    
+    apic_timer_stop();
+    return true;
+}
+
+/**
+ * Check if the local APIC is enabled
+ */
+bool apic_available(void) {
+    return apic_base != NULL;
+}
+
+/**
+ * Get the ID of the current CPU's local APIC
+ */
+uint32_t apic_id(void) {
+    return apic_read(APIC_REG_ID) >> 24;
+}
+
+/**
+ * Signal the end of an APIC interrupt
+ */
+void apic_eoi(void) {
+    apic_write(APIC_REG_EOI, 0);
+}
+
+/**
+ * Write the interrupt command register and wait until it's accepted
+ */
+static void apic_send_icr(uint32_t target, uint32_t command) {
+    // An IPI sent from an interrupt handler would change the destination under us
+    uint32_t flags = interrupts_save();
+    
+    apic_write(APIC_REG_ICR_HIGH, target << 24);
+    apic_write(APIC_REG_ICR_LOW, command);
+    
+    while (apic_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING) {
+        asm volatile ("pause");
+    }
+    
+    interrupts_restore(flags);
+}
+
+/**
+ * Send an INIT IPI to another CPU
+ */
+void apic_send_init(uint32_t target) {
+    apic_send_icr(target, APIC_ICR_INIT | APIC_ICR_ASSERT | APIC_ICR_LEVEL);
+}
+
+/**
+ * Send a startup IPI, the CPU starts in real mode at page * 4KB
+ */
+void apic_send_startup(uint32_t target, uint32_t page) {
+    apic_send_icr(target, APIC_ICR_STARTUP | APIC_ICR_ASSERT | (page & 0xFF));
+}
+
+/**
+ * Send a fixed interrupt to another CPU
+ */
+void apic_send_ipi(uint32_t target, uint32_t vector) {
+    apic_send_icr(target, APIC_ICR_ASSERT | (vector & 0xFF));
+}
+
+/**
+ * Start the timer counting down from its maximum, masked
+ */
+void apic_timer_start_free_running(void) {
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+}
+
+/**
+ * Get the number of timer ticks since apic_timer_start_free_running
+ */
+uint32_t apic_timer_elapsed(void) {
+    return 0xFFFFFFFF - apic_read(APIC_REG_TIMER_CURRENT);
+}
+
+/**
+ * Fire APIC_TIMER_VECTOR once after the given number of ticks
+ */
+void apic_timer_oneshot(uint32_t ticks) {
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INITIAL, ticks);
+}
+
+/**
+ * Stop the timer
+ */
+void apic_timer_stop(void) {
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INITIAL, 0);
+}
\ No newline at end of file
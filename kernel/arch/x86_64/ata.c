@@ -0,0 +1,839 @@
+/**
+ * NKOF ATA Disk Driver Implementation
+ *
+ * Disks are found with IDENTIFY DEVICE, polled, at boot. A PCI IDE
+ * controller that can bus master gives each channel a bus master register
+ * block, and commands then move their data by DMA: the batch's segments
+ * are written into a PRD table (at most 64KB per entry, none crossing a
+ * 64KB boundary) and the controller interrupts once the whole command is
+ * done. Without one, or for a disk whose DMA failed once, commands use PIO
+ * and the CPU moves each sector from the interrupt that announces it,
+ * through a bounce sector and the per-CPU temporary mapping, since block
+ * segments are physical.
+ *
+ * Master and slave share a channel, which runs one command at a time: a
+ * batch for the other disk waits in the channel until the command ends.
+ * A command that doesn't finish within ATA_TIMEOUT_NS resets the channel.
+ * A native mode channel whose PCI interrupt line isn't a usable PIC line
+ * is switched back to compatibility mode (IRQ 14/15) when the controller
+ * allows it; otherwise it runs with interrupts off and a timer polls it
+ * every ATA_POLL_NS while a command is in progress.
+ * Channel state is protected by the channel lock, taken inside the block
+ * device lock and never held while calling back into the block layer.
+ */
+
+#include "../../include/ata.h"
+#include "../../include/block.h"
+#include "../../include/pci.h"
+#include "../../include/pic.h"
+#include "../../include/interrupts.h"
+#include "../../include/paging.h"
+#include "../../include/timer.h"
+#include "../../include/spinlock.h"
+#include "../../include/io.h"
+#include "../../include/string.h"
+#include "../../include/klog.h"
+
+// Legacy channel resources
+#define ATA_PRIMARY_IO        0x1F0
+#define ATA_PRIMARY_CONTROL   0x3F6
+#define ATA_PRIMARY_IRQ       14
+#define ATA_SECONDARY_IO      0x170
+#define ATA_SECONDARY_CONTROL 0x376
+#define ATA_SECONDARY_IRQ     15
+
+// Task file registers, from the channel's I/O base
+#define ATA_REG_DATA     0
+#define ATA_REG_ERROR    1
+#define ATA_REG_COUNT    2
+#define ATA_REG_LBA_LOW  3
+#define ATA_REG_LBA_MID  4
+#define ATA_REG_LBA_HIGH 5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7       // Reading it acknowledges the interrupt
+#define ATA_REG_COMMAND  7
+
+// Status bits
+#define ATA_STATUS_ERR  0x01
+#define ATA_STATUS_DRQ  0x08
+#define ATA_STATUS_DF   0x20
+#define ATA_STATUS_BSY  0x80
+
+// Device control register bits (the alternate status shares its port)
+#define ATA_CONTROL_NIEN 0x02    // Interrupts off
+#define ATA_CONTROL_SRST 0x04    // Software reset
+
+// Drive register: LBA addressing, bit 4 picks the slave
+#define ATA_DRIVE_LBA 0xE0
+#define ATA_DRIVE_LBA48 0x40
+
+// Commands
+#define ATA_CMD_READ_PIO       0x20
+#define ATA_CMD_READ_PIO_EXT   0x24
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_READ_DMA_EXT   0x25
+#define ATA_CMD_WRITE_PIO      0x30
+#define ATA_CMD_WRITE_PIO_EXT  0x34
+#define ATA_CMD_WRITE_DMA      0xCA
+#define ATA_CMD_WRITE_DMA_EXT  0x35
+#define ATA_CMD_IDENTIFY       0xEC
+
+// IDENTIFY DEVICE words
+#define ATA_ID_MODEL         27    // 20 words of byte-swapped text
+#define ATA_ID_CAPABILITIES  49
+#define ATA_ID_LBA28_SECTORS 60
+#define ATA_ID_COMMAND_SETS  83
+#define ATA_ID_LBA48_SECTORS 100
+
+// Capability and command set bits
+#define ATA_CAP_DMA    (1 << 8)
+#define ATA_CAP_LBA    (1 << 9)
+#define ATA_SET_LBA48  (1 << 10)
+
+// Sectors LBA28 commands can reach
+#define ATA_LBA28_LIMIT (1u << 28)
+
+// Bus master registers, from the channel's block (the secondary's is 8 bytes in)
+#define BM_COMMAND 0
+#define BM_STATUS  2
+#define BM_PRDT    4
+
+// Bus master command and status bits
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08       // Device to memory
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERROR 0x02
+#define BM_STATUS_IRQ   0x04
+
+// PCI class of IDE controllers, and the prog IF bits that matter
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE  0x01
+#define IDE_PRIMARY_NATIVE   0x01
+#define IDE_PRIMARY_SWITCHABLE   0x02    // The primary's mode can be changed
+#define IDE_SECONDARY_NATIVE 0x04
+#define IDE_SECONDARY_SWITCHABLE 0x08
+#define IDE_BUS_MASTER       0x80
+
+// Physical Region Descriptor, the bus master's scatter/gather entry
+typedef struct {
+    uint32_t phys;
+    uint16_t bytes;              // 0 means 64KB
+    uint16_t flags;
+} __attribute__((packed)) ata_prd_t;
+
+#define PRD_END 0x8000           // Last entry of the table
+#define PRD_ENTRIES (PAGE_SIZE / sizeof(ata_prd_t))
+
+// Status polls before giving up, each read takes about a microsecond on real hardware
+#define ATA_POLL_SPINS 1000000
+
+// Polled channels: time between polls, and most sectors moved by one poll
+#define ATA_POLL_NS NSEC_PER_MSEC
+#define ATA_POLL_BURST 16
+
+// The PIC line the slave PIC cascades through, never a device's
+#define ATA_CASCADE_IRQ 2
+
+struct ata_channel;
+
+// Disk
+typedef struct ata_drive {
+    block_device_t block;
+    struct ata_channel* channel;
+    uint8_t slave;               // 0 or 1
+    bool lba48;
+    bool dma;                    // Commands use bus master DMA
+    char name[16];
+    char model[41];
+} ata_drive_t;
+
+// IDE channel
+typedef struct ata_channel {
+    uint16_t io;                 // Task file base
+    uint16_t control;            // Device control and alternate status
+    uint16_t bus_master;         // Bus master register block, 0 if none
+    uint8_t irq;
+    bool polled;                 // No usable interrupt line, a timer polls
+    bool present;
+    spinlock_t lock;
+    block_buffer_t prd;          // PRD table, one page
+    
+    // Command in progress
+    ata_drive_t* drive;
+    block_request_t* batch;
+    bool write;
+    bool dma;                    // This command uses DMA
+    bool retried;                // Already retried with PIO
+    
+    // PIO position: sectors still to go and the place in the batch's memory
+    uint32_t pio_left;
+    block_request_t* pio_request;
+    uint32_t pio_segment;
+    uint32_t pio_offset;
+    uint16_t pio_sector[BLOCK_SECTOR_SIZE / 2];
+    
+    // Batch for the other disk, started when the command ends
+    ata_drive_t* pending_drive;
+    block_request_t* pending;
+    
+    timer_event_t timeout;
+    uint64_t deadline;           // When the command in flight times out
+    timer_event_t poll;
+} ata_channel_t;
+
+static ata_channel_t channels[2];
+static ata_drive_t drives[4];
+
+static bool ata_start(block_device_t* device, block_request_t* batch);
+static const block_ops_t ata_ops = { ata_start };
+
+/**
+ * Read the alternate status, which leaves a pending interrupt alone
+ */
+static inline uint8_t alt_status(ata_channel_t* channel) {
+    return inb(channel->control);
+}
+
+/**
+ * Give the drive the 400ns it needs after a drive select
+ */
+static void select_delay(ata_channel_t* channel) {
+    for (uint32_t i = 0; i < 4; i++) {
+        alt_status(channel);
+    }
+}
+
+/**
+ * Wait for BSY to clear, returns the status or 0xFF if it never did
+ */
+static uint8_t wait_not_busy(ata_channel_t* channel) {
+    for (uint32_t i = 0; i < ATA_POLL_SPINS; i++) {
+        uint8_t status = alt_status(channel);
+        if (!(status & ATA_STATUS_BSY)) {
+            return status;
+        }
+    }
+    return 0xFF;
+}
+
+/**
+ * Wait until the drive asks for data (DRQ) or reports an error
+ */
+static bool wait_data(ata_channel_t* channel) {
+    for (uint32_t i = 0; i < ATA_POLL_SPINS; i++) {
+        uint8_t status = alt_status(channel);
+        if (status & ATA_STATUS_BSY) {
+            continue;
+        }
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+            return false;
+        }
+        if (status & ATA_STATUS_DRQ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reset both drives of a channel, leaving interrupts on unless it is polled
+ */
+static void channel_reset(ata_channel_t* channel) {
+    outb(channel->control, ATA_CONTROL_SRST | ATA_CONTROL_NIEN);
+    for (uint32_t i = 0; i < 8; i++) {
+        io_wait();
+    }
+    outb(channel->control, channel->polled ? ATA_CONTROL_NIEN : 0);
+    wait_not_busy(channel);
+}
+
+/**
+ * Get the number of sectors in a batch
+ */
+static uint32_t batch_sectors(block_request_t* batch) {
+    uint32_t sectors = 0;
+    for (block_request_t* request = batch; request; request = request->merged) {
+        sectors += request->count;
+    }
+    return sectors;
+}
+
+/**
+ * Fill the PRD table from the batch's segments, false if it doesn't fit
+ * PRDs hold 32-bit addresses, memory above 4GB is left to PIO
+ */
+static bool build_prd_table(ata_channel_t* channel, block_request_t* batch) {
+    ata_prd_t* table = (ata_prd_t*)channel->prd.data;
+    uint32_t entries = 0;
+    
+    for (block_request_t* request = batch; request; request = request->merged) {
+        for (uint32_t i = 0; i < request->segment_count; i++) {
+            if (request->segments[i].phys + request->segments[i].length > PMM_LOW_ADDRESS) {
+                return false;
+            }
+            uint32_t phys = (uint32_t)request->segments[i].phys;
+            uint32_t left = request->segments[i].length;
+            
+            // An entry can't cross a 64KB boundary
+            while (left > 0) {
+                uint32_t piece = 0x10000 - (phys & 0xFFFF);
+                piece = piece < left ? piece : left;
+                if (entries == PRD_ENTRIES) {
+                    return false;
+                }
+                
+                table[entries].phys = phys;
+                table[entries].bytes = (uint16_t)piece;
+                table[entries].flags = 0;
+                entries++;
+                phys += piece;
+                left -= piece;
+            }
+        }
+    }
+    
+    table[entries - 1].flags = PRD_END;
+    return true;
+}
+
+/**
+ * Copy one sector between the bounce sector and the batch's memory, advancing the PIO position
+ * Interrupts are off (channel lock held) for the temporary mappings
+ */
+static void pio_copy(ata_channel_t* channel, bool to_memory) {
+    uint8_t* sector = (uint8_t*)channel->pio_sector;
+    uint32_t done = 0;
+    
+    while (done < BLOCK_SECTOR_SIZE) {
+        block_request_t* request = channel->pio_request;
+        block_segment_t* segment = &request->segments[channel->pio_segment];
+        uint64_t phys = segment->phys + channel->pio_offset;
+        
+        // Up to the end of the sector, the segment or the page
+        uint32_t piece = BLOCK_SECTOR_SIZE - done;
+        if (piece > segment->length - channel->pio_offset) {
+            piece = segment->length - channel->pio_offset;
+        }
+        if (piece > PAGE_SIZE - (phys & 0xFFF)) {
+            piece = PAGE_SIZE - (phys & 0xFFF);
+        }
+        
+        uint8_t* memory = paging_map_temporary(phys);
+        if (to_memory) {
+            memcpy(memory, sector + done, piece);
+        } else {
+            memcpy(sector + done, memory, piece);
+        }
+        paging_unmap_temporary(memory);
+        
+        done += piece;
+        channel->pio_offset += piece;
+        if (channel->pio_offset == segment->length) {
+            channel->pio_offset = 0;
+            channel->pio_segment++;
+            if (channel->pio_segment == request->segment_count) {
+                channel->pio_segment = 0;
+                channel->pio_request = request->merged;
+            }
+        }
+    }
+}
+
+/**
+ * Give the command in flight a fresh timeout (channel lock held)
+ */
+static void arm_timeout(ata_channel_t* channel) {
+    channel->deadline = timer_now_ns() + ATA_TIMEOUT_NS;
+    timer_add(&channel->timeout, channel->deadline);
+}
+
+/**
+ * Send the command for the channel's batch (channel lock held)
+ */
+static bool issue_command(ata_channel_t* channel) {
+    ata_drive_t* drive = channel->drive;
+    block_request_t* batch = channel->batch;
+    uint32_t lba = batch->lba;
+    uint32_t count = batch_sectors(batch);
+    bool lba48 = lba + count > ATA_LBA28_LIMIT;
+    
+    channel->write = batch->write;
+    channel->dma = drive->dma && build_prd_table(channel, batch);
+    
+    outb(channel->io + ATA_REG_DRIVE, (lba48 ? ATA_DRIVE_LBA48 : ATA_DRIVE_LBA | ((lba >> 24) & 0x0F)) |
+         (drive->slave << 4));
+    select_delay(channel);
+    if (wait_not_busy(channel) == 0xFF) {
+        kprintf("ERROR: %s stays busy\n", drive->name);
+        return false;
+    }
+    
+    if (channel->dma) {
+        uint16_t bm = channel->bus_master;
+        outl(bm + BM_PRDT, channel->prd.phys);
+        outb(bm + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+        outb(bm + BM_COMMAND, channel->write ? 0 : BM_CMD_READ);
+    } else {
+        channel->pio_left = count;
+        channel->pio_request = batch;
+        channel->pio_segment = 0;
+        channel->pio_offset = 0;
+    }
+    
+    // LBA48 registers take the high bytes first; a count of 256 is written as 0
+    if (lba48) {
+        outb(channel->io + ATA_REG_COUNT, (count >> 8) & 0xFF);
+        outb(channel->io + ATA_REG_LBA_LOW, (lba >> 24) & 0xFF);
+        outb(channel->io + ATA_REG_LBA_MID, 0);
+        outb(channel->io + ATA_REG_LBA_HIGH, 0);
+    }
+    outb(channel->io + ATA_REG_COUNT, count & 0xFF);
+    outb(channel->io + ATA_REG_LBA_LOW, lba & 0xFF);
+    outb(channel->io + ATA_REG_LBA_MID, (lba >> 8) & 0xFF);
+    outb(channel->io + ATA_REG_LBA_HIGH, (lba >> 16) & 0xFF);
+    
+    uint8_t command;
+    if (channel->dma) {
+        command = channel->write ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                                 : (lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    } else {
+        command = channel->write ? (lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                                 : (lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+    }
+    outb(channel->io + ATA_REG_COMMAND, command);
+    
+    if (channel->dma) {
+        outb(channel->bus_master + BM_COMMAND, (channel->write ? 0 : BM_CMD_READ) | BM_CMD_START);
+    } else if (channel->write) {
+        // The first sector goes out right away, the interrupt asks for each next one
+        if (!wait_data(channel)) {
+            kprintf("ERROR: %s refused a write\n", drive->name);
+            return false;
+        }
+        pio_copy(channel, false);
+        outsw(channel->io + ATA_REG_DATA, channel->pio_sector, BLOCK_SECTOR_SIZE / 2);
+    }
+    
+    arm_timeout(channel);
+    if (channel->polled) {
+        timer_add(&channel->poll, timer_now_ns() + ATA_POLL_NS);
+    }
+    return true;
+}
+
+/**
+ * Make a batch the channel's command and send it (channel lock held)
+ */
+static bool channel_start(ata_channel_t* channel, ata_drive_t* drive, block_request_t* batch) {
+    channel->drive = drive;
+    channel->batch = batch;
+    channel->retried = false;
+    
+    if (issue_command(channel)) {
+        return true;
+    }
+    
+    channel->drive = NULL;
+    channel->batch = NULL;
+    return false;
+}
+
+/**
+ * Block layer entry: start a batch on a disk
+ */
+static bool ata_start(block_device_t* device, block_request_t* batch) {
+    ata_drive_t* drive = (ata_drive_t*)device->driver;
+    ata_channel_t* channel = drive->channel;
+    
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    
+    // The other disk has the channel, this batch goes next
+    if (channel->batch) {
+        channel->pending_drive = drive;
+        channel->pending = batch;
+        spin_unlock_irqrestore(&channel->lock, flags);
+        return true;
+    }
+    
+    bool started = channel_start(channel, drive, batch);
+    spin_unlock_irqrestore(&channel->lock, flags);
+    return started;
+}
+
+/**
+ * End the channel's command, called with the channel lock held and drops it
+ */
+static void finish_command(ata_channel_t* channel, bool success, uint32_t flags) {
+    timer_cancel(&channel->timeout);
+    ata_drive_t* drive = channel->drive;
+    
+    // A disk whose DMA failed gets the command again by PIO, and PIO from then on
+    if (!success && channel->dma && !channel->retried) {
+        kprintf("WARNING: DMA failed on %s, using PIO\n", drive->name);
+        drive->dma = false;
+        channel->retried = true;
+        if (issue_command(channel)) {
+            spin_unlock_irqrestore(&channel->lock, flags);
+            return;
+        }
+    }
+    
+    channel->drive = NULL;
+    channel->batch = NULL;
+    
+    // Hand the channel to the other disk's waiting batch
+    ata_drive_t* refused = NULL;
+    if (channel->pending) {
+        ata_drive_t* next = channel->pending_drive;
+        block_request_t* batch = channel->pending;
+        channel->pending = NULL;
+        channel->pending_drive = NULL;
+        if (!channel_start(channel, next, batch)) {
+            refused = next;
+        }
+    }
+    spin_unlock_irqrestore(&channel->lock, flags);
+    
+    block_complete(&drive->block, success);
+    if (refused) {
+        block_complete(&refused->block, false);
+    }
+}
+
+/**
+ * Handle a channel's interrupt
+ */
+static void channel_interrupt(ata_channel_t* channel) {
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    
+    if (!channel->batch) {
+        inb(channel->io + ATA_REG_STATUS);
+        spin_unlock_irqrestore(&channel->lock, flags);
+        return;
+    }
+    
+    bool success = true;
+    if (channel->dma) {
+        // The line may be shared, the bus master says whether this channel raised it.
+        // A polled channel never interrupts: it is done once the engine and drive are idle
+        uint8_t bm_status = inb(channel->bus_master + BM_STATUS);
+        bool done = channel->polled ? !(bm_status & BM_STATUS_ACTIVE) && !(alt_status(channel) & ATA_STATUS_BSY)
+                                    : (bm_status & BM_STATUS_IRQ);
+        if (!done) {
+            spin_unlock_irqrestore(&channel->lock, flags);
+            return;
+        }
+        
+        outb(channel->bus_master + BM_COMMAND, 0);
+        uint8_t status = inb(channel->io + ATA_REG_STATUS);
+        outb(channel->bus_master + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+        success = !(status & (ATA_STATUS_ERR | ATA_STATUS_DF)) && !(bm_status & BM_STATUS_ERROR);
+    } else {
+        uint8_t status = inb(channel->io + ATA_REG_STATUS);
+        if (status & ATA_STATUS_BSY) {
+            spin_unlock_irqrestore(&channel->lock, flags);
+            return;
+        }
+        
+        // Reads: a sector is ready; writes: the last sector was written
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+            success = false;
+        } else if (!channel->write) {
+            if (status & ATA_STATUS_DRQ) {
+                insw(channel->io + ATA_REG_DATA, channel->pio_sector, BLOCK_SECTOR_SIZE / 2);
+                pio_copy(channel, true);
+                channel->pio_left--;
+            } else {
+                success = false;
+            }
+        } else {
+            channel->pio_left--;
+            if (channel->pio_left > 0) {
+                if (status & ATA_STATUS_DRQ) {
+                    pio_copy(channel, false);
+                    outsw(channel->io + ATA_REG_DATA, channel->pio_sector, BLOCK_SECTOR_SIZE / 2);
+                } else {
+                    success = false;
+                }
+            }
+        }
+        
+        // More sectors to go: give the command a fresh timeout
+        if (success && channel->pio_left > 0) {
+            arm_timeout(channel);
+            spin_unlock_irqrestore(&channel->lock, flags);
+            return;
+        }
+    }
+    
+    finish_command(channel, success, flags);
+}
+
+/**
+ * IRQ handler shared by the channels
+ */
+static void ata_interrupt(interrupt_frame_t* frame) {
+    uint8_t irq = frame->vector - PIC_IRQ_BASE;
+    
+    if (!pic_send_eoi(irq)) {
+        return;
+    }
+    
+    for (uint32_t i = 0; i < 2; i++) {
+        if (channels[i].present && !channels[i].polled && channels[i].irq == irq) {
+            channel_interrupt(&channels[i]);
+        }
+    }
+}
+
+/**
+ * Poll a channel that has no interrupt, from the timer
+ */
+static void ata_poll(timer_event_t* event) {
+    ata_channel_t* channel = (ata_channel_t*)event->data;
+    
+    // A PIO command may have several sectors ready in a row, move a few per poll
+    for (uint32_t i = 0; i < ATA_POLL_BURST; i++) {
+        if (alt_status(channel) & ATA_STATUS_BSY) {
+            break;
+        }
+        channel_interrupt(channel);
+        if (!__atomic_load_n(&channel->batch, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    
+    // Keep polling while a command is in progress (a new one re-arms the poll itself)
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    if (channel->batch && !channel->poll.pending) {
+        timer_add(&channel->poll, timer_now_ns() + ATA_POLL_NS);
+    }
+    spin_unlock_irqrestore(&channel->lock, flags);
+}
+
+/**
+ * Check a PCI interrupt line: 0xFF means unrouted, and the PIC only has 16
+ */
+static bool irq_usable(uint8_t line) {
+    return line != 0 && line < 16 && line != ATA_CASCADE_IRQ;
+}
+
+/**
+ * A command took too long: reset the channel and fail (or retry) it
+ */
+static void ata_timeout(timer_event_t* event) {
+    ata_channel_t* channel = (ata_channel_t*)event->data;
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    
+    // The event is shared by every command: one that fired while this command was being
+    // started, or while it made progress, belongs to an older deadline. Clocks of different
+    // CPUs may differ a little, so only one well before the current deadline is stale
+    if (!channel->batch || timer_now_ns() + ATA_TIMEOUT_NS / 2 < channel->deadline) {
+        spin_unlock_irqrestore(&channel->lock, flags);
+        return;
+    }
+    
+    kprintf("WARNING: %s timed out, resetting the channel\n", channel->drive->name);
+    if (channel->bus_master) {
+        outb(channel->bus_master + BM_COMMAND, 0);
+        outb(channel->bus_master + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+    }
+    channel_reset(channel);
+    finish_command(channel, false, flags);
+}
+
+/**
+ * Ask a drive to identify itself, false if there is no ATA disk there
+ */
+static bool identify(ata_channel_t* channel, uint8_t slave, uint16_t* id) {
+    outb(channel->io + ATA_REG_DRIVE, 0xA0 | (slave << 4));
+    select_delay(channel);
+    outb(channel->io + ATA_REG_COUNT, 0);
+    outb(channel->io + ATA_REG_LBA_LOW, 0);
+    outb(channel->io + ATA_REG_LBA_MID, 0);
+    outb(channel->io + ATA_REG_LBA_HIGH, 0);
+    outb(channel->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    
+    // No drive leaves the status at 0 (or floating high)
+    uint8_t status = alt_status(channel);
+    if (status == 0 || status == 0xFF) {
+        return false;
+    }
+    if (wait_not_busy(channel) == 0xFF) {
+        return false;
+    }
+    
+    // ATAPI and SATA devices put their signature here and abort the command
+    if (inb(channel->io + ATA_REG_LBA_MID) || inb(channel->io + ATA_REG_LBA_HIGH)) {
+        return false;
+    }
+    if (!wait_data(channel)) {
+        return false;
+    }
+    
+    insw(channel->io + ATA_REG_DATA, id, 256);
+    return true;
+}
+
+/**
+ * Set up a disk from its IDENTIFY data and register it
+ */
+static bool add_drive(ata_channel_t* channel, uint32_t index, uint8_t slave, const uint16_t* id) {
+    ata_drive_t* drive = &drives[index * 2 + slave];
+    ksnprintf(drive->name, sizeof(drive->name), "ata%u-%s", index, slave ? "slave" : "master");
+    
+    // The model string has its bytes swapped in each word and is padded with spaces
+    for (uint32_t i = 0; i < 20; i++) {
+        drive->model[i * 2] = id[ATA_ID_MODEL + i] >> 8;
+        drive->model[i * 2 + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    uint32_t length = 40;
+    while (length > 0 && drive->model[length - 1] == ' ') {
+        length--;
+    }
+    drive->model[length] = '\0';
+    
+    if (!(id[ATA_ID_CAPABILITIES] & ATA_CAP_LBA)) {
+        kprintf("WARNING: %s (%s) has no LBA addressing, not used\n", drive->name, drive->model);
+        return false;
+    }
+    
+    uint32_t sectors = id[ATA_ID_LBA28_SECTORS] | ((uint32_t)id[ATA_ID_LBA28_SECTORS + 1] << 16);
+    drive->lba48 = (id[ATA_ID_COMMAND_SETS] & ATA_SET_LBA48) != 0;
+    if (drive->lba48) {
+        // Sectors past 2^32 can't be named in a 32-bit LBA
+        uint32_t high = id[ATA_ID_LBA48_SECTORS + 2] | id[ATA_ID_LBA48_SECTORS + 3];
+        sectors = high ? 0xFFFFFFFF
+                       : id[ATA_ID_LBA48_SECTORS] | ((uint32_t)id[ATA_ID_LBA48_SECTORS + 1] << 16);
+    } else if (sectors > ATA_LBA28_LIMIT) {
+        sectors = ATA_LBA28_LIMIT;
+    }
+    if (sectors == 0) {
+        return false;
+    }
+    
+    drive->channel = channel;
+    drive->slave = slave;
+    drive->dma = channel->bus_master != 0 && (id[ATA_ID_CAPABILITIES] & ATA_CAP_DMA);
+    drive->block.name = drive->name;
+    drive->block.sectors = sectors;
+    drive->block.max_sectors = ATA_MAX_SECTORS;
+    drive->block.max_segments = ATA_MAX_SEGMENTS;
+    drive->block.ops = &ata_ops;
+    drive->block.driver = drive;
+    if (!block_register(&drive->block)) {
+        return false;
+    }
+    
+    channel->present = true;
+    kprintf("ATA: %s: %s, %u MB, %s%s\n", drive->name, drive->model,
+            sectors / (1024 * 1024 / BLOCK_SECTOR_SIZE), drive->lba48 ? "LBA48, " : "", drive->dma ? "DMA" : "PIO");
+    return true;
+}
+
+/**
+ * Find the disks and register them with the block layer
+ */
+uint32_t ata_init(void) {
+    kprintf("Initializing ATA disks...\n");
+    
+    channels[0].io = ATA_PRIMARY_IO;
+    channels[0].control = ATA_PRIMARY_CONTROL;
+    channels[0].irq = ATA_PRIMARY_IRQ;
+    channels[1].io = ATA_SECONDARY_IO;
+    channels[1].control = ATA_SECONDARY_CONTROL;
+    channels[1].irq = ATA_SECONDARY_IRQ;
+    
+    // A PCI IDE controller may move the channels to its BARs and adds bus mastering
+    pci_device_t ide;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &ide)) {
+        uint8_t line = pci_read32(&ide, PCI_INTERRUPT_LINE) & 0xFF;
+        
+        // Native channels need the PCI line; without a usable one go back to the legacy ports and IRQs
+        if (!irq_usable(line)) {
+            uint8_t prog_if = ide.prog_if;
+            if ((prog_if & IDE_PRIMARY_NATIVE) && (prog_if & IDE_PRIMARY_SWITCHABLE)) {
+                prog_if &= ~IDE_PRIMARY_NATIVE;
+            }
+            if ((prog_if & IDE_SECONDARY_NATIVE) && (prog_if & IDE_SECONDARY_SWITCHABLE)) {
+                prog_if &= ~IDE_SECONDARY_NATIVE;
+            }
+            if (prog_if != ide.prog_if) {
+                // The prog IF is the high byte of the revision word, the revision itself is read only
+                uint16_t revision = pci_read16(&ide, PCI_CLASS) & 0xFF;
+                pci_write16(&ide, PCI_CLASS, ((uint16_t)prog_if << 8) | revision);
+                ide.prog_if = (pci_read16(&ide, PCI_CLASS) >> 8) & 0xFF;
+                kprintf("WARNING: IDE interrupt line %u is unusable, using the legacy channels\n", line);
+            }
+        }
+        
+        if (ide.prog_if & IDE_PRIMARY_NATIVE) {
+            channels[0].io = pci_io_bar(&ide, 0);
+            channels[0].control = pci_io_bar(&ide, 1) + 2;
+            channels[0].irq = line;
+            channels[0].polled = !irq_usable(line);
+        }
+        if (ide.prog_if & IDE_SECONDARY_NATIVE) {
+            channels[1].io = pci_io_bar(&ide, 2);
+            channels[1].control = pci_io_bar(&ide, 3) + 2;
+            channels[1].irq = line;
+            channels[1].polled = !irq_usable(line);
+        }
+        
+        uint16_t bus_master = pci_io_bar(&ide, 4);
+        if ((ide.prog_if & IDE_BUS_MASTER) && bus_master) {
+            pci_write16(&ide, PCI_COMMAND, pci_read16(&ide, PCI_COMMAND) | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+            channels[0].bus_master = bus_master;
+            channels[1].bus_master = bus_master + 8;
+        } else {
+            kprintf("WARNING: IDE controller %x:%x can't bus master, using PIO\n", ide.vendor_id, ide.device_id);
+        }
+    }
+    
+    uint16_t id[256];
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < 2; i++) {
+        ata_channel_t* channel = &channels[i];
+        spin_init(&channel->lock);
+        channel->timeout.callback = ata_timeout;
+        channel->timeout.data = channel;
+        channel->poll.callback = ata_poll;
+        channel->poll.data = channel;
+        
+        // A floating bus reads all ones: nothing is attached
+        if (channel->io == 0 || inb(channel->io + ATA_REG_STATUS) == 0xFF) {
+            continue;
+        }
+        
+        // Probing polls, the channel interrupts once disks are set up
+        outb(channel->control, ATA_CONTROL_NIEN);
+        if (channel->bus_master && !block_alloc_buffer(&channel->prd, 1)) {
+            channel->bus_master = 0;
+        }
+        for (uint8_t slave = 0; slave < 2; slave++) {
+            if (identify(channel, slave, id) && add_drive(channel, i, slave, id)) {
+                found++;
+            }
+        }
+        if (!channel->present) {
+            if (channel->bus_master) {
+                block_free_buffer(&channel->prd);
+            }
+            continue;
+        }
+        
+        // A polled channel keeps interrupts off, its commands arm the poll timer
+        if (channel->polled) {
+            kprintf("WARNING: ATA channel %u has no interrupt line, polling it\n", i);
+            continue;
+        }
+        interrupts_register_handler(PIC_IRQ_BASE + channel->irq, ata_interrupt);
+        pic_unmask(channel->irq);
+        outb(channel->control, 0);
+    }
+    
+    if (found == 0) {
+        kprintf("ATA: no disks found\n");
+    }
+    return found;
+}
\ No newline at end of file
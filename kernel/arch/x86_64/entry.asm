@@ -3,6 +3,11 @@
 ;
 ; This is the entry point for the kernel, called by the bootloader.
 ; It sets up the environment for the C kernel and calls the main function.
+;
+; Three loaders can start the kernel: our stage 2 (EBX = E820 map,
+; ECX = entry count), a Multiboot loader such as qemu -kernel, and a
+; Multiboot2 loader such as GRUB (EAX = magic, EBX = info). The
+; registers are saved as they are and boot_info_init sorts them out.
 
 [BITS 32]
 
@@ -12,31 +17,62 @@ extern kernel_main
 ; Export our entry point to the linker
 global kernel_entry
 
-; Export memory map variables
-global boot_memory_map
+; Export the registers the boot loader passed
+global boot_magic
+global boot_info_addr
 global boot_memory_map_count
 
-; Multiboot header for compatibility (not required, but useful)
+MULTIBOOT_MAGIC     equ 0x1BADB002
+MULTIBOOT_FLAGS     equ 0x00000003  ; Page-aligned modules, memory information
+MULTIBOOT2_MAGIC    equ 0xE85250D6
+MULTIBOOT2_ARCH     equ 0           ; 32-bit protected mode i386
+
+; Multiboot headers, both must be in the first 8KB of the image
 section .multiboot
 align 4
-    dd 0x1BADB002           ; Magic number
-    dd 0x00                 ; Flags
-    dd -(0x1BADB002 + 0x00) ; Checksum
+    dd MULTIBOOT_MAGIC                          ; Magic number
+    dd MULTIBOOT_FLAGS                          ; Flags
+    dd -(MULTIBOOT_MAGIC + MULTIBOOT_FLAGS)     ; Checksum
+
+align 8
+multiboot2_header:
+    dd MULTIBOOT2_MAGIC
+    dd MULTIBOOT2_ARCH
+    dd multiboot2_header_end - multiboot2_header
+    dd 0x100000000 - (MULTIBOOT2_MAGIC + MULTIBOOT2_ARCH + (multiboot2_header_end - multiboot2_header))
+    
+    ; End tag
+    dw 0                    ; Type
+    dw 0                    ; Flags
+    dd 8                    ; Size
+multiboot2_header_end:
 
 section .text
 kernel_entry:
-    ; Save memory map address passed by bootloader in EBX
-    mov [boot_memory_map], ebx
+    ; Clear interrupts
+    cli
     
-    ; Save memory map entry count passed by bootloader in ECX
+    ; Save what the boot loader passed before anything touches it
+    mov [boot_magic], eax
+    mov [boot_info_addr], ebx
     mov [boot_memory_map_count], ecx
     
+    ; Multiboot leaves GDTR undefined, so switch to our own flat GDT
+    ; with the same selectors stage 2 uses (0x08 code, 0x10 data)
+    lgdt [boot_gdt_descriptor]
+    jmp 0x08:.reload_segments
+    
+.reload_segments:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    
     ; Set up kernel stack
     mov esp, kernel_stack_top
 
-    ; Clear interrupts
-    cli
-
     ; Initialize essential CPU state here if needed
 
     ; Call the C kernel main function
@@ -49,11 +85,24 @@ kernel_entry:
     jmp .hang               ; Just in case an interrupt wakes up the CPU
 
 section .data
-boot_memory_map:       dd 0
+boot_magic:            dd 0
+boot_info_addr:        dd 0
 boot_memory_map_count: dd 0
 
+; Flat 4GB code and data segments, also copied to the APs by smp_init
+align 8
+boot_gdt:
+    dq 0                    ; Null descriptor
+    dq 0x00CF9A000000FFFF   ; 0x08: code, ring 0, 4KB granularity, 32-bit
+    dq 0x00CF92000000FFFF   ; 0x10: data, ring 0, 4KB granularity, 32-bit
+boot_gdt_end:
+
+boot_gdt_descriptor:
+    dw boot_gdt_end - boot_gdt - 1
+    dd boot_gdt
+
 section .bss
 align 16
 kernel_stack_bottom:
-    resb 16384             ; 16 KB for kernel stack
+    resb 16384             ; 16 KB boot CPU stack (APs get theirs from smp_init)
 kernel_stack_top:
\ No newline at end of file
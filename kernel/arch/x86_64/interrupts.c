@@ -0,0 +1,150 @@
+/**
+ * NKOF Interrupt Handling Implementation
+ *
+ * This file builds the IDT and dispatches interrupts to C handlers.
+ * Every vector has a stub in isr.asm that saves the registers and calls
+ * interrupt_dispatch with the saved frame. Page faults go to the paging
+ * system; other unhandled exceptions halt the system, and interrupts
+ * without a handler are ignored.
+ */
+
+#include "../../include/interrupts.h"
+#include "../../include/paging.h"
+#include "../../include/klog.h"
+#include "../../include/cpu.h"
+#include "../../include/sched.h"
+
+// IDT gate descriptor
+typedef struct {
+    uint16_t offset_low;           // Handler address bits 0-15
+    uint16_t selector;             // Code segment selector
+    uint8_t zero;                  // Always 0
+    uint8_t type_attr;             // Gate type, DPL and present bit
+    uint16_t offset_high;          // Handler address bits 16-31
+} __attribute__((packed)) idt_entry_t;
+
+// Operand of lidt
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) idt_pointer_t;
+
+// Present, ring 0, 32-bit interrupt gate
+#define IDT_INTERRUPT_GATE 0x8E
+
+// Stub addresses and SSE save flag from isr.asm
+extern uint32_t isr_stub_table[IDT_ENTRIES];
+extern uint32_t isr_save_simd;
+
+// The IDT and the registered handlers
+static idt_entry_t idt[IDT_ENTRIES] __attribute__((aligned(8)));
+static interrupt_handler_t handlers[IDT_ENTRIES];
+
+// Exception names for fault reports
+static const char* exception_names[EXCEPTION_COUNT] = {
+    "Divide error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "Bound range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS", "Segment not present",
+    "Stack-segment fault", "General protection fault", "Page fault", "Reserved",
+    "x87 floating-point exception", "Alignment check", "Machine check", "SIMD floating-point exception",
+    "Virtualization exception", "Control protection exception", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Reserved", "VMM communication exception", "Security exception", "Reserved"
+};
+
+/**
+ * Route page faults to the paging system
+ */
+static void page_fault_handler(interrupt_frame_t* frame) {
+    uint32_t fault_addr;
+    asm volatile ("mov %%cr2, %0" : "=r" (fault_addr));
+    
+    paging_handle_fault(fault_addr, frame->error_code);
+}
+
+/**
+ * Report an exception nobody handles and halt
+ */
+static void unhandled_exception(interrupt_frame_t* frame) {
+    kprintf("\nEXCEPTION: %s (vector %u, error code 0x%X)\n",
+            exception_names[frame->vector], frame->vector, frame->error_code);
+    kprintf("EIP: 0x%X  CS: 0x%X  EFLAGS: 0x%X\n", frame->eip, frame->cs, frame->eflags);
+    
+    kprintf("System halted due to unhandled exception.\n");
+    
+    // Nothing will drain the log once this CPU stops
+    klog_flush();
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
+
+/**
+ * Install an IDT gate for a vector
+ */
+void interrupts_set_gate(uint8_t vector, uint32_t handler) {
+    uint16_t cs;
+    asm volatile ("mov %%cs, %0" : "=r" (cs));
+    
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = cs;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = IDT_INTERRUPT_GATE;
+    idt[vector].offset_high = (handler >> 16) & 0xFFFF;
+}
+
+/**
+ * Register a handler for an interrupt vector
+ */
+void interrupts_register_handler(uint8_t vector, interrupt_handler_t handler) {
+    handlers[vector] = handler;
+}
+
+/**
+ * Called by the assembly stubs for every interrupt
+ */
+void interrupt_dispatch(interrupt_frame_t* frame) {
+    interrupt_handler_t handler = handlers[frame->vector & 0xFF];
+    
+    if (handler) {
+        handler(frame);
+    } else if (frame->vector < EXCEPTION_COUNT) {
+        unhandled_exception(frame);
+    }
+    
+    // Device and timer interrupts may have made a higher-priority task ready
+    if (frame->vector >= EXCEPTION_COUNT) {
+        sched_irq_exit();
+    }
+}
+
+/**
+ * Set up the IDT and install the exception handlers
+ */
+void interrupts_init(void) {
+    kprintf("Initializing interrupts...\n");
+    
+    for (uint32_t i = 0; i < IDT_ENTRIES; i++) {
+        interrupts_set_gate(i, isr_stub_table[i]);
+    }
+    
+    interrupts_register_handler(VECTOR_PAGE_FAULT, page_fault_handler);
+    
+    // Interrupt stubs save SSE state once SSE is on
+    isr_save_simd = (read_cr4() & CR4_OSFXSR) ? 1 : 0;
+    
+    interrupts_init_cpu();
+    
+    kprintf("Interrupts initialized.\n");
+}
+
+/**
+ * Load the shared IDT on the calling CPU
+ */
+void interrupts_init_cpu(void) {
+    idt_pointer_t idt_ptr = {
+        .limit = sizeof(idt) - 1,
+        .base = (uint32_t)idt
+    };
+    asm volatile ("lidt %0" : : "m" (idt_ptr));
+}
\ No newline at end of file
@@ -0,0 +1,134 @@
+;
+; NKOF Interrupt Service Routine Stubs
+;
+; One small stub per vector pushes the vector number (and a dummy error
+; code where the CPU doesn't push one), then jumps to a common path that
+; saves the registers and calls interrupt_dispatch in C. Vectors 0-31 are
+; CPU exceptions, the rest are hardware and software interrupts.
+
+[BITS 32]
+
+; C dispatcher, takes a pointer to the saved interrupt frame
+extern interrupt_dispatch
+
+; Table of stub addresses, used to fill the IDT
+global isr_stub_table
+
+; Set by interrupts_init when FXSAVE is enabled, so SSE state is preserved
+global isr_save_simd
+
+; Exception without an error code: push a dummy one
+%macro ISR_NOERR 1
+isr_stub_%1:
+    push dword 0
+    push dword %1
+    jmp isr_common
+%endmacro
+
+; Exception with an error code pushed by the CPU
+%macro ISR_ERR 1
+isr_stub_%1:
+    push dword %1
+    jmp isr_common
+%endmacro
+
+section .text
+ISR_NOERR 0     ; Divide error
+ISR_NOERR 1     ; Debug
+ISR_NOERR 2     ; NMI
+ISR_NOERR 3     ; Breakpoint
+ISR_NOERR 4     ; Overflow
+ISR_NOERR 5     ; Bound range exceeded
+ISR_NOERR 6     ; Invalid opcode
+ISR_NOERR 7     ; Device not available
+ISR_ERR   8     ; Double fault
+ISR_NOERR 9     ; Coprocessor segment overrun
+ISR_ERR   10    ; Invalid TSS
+ISR_ERR   11    ; Segment not present
+ISR_ERR   12    ; Stack-segment fault
+ISR_ERR   13    ; General protection fault
+ISR_ERR   14    ; Page fault
+ISR_NOERR 15    ; Reserved
+ISR_NOERR 16    ; x87 floating-point exception
+ISR_ERR   17    ; Alignment check
+ISR_NOERR 18    ; Machine check
+ISR_NOERR 19    ; SIMD floating-point exception
+ISR_NOERR 20    ; Virtualization exception
+ISR_ERR   21    ; Control protection exception
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_ERR   29    ; VMM communication exception
+ISR_ERR   30    ; Security exception
+ISR_NOERR 31
+
+; Hardware and software interrupts never have an error code
+%assign i 32
+%rep 224
+ISR_NOERR %[i]
+%assign i i + 1
+%endrep
+
+isr_common:
+    ; Save general purpose and segment registers
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
+
+    ; Kernel data segment (same as the stack segment)
+    mov ax, ss
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    cld
+
+    ; EBX points at the frame and survives the call
+    mov ebx, esp
+
+    ; Save SSE state, the kernel's memcpy/memset use XMM registers
+    cmp dword [isr_save_simd], 0
+    je .no_save
+    and esp, ~15
+    sub esp, 512
+    fxsave [esp]
+.no_save:
+
+    push ebx
+    call interrupt_dispatch
+    add esp, 4
+
+    cmp dword [isr_save_simd], 0
+    je .no_restore
+    fxrstor [esp]
+.no_restore:
+    mov esp, ebx
+
+    ; Restore registers
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    popa
+
+    ; Drop the vector number and error code
+    add esp, 8
+    iret
+
+section .data
+isr_save_simd: dd 0
+
+; Stub addresses, indexed by vector
+isr_stub_table:
+%assign i 0
+%rep 256
+    dd isr_stub_%[i]
+%assign i i + 1
+%endrep
\ No newline at end of file
@@ -0,0 +1,286 @@
+/**
+ * NKOF Boot Information Implementation
+ *
+ * The loader's data is read before pmm_init and paging_init, while
+ * physical memory is still addressed directly. Memory map entries,
+ * module ranges and strings are copied into static storage, and every
+ * module is added to the map as a reserved entry so the PMM never
+ * hands it out.
+ */
+
+#include "../../include/multiboot.h"
+#include "../../include/string.h"
+#include "../../include/klog.h"
+
+// Multiboot information flags
+#define MB1_INFO_MEMORY     (1 << 0)
+#define MB1_INFO_CMDLINE    (1 << 2)
+#define MB1_INFO_MODS       (1 << 3)
+#define MB1_INFO_MMAP       (1 << 6)
+#define MB1_INFO_LOADER     (1 << 9)
+
+// Multiboot2 tag types
+#define MB2_TAG_END         0
+#define MB2_TAG_CMDLINE     1
+#define MB2_TAG_LOADER      2
+#define MB2_TAG_MODULE      3
+#define MB2_TAG_MEMINFO     4
+#define MB2_TAG_MMAP        6
+
+// Multiboot information structure (the fields used here)
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;             // KB below 1MB
+    uint32_t mem_upper;             // KB above 1MB
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+} __attribute__((packed)) mb1_info_t;
+
+// Multiboot module descriptor
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} __attribute__((packed)) mb1_module_t;
+
+// Multiboot memory map entry, size excludes the size field itself
+typedef struct {
+    uint32_t size;
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;
+} __attribute__((packed)) mb1_mmap_entry_t;
+
+// Header shared by all Multiboot2 tags, tags are 8-byte aligned
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+} __attribute__((packed)) mb2_tag_t;
+
+// Multiboot2 module tag, followed by its NUL-terminated string
+typedef struct {
+    mb2_tag_t tag;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char string[];
+} __attribute__((packed)) mb2_module_tag_t;
+
+// Multiboot2 basic memory information tag
+typedef struct {
+    mb2_tag_t tag;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+} __attribute__((packed)) mb2_meminfo_tag_t;
+
+// Multiboot2 memory map tag, entries have the memory_map_entry_t layout
+typedef struct {
+    mb2_tag_t tag;
+    uint32_t entry_size;
+    uint32_t entry_version;
+} __attribute__((packed)) mb2_mmap_tag_t;
+
+static boot_info_t boot_info;
+static memory_map_entry_t boot_memory_entries[BOOT_MAX_MEMORY_ENTRIES];
+
+// Basic memory sizes in KB, used when the loader gives no memory map
+static uint32_t basic_mem_lower;
+static uint32_t basic_mem_upper;
+static bool have_basic_mem;
+
+/**
+ * Copy a loader string, always NUL-terminated
+ */
+static void copy_string(char* dest, const char* src, size_t size) {
+    size_t length = 0;
+    
+    if (src != NULL) {
+        length = strlen(src);
+        if (length >= size) {
+            length = size - 1;
+        }
+        memcpy(dest, src, length);
+    }
+    dest[length] = '\0';
+}
+
+/**
+ * Append an entry to the memory map
+ */
+static void add_memory_entry(uint64_t base, uint64_t length, uint32_t type) {
+    if (boot_info.memory_map_count >= BOOT_MAX_MEMORY_ENTRIES) {
+        kprintf("WARNING: Boot memory map full, dropping %llx+%llx\n", base, length);
+        return;
+    }
+    
+    memory_map_entry_t* entry = &boot_memory_entries[boot_info.memory_map_count++];
+    entry->base_addr = base;
+    entry->length = length;
+    entry->type = type;
+    entry->acpi_attributes = 0;
+}
+
+/**
+ * Record a module
+ */
+static void add_module(uint32_t start, uint32_t end, const char* name) {
+    if (boot_info.module_count >= BOOT_MAX_MODULES) {
+        kprintf("WARNING: Too many boot modules, ignoring %x-%x\n", start, end);
+        return;
+    }
+    
+    boot_module_t* module = &boot_info.modules[boot_info.module_count++];
+    module->start = start;
+    module->end = end;
+    copy_string(module->name, name, sizeof(module->name));
+}
+
+/**
+ * Build the map from mem_lower/mem_upper when there is no real map
+ */
+static void add_basic_memory(void) {
+    add_memory_entry(0, (uint64_t)basic_mem_lower * 1024, MEMORY_REGION_AVAILABLE);
+    add_memory_entry(0x100000, (uint64_t)basic_mem_upper * 1024, MEMORY_REGION_AVAILABLE);
+}
+
+/**
+ * Parse a Multiboot information structure
+ */
+static void parse_multiboot(const mb1_info_t* info) {
+    if (info->flags & MB1_INFO_CMDLINE) {
+        copy_string(boot_info.cmdline, (const char*)info->cmdline, sizeof(boot_info.cmdline));
+    }
+    if (info->flags & MB1_INFO_LOADER) {
+        copy_string(boot_info.loader_name, (const char*)info->boot_loader_name, sizeof(boot_info.loader_name));
+    }
+    
+    if (info->flags & MB1_INFO_MEMORY) {
+        basic_mem_lower = info->mem_lower;
+        basic_mem_upper = info->mem_upper;
+        have_basic_mem = true;
+    }
+    
+    if (info->flags & MB1_INFO_MMAP) {
+        uint32_t addr = info->mmap_addr;
+        uint32_t end = info->mmap_addr + info->mmap_length;
+        
+        while (addr + sizeof(mb1_mmap_entry_t) <= end) {
+            const mb1_mmap_entry_t* entry = (const mb1_mmap_entry_t*)addr;
+            add_memory_entry(entry->base_addr, entry->length, entry->type);
+            addr += entry->size + sizeof(entry->size);
+        }
+    }
+    
+    if (info->flags & MB1_INFO_MODS) {
+        const mb1_module_t* mods = (const mb1_module_t*)info->mods_addr;
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            add_module(mods[i].mod_start, mods[i].mod_end, (const char*)mods[i].string);
+        }
+    }
+}
+
+/**
+ * Parse a Multiboot2 tag list
+ */
+static void parse_multiboot2(uint32_t info) {
+    uint32_t total_size = *(const uint32_t*)info;
+    uint32_t addr = info + 8;
+    uint32_t end = info + total_size;
+    
+    while (addr + sizeof(mb2_tag_t) <= end) {
+        const mb2_tag_t* tag = (const mb2_tag_t*)addr;
+        if (tag->type == MB2_TAG_END || tag->size < sizeof(mb2_tag_t)) {
+            break;
+        }
+        
+        if (tag->type == MB2_TAG_CMDLINE) {
+            copy_string(boot_info.cmdline, (const char*)(tag + 1), sizeof(boot_info.cmdline));
+        } else if (tag->type == MB2_TAG_LOADER) {
+            copy_string(boot_info.loader_name, (const char*)(tag + 1), sizeof(boot_info.loader_name));
+        } else if (tag->type == MB2_TAG_MODULE) {
+            const mb2_module_tag_t* module = (const mb2_module_tag_t*)tag;
+            add_module(module->mod_start, module->mod_end, module->string);
+        } else if (tag->type == MB2_TAG_MEMINFO) {
+            const mb2_meminfo_tag_t* meminfo = (const mb2_meminfo_tag_t*)tag;
+            basic_mem_lower = meminfo->mem_lower;
+            basic_mem_upper = meminfo->mem_upper;
+            have_basic_mem = true;
+        } else if (tag->type == MB2_TAG_MMAP) {
+            const mb2_mmap_tag_t* mmap = (const mb2_mmap_tag_t*)tag;
+            uint32_t entry_addr = addr + sizeof(mb2_mmap_tag_t);
+            
+            // Entries may grow in later versions, the first 20 bytes stay the same
+            while (mmap->entry_size >= 20 && entry_addr + mmap->entry_size <= addr + tag->size) {
+                const memory_map_entry_t* entry = (const memory_map_entry_t*)entry_addr;
+                add_memory_entry(entry->base_addr, entry->length, entry->type);
+                entry_addr += mmap->entry_size;
+            }
+        }
+        
+        addr += (tag->size + 7) & ~7;
+    }
+}
+
+/**
+ * Parse the EAX, EBX and ECX values kernel_entry saved
+ */
+const boot_info_t* boot_info_init(uint32_t magic, uint32_t info, uint32_t count) {
+    memset(&boot_info, 0, sizeof(boot_info));
+    boot_info.memory_map = boot_memory_entries;
+    have_basic_mem = false;
+    
+    if (magic == MULTIBOOT2_BOOTLOADER_MAGIC && info != 0) {
+        boot_info.protocol = BOOT_PROTOCOL_MULTIBOOT2;
+        parse_multiboot2(info);
+    } else if (magic == MULTIBOOT_BOOTLOADER_MAGIC && info != 0) {
+        boot_info.protocol = BOOT_PROTOCOL_MULTIBOOT;
+        parse_multiboot((const mb1_info_t*)info);
+    } else {
+        // Stage 2: EBX points at E820 entries already in our layout
+        boot_info.protocol = BOOT_PROTOCOL_STAGE2;
+        copy_string(boot_info.loader_name, "NKOF stage 2", sizeof(boot_info.loader_name));
+        
+        const memory_map_entry_t* entries = (const memory_map_entry_t*)info;
+        for (uint32_t i = 0; entries != NULL && i < count; i++) {
+            add_memory_entry(entries[i].base_addr, entries[i].length, entries[i].type);
+        }
+    }
+    
+    if (boot_info.memory_map_count == 0 && have_basic_mem) {
+        add_basic_memory();
+    }
+    
+    // Modules live in available memory, reserved entries keep the PMM off them
+    for (uint32_t i = 0; i < boot_info.module_count; i++) {
+        boot_module_t* module = &boot_info.modules[i];
+        if (module->end > module->start) {
+            add_memory_entry(module->start, module->end - module->start, MEMORY_REGION_RESERVED);
+        }
+    }
+    
+    kprintf("Boot loader: %s, %u memory map entries, %u modules\n",
+            boot_info.loader_name[0] ? boot_info.loader_name : "unknown",
+            boot_info.memory_map_count, boot_info.module_count);
+    for (uint32_t i = 0; i < boot_info.module_count; i++) {
+        kprintf("  Module %u: %x-%x %s\n", i, boot_info.modules[i].start,
+                boot_info.modules[i].end, boot_info.modules[i].name);
+    }
+    
+    return &boot_info;
+}
+
+/**
+ * Get the information parsed by boot_info_init
+ */
+const boot_info_t* boot_info_get(void) {
+    return &boot_info;
+}
\ No newline at end of file
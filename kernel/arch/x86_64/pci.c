@@ -0,0 +1,139 @@
+/**
+ * NKOF PCI Configuration Space Implementation
+ *
+ * Registers are reached by writing the function's address to 0xCF8 and
+ * reading or writing the dword at 0xCFC. The scan for a class visits
+ * every slot of every bus, and functions 1-7 only of multifunction
+ * devices, so it's a few thousand port accesses at most.
+ */
+
+#include "../../include/pci.h"
+#include "../../include/io.h"
+#include "../../include/spinlock.h"
+
+// Configuration mechanism #1 ports
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Address enable bit
+#define PCI_CONFIG_ENABLE 0x80000000
+
+// Header type bit: the device has functions 1-7
+#define PCI_MULTIFUNCTION 0x80
+
+// Address and data accesses come in pairs, CPUs must not interleave them
+static spinlock_t pci_lock = SPINLOCK_INIT;
+
+/**
+ * Read a configuration dword by address
+ */
+static uint32_t config_read(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) {
+    uint32_t address = PCI_CONFIG_ENABLE | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+                       ((uint32_t)function << 8) | (offset & 0xFC);
+    
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, address);
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+/**
+ * Read a configuration dword
+ */
+uint32_t pci_read32(const pci_device_t* device, uint8_t offset) {
+    return config_read(device->bus, device->slot, device->function, offset);
+}
+
+/**
+ * Read a configuration word
+ */
+uint16_t pci_read16(const pci_device_t* device, uint8_t offset) {
+    return (uint16_t)(pci_read32(device, offset) >> ((offset & 2) * 8));
+}
+
+/**
+ * Write a configuration dword
+ */
+void pci_write32(const pci_device_t* device, uint8_t offset, uint32_t value) {
+    uint32_t address = PCI_CONFIG_ENABLE | ((uint32_t)device->bus << 16) | ((uint32_t)device->slot << 11) |
+                       ((uint32_t)device->function << 8) | (offset & 0xFC);
+    
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, address);
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+/**
+ * Write a configuration word
+ */
+void pci_write16(const pci_device_t* device, uint8_t offset, uint16_t value) {
+    uint32_t address = PCI_CONFIG_ENABLE | ((uint32_t)device->bus << 16) | ((uint32_t)device->slot << 11) |
+                       ((uint32_t)device->function << 8) | (offset & 0xFC);
+    
+    // Word writes go to their half of the data port
+    uint32_t flags = spin_lock_irqsave(&pci_lock);
+    outl(PCI_CONFIG_ADDRESS, address);
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+    spin_unlock_irqrestore(&pci_lock, flags);
+}
+
+/**
+ * Find the index-th function with a class and subclass
+ */
+bool pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t index, pci_device_t* device) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint32_t slot = 0; slot < 32; slot++) {
+            // No device answers with an all-ones vendor ID
+            if ((config_read(bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) {
+                continue;
+            }
+            
+            uint32_t functions = 1;
+            if ((config_read(bus, slot, 0, PCI_HEADER_TYPE) >> 16) & PCI_MULTIFUNCTION) {
+                functions = 8;
+            }
+            
+            for (uint32_t function = 0; function < functions; function++) {
+                uint32_t id = config_read(bus, slot, function, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    continue;
+                }
+                
+                uint32_t class_reg = config_read(bus, slot, function, PCI_CLASS);
+                if ((class_reg >> 24) != class_code || ((class_reg >> 16) & 0xFF) != subclass) {
+                    continue;
+                }
+                if (index-- > 0) {
+                    continue;
+                }
+                
+                device->bus = bus;
+                device->slot = slot;
+                device->function = function;
+                device->vendor_id = id & 0xFFFF;
+                device->device_id = id >> 16;
+                device->class_code = class_code;
+                device->subclass = subclass;
+                device->prog_if = (class_reg >> 8) & 0xFF;
+                return true;
+            }
+        }
+    }
+    
+    return false;
+}
+
+/**
+ * Get the I/O port base of a BAR
+ */
+uint16_t pci_io_bar(const pci_device_t* device, uint32_t bar) {
+    uint32_t value = pci_read32(device, PCI_BAR0 + bar * 4);
+    
+    // Bit 0 set marks an I/O BAR, the low 2 bits aren't part of the address
+    if (!(value & 1)) {
+        return 0;
+    }
+    return (uint16_t)(value & 0xFFFC);
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+/**
+ * NKOF 8259 PIC Driver Implementation
+ *
+ * This file remaps the master and slave PICs so IRQs 0-15 arrive on
+ * vectors 32-47, and manages their masks and end-of-interrupt commands.
+ */
+
+#include "../../include/pic.h"
+#include "../../include/io.h"
+
+// PIC ports
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+
+// PIC commands
+#define PIC_ICW1_INIT 0x11         // Initialize, expect ICW4
+#define PIC_ICW4_8086 0x01         // 8086 mode
+#define PIC_EOI       0x20         // End of interrupt
+#define PIC_READ_ISR  0x0B         // Read the in-service register
+
+// IRQ the slave is cascaded on
+#define PIC_CASCADE_IRQ 2
+
+/**
+ * Remap the PICs and mask every IRQ
+ */
+void pic_init(void) {
+    // Start the initialization sequence
+    outb(PIC1_COMMAND, PIC_ICW1_INIT);
+    io_wait();
+    outb(PIC2_COMMAND, PIC_ICW1_INIT);
+    io_wait();
+    
+    // Vector offsets
+    outb(PIC1_DATA, PIC_IRQ_BASE);
+    io_wait();
+    outb(PIC2_DATA, PIC_IRQ_BASE + 8);
+    io_wait();
+    
+    // Wiring: slave on IRQ 2
+    outb(PIC1_DATA, 1 << PIC_CASCADE_IRQ);
+    io_wait();
+    outb(PIC2_DATA, PIC_CASCADE_IRQ);
+    io_wait();
+    
+    outb(PIC1_DATA, PIC_ICW4_8086);
+    io_wait();
+    outb(PIC2_DATA, PIC_ICW4_8086);
+    io_wait();
+    
+    // Mask everything except the cascade, drivers unmask what they use
+    outb(PIC1_DATA, 0xFF & ~(1 << PIC_CASCADE_IRQ));
+    outb(PIC2_DATA, 0xFF);
+}
+
+/**
+ * Allow an IRQ line to interrupt
+ */
+void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq % 8)));
+}
+
+/**
+ * Stop an IRQ line from interrupting
+ */
+void pic_mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq % 8)));
+}
+
+/**
+ * Read the in-service register of one PIC
+ */
+static uint8_t pic_read_isr(uint16_t command_port) {
+    outb(command_port, PIC_READ_ISR);
+    return inb(command_port);
+}
+
+/**
+ * Signal the end of an IRQ
+ */
+bool pic_send_eoi(uint8_t irq) {
+    // IRQ 7 and 15 can be spurious: nothing is actually in service
+    if (irq == 7 && !(pic_read_isr(PIC1_COMMAND) & 0x80)) {
+        return false;
+    }
+    if (irq == 15 && !(pic_read_isr(PIC2_COMMAND) & 0x80)) {
+        // The master still saw the cascade IRQ
+        outb(PIC1_COMMAND, PIC_EOI);
+        return false;
+    }
+    
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+/**
+ * NKOF 8253/8254 PIT Driver Implementation
+ *
+ * Channel 2 (the speaker channel, which can be polled without interrupts)
+ * provides calibrated busy-waits. Channel 0 provides one-shot interrupts
+ * on IRQ 0 for machines without a local APIC timer.
+ */
+
+#include "../../include/pit.h"
+#include "../../include/io.h"
+
+// PIT ports
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND  0x43
+#define PIT_GATE     0x61          // Channel 2 gate and output status
+
+// Command bytes: channel, lobyte/hibyte access, mode 0 (interrupt on terminal count)
+#define PIT_CMD_CH0_ONESHOT 0x30
+#define PIT_CMD_CH2_ONESHOT 0xB0
+
+// Port 0x61 bits
+#define PIT_GATE_ENABLE  0x01      // Channel 2 gate
+#define PIT_SPEAKER      0x02      // Speaker data
+#define PIT_OUT2         0x20      // Channel 2 output
+
+/**
+ * Busy-wait using channel 2
+ */
+void pit_wait_ms(uint32_t ms) {
+    uint32_t ticks = PIT_FREQUENCY / 1000 * ms;
+    if (ticks > PIT_MAX_TICKS) {
+        ticks = PIT_MAX_TICKS;
+    }
+    
+    // Gate off, speaker off while programming
+    uint8_t gate = inb(PIT_GATE) & ~(PIT_GATE_ENABLE | PIT_SPEAKER);
+    outb(PIT_GATE, gate);
+    
+    outb(PIT_COMMAND, PIT_CMD_CH2_ONESHOT);
+    outb(PIT_CHANNEL2, ticks & 0xFF);
+    outb(PIT_CHANNEL2, (ticks >> 8) & 0xFF);
+    
+    // Start counting, OUT2 goes high at terminal count
+    outb(PIT_GATE, gate | PIT_GATE_ENABLE);
+    while (!(inb(PIT_GATE) & PIT_OUT2)) {
+        asm volatile ("pause");
+    }
+    
+    outb(PIT_GATE, gate);
+}
+
+/**
+ * Fire IRQ 0 once after the given number of PIT ticks
+ */
+void pit_set_oneshot(uint32_t ticks) {
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    if (ticks > PIT_MAX_TICKS) {
+        ticks = PIT_MAX_TICKS;
+    }
+    
+    outb(PIT_COMMAND, PIT_CMD_CH0_ONESHOT);
+    outb(PIT_CHANNEL0, ticks & 0xFF);
+    outb(PIT_CHANNEL0, (ticks >> 8) & 0xFF);
+}
\ No newline at end of file
@@ -0,0 +1,116 @@
+/**
+ * NKOF 16550 UART Driver Implementation
+ *
+ * COM1 is polled: the transmitter interrupt is left off and writers wait
+ * for the holding register to empty. With the FIFO enabled one wait
+ * makes room for 16 bytes, so output is written in bursts.
+ */
+
+#include "../../include/serial.h"
+#include "../../include/io.h"
+
+// UART registers, as offsets from the port base
+#define UART_DATA        0         // Transmit/receive buffer (divisor low with DLAB)
+#define UART_IER         1         // Interrupt enable (divisor high with DLAB)
+#define UART_FCR         2         // FIFO control
+#define UART_LCR         3         // Line control
+#define UART_MCR         4         // Modem control
+#define UART_LSR         5         // Line status
+
+// Line control bits
+#define UART_LCR_8N1     0x03      // 8 data bits, no parity, 1 stop bit
+#define UART_LCR_DLAB    0x80      // Divisor latch access
+
+// FIFO control: enable, clear both FIFOs, 14-byte receive threshold
+#define UART_FCR_ENABLE  0xC7
+
+// Modem control bits
+#define UART_MCR_DTR     0x01
+#define UART_MCR_RTS     0x02
+#define UART_MCR_OUT2    0x08
+#define UART_MCR_LOOP    0x10
+
+// Line status: transmit holding register (and FIFO) empty
+#define UART_LSR_THRE    0x20
+
+// Depth of the 16550 transmit FIFO
+#define UART_FIFO_SIZE   16
+
+// UART input clock divided by 16
+#define UART_CLOCK       115200
+
+// Byte sent through loopback to check a UART is there
+#define UART_TEST_BYTE   0xAE
+
+// Set once the loopback test passed
+static bool present = false;
+
+/**
+ * Program COM1 for 8N1 with FIFOs
+ */
+bool serial_init(void) {
+    uint16_t base = SERIAL_COM1;
+    uint16_t divisor = UART_CLOCK / SERIAL_BAUD;
+    
+    // No UART interrupts, the log drain polls
+    outb(base + UART_IER, 0);
+    
+    outb(base + UART_LCR, UART_LCR_DLAB);
+    outb(base + UART_DATA, divisor & 0xFF);
+    outb(base + UART_IER, divisor >> 8);
+    outb(base + UART_LCR, UART_LCR_8N1);
+    outb(base + UART_FCR, UART_FCR_ENABLE);
+    
+    // Check the chip answers: a byte sent in loopback mode must come back
+    outb(base + UART_MCR, UART_MCR_LOOP | UART_MCR_OUT2 | UART_MCR_RTS);
+    outb(base + UART_DATA, UART_TEST_BYTE);
+    if (inb(base + UART_DATA) != UART_TEST_BYTE) {
+        present = false;
+        return false;
+    }
+    
+    // Normal operation
+    outb(base + UART_MCR, UART_MCR_OUT2 | UART_MCR_RTS | UART_MCR_DTR);
+    present = true;
+    return true;
+}
+
+/**
+ * Check if serial_init found a working UART
+ */
+bool serial_present(void) {
+    return present;
+}
+
+/**
+ * Write bytes to COM1
+ */
+void serial_write(const char* data, size_t length) {
+    if (!present) {
+        return;
+    }
+    
+    uint16_t base = SERIAL_COM1;
+    size_t i = 0;
+    bool carriage_return_sent = false;
+    
+    while (i < length) {
+        // An empty holding register means the whole FIFO is free
+        while (!(inb(base + UART_LSR) & UART_LSR_THRE)) {
+            asm volatile ("pause");
+        }
+        
+        for (int room = UART_FIFO_SIZE; room > 0 && i < length; room--) {
+            // Terminals expect "\r\n"
+            if (data[i] == '\n' && !carriage_return_sent) {
+                outb(base + UART_DATA, '\r');
+                carriage_return_sent = true;
+                continue;
+            }
+            
+            outb(base + UART_DATA, (uint8_t)data[i]);
+            carriage_return_sent = false;
+            i++;
+        }
+    }
+}
\ No newline at end of file
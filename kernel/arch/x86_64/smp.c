@@ -0,0 +1,295 @@
+/**
+ * NKOF Multiprocessor Support Implementation
+ *
+ * The APs are started one at a time. For each one the boot CPU fills in
+ * the trampoline's parameter block (its control registers, GDT, a fresh
+ * stack and the CPU number), sends INIT-SIPI-SIPI and waits for the AP to
+ * mark itself online. The AP then loads the shared IDT, enables its local
+ * APIC and becomes the idle task of its own run queue.
+ *
+ * TLB shootdowns are synchronous: the initiator sets a request flag for
+ * every other CPU, sends SMP_TLB_VECTOR and spins until all have flushed.
+ * A CPU spinning on the paging lock with interrupts off services its own
+ * request from the spin loop, so it can't hold up the initiator.
+ */
+
+#include "../../include/smp.h"
+#include "../../include/acpi.h"
+#include "../../include/apic.h"
+#include "../../include/interrupts.h"
+#include "../../include/paging.h"
+#include "../../include/kheap.h"
+#include "../../include/sched.h"
+#include "../../include/timer.h"
+#include "../../include/string.h"
+#include "../../include/pit.h"
+#include "../../include/cpu.h"
+#include "../../include/klog.h"
+
+// Time an AP gets to come online
+#define AP_START_TIMEOUT_NS (100 * NSEC_PER_MSEC)
+
+// Parameter block at the end of the trampoline
+typedef struct {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+} __attribute__((packed)) trampoline_params_t;
+
+// Operand of sgdt
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) gdt_pointer_t;
+
+// Trampoline code from trampoline.asm
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_params[];
+
+// Per-CPU data, indexed by CPU number
+static cpu_info_t cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count = 1;
+static volatile uint32_t cpus_online = 1;
+
+// CPU number of each local APIC ID
+static uint8_t apic_to_cpu[256];
+
+// Outstanding TLB shootdown requests
+static volatile uint32_t tlb_request[SMP_MAX_CPUS];
+static volatile uint32_t tlb_pending = 0;
+
+/**
+ * Get the number of the calling CPU
+ */
+uint32_t smp_cpu_index(void) {
+    // Before any AP is started there is only CPU 0
+    if (cpu_count == 1) {
+        return 0;
+    }
+    
+    return apic_to_cpu[apic_id() & 0xFF];
+}
+
+/**
+ * Get the number of CPUs found
+ */
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+/**
+ * Get the number of CPUs running the kernel
+ */
+uint32_t smp_cpus_online(void) {
+    return cpus_online;
+}
+
+/**
+ * Get a CPU's per-CPU data
+ */
+cpu_info_t* smp_cpu(uint32_t index) {
+    return index < cpu_count ? &cpus[index] : NULL;
+}
+
+/**
+ * Ask another CPU to run the scheduler
+ */
+void smp_send_reschedule(uint32_t index) {
+    if (index < cpu_count && cpus[index].online && index != smp_cpu_index()) {
+        apic_send_ipi(cpus[index].apic_id, SMP_RESCHEDULE_VECTOR);
+    }
+}
+
+/**
+ * Carry out a shootdown requested of this CPU
+ */
+void smp_tlb_service(void) {
+    uint32_t cpu = smp_cpu_index();
+    
+    if (tlb_request[cpu] && __atomic_exchange_n(&tlb_request[cpu], 0, __ATOMIC_ACQ_REL)) {
+        paging_flush_tlb_global();
+        __atomic_fetch_sub(&tlb_pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Flush the TLBs of all other CPUs and wait for them
+ * The caller holds the paging lock, so only one shootdown is in flight
+ */
+void smp_tlb_shootdown(void) {
+    if (cpus_online <= 1) {
+        return;
+    }
+    
+    uint32_t self = smp_cpu_index();
+    uint32_t targets = 0;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self && cpus[i].online) {
+            tlb_request[i] = 1;
+            targets++;
+        }
+    }
+    __atomic_store_n(&tlb_pending, targets, __ATOMIC_RELEASE);
+    
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (i != self && cpus[i].online) {
+            apic_send_ipi(cpus[i].apic_id, SMP_TLB_VECTOR);
+        }
+    }
+    
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE) != 0) {
+        asm volatile ("pause");
+    }
+}
+
+/**
+ * TLB shootdown IPI
+ */
+static void tlb_ipi_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    smp_tlb_service();
+    apic_eoi();
+}
+
+/**
+ * Reschedule IPI, the switch itself happens on interrupt exit
+ */
+static void reschedule_ipi_handler(interrupt_frame_t* frame) {
+    (void)frame;
+    apic_eoi();
+}
+
+/**
+ * C entry point of an AP, called by the trampoline
+ */
+static void ap_main(uint32_t cpu) {
+    // Clean x87/SSE state, CR0 and CR4 came from the boot CPU
+    asm volatile ("fninit");
+    
+    interrupts_init_cpu();
+    apic_init();
+    
+    sched_init_cpu(cpu);
+    
+    cpus[cpu].online = true;
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+    
+    interrupts_enable();
+    sched_idle();
+}
+
+/**
+ * Busy-wait for a number of nanoseconds
+ */
+static void smp_delay_ns(uint64_t ns) {
+    uint64_t until = timer_now_ns() + ns;
+    while (timer_now_ns() < until) {
+        asm volatile ("pause");
+    }
+}
+
+/**
+ * Start one AP and wait for it to come online
+ */
+static bool smp_start_ap(uint32_t cpu) {
+    cpu_info_t* info = &cpus[cpu];
+    
+    // Commit the whole stack now: a fault on an absent stack page can't be handled
+    info->stack = kmalloc(SMP_AP_STACK_SIZE);
+    if (!info->stack) {
+        kprintf("ERROR: Out of memory for AP stack\n");
+        return false;
+    }
+    memset(info->stack, 0, SMP_AP_STACK_SIZE);
+    
+    // Hand the AP our control registers and GDT
+    trampoline_params_t* params = (trampoline_params_t*)(SMP_TRAMPOLINE_BASE +
+        (ap_trampoline_params - ap_trampoline_start));
+    gdt_pointer_t gdtr;
+    asm volatile ("sgdt %0" : "=m" (gdtr));
+    
+    params->cr0 = read_cr0();
+    params->cr3 = (uint32_t)paging_get_directory();
+    params->cr4 = read_cr4();
+    params->stack = (uint32_t)info->stack + SMP_AP_STACK_SIZE;
+    params->entry = (uint32_t)ap_main;
+    params->cpu = cpu;
+    params->gdt_limit = gdtr.limit;
+    params->gdt_base = gdtr.base;
+    
+    // INIT, then two startup IPIs as the MP specification asks
+    apic_send_init(info->apic_id);
+    pit_wait_ms(10);
+    for (int i = 0; i < 2 && !info->online; i++) {
+        apic_send_startup(info->apic_id, SMP_TRAMPOLINE_BASE / PAGE_SIZE);
+        smp_delay_ns(200 * NSEC_PER_USEC);
+    }
+    
+    uint64_t deadline = timer_now_ns() + AP_START_TIMEOUT_NS;
+    while (!info->online && timer_now_ns() < deadline) {
+        asm volatile ("pause");
+    }
+    
+    return info->online;
+}
+
+/**
+ * Find and start the application processors
+ */
+void smp_init(void) {
+    cpus[0].index = 0;
+    cpus[0].online = true;
+    
+    if (!apic_available()) {
+        kprintf("SMP: no local APIC, running on one CPU\n");
+        return;
+    }
+    
+    uint32_t ids[SMP_MAX_CPUS];
+    uint32_t found = acpi_find_cpus(ids, SMP_MAX_CPUS);
+    uint32_t boot_id = apic_id();
+    cpus[0].apic_id = boot_id;
+    
+    // Number the CPUs in MADT order, the boot CPU is always 0 (it may be listed past the IDs we got)
+    memset(apic_to_cpu, 0, sizeof(apic_to_cpu));
+    uint32_t stored = found < SMP_MAX_CPUS ? found : SMP_MAX_CPUS;
+    for (uint32_t i = 0; i < stored && cpu_count < SMP_MAX_CPUS; i++) {
+        if (ids[i] == boot_id) {
+            continue;
+        }
+        cpus[cpu_count].index = cpu_count;
+        cpus[cpu_count].apic_id = ids[i];
+        apic_to_cpu[ids[i]] = cpu_count;
+        cpu_count++;
+    }
+    if (found > cpu_count) {
+        kprintf("WARNING: %u CPUs listed, only %u (SMP_MAX_CPUS) are used, %u ignored\n",
+                found, cpu_count, found - cpu_count);
+    }
+    
+    if (cpu_count == 1) {
+        kprintf("SMP: 1 CPU\n");
+        return;
+    }
+    
+    interrupts_register_handler(SMP_RESCHEDULE_VECTOR, reschedule_ipi_handler);
+    interrupts_register_handler(SMP_TLB_VECTOR, tlb_ipi_handler);
+    
+    // The trampoline must be in low memory for real mode
+    memcpy((void*)SMP_TRAMPOLINE_BASE, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    
+    for (uint32_t cpu = 1; cpu < cpu_count; cpu++) {
+        // A CPU that misses the deadline keeps its stack in case it starts late
+        if (!smp_start_ap(cpu)) {
+            kprintf("WARNING: CPU with APIC ID %u did not start\n", cpus[cpu].apic_id);
+        }
+    }
+    
+    kprintf("SMP: %u of %u CPUs online\n", cpus_online, cpu_count);
+}
\ No newline at end of file
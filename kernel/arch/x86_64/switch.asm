@@ -0,0 +1,33 @@
+;
+; NKOF Context Switch
+;
+; Saves the callee-saved registers and EFLAGS of the current task on its
+; stack, stores its stack pointer, then loads the next task's stack and
+; restores its registers. FPU/SSE state is handled by the scheduler.
+
+[BITS 32]
+
+global context_switch
+
+section .text
+
+; void context_switch(uint32_t* old_esp, uint32_t new_esp)
+context_switch:
+    mov eax, [esp + 4]      ; Where to save the old stack pointer
+    mov edx, [esp + 8]      ; Stack pointer to switch to
+
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+
+    mov [eax], esp
+    mov esp, edx
+
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
\ No newline at end of file
@@ -0,0 +1,80 @@
+;
+; NKOF Application Processor Trampoline
+;
+; smp_init copies this code to SMP_TRAMPOLINE_BASE and fills in the
+; parameter block at its end. A startup IPI starts the AP here in real
+; mode; it loads the boot CPU's GDT, enters protected mode, turns on
+; paging with the boot CPU's control registers and calls the C entry
+; point on its own stack. The code runs from the copy, so every address
+; it uses is computed relative to SMP_TRAMPOLINE_BASE.
+
+[BITS 16]
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_params
+
+; Must match SMP_TRAMPOLINE_BASE in smp.h
+TRAMPOLINE_BASE equ 0x7000
+
+; Address of a label in the copy
+%define TRAMP(label) (TRAMPOLINE_BASE + (label) - ap_trampoline_start)
+
+; Code and data selectors of the GDT set up by stage 2
+KERNEL_CS equ 0x08
+KERNEL_DS equ 0x10
+
+section .text
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+
+    ; Same GDT as the boot CPU
+    o32 lgdt [TRAMP(tp_gdtr)]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword KERNEL_CS:TRAMP(ap_protected)
+
+[BITS 32]
+ap_protected:
+    mov ax, KERNEL_DS
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; PAE/PGE/SSE bits first, then paging (this page is identity-mapped)
+    mov eax, [TRAMP(tp_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMP(tp_cr3)]
+    mov cr3, eax
+    mov eax, [TRAMP(tp_cr0)]
+    mov cr0, eax
+
+    ; ap_main(cpu) on the AP's own stack, it never returns
+    mov esp, [TRAMP(tp_stack)]
+    push dword [TRAMP(tp_cpu)]
+    call [TRAMP(tp_entry)]
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+; Parameter block, laid out like trampoline_params_t in smp.c
+align 4
+ap_trampoline_params:
+tp_cr0:     dd 0
+tp_cr3:     dd 0
+tp_cr4:     dd 0
+tp_stack:   dd 0            ; Top of the AP's stack
+tp_entry:   dd 0            ; C entry point
+tp_cpu:     dd 0            ; CPU number passed to the entry point
+tp_gdtr:    dw 0            ; GDT limit
+            dd 0            ; GDT base
+ap_trampoline_end:
\ No newline at end of file
@@ -0,0 +1,545 @@
+/**
+ * NKOF Benchmarks Implementation
+ *
+ * Each benchmark times every operation with rdtsc into a profiling
+ * counter, so the report has min/max/mean cycles and a log2 histogram on
+ * top of the overall rate. Sizes and access orders come from a fixed-seed
+ * xorshift generator, so two runs of the same kernel do the same work.
+ *
+ * Output is one key=value line per result between "BENCH BEGIN" and
+ * "BENCH END", written to COM1:
+ *   BENCH name=<benchmark> ops=<n> cycles=<n> ops_per_sec=<n>
+ *   COUNTER name=<benchmark>.<op> calls=... hist=<log2>:<count>,...
+ *   FRAG name=<benchmark> heap_total=... frag_permille=... pmm_largest_order=...
+ *   CHECK name=<check> status=ok|failed
+ */
+
+#include "../include/bench.h"
+#include "../include/kheap.h"
+#include "../include/pmm.h"
+#include "../include/paging.h"
+#include "../include/profile.h"
+#include "../include/klog.h"
+#include "../include/timer.h"
+#include "../include/cpu.h"
+#include "../include/io.h"
+#include "../include/math.h"
+#include "../include/string.h"
+
+// Most live allocations in the kmalloc benchmarks
+#define BENCH_SLOTS 1024
+
+// Bytes kept live at once by the kmalloc benchmarks
+#define BENCH_HEAP_BUDGET (2 * 1024 * 1024)
+
+// Repetitions of the LIFO and FIFO patterns
+#define BENCH_PATTERN_ROUNDS 8
+
+// Operations in the random mixes
+#define BENCH_RANDOM_OPS 20000
+
+// krealloc growth: rounds, and the size each round grows to
+#define BENCH_REALLOC_ROUNDS 64
+#define BENCH_REALLOC_MAX (64 * 1024)
+
+// PMM churn: operations per fill level, frames in the churn window
+#define BENCH_PMM_OPS 20000
+#define BENCH_PMM_WINDOW 64
+
+// Most frames held to fill the PMM
+#define BENCH_MAX_FRAMES 16384
+
+// Paging: pages mapped per round, rounds, and the scratch window they use
+#define BENCH_MAP_PAGES 1024
+#define BENCH_MAP_ROUNDS 8
+#define BENCH_MAP_BASE 0xE0000000
+
+// Seed for every benchmark's generator
+#define BENCH_SEED 0x2545F491
+
+// Allocation size distribution, sizes are uniform in [min, max]
+typedef struct {
+    const char* name;
+    uint32_t min;
+    uint32_t max;
+} size_dist_t;
+
+static const size_dist_t distributions[] = {
+    { "small", 16, 256 },
+    { "medium", 256, 4096 },
+    { "large", 4096, 65536 },
+};
+
+#define DIST_COUNT (sizeof(distributions) / sizeof(distributions[0]))
+
+// Order the LIFO/FIFO benchmarks free their allocations in
+typedef enum {
+    ORDER_LIFO,
+    ORDER_FIFO
+} free_order_t;
+
+// Generator state
+static uint32_t rng_state = BENCH_SEED;
+
+// Live allocations and held frames
+static void* slots[BENCH_SLOTS];
+static uint64_t frames[BENCH_MAX_FRAMES];
+
+// Per-operation counters, reset and renamed for each benchmark
+static profile_counter_t alloc_counter;
+static profile_counter_t free_counter;
+static char alloc_name[48];
+static char free_name[48];
+
+/**
+ * Next value of a xorshift32 generator
+ */
+static uint32_t rng_next(void) {
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+/**
+ * Pick an allocation size from a distribution
+ */
+static size_t dist_size(const size_dist_t* dist) {
+    return dist->min + rng_next() % (dist->max - dist->min + 1);
+}
+
+/**
+ * Number of live allocations a distribution gets within the heap budget
+ */
+static uint32_t dist_slots(const size_dist_t* dist) {
+    uint32_t count = BENCH_HEAP_BUDGET / ((dist->min + dist->max) / 2);
+    return count < BENCH_SLOTS ? count : BENCH_SLOTS;
+}
+
+/**
+ * Start a benchmark: reseed and name the counters "<benchmark>.<op>"
+ */
+static void bench_start(const char* name, const char* alloc_op, const char* free_op) {
+    rng_state = BENCH_SEED;
+    
+    memset(alloc_counter.cpu, 0, sizeof(alloc_counter.cpu));
+    memset(free_counter.cpu, 0, sizeof(free_counter.cpu));
+    ksnprintf(alloc_name, sizeof(alloc_name), "%s.%s", name, alloc_op);
+    ksnprintf(free_name, sizeof(free_name), "%s.%s", name, free_op);
+    alloc_counter.name = alloc_name;
+    free_counter.name = free_name;
+}
+
+/**
+ * Get operations per second for a number of operations over a cycle count
+ */
+static uint64_t ops_per_sec(uint64_t ops, uint64_t cycles) {
+    uint64_t scaled = ops * timer_tsc_khz() * 1000;
+    
+    // div64_32 needs a 32-bit divisor
+    while (cycles > 0xFFFFFFFF) {
+        scaled >>= 1;
+        cycles >>= 1;
+    }
+    
+    return cycles ? div64_32(scaled, (uint32_t)cycles) : 0;
+}
+
+/**
+ * Report a finished benchmark and its counters
+ */
+static void bench_report(const char* name, uint64_t ops, uint64_t cycles) {
+    char line[KLOG_LINE_MAX];
+    
+    ksnprintf(line, sizeof(line), "BENCH name=%s ops=%llu cycles=%llu ops_per_sec=%llu\n",
+              name, ops, cycles, ops_per_sec(ops, cycles));
+    profile_write(line);
+    
+    if (alloc_counter.registered) {
+        profile_dump_counter(&alloc_counter);
+    }
+    if (free_counter.registered) {
+        profile_dump_counter(&free_counter);
+    }
+}
+
+/**
+ * Report how fragmented the allocators are right now
+ */
+static void bench_report_fragmentation(const char* name) {
+    char line[2 * KLOG_LINE_MAX];
+    kheap_detailed_stats_t stats;
+    
+    kheap_get_detailed_stats(&stats);
+    
+    ksnprintf(line, sizeof(line),
+              "FRAG name=%s heap_total=%u heap_used=%u heap_free=%u slab_total=%u slab_used=%u "
+              "free_blocks=%u largest_free=%u frag_permille=%u peak=%u "
+              "pmm_free=%llu pmm_largest_order=%d\n",
+              name, stats.total, stats.used, stats.free, stats.slab_total, stats.slab_used,
+              stats.free_blocks, stats.largest_free_block, stats.fragmentation, stats.peak_footprint,
+              pmm_get_free_memory(), pmm_largest_free_order());
+    profile_write(line);
+}
+
+/**
+ * Allocate into a slot, timed
+ */
+static bool timed_kmalloc(uint32_t slot, size_t size) {
+    uint64_t start = rdtsc();
+    void* ptr = kmalloc(size);
+    profile_record(&alloc_counter, rdtsc() - start);
+    
+    if (!ptr) {
+        return false;
+    }
+    
+    // Touch the memory so demand paging is part of the cost, as for real users
+    memset(ptr, (uint8_t)slot, size < 64 ? size : 64);
+    slots[slot] = ptr;
+    return true;
+}
+
+/**
+ * Free a slot, timed
+ */
+static void timed_kfree(uint32_t slot) {
+    uint64_t start = rdtsc();
+    kfree(slots[slot]);
+    profile_record(&free_counter, rdtsc() - start);
+    slots[slot] = NULL;
+}
+
+/**
+ * Free every slot that is still in use, untimed
+ */
+static void free_all_slots(void) {
+    for (uint32_t i = 0; i < BENCH_SLOTS; i++) {
+        if (slots[i]) {
+            kfree(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Allocate a batch, then free it in LIFO or FIFO order
+ */
+static bool bench_kmalloc_pattern(const size_dist_t* dist, free_order_t order) {
+    char name[40];
+    ksnprintf(name, sizeof(name), "kmalloc_%s_%s", order == ORDER_LIFO ? "lifo" : "fifo", dist->name);
+    bench_start(name, "kmalloc", "kfree");
+    
+    uint32_t count = dist_slots(dist);
+    uint64_t ops = 0;
+    uint64_t start = rdtsc();
+    
+    for (uint32_t round = 0; round < BENCH_PATTERN_ROUNDS; round++) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!timed_kmalloc(i, dist_size(dist))) {
+                kprintf("ERROR: %s ran out of memory\n", name);
+                free_all_slots();
+                return false;
+            }
+        }
+        
+        for (uint32_t i = 0; i < count; i++) {
+            timed_kfree(order == ORDER_LIFO ? count - 1 - i : i);
+        }
+        
+        ops += 2 * count;
+    }
+    
+    bench_report(name, ops, rdtsc() - start);
+    return true;
+}
+
+/**
+ * Random mix of allocations and frees over a set of slots
+ */
+static bool bench_kmalloc_random(const size_dist_t* dist) {
+    char name[40];
+    ksnprintf(name, sizeof(name), "kmalloc_random_%s", dist->name);
+    bench_start(name, "kmalloc", "kfree");
+    
+    uint32_t count = dist_slots(dist);
+    uint64_t start = rdtsc();
+    
+    for (uint32_t op = 0; op < BENCH_RANDOM_OPS; op++) {
+        uint32_t slot = rng_next() % count;
+        
+        if (slots[slot]) {
+            timed_kfree(slot);
+        } else if (!timed_kmalloc(slot, dist_size(dist))) {
+            kprintf("ERROR: %s ran out of memory\n", name);
+            free_all_slots();
+            return false;
+        }
+    }
+    
+    uint64_t cycles = rdtsc() - start;
+    
+    // Fragmentation is measured with the mix's survivors still live
+    bench_report(name, BENCH_RANDOM_OPS, cycles);
+    bench_report_fragmentation(name);
+    
+    free_all_slots();
+    return true;
+}
+
+/**
+ * Grow allocations by half again each step with krealloc
+ */
+static bool bench_krealloc_growth(void) {
+    const char* name = "krealloc_growth";
+    bench_start(name, "krealloc", "kfree");
+    
+    uint64_t ops = 0;
+    uint64_t start = rdtsc();
+    
+    for (uint32_t round = 0; round < BENCH_REALLOC_ROUNDS; round++) {
+        size_t size = 16;
+        void* ptr = kmalloc(size);
+        
+        while (ptr && size < BENCH_REALLOC_MAX) {
+            size += size / 2 + 16;
+            
+            uint64_t op_start = rdtsc();
+            void* grown = krealloc(ptr, size);
+            profile_record(&alloc_counter, rdtsc() - op_start);
+            
+            if (!grown) {
+                kfree(ptr);
+                ptr = NULL;
+                break;
+            }
+            ptr = grown;
+            ops++;
+        }
+        
+        if (!ptr) {
+            kprintf("ERROR: %s ran out of memory\n", name);
+            return false;
+        }
+        
+        uint64_t op_start = rdtsc();
+        kfree(ptr);
+        profile_record(&free_counter, rdtsc() - op_start);
+        ops++;
+    }
+    
+    bench_report(name, ops, rdtsc() - start);
+    return true;
+}
+
+/**
+ * Page allocation churn with a share of the free frames held elsewhere
+ */
+static bool bench_pmm_churn(uint32_t fill_percent) {
+    char name[40];
+    ksnprintf(name, sizeof(name), "pmm_churn_fill%u", fill_percent);
+    bench_start(name, "pmm_alloc_page", "pmm_free_page");
+    
+    // Hold frames until the requested share of free memory is gone
+    uint32_t free_frames = (uint32_t)(pmm_get_free_memory() / PAGE_SIZE);
+    uint32_t fill = (uint32_t)div64_32((uint64_t)free_frames * fill_percent, 100);
+    if (fill > BENCH_MAX_FRAMES) {
+        fill = BENCH_MAX_FRAMES;
+    }
+    
+    // Leave room for the churn window
+    if (fill + BENCH_PMM_WINDOW > free_frames) {
+        fill = free_frames > BENCH_PMM_WINDOW ? free_frames - BENCH_PMM_WINDOW : 0;
+    }
+    
+    uint32_t held = 0;
+    while (held < fill) {
+        uint64_t frame = pmm_alloc_page();
+        if (!frame) {
+            break;
+        }
+        frames[held++] = frame;
+    }
+    
+    uint64_t window[BENCH_PMM_WINDOW];
+    memset(window, 0, sizeof(window));
+    
+    bool ok = true;
+    uint64_t start = rdtsc();
+    
+    for (uint32_t op = 0; op < BENCH_PMM_OPS; op++) {
+        uint32_t slot = rng_next() % BENCH_PMM_WINDOW;
+        uint64_t op_start = rdtsc();
+        
+        if (window[slot]) {
+            pmm_free_page(window[slot]);
+            profile_record(&free_counter, rdtsc() - op_start);
+            window[slot] = 0;
+        } else {
+            window[slot] = pmm_alloc_page();
+            profile_record(&alloc_counter, rdtsc() - op_start);
+            if (!window[slot]) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    
+    uint64_t cycles = rdtsc() - start;
+    
+    for (uint32_t i = 0; i < BENCH_PMM_WINDOW; i++) {
+        if (window[i]) {
+            pmm_free_page(window[i]);
+        }
+    }
+    
+    if (ok) {
+        bench_report(name, BENCH_PMM_OPS, cycles);
+        bench_report_fragmentation(name);
+    } else {
+        kprintf("ERROR: %s ran out of memory\n", name);
+    }
+    
+    while (held > 0) {
+        pmm_free_page(frames[--held]);
+    }
+    
+    return ok;
+}
+
+/**
+ * Report the outcome of a correctness check
+ */
+static void bench_report_check(const char* name, bool ok) {
+    char line[KLOG_LINE_MAX];
+    ksnprintf(line, sizeof(line), "CHECK name=%s status=%s\n", name, ok ? "ok" : "failed");
+    profile_write(line);
+}
+
+/**
+ * Free a frame twice and check that it is only handed out once afterwards
+ * The second free lands while the frame sits in this CPU's magazine
+ */
+static bool bench_pmm_double_free(void) {
+    const char* name = "pmm_double_free";
+    
+    uint64_t frame = pmm_alloc_page();
+    if (!frame) {
+        kprintf("ERROR: %s ran out of memory\n", name);
+        return false;
+    }
+    
+    pmm_free_page(frame);
+    kprintf("%s: a warning about freeing a free page is expected\n", name);
+    pmm_free_page(frame);
+    
+    // Enough allocations to empty the magazine into which the frame went twice
+    uint32_t count = 2 * PMM_MAGAZINE_MAX;
+    uint32_t seen = 0;
+    uint32_t held = 0;
+    while (held < count) {
+        uint64_t page = pmm_alloc_page();
+        if (!page) {
+            break;
+        }
+        if (page == frame) {
+            seen++;
+        }
+        frames[held++] = page;
+    }
+    
+    while (held > 0) {
+        pmm_free_page(frames[--held]);
+    }
+    
+    bool ok = seen <= 1;
+    bench_report_check(name, ok);
+    return ok;
+}
+
+/**
+ * Map and unmap a window of pages, all backed by one frame
+ */
+static bool bench_paging(void) {
+    const char* name = "paging_map_unmap";
+    bench_start(name, "paging_map_page", "paging_unmap_page");
+    
+    uint64_t frame = pmm_alloc_page();
+    if (!frame) {
+        kprintf("ERROR: %s ran out of memory\n", name);
+        return false;
+    }
+    
+    uint64_t start = rdtsc();
+    
+    for (uint32_t round = 0; round < BENCH_MAP_ROUNDS; round++) {
+        for (uint32_t i = 0; i < BENCH_MAP_PAGES; i++) {
+            uint64_t op_start = rdtsc();
+            paging_map_page(BENCH_MAP_BASE + i * PAGE_SIZE, frame, PAGE_PRESENT | PAGE_WRITABLE);
+            profile_record(&alloc_counter, rdtsc() - op_start);
+        }
+        
+        for (uint32_t i = 0; i < BENCH_MAP_PAGES; i++) {
+            uint64_t op_start = rdtsc();
+            paging_unmap_page(BENCH_MAP_BASE + i * PAGE_SIZE);
+            profile_record(&free_counter, rdtsc() - op_start);
+        }
+    }
+    
+    bench_report(name, 2 * BENCH_MAP_ROUNDS * BENCH_MAP_PAGES, rdtsc() - start);
+    
+    pmm_free_page(frame);
+    return true;
+}
+
+/**
+ * Run every benchmark and report the results
+ */
+bool bench_run(void) {
+    char line[KLOG_LINE_MAX];
+    bool ok = true;
+    
+    // Results bypass the log, earlier messages go first
+    klog_flush();
+    
+    ksnprintf(line, sizeof(line), "BENCH BEGIN tsc_khz=%u\n", timer_tsc_khz());
+    profile_write(line);
+    bench_report_fragmentation("baseline");
+    
+    for (uint32_t i = 0; i < DIST_COUNT; i++) {
+        ok &= bench_kmalloc_pattern(&distributions[i], ORDER_LIFO);
+        ok &= bench_kmalloc_pattern(&distributions[i], ORDER_FIFO);
+        ok &= bench_kmalloc_random(&distributions[i]);
+    }
+    
+    ok &= bench_krealloc_growth();
+    
+    ok &= bench_pmm_churn(0);
+    ok &= bench_pmm_churn(50);
+    ok &= bench_pmm_churn(90);
+    ok &= bench_pmm_double_free();
+    
+    ok &= bench_paging();
+    
+    bench_report_fragmentation("final");
+    
+    klog_flush();
+    ksnprintf(line, sizeof(line), "BENCH END status=%s\n", ok ? "ok" : "failed");
+    profile_write(line);
+    
+    return ok;
+}
+
+/**
+ * Leave the emulator with a status code
+ */
+void bench_exit(bool success) {
+    outb(BENCH_EXIT_PORT, success ? BENCH_EXIT_SUCCESS : BENCH_EXIT_FAILURE);
+    
+    // No debug-exit device (Bochs, real hardware): stop here
+    for (;;) {
+        asm volatile ("cli; hlt");
+    }
+}
\ No newline at end of file
@@ -0,0 +1,604 @@
+/**
+ * NKOF Block Layer Implementation
+ *
+ * Each device keeps its waiting requests in a list sorted by LBA. When
+ * the device is idle the next batch is picked C-LOOK style: the first
+ * request at or past the sector the last command ended at, wrapping to
+ * the lowest one. Requests right behind it that continue its sectors in
+ * the same direction join its command, up to the device's limits. The
+ * driver reports the end of a command with block_complete, normally from
+ * its interrupt handler, which completes every request of the batch and
+ * starts the next one.
+ *
+ * Requests in flight at the same time must not overlap, the elevator
+ * doesn't keep their order. The synchronous helpers split a transfer into
+ * requests, submit a window of them at once so they reach the device
+ * together, and sleep until they finish.
+ */
+
+#include "../include/block.h"
+#include "../include/pmm.h"
+#include "../include/paging.h"
+#include "../include/vmalloc.h"
+#include "../include/kheap.h"
+#include "../include/sched.h"
+#include "../include/timer.h"
+#include "../include/math.h"
+#include "../include/string.h"
+#include "../include/klog.h"
+
+// Requests a synchronous transfer keeps in flight at once
+#define BLOCK_TRANSFER_DEPTH 8
+
+// Registered devices, in registration order
+static block_device_t* devices = NULL;
+static spinlock_t devices_lock = SPINLOCK_INIT;
+
+/**
+ * Check whether two device names match
+ */
+static bool name_matches(const char* a, const char* b) {
+    size_t length = strlen(a);
+    return strlen(b) == length && memcmp(a, b, length) == 0;
+}
+
+/**
+ * Make a device available
+ */
+bool block_register(block_device_t* device) {
+    if (!device->name || !device->ops || !device->ops->start ||
+        device->sectors == 0 || device->max_sectors == 0 || device->max_segments == 0) {
+        kprintf("ERROR: Block device is missing its name, size, limits or driver\n");
+        return false;
+    }
+    
+    spin_init(&device->lock);
+    device->queue = NULL;
+    device->active = NULL;
+    device->head = 0;
+    memset(&device->stats, 0, sizeof(device->stats));
+    device->next = NULL;
+    
+    uint32_t flags = spin_lock_irqsave(&devices_lock);
+    block_device_t** link = &devices;
+    while (*link) {
+        if (name_matches((*link)->name, device->name)) {
+            spin_unlock_irqrestore(&devices_lock, flags);
+            kprintf("ERROR: Block device %s is already registered\n", device->name);
+            return false;
+        }
+        link = &(*link)->next;
+    }
+    *link = device;
+    spin_unlock_irqrestore(&devices_lock, flags);
+    return true;
+}
+
+/**
+ * Find a device by name
+ */
+block_device_t* block_find(const char* name) {
+    uint32_t flags = spin_lock_irqsave(&devices_lock);
+    block_device_t* device = devices;
+    while (device && !name_matches(device->name, name)) {
+        device = device->next;
+    }
+    spin_unlock_irqrestore(&devices_lock, flags);
+    return device;
+}
+
+/**
+ * Get the first registered device
+ */
+block_device_t* block_first(void) {
+    return devices;
+}
+
+/**
+ * Complete a chain of requests linked through merged
+ */
+static void finish_requests(block_request_t* request, bool success) {
+    while (request) {
+        // The owner may reuse the request as soon as it's complete
+        block_request_t* next = request->merged;
+        void (*done)(block_request_t* request) = request->done;
+        task_t* waiter = (task_t*)request->context;
+        
+        request->failed = !success;
+        if (done) {
+            request->completed = true;
+            done(request);
+        } else if (waiter && request->device) {
+            // Under the queue lock, which block_wait checks completed under before it sleeps
+            spinlock_t* lock = &request->device->lock;
+            uint32_t flags = spin_lock_irqsave(lock);
+            __atomic_store_n(&request->completed, true, __ATOMIC_RELEASE);
+            task_wake(waiter);
+            spin_unlock_irqrestore(lock, flags);
+        } else {
+            __atomic_store_n(&request->completed, true, __ATOMIC_RELEASE);
+        }
+        request = next;
+    }
+}
+
+/**
+ * Take the next batch off a device's queue (device lock held)
+ */
+static block_request_t* take_batch(block_device_t* device) {
+    // C-LOOK: carry on upwards from the last command, wrap to the lowest sector
+    block_request_t** link = &device->queue;
+    while (*link && (*link)->lba < device->head) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        link = &device->queue;
+    }
+    
+    block_request_t* first = *link;
+    block_request_t* last = first;
+    uint32_t sectors = first->count;
+    uint32_t segments = first->segment_count;
+    
+    // Requests continuing its sectors sit right behind it in LBA order
+    block_request_t* candidate = first->next;
+    while (candidate && candidate->lba == last->lba + last->count && candidate->write == first->write &&
+           sectors + candidate->count <= device->max_sectors &&
+           segments + candidate->segment_count <= device->max_segments) {
+        sectors += candidate->count;
+        segments += candidate->segment_count;
+        last->merged = candidate;
+        last = candidate;
+        candidate = candidate->next;
+        device->stats.merges++;
+    }
+    last->merged = NULL;
+    
+    *link = candidate;
+    device->head = last->lba + last->count;
+    return first;
+}
+
+/**
+ * Start batches until one is running or the queue is empty (device lock held)
+ * Returns the requests of batches the driver refused, to be failed after unlocking
+ */
+static block_request_t* dispatch(block_device_t* device) {
+    block_request_t* refused = NULL;
+    
+    while (!device->active && device->queue) {
+        block_request_t* batch = take_batch(device);
+        device->active = batch;
+        device->stats.commands++;
+        if (device->ops->start(device, batch)) {
+            break;
+        }
+        
+        device->active = NULL;
+        block_request_t* last = batch;
+        while (last->merged) {
+            last = last->merged;
+        }
+        last->merged = refused;
+        refused = batch;
+    }
+    
+    return refused;
+}
+
+/**
+ * Count finished requests in the device statistics (device lock held)
+ */
+static void account_requests(block_device_t* device, block_request_t* request, bool success) {
+    uint64_t now = timer_now_ns();
+    
+    for (; request; request = request->merged) {
+        if (!success) {
+            device->stats.errors++;
+        } else if (request->write) {
+            device->stats.sectors_written += request->count;
+        } else {
+            device->stats.sectors_read += request->count;
+        }
+        device->stats.wait_ns += now - request->submit_ns;
+    }
+}
+
+/**
+ * Check that a request fits its device and that its memory covers its sectors
+ */
+static bool request_valid(block_request_t* request) {
+    block_device_t* device = request->device;
+    if (!device) {
+        kprintf("ERROR: Block request has no device\n");
+        return false;
+    }
+    if (request->count == 0 || request->count > device->max_sectors ||
+        request->lba >= device->sectors || request->count > device->sectors - request->lba) {
+        kprintf("ERROR: Block request for sectors %u+%u doesn't fit %s\n",
+                request->lba, request->count, device->name);
+        return false;
+    }
+    if (request->segment_count == 0 || request->segment_count > BLOCK_MAX_SEGMENTS ||
+        request->segment_count > device->max_segments) {
+        kprintf("ERROR: Block request has %u segments (%s takes 1 to %u)\n",
+                request->segment_count, device->name, device->max_segments);
+        return false;
+    }
+    
+    // DMA engines move 16-bit words
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < request->segment_count; i++) {
+        if ((request->segments[i].phys & 1) || (request->segments[i].length & 1) || request->segments[i].length == 0) {
+            kprintf("ERROR: Block request segments must be 2-byte aligned and sized\n");
+            return false;
+        }
+        bytes += request->segments[i].length;
+    }
+    if (bytes != request->count * BLOCK_SECTOR_SIZE) {
+        kprintf("ERROR: Block request segments hold %u bytes for %u sectors\n", bytes, request->count);
+        return false;
+    }
+    
+    return true;
+}
+
+/**
+ * Queue a request
+ */
+bool block_submit(block_request_t* request) {
+    request->completed = false;
+    request->failed = false;
+    request->next = NULL;
+    request->merged = NULL;
+    
+    if (!request_valid(request)) {
+        finish_requests(request, false);
+        return false;
+    }
+    
+    block_device_t* device = request->device;
+    request->submit_ns = timer_now_ns();
+    
+    uint32_t flags = spin_lock_irqsave(&device->lock);
+    device->stats.requests++;
+    
+    // After the requests for the same sector, so those keep their order
+    block_request_t** link = &device->queue;
+    while (*link && (*link)->lba <= request->lba) {
+        link = &(*link)->next;
+    }
+    request->next = *link;
+    *link = request;
+    
+    block_request_t* refused = dispatch(device);
+    if (refused) {
+        account_requests(device, refused, false);
+    }
+    spin_unlock_irqrestore(&device->lock, flags);
+    
+    finish_requests(refused, false);
+    return true;
+}
+
+/**
+ * Report that the active batch finished
+ */
+void block_complete(block_device_t* device, bool success) {
+    uint32_t flags = spin_lock_irqsave(&device->lock);
+    block_request_t* batch = device->active;
+    device->active = NULL;
+    if (batch) {
+        account_requests(device, batch, success);
+    }
+    
+    // Keep the device busy before waking anyone
+    block_request_t* refused = dispatch(device);
+    if (refused) {
+        account_requests(device, refused, false);
+    }
+    spin_unlock_irqrestore(&device->lock, flags);
+    
+    finish_requests(batch, success);
+    finish_requests(refused, false);
+}
+
+/**
+ * Wait for a submitted request that has no done function
+ */
+bool block_wait(block_request_t* request) {
+    // Invalid requests complete in block_submit, and may have no device to lock
+    if (__atomic_load_n(&request->completed, __ATOMIC_ACQUIRE)) {
+        return !request->failed;
+    }
+    
+    // The completion sets completed and wakes us under the queue lock, so it can't be missed
+    block_device_t* device = request->device;
+    uint32_t flags = spin_lock_irqsave(&device->lock);
+    while (!request->completed) {
+        task_block(&device->lock, flags);
+        flags = spin_lock_irqsave(&device->lock);
+    }
+    spin_unlock_irqrestore(&device->lock, flags);
+    
+    return !request->failed;
+}
+
+/**
+ * Transfer sectors to or from a list of physical segments, waits for the transfer
+ */
+static bool transfer(block_device_t* device, uint32_t lba, uint32_t count,
+                     const block_segment_t* segments, bool write) {
+    block_request_t* requests = kmalloc(BLOCK_TRANSFER_DEPTH * sizeof(block_request_t));
+    if (!requests) {
+        kprintf("ERROR: No memory for block requests\n");
+        return false;
+    }
+    
+    uint32_t max_segments = device->max_segments < BLOCK_MAX_SEGMENTS ? device->max_segments : BLOCK_MAX_SEGMENTS;
+    uint32_t segment = 0;
+    uint32_t offset = 0;
+    bool success = true;
+    
+    while (count > 0 && success) {
+        // Fill a window of requests, each as big as the device takes
+        uint32_t submitted = 0;
+        while (count > 0 && submitted < BLOCK_TRANSFER_DEPTH) {
+            block_request_t* request = &requests[submitted];
+            memset(request, 0, sizeof(*request));
+            request->device = device;
+            request->lba = lba;
+            request->write = write;
+            request->context = task_current();
+            
+            uint32_t want = (count < device->max_sectors ? count : device->max_sectors) * BLOCK_SECTOR_SIZE;
+            uint32_t bytes = 0;
+            while (bytes < want && request->segment_count < max_segments) {
+                uint32_t piece = segments[segment].length - offset;
+                piece = piece < want - bytes ? piece : want - bytes;
+                request->segments[request->segment_count].phys = segments[segment].phys + offset;
+                request->segments[request->segment_count].length = piece;
+                request->segment_count++;
+                bytes += piece;
+                offset += piece;
+                if (offset == segments[segment].length) {
+                    segment++;
+                    offset = 0;
+                }
+            }
+            
+            // Out of segments partway through a sector: hand the piece to the next request
+            uint32_t partial = bytes % BLOCK_SECTOR_SIZE;
+            bytes -= partial;
+            while (partial > 0) {
+                block_segment_t* last = &request->segments[request->segment_count - 1];
+                uint32_t back = partial < last->length ? partial : last->length;
+                if (offset == 0) {
+                    segment--;
+                    offset = segments[segment].length;
+                }
+                offset -= back;
+                last->length -= back;
+                partial -= back;
+                if (last->length == 0) {
+                    request->segment_count--;
+                }
+            }
+            if (bytes == 0) {
+                kprintf("ERROR: Block transfer segments are too small for one sector per request\n");
+                success = false;
+                break;
+            }
+            
+            request->count = bytes / BLOCK_SECTOR_SIZE;
+            lba += request->count;
+            count -= request->count;
+            submitted++;
+        }
+        
+        // Submit the window together so the queue can merge and order it
+        for (uint32_t i = 0; i < submitted; i++) {
+            block_submit(&requests[i]);
+        }
+        for (uint32_t i = 0; i < submitted; i++) {
+            if (!block_wait(&requests[i])) {
+                success = false;
+            }
+        }
+    }
+    
+    kfree(requests);
+    return success;
+}
+
+/**
+ * Transfer sectors to or from a kernel buffer
+ */
+static bool transfer_buffer(block_device_t* device, uint32_t lba, uint32_t count, void* buffer, bool write) {
+    uint32_t start = (uint32_t)buffer;
+    uint32_t bytes = count * BLOCK_SECTOR_SIZE;
+    if (start & 1) {
+        kprintf("ERROR: Block buffers must be 2-byte aligned\n");
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    
+    // One segment per page at most, fewer where frames happen to be contiguous
+    uint32_t max_segments = (bytes + PAGE_SIZE - 1) / PAGE_SIZE + 1;
+    block_segment_t* segments = kmalloc(max_segments * sizeof(block_segment_t));
+    if (!segments) {
+        kprintf("ERROR: No memory for block segments\n");
+        return false;
+    }
+    
+    uint32_t segment_count = 0;
+    uint32_t addr = start;
+    while (addr < start + bytes) {
+        uint32_t page_end = (addr & 0xFFFFF000) + PAGE_SIZE;
+        uint32_t piece = (page_end < start + bytes ? page_end : start + bytes) - addr;
+        
+        // Heap pages are committed on first touch, the device can't fault them in
+        (void)*(volatile uint8_t*)addr;
+        uint64_t phys = paging_get_physical_address(addr);
+        if (phys == 0) {
+            kprintf("ERROR: Block buffer at %p is not mapped\n", (void*)addr);
+            kfree(segments);
+            return false;
+        }
+        
+        if (segment_count > 0 && segments[segment_count - 1].phys + segments[segment_count - 1].length == phys) {
+            segments[segment_count - 1].length += piece;
+        } else {
+            segments[segment_count].phys = phys;
+            segments[segment_count].length = piece;
+            segment_count++;
+        }
+        addr += piece;
+    }
+    
+    bool success = transfer(device, lba, count, segments, write);
+    kfree(segments);
+    return success;
+}
+
+/**
+ * Read sectors into a kernel buffer
+ */
+bool block_read(block_device_t* device, uint32_t lba, uint32_t count, void* buffer) {
+    return transfer_buffer(device, lba, count, buffer, false);
+}
+
+/**
+ * Write sectors from a kernel buffer
+ */
+bool block_write(block_device_t* device, uint32_t lba, uint32_t count, const void* buffer) {
+    return transfer_buffer(device, lba, count, (void*)buffer, true);
+}
+
+/**
+ * Transfer whole pages to or from page frames
+ */
+static bool transfer_frames(block_device_t* device, uint32_t lba, const uint64_t* frames, uint32_t pages, bool write) {
+    if (pages == 0) {
+        return true;
+    }
+    
+    block_segment_t* segments = kmalloc(pages * sizeof(block_segment_t));
+    if (!segments) {
+        kprintf("ERROR: No memory for block segments\n");
+        return false;
+    }
+    
+    // Runs of contiguous frames become one segment
+    uint32_t segment_count = 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (segment_count > 0 && segments[segment_count - 1].phys + segments[segment_count - 1].length == frames[i]) {
+            segments[segment_count - 1].length += PAGE_SIZE;
+        } else {
+            segments[segment_count].phys = frames[i];
+            segments[segment_count].length = PAGE_SIZE;
+            segment_count++;
+        }
+    }
+    
+    bool success = transfer(device, lba, pages * BLOCK_SECTORS_PER_PAGE, segments, write);
+    kfree(segments);
+    return success;
+}
+
+/**
+ * Read whole pages into page frames
+ */
+bool block_read_frames(block_device_t* device, uint32_t lba, const uint64_t* frames, uint32_t pages) {
+    return transfer_frames(device, lba, frames, pages, false);
+}
+
+/**
+ * Write whole pages from page frames
+ */
+bool block_write_frames(block_device_t* device, uint32_t lba, const uint64_t* frames, uint32_t pages) {
+    return transfer_frames(device, lba, frames, pages, true);
+}
+
+/**
+ * Allocate a physically contiguous buffer
+ * It comes from below 4GB so any DMA engine can reach it
+ */
+bool block_alloc_buffer(block_buffer_t* buffer, uint32_t pages) {
+    uint32_t order = 0;
+    while ((1u << order) < pages) {
+        order++;
+    }
+    
+    uint32_t phys = pmm_alloc_low_pages(order);
+    if (phys == 0) {
+        kprintf("ERROR: No contiguous memory for a %u page block buffer\n", pages);
+        return false;
+    }
+    
+    uint32_t count = 1u << order;
+    uint32_t virt = vm_area_alloc(count, PAGE_SIZE);
+    if (virt == 0 || !paging_map_range(virt, phys, count, PAGE_KERNEL)) {
+        kprintf("ERROR: No kernel space to map a block buffer\n");
+        if (virt != 0) {
+            vm_area_free(virt);
+        }
+        pmm_free_pages(phys, order);
+        return false;
+    }
+    
+    buffer->data = (void*)virt;
+    buffer->phys = phys;
+    buffer->pages = count;
+    buffer->order = order;
+    return true;
+}
+
+/**
+ * Free a buffer from block_alloc_buffer
+ */
+void block_free_buffer(block_buffer_t* buffer) {
+    paging_unmap_range((uint32_t)buffer->data, buffer->pages, false);
+    vm_area_free((uint32_t)buffer->data);
+    pmm_free_pages(buffer->phys, buffer->order);
+    buffer->data = NULL;
+}
+
+/**
+ * Get a device's statistics
+ */
+void block_get_stats(block_device_t* device, block_stats_t* stats) {
+    uint32_t flags = spin_lock_irqsave(&device->lock);
+    *stats = device->stats;
+    spin_unlock_irqrestore(&device->lock, flags);
+}
+
+/**
+ * Print the statistics of every device
+ */
+void block_print_stats(void) {
+    kprintf("Block Devices:\n");
+    if (!devices) {
+        kprintf("  (none)\n");
+        return;
+    }
+    
+    for (block_device_t* device = devices; device; device = device->next) {
+        block_stats_t stats;
+        block_get_stats(device, &stats);
+        
+        uint32_t wait_us = 0;
+        if (stats.requests > 0) {
+            wait_us = (uint32_t)div64_32(stats.wait_ns, stats.requests * 1000);
+        }
+        
+        kprintf("  %s: %u MB, %u requests (%u merged) in %u commands, %u errors\n",
+                device->name, device->sectors / (1024 * 1024 / BLOCK_SECTOR_SIZE),
+                stats.requests, stats.merges, stats.commands, stats.errors);
+        kprintf("    Read %u KB, written %u KB, average wait %u us\n",
+                (uint32_t)(stats.sectors_read / (1024 / BLOCK_SECTOR_SIZE)),
+                (uint32_t)(stats.sectors_written / (1024 / BLOCK_SECTOR_SIZE)), wait_us);
+    }
+}
\ No newline at end of file
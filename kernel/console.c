@@ -3,14 +3,46 @@
  * 
  * This file implements the console interface for text output in the kernel.
  * It provides functions to write text to the screen using the VGA text mode.
+ * Text is drawn into a shadow buffer in RAM that works as a ring of lines,
+ * so scrolling only moves the top row index. Dirty rows are copied to VGA
+ * memory in bulk when a write ends a line, when enough text is pending,
+ * or on console_flush.
  */
 
 #include "include/console.h"
 #include "include/types.h"
+#include "include/string.h"
+#include "include/io.h"
+#include "include/spinlock.h"
 
 // Video memory address for VGA text mode
 static uint16_t* const video_memory = (uint16_t*)0xB8000;
 
+// VGA CRT controller ports and cursor location registers
+#define VGA_CRTC_INDEX       0x3D4
+#define VGA_CRTC_DATA        0x3D5
+#define VGA_CURSOR_HIGH      0x0E
+#define VGA_CURSOR_LOW       0x0F
+
+// Flush once this many characters are pending without a newline
+#define CONSOLE_FLUSH_THRESHOLD CONSOLE_WIDTH
+
+// Shadow of the screen, screen row y lives in shadow row (top_row + y) % CONSOLE_HEIGHT
+static uint16_t shadow[CONSOLE_HEIGHT][CONSOLE_WIDTH];
+static int top_row = 0;
+
+// Screen rows that differ from VGA memory, one bit per row
+static uint32_t dirty_rows = 0;
+
+// Characters drawn since the last flush
+static int pending_chars = 0;
+
+// Cursor position last written to the CRT controller
+static int hw_cursor = -1;
+
+// Serializes writers, the shadow buffer and ring index are shared by all CPUs
+static spinlock_t console_lock = SPINLOCK_INIT;
+
 // Current position and color
 static int cursor_x = 0;
 static int cursor_y = 0;
@@ -30,6 +62,65 @@ static inline uint8_t make_color(uint8_t fg, uint8_t bg) {
     return fg | (bg << 4);
 }
 
+/**
+ * Get the shadow row shown at a screen row.
+ */
+static inline uint16_t* shadow_row(int y) {
+    return shadow[(top_row + y) % CONSOLE_HEIGHT];
+}
+
+/**
+ * Move the hardware cursor if it changed.
+ */
+static void update_hw_cursor(void) {
+    int pos = cursor_y * CONSOLE_WIDTH + cursor_x;
+    if (pos == hw_cursor) {
+        return;
+    }
+    
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_LOW);
+    outb(VGA_CRTC_DATA, (uint8_t)(pos & 0xFF));
+    outb(VGA_CRTC_INDEX, VGA_CURSOR_HIGH);
+    outb(VGA_CRTC_DATA, (uint8_t)(pos >> 8));
+    hw_cursor = pos;
+}
+
+/**
+ * Copy dirty rows to VGA memory and update the hardware cursor.
+ * Caller holds console_lock.
+ */
+static void flush_locked(void) {
+    uint32_t rows = dirty_rows;
+    
+    while (rows) {
+        // Copy each run of consecutive dirty rows that is contiguous in the ring
+        int y = __builtin_ctz(rows);
+        int count = 1;
+        while (y + count < CONSOLE_HEIGHT && (rows & (1u << (y + count))) &&
+               (top_row + y + count) % CONSOLE_HEIGHT != 0) {
+            count++;
+        }
+        
+        memcpy(video_memory + y * CONSOLE_WIDTH, shadow_row(y),
+               count * CONSOLE_WIDTH * sizeof(uint16_t));
+        rows &= ~(((1u << count) - 1) << y);
+    }
+    
+    dirty_rows = 0;
+    pending_chars = 0;
+    update_hw_cursor();
+}
+
+/**
+ * Flush if a write ended a line or left enough text pending.
+ * Caller holds console_lock.
+ */
+static void flush_if_needed(bool newline) {
+    if (newline || pending_chars >= CONSOLE_FLUSH_THRESHOLD) {
+        flush_locked();
+    }
+}
+
 /**
  * Initialize the console by clearing the screen.
  */
@@ -42,16 +133,19 @@ void console_init(void) {
  * Clear the entire console screen.
  */
 void console_clear(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    
     uint16_t blank = make_vga_entry(' ', current_color);
     
-    for (int y = 0; y < CONSOLE_HEIGHT; y++) {
-        for (int x = 0; x < CONSOLE_WIDTH; x++) {
-            video_memory[y * CONSOLE_WIDTH + x] = blank;
-        }
-    }
+    memset16(shadow, blank, CONSOLE_WIDTH * CONSOLE_HEIGHT);
+    top_row = 0;
+    dirty_rows = (1u << CONSOLE_HEIGHT) - 1;
     
     cursor_x = 0;
     cursor_y = 0;
+    
+    flush_locked();
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 /**
@@ -65,24 +159,22 @@ void console_set_color(uint8_t fg, uint8_t bg) {
  * Scroll the console up one line.
  */
 static void console_scroll(void) {
-    // Move all existing lines up
-    for (int y = 0; y < CONSOLE_HEIGHT - 1; y++) {
-        for (int x = 0; x < CONSOLE_WIDTH; x++) {
-            video_memory[y * CONSOLE_WIDTH + x] = video_memory[(y + 1) * CONSOLE_WIDTH + x];
-        }
-    }
+    // The old top row becomes the new bottom row
+    top_row = (top_row + 1) % CONSOLE_HEIGHT;
     
     // Clear the bottom line
     uint16_t blank = make_vga_entry(' ', current_color);
-    for (int x = 0; x < CONSOLE_WIDTH; x++) {
-        video_memory[(CONSOLE_HEIGHT - 1) * CONSOLE_WIDTH + x] = blank;
-    }
+    memset16(shadow_row(CONSOLE_HEIGHT - 1), blank, CONSOLE_WIDTH);
+    
+    // Every screen row now shows a different line
+    dirty_rows = (1u << CONSOLE_HEIGHT) - 1;
 }
 
 /**
- * Write a single character to the console.
+ * Draw a character into the shadow buffer.
+ * Caller holds console_lock.
  */
-void console_put_char(char c) {
+static void put_char_locked(char c) {
     // Handle special characters
     if (c == '\n') {
         cursor_x = 0;
@@ -98,8 +190,9 @@ void console_put_char(char c) {
         cursor_x = (cursor_x + 8) & ~(8 - 1);
     } else {
         // Regular character
-        uint16_t* location = video_memory + (cursor_y * CONSOLE_WIDTH + cursor_x);
-        *location = make_vga_entry(c, current_color);
+        shadow_row(cursor_y)[cursor_x] = make_vga_entry(c, current_color);
+        dirty_rows |= 1u << cursor_y;
+        pending_chars++;
         cursor_x++;
     }
     
@@ -116,74 +209,85 @@ void console_put_char(char c) {
     }
 }
 
+/**
+ * Write a single character to the console.
+ */
+void console_put_char(char c) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    put_char_locked(c);
+    flush_if_needed(c == '\n');
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
 /**
  * Write a string to the console.
  */
 void console_write_string(const char* str) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    
+    bool newline = false;
     while (*str) {
-        console_put_char(*str);
+        put_char_locked(*str);
+        newline |= (*str == '\n');
         str++;
     }
+    
+    flush_if_needed(newline);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+/**
+ * Copy all pending output to the screen.
+ */
+void console_flush(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    flush_locked();
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 /**
  * Write a decimal integer to the console.
  */
 void console_write_int(int value) {
-    // Handle negative numbers
-    if (value < 0) {
-        console_put_char('-');
-        value = -value;
-    }
+    // Build the digits backwards, so the number is written in one call
+    char buffer[12]; // Enough for a 32-bit int with its sign
+    int pos = sizeof(buffer) - 1;
+    buffer[pos] = '\0';
     
-    // Special case for zero
-    if (value == 0) {
-        console_put_char('0');
-        return;
-    }
+    // Negate as unsigned so INT_MIN works too
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
     
-    // Convert the number to characters
-    char buffer[12]; // Enough for 32-bit int
-    int pos = 0;
+    do {
+        buffer[--pos] = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
     
-    while (value > 0) {
-        buffer[pos++] = '0' + (value % 10);
-        value /= 10;
+    if (value < 0) {
+        buffer[--pos] = '-';
     }
     
-    // Print the digits in reverse (correct) order
-    while (pos > 0) {
-        console_put_char(buffer[--pos]);
-    }
+    console_write_string(&buffer[pos]);
 }
 
 /**
  * Write a hexadecimal number to the console.
  */
 void console_write_hex(uint32_t value) {
-    // Print "0x" prefix
-    console_write_string("0x");
-    
-    // Special case for zero
-    if (value == 0) {
-        console_put_char('0');
-        return;
-    }
+    // "0x" prefix, up to 8 hex digits and the terminator
+    char buffer[11];
+    int pos = sizeof(buffer) - 1;
+    buffer[pos] = '\0';
     
-    // Convert the number to hex characters
-    char buffer[8]; // Enough for 32-bit int (8 hex digits)
-    int pos = 0;
-    
-    while (value > 0 && pos < 8) {
+    do {
         uint8_t digit = value & 0xF;
-        buffer[pos++] = digit < 10 ? '0' + digit : 'A' + (digit - 10);
+        buffer[--pos] = digit < 10 ? '0' + digit : 'A' + (digit - 10);
         value >>= 4;
-    }
+    } while (value > 0);
     
-    // Print the digits in reverse (correct) order
-    while (pos > 0) {
-        console_put_char(buffer[--pos]);
-    }
+    buffer[--pos] = 'x';
+    buffer[--pos] = '0';
+    
+    console_write_string(&buffer[pos]);
 }
 
 /**
@@ -191,7 +295,10 @@ void console_write_hex(uint32_t value) {
  */
 void console_set_cursor(int x, int y) {
     if (x >= 0 && x < CONSOLE_WIDTH && y >= 0 && y < CONSOLE_HEIGHT) {
+        uint32_t flags = spin_lock_irqsave(&console_lock);
         cursor_x = x;
         cursor_y = y;
+        flush_locked();
+        spin_unlock_irqrestore(&console_lock, flags);
     }
 }
\ No newline at end of file
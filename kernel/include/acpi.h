@@ -0,0 +1,17 @@
+/**
+ * NKOF ACPI Tables
+ *
+ * This file declares the minimal ACPI support needed for SMP: finding the
+ * RSDP, walking the RSDT and reading the processors out of the MADT.
+ */
+
+#ifndef NKOF_ACPI_H
+#define NKOF_ACPI_H
+
+#include "types.h"
+
+// Get the local APIC IDs of the enabled processors listed in the MADT
+// Returns the number found, 0 if there is no MADT; only the first max are stored
+uint32_t acpi_find_cpus(uint32_t* apic_ids, uint32_t max);
+
+#endif /* NKOF_ACPI_H */
\ No newline at end of file
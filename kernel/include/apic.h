@@ -0,0 +1,53 @@
+/**
+ * NKOF Local APIC Driver
+ *
+ * This file declares the local APIC interface: enabling the APIC,
+ * end-of-interrupt, inter-processor interrupts and the one-shot local
+ * APIC timer.
+ */
+
+#ifndef NKOF_APIC_H
+#define NKOF_APIC_H
+
+#include "types.h"
+
+// Vector of the local APIC timer interrupt
+#define APIC_TIMER_VECTOR 48
+
+// Vector for spurious APIC interrupts
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// Enable the calling CPU's local APIC, returns false if the CPU has none
+bool apic_init(void);
+
+// Check if the local APIC is enabled
+bool apic_available(void);
+
+// Get the ID of the current CPU's local APIC
+uint32_t apic_id(void);
+
+// Signal the end of an APIC interrupt
+void apic_eoi(void);
+
+// Send an INIT IPI to another CPU
+void apic_send_init(uint32_t target);
+
+// Send a startup IPI, the CPU starts in real mode at page * 4KB
+void apic_send_startup(uint32_t target, uint32_t page);
+
+// Send a fixed interrupt to another CPU
+void apic_send_ipi(uint32_t target, uint32_t vector);
+
+// Start the timer counting down from its maximum, masked, for calibration
+void apic_timer_start_free_running(void);
+
+// Get the number of timer ticks since apic_timer_start_free_running
+uint32_t apic_timer_elapsed(void);
+
+// Fire APIC_TIMER_VECTOR once after the given number of timer ticks
+void apic_timer_oneshot(uint32_t ticks);
+
+// Stop the timer
+void apic_timer_stop(void);
+
+#endif /* NKOF_APIC_H */
\ No newline at end of file
@@ -0,0 +1,29 @@
+/**
+ * NKOF ATA Disk Driver
+ *
+ * This file declares the driver for ATA disks on the two legacy IDE
+ * channels. Each disk found becomes a block device named after its place
+ * in the Bochs configuration (ata0-master, ata0-slave, ata1-master, ...).
+ * Transfers use bus master DMA through the PCI IDE controller when there
+ * is one and PIO otherwise, and complete from the channel's interrupt
+ * (or from a poll timer on a channel without a usable interrupt line).
+ */
+
+#ifndef NKOF_ATA_H
+#define NKOF_ATA_H
+
+#include "types.h"
+
+// Most sectors in one command (the LBA28 limit, 128KB)
+#define ATA_MAX_SECTORS 256
+
+// Most block segments in one command, each takes up to 3 PRD entries
+#define ATA_MAX_SEGMENTS 64
+
+// Time a command may take before the channel is reset
+#define ATA_TIMEOUT_NS (2 * NSEC_PER_SEC)
+
+// Find the disks and register them with the block layer, returns how many were found
+uint32_t ata_init(void);
+
+#endif /* NKOF_ATA_H */
\ No newline at end of file
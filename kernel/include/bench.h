@@ -0,0 +1,28 @@
+/**
+ * NKOF Benchmarks
+ *
+ * This file declares the in-kernel allocator and paging benchmarks.
+ * Kernels built with "./build.sh bench" run them at the end of boot,
+ * report the results over COM1 and exit QEMU through isa-debug-exit.
+ */
+
+#ifndef NKOF_BENCH_H
+#define NKOF_BENCH_H
+
+#include "types.h"
+
+// I/O port of QEMU's isa-debug-exit device (-device isa-debug-exit,iobase=0xf4,iosize=0x04)
+#define BENCH_EXIT_PORT 0xF4
+
+// Values written to the exit port, QEMU exits with (value << 1) | 1
+#define BENCH_EXIT_SUCCESS 0x10
+#define BENCH_EXIT_FAILURE 0x11
+
+// Run every benchmark and report the results
+// Returns false if a benchmark could not run (e.g. it ran out of memory)
+bool bench_run(void);
+
+// Leave the emulator with a status code, halts when there is no debug-exit device
+void bench_exit(bool success);
+
+#endif /* NKOF_BENCH_H */
\ No newline at end of file
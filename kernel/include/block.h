@@ -0,0 +1,137 @@
+/**
+ * NKOF Block Layer
+ *
+ * This file declares block devices and their request queues. A request
+ * names a run of sectors and the physical memory segments they go to or
+ * come from, so drivers can DMA straight into page frames (the page cache
+ * hands over frames, nothing is copied). Requests are queued in LBA order,
+ * adjacent ones are merged into a single command and the device works
+ * through them in elevator order, completing each from its interrupt.
+ */
+
+#ifndef NKOF_BLOCK_H
+#define NKOF_BLOCK_H
+
+#include "types.h"
+#include "spinlock.h"
+#include "pmm.h"
+#include "timer.h"
+
+// Size of a sector, the unit of every transfer
+#define BLOCK_SECTOR_SIZE 512
+
+// Sectors per page, for page-sized transfers
+#define BLOCK_SECTORS_PER_PAGE (PAGE_SIZE / BLOCK_SECTOR_SIZE)
+
+// Most physical segments in one request
+#define BLOCK_MAX_SEGMENTS 16
+
+struct block_device;
+
+// Physically contiguous piece of a transfer (2-byte aligned, an even number of bytes)
+typedef struct block_segment {
+    uint64_t phys;
+    uint32_t length;
+} block_segment_t;
+
+// Transfer of a run of sectors
+typedef struct block_request {
+    struct block_device* device;
+    uint32_t lba;                                   // First sector
+    uint32_t count;                                 // Number of sectors
+    bool write;                                     // Memory to disk
+    block_segment_t segments[BLOCK_MAX_SEGMENTS];   // Memory, count * BLOCK_SECTOR_SIZE bytes in all
+    uint32_t segment_count;
+    void (*done)(struct block_request* request);    // Called on completion, maybe from an interrupt
+    void* context;                                  // Owner's data
+    volatile bool completed;                        // Set before done is called
+    bool failed;                                    // The transfer didn't succeed
+    uint64_t submit_ns;                             // When it was queued
+    struct block_request* next;                     // Next request in the queue, by LBA
+    struct block_request* merged;                   // Next request of the same command
+} block_request_t;
+
+// Driver entry points
+typedef struct block_ops {
+    // Start a command for a batch of requests with adjacent sectors, linked through
+    // merged. Completion is reported with block_complete, false if it couldn't start
+    bool (*start)(struct block_device* device, block_request_t* batch);
+} block_ops_t;
+
+// Block device statistics
+typedef struct block_stats {
+    uint32_t requests;                              // Requests submitted
+    uint32_t merges;                                // Requests that joined another's command
+    uint32_t commands;                              // Commands sent to the device
+    uint32_t errors;                                // Requests that failed
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t wait_ns;                               // Total time from submission to completion
+} block_stats_t;
+
+// Block device, filled in by the driver before block_register
+typedef struct block_device {
+    const char* name;
+    uint32_t sectors;                               // Capacity
+    uint32_t max_sectors;                           // Most sectors in one command
+    uint32_t max_segments;                          // Most segments in one command
+    const block_ops_t* ops;
+    void* driver;                                   // Driver's data
+    
+    // Queue state, protected by lock
+    spinlock_t lock;
+    block_request_t* queue;                         // Waiting requests, by LBA
+    block_request_t* active;                        // Batch the device is working on
+    uint32_t head;                                  // Sector after the last command, for the elevator
+    block_stats_t stats;
+    struct block_device* next;                      // Next registered device
+} block_device_t;
+
+// Physically contiguous buffer from the buddy allocator below 4GB, mapped for the CPU
+typedef struct block_buffer {
+    void* data;
+    uint32_t phys;
+    uint32_t pages;
+    uint32_t order;
+} block_buffer_t;
+
+// Make a device available, its name must be unique
+bool block_register(block_device_t* device);
+
+// Find a device by name, NULL if there is none
+block_device_t* block_find(const char* name);
+
+// Get the first registered device (the list continues through next)
+block_device_t* block_first(void);
+
+// Queue a request, its done function is called when it finishes
+// Returns false (after completing it as failed) if the request is invalid
+bool block_submit(block_request_t* request);
+
+// Report that the active batch finished (drivers, usually from their interrupt)
+void block_complete(block_device_t* device, bool success);
+
+// Wait for a submitted request that has no done function of its own
+bool block_wait(block_request_t* request);
+
+// Read or write sectors from a kernel buffer (2-byte aligned), waits for the transfer
+bool block_read(block_device_t* device, uint32_t lba, uint32_t count, void* buffer);
+bool block_write(block_device_t* device, uint32_t lba, uint32_t count, const void* buffer);
+
+// Read or write whole pages straight to or from page frames, waits for the transfer
+bool block_read_frames(block_device_t* device, uint32_t lba, const uint64_t* frames, uint32_t pages);
+bool block_write_frames(block_device_t* device, uint32_t lba, const uint64_t* frames, uint32_t pages);
+
+// Allocate a physically contiguous buffer of at least the given number of pages
+bool block_alloc_buffer(block_buffer_t* buffer, uint32_t pages);
+
+// Free a buffer from block_alloc_buffer
+void block_free_buffer(block_buffer_t* buffer);
+
+// Get a device's statistics
+void block_get_stats(block_device_t* device, block_stats_t* stats);
+
+// Print the statistics of every device
+void block_print_stats(void);
+
+#endif /* NKOF_BLOCK_H */
\ No newline at end of file
@@ -47,6 +47,9 @@ void console_put_char(char c);
 // Write a string to the console
 void console_write_string(const char* str);
 
+// Copy pending output to the screen (writes flush on newlines by themselves)
+void console_flush(void);
+
 // Write a decimal integer to the console
 void console_write_int(int value);
 
@@ -0,0 +1,121 @@
+/**
+ * NKOF CPU Helpers
+ *
+ * This file contains inline helpers for CPUID and the control registers,
+ * shared by the subsystems that pick code paths based on CPU features.
+ */
+
+#ifndef NKOF_CPU_H
+#define NKOF_CPU_H
+
+#include "types.h"
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_EDX_FPU   (1 << 0)
+#define CPUID_EDX_PSE   (1 << 3)
+#define CPUID_EDX_TSC   (1 << 4)
+#define CPUID_EDX_MSR   (1 << 5)
+#define CPUID_EDX_PAE   (1 << 6)
+#define CPUID_EDX_APIC  (1 << 9)
+#define CPUID_EDX_PGE   (1 << 13)
+#define CPUID_EDX_FXSR  (1 << 24)
+#define CPUID_EDX_SSE   (1 << 25)
+#define CPUID_EDX_SSE2  (1 << 26)
+
+// CPUID leaf 0x80000001 EDX feature bits
+#define CPUID_EXT_EDX_NX  (1 << 20)    // No-execute pages
+#define CPUID_EXT_EDX_LM  (1 << 29)    // Long mode (64-bit)
+
+// CR0 bits
+#define CR0_MP  (1 << 1)     // Monitor coprocessor
+#define CR0_EM  (1 << 2)     // x87 emulation
+#define CR0_WP  (1 << 16)    // Write protect in ring 0
+#define CR0_PG  (1 << 31)    // Paging
+
+// CR4 bits
+#define CR4_PSE        (1 << 4)     // 4MB pages
+#define CR4_PAE        (1 << 5)     // Physical address extension
+#define CR4_PGE        (1 << 7)     // Global pages
+#define CR4_OSFXSR     (1 << 9)     // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT (1 << 10)    // SSE exceptions enabled
+
+/**
+ * Execute CPUID for a leaf
+ */
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    uint32_t a, b, c, d;
+    asm volatile ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (leaf), "c" (0));
+    if (eax) *eax = a;
+    if (ebx) *ebx = b;
+    if (ecx) *ecx = c;
+    if (edx) *edx = d;
+}
+
+/**
+ * Get the CPUID leaf 1 EDX feature flags
+ */
+static inline uint32_t cpu_features_edx(void) {
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    return edx;
+}
+
+/**
+ * Get the CPUID leaf 0x80000001 EDX feature flags, 0 if the leaf is missing
+ */
+static inline uint32_t cpu_ext_features_edx(void) {
+    uint32_t max_leaf, edx;
+    cpuid(0x80000000, &max_leaf, NULL, NULL, NULL);
+    if (max_leaf < 0x80000001) {
+        return 0;
+    }
+    cpuid(0x80000001, NULL, NULL, NULL, &edx);
+    return edx;
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t value;
+    asm volatile ("mov %%cr0, %0" : "=r" (value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+    asm volatile ("mov %0, %%cr0" : : "r" (value) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t value;
+    asm volatile ("mov %%cr4, %0" : "=r" (value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+    asm volatile ("mov %0, %%cr4" : : "r" (value) : "memory");
+}
+
+/**
+ * Read the time stamp counter
+ */
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Read a model-specific register
+ */
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * Write a model-specific register
+ */
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+#endif /* NKOF_CPU_H */
\ No newline at end of file
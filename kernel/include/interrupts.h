@@ -0,0 +1,81 @@
+/**
+ * NKOF Interrupt Handling
+ *
+ * This file declares the IDT setup and the interface for registering
+ * handlers for CPU exceptions and hardware interrupts.
+ */
+
+#ifndef NKOF_INTERRUPTS_H
+#define NKOF_INTERRUPTS_H
+
+#include "types.h"
+
+// Number of IDT entries
+#define IDT_ENTRIES 256
+
+// Number of CPU exception vectors
+#define EXCEPTION_COUNT 32
+
+// Exception vectors handled specially
+#define VECTOR_PAGE_FAULT 14
+
+// Registers saved by the interrupt stubs, lowest address first
+typedef struct {
+    uint32_t gs, fs, es, ds;                          // Segment registers
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;  // Saved by pusha
+    uint32_t vector;                                  // Interrupt vector
+    uint32_t error_code;                              // CPU error code, or 0
+    uint32_t eip, cs, eflags;                         // Pushed by the CPU
+} interrupt_frame_t;
+
+// Interrupt handler function
+typedef void (*interrupt_handler_t)(interrupt_frame_t* frame);
+
+// Set up the IDT and install the exception handlers
+void interrupts_init(void);
+
+// Load the shared IDT on the calling CPU (used by application processors)
+void interrupts_init_cpu(void);
+
+// Register a handler for an interrupt vector
+void interrupts_register_handler(uint8_t vector, interrupt_handler_t handler);
+
+// Install an IDT gate for a vector
+void interrupts_set_gate(uint8_t vector, uint32_t handler);
+
+// Called by the assembly stubs for every interrupt
+void interrupt_dispatch(interrupt_frame_t* frame);
+
+/**
+ * Enable interrupts
+ */
+static inline void interrupts_enable(void) {
+    asm volatile ("sti");
+}
+
+/**
+ * Disable interrupts
+ */
+static inline void interrupts_disable(void) {
+    asm volatile ("cli");
+}
+
+/**
+ * Disable interrupts, returning the previous EFLAGS for interrupts_restore
+ */
+static inline uint32_t interrupts_save(void) {
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+/**
+ * Re-enable interrupts if they were enabled before interrupts_save
+ */
+static inline void interrupts_restore(uint32_t flags) {
+    if (flags & 0x200) {
+        asm volatile ("sti" : : : "memory");
+    }
+}
+
+#endif /* NKOF_INTERRUPTS_H */
\ No newline at end of file
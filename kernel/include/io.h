@@ -0,0 +1,81 @@
+/**
+ * NKOF Port I/O
+ *
+ * This file contains inline helpers for x86 I/O port access.
+ */
+
+#ifndef NKOF_IO_H
+#define NKOF_IO_H
+
+#include "types.h"
+
+/**
+ * Write a byte to an I/O port
+ */
+static inline void outb(uint16_t port, uint8_t value) {
+    asm volatile ("outb %0, %1" : : "a" (value), "Nd" (port));
+}
+
+/**
+ * Read a byte from an I/O port
+ */
+static inline uint8_t inb(uint16_t port) {
+    uint8_t value;
+    asm volatile ("inb %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
+
+/**
+ * Write a 16-bit word to an I/O port
+ */
+static inline void outw(uint16_t port, uint16_t value) {
+    asm volatile ("outw %0, %1" : : "a" (value), "Nd" (port));
+}
+
+/**
+ * Read a 16-bit word from an I/O port
+ */
+static inline uint16_t inw(uint16_t port) {
+    uint16_t value;
+    asm volatile ("inw %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
+
+/**
+ * Write a 32-bit value to an I/O port
+ */
+static inline void outl(uint16_t port, uint32_t value) {
+    asm volatile ("outl %0, %1" : : "a" (value), "Nd" (port));
+}
+
+/**
+ * Read a 32-bit value from an I/O port
+ */
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    asm volatile ("inl %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
+
+/**
+ * Read count 16-bit words from an I/O port into a buffer
+ */
+static inline void insw(uint16_t port, void* buffer, uint32_t count) {
+    asm volatile ("rep insw" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+/**
+ * Write count 16-bit words from a buffer to an I/O port
+ */
+static inline void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    asm volatile ("rep outsw" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+/**
+ * Give slow devices time to settle after a port write
+ */
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+#endif /* NKOF_IO_H */
\ No newline at end of file
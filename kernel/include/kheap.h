@@ -9,6 +9,51 @@
 
 #include "types.h"
 
+// Free block histogram buckets, bucket i counts blocks of [32 << i, 64 << i) bytes
+// and the last one everything larger
+#define KHEAP_FREE_BUCKETS 16
+
+// Requests up to this size are served by slab size classes
+#define KMALLOC_MAX_SMALL 2048
+
+// Most size classes in use at once, each a multiple of the granule
+#define KHEAP_MAX_CLASSES 12
+#define KHEAP_CLASS_GRANULE 16
+
+// Least pages the block heap grows by (default and largest allowed)
+#define KHEAP_EXPAND_PAGES 16
+#define KHEAP_EXPAND_MAX_PAGES 256
+
+// Detailed heap statistics
+typedef struct kheap_detailed_stats {
+    size_t total;                  // Same as kheap_get_stats
+    size_t used;
+    size_t free;
+    size_t peak_footprint;         // Most bytes held at once by blocks, slabs and large allocations
+    size_t block_free;             // Free bytes in the block arenas
+    uint32_t free_blocks;          // Number of free blocks
+    size_t largest_free_block;     // Largest free block, including its header and footer
+    uint32_t fragmentation;        // External fragmentation of the blocks, per mille:
+                                   // 1000 * (1 - largest_free_block / block_free)
+    uint32_t free_histogram[KHEAP_FREE_BUCKETS];
+    size_t slab_total;             // Bytes of slabs and of the objects in use in them
+    size_t slab_used;
+    size_t large_total;            // Bytes mapped for large allocations
+    uint32_t large_count;          // Number of large allocations
+    uint32_t arenas;               // Block arenas opened, each arena_size bytes
+    size_t arena_size;
+    uint32_t expansions;           // Times the block heap has grown
+    uint32_t expand_step;          // Least pages it grows by
+} kheap_detailed_stats_t;
+
+// An allocation site (NKOF_HEAP_TAGS builds only)
+typedef struct kheap_site {
+    void* site;                    // Return address of the kmalloc call
+    uint32_t live_count;           // Allocations from the site not freed yet
+    size_t live_bytes;             // Bytes they requested
+    uint32_t total_count;          // Allocations ever made from the site
+} kheap_site_t;
+
 // Initialize the kernel heap
 void kheap_init(void);
 
@@ -24,13 +69,57 @@ void* kzalloc(size_t size);
 // Free allocated memory
 void kfree(void* ptr);
 
+// Free memory from kmalloc_aligned (same as kfree)
+void kfree_aligned(void* ptr);
+
 // Reallocate memory to a new size
 void* krealloc(void* ptr, size_t size);
 
+// Map whole pages in the heap's page area (backs the slab allocator)
+void* kheap_map_pages(size_t pages, size_t alignment);
+
+// Unmap pages from kheap_map_pages and return their frames
+void kheap_unmap_pages(void* ptr, size_t pages);
+
+// Replace the slab size classes: ascending multiples of KHEAP_CLASS_GRANULE
+// ending at KMALLOC_MAX_SMALL. Objects already allocated keep their caches
+bool kheap_set_size_classes(const uint32_t* sizes, uint32_t count);
+
+// Get the slab size classes in use, returns how many were filled in
+uint32_t kheap_get_size_classes(uint32_t* sizes, uint32_t max);
+
+// Check whether a size class already has a cache (classes of new sizes need one each)
+bool kheap_has_class_cache(uint32_t size);
+
+// Get how many more size class caches can be created
+uint32_t kheap_class_caches_left(void);
+
+// Set the least number of pages the block heap grows by (1 to KHEAP_EXPAND_MAX_PAGES)
+void kheap_set_expand_step(uint32_t pages);
+
+// Get the least number of pages the block heap grows by
+uint32_t kheap_get_expand_step(void);
+
+// Get how many times the block heap has grown (cheap, unlike the detailed stats)
+uint32_t kheap_get_expansions(void);
+
 // Get heap statistics
 void kheap_get_stats(size_t* total, size_t* used, size_t* free);
 
 // Print heap statistics
 void kheap_print_stats(void);
 
+// Get detailed heap statistics, walks the free list
+void kheap_get_detailed_stats(kheap_detailed_stats_t* stats);
+
+// Print detailed heap statistics
+void kheap_print_detailed_stats(void);
+
+// Get the allocation sites holding the most live bytes, largest first
+// Returns the number filled in, always 0 unless built with NKOF_HEAP_TAGS
+uint32_t kheap_top_sites(kheap_site_t* sites, uint32_t max);
+
+// Print the allocation sites holding the most live bytes
+void kheap_print_top_sites(uint32_t max);
+
 #endif /* NKOF_KHEAP_H */
\ No newline at end of file
@@ -0,0 +1,47 @@
+/**
+ * NKOF Kernel Log
+ *
+ * This file declares the kernel log: a printf-style API that formats
+ * messages into a lock-free ring buffer. The ring is drained to COM1 and
+ * the console later, by idle CPUs or when it fills up, so logging is
+ * cheap in hot paths and safe from interrupt handlers.
+ */
+
+#ifndef NKOF_KLOG_H
+#define NKOF_KLOG_H
+
+#include "types.h"
+
+// Variable argument lists, from the compiler
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type)   __builtin_va_arg(ap, type)
+#define va_end(ap)         __builtin_va_end(ap)
+
+// Number of messages the ring holds (power of 2)
+#define KLOG_ENTRIES 256
+
+// Longest text stored in one ring entry, longer messages take several
+#define KLOG_MESSAGE_SIZE 120
+
+// Longest message one kprintf call formats, the rest is cut off
+#define KLOG_LINE_MAX 256
+
+// Set up the ring and the serial port (earlier kprintf calls go straight to the console)
+void klog_init(void);
+
+// Format a message into the log
+// Supports %d %i %u %x %X %p %s %c %%, width, '0' and '-' flags, and l/ll/z lengths
+int kprintf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+// Format into a buffer, returns the length the full output would have
+int kvsnprintf(char* buffer, size_t size, const char* format, va_list args);
+int ksnprintf(char* buffer, size_t size, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+// Write pending messages out, unless another CPU is already doing it
+void klog_drain(void);
+
+// Write all pending messages out, waiting for another CPU's drain if needed
+void klog_flush(void);
+
+#endif /* NKOF_KLOG_H */
\ No newline at end of file
@@ -0,0 +1,29 @@
+/**
+ * NKOF Integer Math Helpers
+ *
+ * This file contains 64-bit arithmetic helpers. The kernel is built
+ * without libgcc, so plain 64-bit division is not available.
+ */
+
+#ifndef NKOF_MATH_H
+#define NKOF_MATH_H
+
+#include "types.h"
+
+/**
+ * Divide a 64-bit value by a 32-bit value
+ */
+static inline uint64_t div64_32(uint64_t dividend, uint32_t divisor) {
+    uint32_t high = (uint32_t)(dividend >> 32);
+    uint32_t low = (uint32_t)dividend;
+    uint32_t q_high = high / divisor;
+    uint32_t q_low;
+    uint32_t rem = high % divisor;
+    
+    // rem < divisor, so the second divide can't overflow
+    asm ("divl %2" : "=a" (q_low), "+d" (rem) : "rm" (divisor), "a" (low));
+    
+    return ((uint64_t)q_high << 32) | q_low;
+}
+
+#endif /* NKOF_MATH_H */
\ No newline at end of file
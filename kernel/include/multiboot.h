@@ -0,0 +1,57 @@
+/**
+ * NKOF Boot Information
+ *
+ * This file declares the parser for what the boot loader hands the kernel.
+ * kernel_entry accepts three loaders: our own stage 2 (EBX = E820 map,
+ * ECX = entry count), Multiboot (qemu -kernel) and Multiboot2 (GRUB).
+ */
+
+#ifndef NKOF_MULTIBOOT_H
+#define NKOF_MULTIBOOT_H
+
+#include "types.h"
+#include "pmm.h"
+
+// Values a Multiboot loader leaves in EAX
+#define MULTIBOOT_BOOTLOADER_MAGIC  0x2BADB002
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36D76289
+
+// Boot protocols
+#define BOOT_PROTOCOL_STAGE2     0
+#define BOOT_PROTOCOL_MULTIBOOT  1
+#define BOOT_PROTOCOL_MULTIBOOT2 2
+
+// Memory map entries kept, including one reserved entry per module
+#define BOOT_MAX_MEMORY_ENTRIES 64
+
+// Modules kept, and the string sizes copied out of the loader's data
+#define BOOT_MAX_MODULES      16
+#define BOOT_MODULE_NAME_SIZE 64
+#define BOOT_CMDLINE_SIZE     128
+
+// A module loaded alongside the kernel, physical range [start, end)
+typedef struct boot_module {
+    uint32_t start;
+    uint32_t end;
+    char name[BOOT_MODULE_NAME_SIZE];
+} boot_module_t;
+
+// Everything the kernel keeps from the boot loader
+typedef struct boot_info {
+    uint32_t protocol;
+    memory_map_entry_t* memory_map;     // Ready for pmm_init, modules marked reserved
+    uint32_t memory_map_count;
+    boot_module_t modules[BOOT_MAX_MODULES];
+    uint32_t module_count;
+    char cmdline[BOOT_CMDLINE_SIZE];
+    char loader_name[BOOT_MODULE_NAME_SIZE];
+} boot_info_t;
+
+// Parse the EAX, EBX and ECX values kernel_entry saved
+// Everything is copied, so the loader's memory can be reused afterwards
+const boot_info_t* boot_info_init(uint32_t magic, uint32_t info, uint32_t count);
+
+// Get the information parsed by boot_info_init
+const boot_info_t* boot_info_get(void);
+
+#endif /* NKOF_MULTIBOOT_H */
\ No newline at end of file
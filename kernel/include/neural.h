@@ -0,0 +1,104 @@
+/**
+ * NKOF Neural Resource Optimization
+ *
+ * This file declares the allocator tuner. It samples allocator telemetry
+ * (kmalloc sizes and lifetimes, PMM and slab magazine traffic, the zeroed
+ * page pool and heap growth) and every period hands it to a policy, which
+ * picks the slab size classes, magazine depths, heap expansion step and
+ * zeroed pool watermark. Policies are registered by name and can be
+ * swapped while the kernel runs.
+ */
+
+#ifndef NKOF_NEURAL_H
+#define NKOF_NEURAL_H
+
+#include "types.h"
+#include "pmm.h"
+#include "kheap.h"
+
+// Time between tuning periods
+#define NEURAL_PERIOD_MS 200
+
+// Small request sizes are counted by KHEAP_CLASS_GRANULE slot, rounded up
+#define NEURAL_SIZE_SLOTS (KMALLOC_MAX_SMALL / KHEAP_CLASS_GRANULE + 1)
+
+// Lifetime buckets, bucket i holds lifetimes of [4^i, 4^(i+1)) TSC cycles
+// and the last one everything longer
+#define NEURAL_LIFETIME_BUCKETS 16
+
+// One allocation in this many has its lifetime measured
+#define NEURAL_LIFETIME_SAMPLE 64
+
+// Telemetry of one period (counts are for the period only)
+typedef struct neural_sample {
+    uint64_t period_ns;                                 // Length of the period
+    uint32_t tsc_khz;                                   // For turning lifetimes into time
+    uint32_t allocs;                                    // kmalloc family allocations
+    uint32_t frees;                                     // kfree calls
+    uint32_t large_allocs;                              // Requests above KMALLOC_MAX_SMALL
+    uint32_t sizes[NEURAL_SIZE_SLOTS];                  // Small requests by size slot
+    uint32_t lifetimes[NEURAL_LIFETIME_BUCKETS];        // Sampled lifetimes
+    pmm_activity_t pmm;                                 // PMM magazine traffic
+    uint32_t slab_refills;                              // Slab magazine trips to the slabs
+    uint32_t slab_drains;
+    uint32_t zero_hits;                                 // Zeroed pool requests served and missed
+    uint32_t zero_misses;
+    uint32_t heap_expansions;                           // Times the block heap grew
+} neural_sample_t;
+
+// Allocator settings chosen by a policy
+typedef struct neural_params {
+    uint32_t classes[KHEAP_MAX_CLASSES];                // Slab size classes, ascending
+    uint32_t class_count;
+    uint32_t pmm_magazine_depth;                        // Frames per PMM magazine
+    uint32_t slab_magazine_depth;                       // Objects per slab magazine
+    uint32_t heap_expand_pages;                         // Least pages the heap grows by
+    uint32_t zero_watermark;                            // Zeroed frames kept ready
+} neural_params_t;
+
+// Tuning policy
+typedef struct neural_policy {
+    const char* name;
+    // Adjust params (the settings in effect on entry) for the next period
+    void (*decide)(const neural_sample_t* sample, neural_params_t* params);
+    // Forget learned state when the policy is selected (optional)
+    void (*reset)(void);
+    struct neural_policy* next;                         // Next registered policy
+} neural_policy_t;
+
+// Tuner statistics
+typedef struct neural_stats {
+    const char* policy;                                 // Active policy
+    uint32_t periods;                                   // Periods sampled
+    uint32_t decisions;                                 // Periods handed to the policy (not idle)
+    uint32_t changes;                                   // Settings changed
+    neural_params_t params;                             // Settings in effect
+    neural_sample_t last;                               // The last period's telemetry
+} neural_stats_t;
+
+// Register the built-in policies and start the tuner task
+void neural_init(void);
+
+// Register a policy (the structure must stay valid)
+bool neural_register_policy(neural_policy_t* policy);
+
+// Select a policy by name, it takes over at the next period
+bool neural_set_policy(const char* name);
+
+// Get the name of the active policy
+const char* neural_get_policy(void);
+
+// Run one tuning period now (the tuner task calls this every NEURAL_PERIOD_MS)
+void neural_tune(void);
+
+// Record a kmalloc family allocation and a kfree (called by the heap)
+void neural_note_alloc(void* ptr, size_t size);
+void neural_note_free(void* ptr);
+
+// Get the tuner statistics
+void neural_get_stats(neural_stats_t* stats);
+
+// Print the tuner statistics
+void neural_print_stats(void);
+
+#endif /* NKOF_NEURAL_H */
\ No newline at end of file
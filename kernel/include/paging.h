@@ -3,6 +3,8 @@
  * 
  * This file contains declarations for the paging system which 
  * manages virtual memory through page tables.
+ * Paging uses PAE: entries are 64-bit, so frames anywhere below
+ * PMM_MAX_ADDRESS can be mapped, and large pages are 2MB.
  */
 
 #ifndef NKOF_PAGING_H
@@ -19,30 +21,59 @@
 #define PAGE_CACHE_DISABLE 0x10
 #define PAGE_ACCESSED    0x20
 #define PAGE_DIRTY       0x40
-#define PAGE_SIZE_BIT    0x80    // 4MB page (PDE only)
-#define PAGE_GLOBAL      0x100   // Global page (PDE only)
+#define PAGE_SIZE_BIT    0x80    // 2MB page (PDE only)
+#define PAGE_GLOBAL      0x100   // Global page (kept across CR3 loads when PGE is on)
+#define PAGE_COW         0x200   // Copy-on-write (available bit, ignored by the CPU)
 
-// Page directory entry structure
-typedef struct {
-    uint32_t entries[1024];
-} page_directory_t;
+// Flags for kernel mappings shared by every address space
+#define PAGE_KERNEL      (PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL)
+
+// Physical frame bits of an entry
+#define PAGE_FRAME_MASK  0x000FFFFFFFFFF000ULL
+
+// Size of a 2MB page
+#define LARGE_PAGE_SIZE  0x200000
+
+// Entries in a page table, and directory entries over the 4GB address space
+#define PAGE_TABLE_ENTRIES     512
+#define PAGE_DIRECTORY_ENTRIES 2048
+
+// Directory entry and table entry covering a virtual address
+#define PD_INDEX(virtual_addr) ((virtual_addr) >> 21)
+#define PT_INDEX(virtual_addr) (((virtual_addr) >> 12) & (PAGE_TABLE_ENTRIES - 1))
 
 // Page table entry structure
 typedef struct {
-    uint32_t entries[1024];
+    uint64_t entries[PAGE_TABLE_ENTRIES];
 } page_table_t;
 
+// The four page directories of an address space, seen as one table
+typedef struct {
+    uint64_t entries[PAGE_DIRECTORY_ENTRIES];
+} page_directory_t;
+
+// Page directory pointer table, what CR3 points at (one per address space)
+typedef struct {
+    uint64_t entries[4];
+} __attribute__((aligned(32))) page_pdpt_t;
+
 // Initialize the paging system
 void paging_init(void);
 
+// Take the lock over the paging state (recursive, interrupts off while held)
+void paging_lock(void);
+
+// Release the paging lock
+void paging_unlock(void);
+
 // Map a virtual page to a physical page
-void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
+void paging_map_page(uint32_t virtual_addr, uint64_t physical_addr, uint32_t flags);
 
 // Unmap a virtual page
 void paging_unmap_page(uint32_t virtual_addr);
 
 // Get the physical address mapped to a virtual address
-uint32_t paging_get_physical_address(uint32_t virtual_addr);
+uint64_t paging_get_physical_address(uint32_t virtual_addr);
 
 // Check if a virtual page is present
 bool paging_is_page_present(uint32_t virtual_addr);
@@ -50,19 +81,60 @@ bool paging_is_page_present(uint32_t virtual_addr);
 // Allocate a page and map it
 uint32_t paging_alloc_and_map(uint32_t virtual_addr, uint32_t flags);
 
-// Handle a page fault
+// Map a range of virtual pages to contiguous physical pages, flushing the TLB once
+bool paging_map_range(uint32_t virtual_addr, uint64_t physical_addr, uint32_t count, uint32_t flags);
+
+// Unmap a range of virtual pages, optionally returning their frames to the PMM
+void paging_unmap_range(uint32_t virtual_addr, uint32_t count, bool free_frames);
+
+// Allocate frames for a range of virtual pages and map them (0 on failure, nothing left mapped)
+uint32_t paging_alloc_and_map_range(uint32_t virtual_addr, uint32_t count, uint32_t flags);
+
+// Check if 2MB pages are available
+bool paging_large_pages_supported(void);
+
+// Map a 2MB virtual page to a 2MB physical page (both 2MB-aligned)
+bool paging_map_large_page(uint32_t virtual_addr, uint64_t physical_addr, uint32_t flags);
+
+// Unmap a 2MB page
+void paging_unmap_large_page(uint32_t virtual_addr);
+
+// Check if a virtual address is mapped by a 2MB page
+bool paging_is_large_page(uint32_t virtual_addr);
+
+// Reserve a virtual range whose pages are committed on first access
+bool paging_reserve_range(uint32_t start, uint32_t end, uint32_t flags, bool zero_fill);
+
+// Handle a page fault (commits reserved pages, halts on anything else)
 void paging_handle_fault(uint32_t fault_addr, uint32_t error_code);
 
-// Get the current page directory
-page_directory_t* paging_get_directory(void);
+// Get the current address space (its PDPT, which is what CR3 holds)
+page_pdpt_t* paging_get_directory(void);
+
+// Clone the loaded address space: kernel entries are shared, user pages
+// become copy-on-write in both directories. NULL on failure
+page_pdpt_t* paging_clone_directory(void);
+
+// Free an address space from paging_clone_directory, dropping its user pages (must not be loaded)
+void paging_free_directory(page_pdpt_t* directory);
 
-// Load a new page directory
-void paging_load_directory(page_directory_t* directory);
+// Map a frame at this CPU's temporary page without taking the paging lock
+// (usable in interrupt handlers), interrupts must stay off until it's unmapped
+void* paging_map_temporary(uint64_t physical_addr);
+
+// Remove the mapping from paging_map_temporary
+void paging_unmap_temporary(void* addr);
+
+// Load a new address space
+void paging_load_directory(page_pdpt_t* directory);
 
 // Flush a specific page from the TLB
 void paging_flush_tlb_page(uint32_t virtual_addr);
 
-// Flush the entire TLB
+// Flush the entire TLB (global entries are kept)
 void paging_flush_tlb(void);
 
+// Flush the entire TLB, including global entries
+void paging_flush_tlb_global(void);
+
 #endif /* NKOF_PAGING_H */
\ No newline at end of file
@@ -0,0 +1,50 @@
+/**
+ * NKOF PCI Configuration Space
+ *
+ * This file declares access to PCI configuration space through the
+ * legacy 0xCF8/0xCFC ports (configuration mechanism #1), and a lookup
+ * of devices by class, which is all the drivers need so far.
+ */
+
+#ifndef NKOF_PCI_H
+#define NKOF_PCI_H
+
+#include "types.h"
+
+// Configuration space registers
+#define PCI_VENDOR_ID      0x00
+#define PCI_COMMAND        0x04
+#define PCI_CLASS          0x08    // Revision, prog IF, subclass, class (low to high byte)
+#define PCI_HEADER_TYPE    0x0E
+#define PCI_BAR0           0x10
+#define PCI_INTERRUPT_LINE 0x3C
+
+// Command register bits
+#define PCI_COMMAND_IO     0x01    // Respond to I/O space accesses
+#define PCI_COMMAND_MASTER 0x04    // May act as a bus master (DMA)
+
+// A function on the bus
+typedef struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+} pci_device_t;
+
+// Read and write configuration registers (offsets are aligned to the access size)
+uint32_t pci_read32(const pci_device_t* device, uint8_t offset);
+uint16_t pci_read16(const pci_device_t* device, uint8_t offset);
+void pci_write32(const pci_device_t* device, uint8_t offset, uint32_t value);
+void pci_write16(const pci_device_t* device, uint8_t offset, uint16_t value);
+
+// Find the index-th function (counting from 0) with a class and subclass
+bool pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t index, pci_device_t* device);
+
+// Get the I/O port base of a BAR, 0 if it isn't an I/O BAR
+uint16_t pci_io_bar(const pci_device_t* device, uint32_t bar);
+
+#endif /* NKOF_PCI_H */
\ No newline at end of file
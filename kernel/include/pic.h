@@ -0,0 +1,28 @@
+/**
+ * NKOF 8259 PIC Driver
+ *
+ * This file declares the legacy interrupt controller interface.
+ * IRQs 0-15 are remapped to vectors 32-47, clear of the CPU exceptions.
+ */
+
+#ifndef NKOF_PIC_H
+#define NKOF_PIC_H
+
+#include "types.h"
+
+// First vector used by PIC interrupts
+#define PIC_IRQ_BASE 32
+
+// Remap the PICs and mask every IRQ
+void pic_init(void);
+
+// Allow an IRQ line to interrupt
+void pic_unmask(uint8_t irq);
+
+// Stop an IRQ line from interrupting
+void pic_mask(uint8_t irq);
+
+// Signal the end of an IRQ, returns false for a spurious IRQ that needs no EOI
+bool pic_send_eoi(uint8_t irq);
+
+#endif /* NKOF_PIC_H */
\ No newline at end of file
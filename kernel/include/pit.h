@@ -0,0 +1,28 @@
+/**
+ * NKOF 8253/8254 PIT Driver
+ *
+ * This file declares the programmable interval timer interface. The PIT
+ * is used to calibrate faster clocks and as a fallback one-shot timer.
+ */
+
+#ifndef NKOF_PIT_H
+#define NKOF_PIT_H
+
+#include "types.h"
+
+// PIT input clock in Hz
+#define PIT_FREQUENCY 1193182
+
+// IRQ line of PIT channel 0
+#define PIT_IRQ 0
+
+// Longest one-shot the 16-bit counter allows
+#define PIT_MAX_TICKS 0xFFFF
+
+// Busy-wait using channel 2 (at most 54 ms)
+void pit_wait_ms(uint32_t ms);
+
+// Fire IRQ 0 once after the given number of PIT ticks
+void pit_set_oneshot(uint32_t ticks);
+
+#endif /* NKOF_PIT_H */
\ No newline at end of file
@@ -2,7 +2,11 @@
  * NKOF Physical Memory Manager
  * 
  * This file contains declarations for the physical memory manager,
- * which keeps track of available physical memory pages.
+ * which keeps track of available physical memory pages. Physical
+ * addresses are 64-bit: with PAE paging, frames above 4GB are handed out
+ * like any other, so they can only be reached by mapping them. Memory
+ * for devices and CPU structures that take 32-bit addresses comes from
+ * pmm_alloc_low_pages.
  */
 
 #ifndef NKOF_PMM_H
@@ -13,6 +17,23 @@
 // 4KB pages are standard in x86
 #define PAGE_SIZE 4096
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (2MB, one PAE large page)
+#define PMM_MAX_ORDER 9
+
+// End of the physical memory the PMM tracks: 64GB, the reach of 36-bit PAE addresses
+#define PMM_MAX_ADDRESS 0x1000000000ULL
+
+// End of the memory pmm_alloc_low_pages hands out, what 32-bit addresses reach
+#define PMM_LOW_ADDRESS 0x100000000ULL
+
+// Most pre-zeroed frames the PMM can hold, and how many it keeps by default
+#define PMM_ZERO_POOL_SIZE 256
+#define PMM_ZERO_WATERMARK 64
+
+// Most frames a per-CPU magazine can hold, and how many it holds by default
+#define PMM_MAGAZINE_MAX   64
+#define PMM_MAGAZINE_DEPTH 32
+
 // Memory region types (compatible with BIOS E820 map)
 #define MEMORY_REGION_AVAILABLE      1
 #define MEMORY_REGION_RESERVED       2
@@ -28,14 +49,73 @@ typedef struct memory_map_entry {
     uint32_t acpi_attributes;
 } memory_map_entry_t;
 
+// Running totals of single-frame traffic, for tuning (they wrap)
+typedef struct {
+    uint32_t allocs;               // pmm_alloc_page calls served by a magazine
+    uint32_t frees;                // pmm_free_page calls that reached a magazine
+    uint32_t refills;              // Magazines refilled from the buddy allocator
+    uint32_t drains;               // Magazines drained to the buddy allocator
+} pmm_activity_t;
+
 // Initialize the physical memory manager
 void pmm_init(memory_map_entry_t* memory_map, uint32_t entry_count);
 
 // Allocate a physical page, returns the physical address
-uint32_t pmm_alloc_page(void);
+uint64_t pmm_alloc_page(void);
+
+// Allocate a physical page filled with zeros (from the zeroed pool when it has one)
+uint64_t pmm_alloc_zeroed_page(void);
+
+// Take a frame from the zeroed pool, 0 if the pool is empty
+uint64_t pmm_take_zeroed_page(void);
+
+// Zero free frames into the pool until it reaches the watermark or max_pages were done
+// Returns the number of frames zeroed (meant for the idle task)
+uint32_t pmm_refill_zeroed_pages(uint32_t max_pages);
+
+// Set how many zeroed frames to keep (at most PMM_ZERO_POOL_SIZE)
+void pmm_set_zero_watermark(uint32_t pages);
+
+// Get the zeroed pool's frame count and watermark, requests it served and ones that found it empty
+void pmm_get_zero_pool_stats(uint32_t* count, uint32_t* watermark, uint32_t* hits, uint32_t* misses);
 
 // Free a previously allocated page
-void pmm_free_page(uint32_t page_addr);
+void pmm_free_page(uint64_t page_addr);
+
+// Set how many frames each per-CPU magazine holds (2 to PMM_MAGAZINE_MAX)
+// Half of them move to or from the buddy allocator at a time
+void pmm_set_magazine_depth(uint32_t depth);
+
+// Get the per-CPU magazine depth
+uint32_t pmm_get_magazine_depth(void);
+
+// Get the running totals of single-frame traffic
+void pmm_get_activity(pmm_activity_t* activity);
+
+// Add a reference to an allocated page (for copy-on-write sharing)
+// pmm_free_page drops one reference and frees the page with the last
+bool pmm_share_page(uint64_t page_addr);
+
+// Get the number of references to a page, 0 if it's free
+uint32_t pmm_page_refs(uint64_t page_addr);
+
+// Allocate 2^order physically contiguous pages, naturally aligned
+uint64_t pmm_alloc_pages(uint32_t order);
+
+// Allocate 2^order physically contiguous pages below PMM_LOW_ADDRESS, 0 if there are none
+uint32_t pmm_alloc_low_pages(uint32_t order);
+
+// Free a block previously returned by pmm_alloc_pages or pmm_alloc_low_pages
+void pmm_free_pages(uint64_t addr, uint32_t order);
+
+// Get the amount of available memory above PMM_MAX_ADDRESS (reported, never allocated)
+uint64_t pmm_get_untracked_memory(void);
+
+// Get the physical address where the PMM's own data ends, paging keeps everything below it identity-mapped
+uint32_t pmm_get_metadata_end(void);
+
+// Get the largest order with a free block, -1 if memory is exhausted
+int pmm_largest_free_order(void);
 
 // Get the total amount of physical memory in bytes
 uint64_t pmm_get_total_memory(void);
@@ -50,9 +130,9 @@ uint64_t pmm_get_used_memory(void);
 void pmm_print_stats(void);
 
 // Mark a specific page as used
-void pmm_mark_page_used(uint32_t page_addr);
+void pmm_mark_page_used(uint64_t page_addr);
 
 // Check if a specific page is free
-bool pmm_is_page_free(uint32_t page_addr);
+bool pmm_is_page_free(uint64_t page_addr);
 
 #endif /* NKOF_PMM_H */
\ No newline at end of file
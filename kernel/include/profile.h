@@ -0,0 +1,92 @@
+/**
+ * NKOF Profiling
+ *
+ * This file declares TSC-based profiling counters and the boot timeline.
+ * A counter keeps the call count, total, minimum and maximum cycles and a
+ * log2 latency histogram for one instrumented code path. Counters only
+ * exist in kernels built with NKOF_PROFILE ("./build.sh profile"),
+ * otherwise PROFILE_SCOPE compiles to nothing. The boot timeline is
+ * always recorded, it costs one rdtsc per milestone.
+ */
+
+#ifndef NKOF_PROFILE_H
+#define NKOF_PROFILE_H
+
+#include "types.h"
+#include "cpu.h"
+#include "smp.h"
+
+// Histogram buckets: bucket n counts calls that took [2^n, 2^(n+1)) cycles
+#define PROFILE_BUCKETS 32
+
+// Most milestones the boot timeline holds
+#define PROFILE_TIMELINE_MAX 32
+
+// Statistics one CPU collected for a counter
+typedef struct {
+    uint64_t calls;
+    uint64_t total_cycles;
+    uint64_t min_cycles;
+    uint64_t max_cycles;
+    uint32_t histogram[PROFILE_BUCKETS];
+} profile_stats_t;
+
+// Counter for one instrumented code path
+// Each CPU updates its own stats, so recording never bounces cache lines
+typedef struct profile_counter {
+    const char* name;
+    struct profile_counter* next;  // Next registered counter
+    uint32_t registered;           // Set once the counter is on the list
+    profile_stats_t cpu[SMP_MAX_CPUS];
+} profile_counter_t;
+
+// Add one measurement to a counter
+void profile_record(profile_counter_t* counter, uint64_t cycles);
+
+// Sum a counter's per-CPU statistics
+void profile_get_stats(profile_counter_t* counter, profile_stats_t* stats);
+
+// Clear the statistics of every registered counter
+void profile_reset(void);
+
+// Record a boot milestone with the current TSC
+void profile_mark(const char* name);
+
+// Write the timeline and all counters to COM1 (or the log without a UART)
+void profile_dump(void);
+
+// Write one counter the way profile_dump does
+void profile_dump_counter(profile_counter_t* counter);
+
+// Write a line of dump output, bypassing the log ring when there is a UART
+void profile_write(const char* line);
+
+#ifdef NKOF_PROFILE
+
+// Start of a measured scope
+typedef struct {
+    profile_counter_t* counter;
+    uint64_t start;
+} profile_scope_t;
+
+/**
+ * Record the cycles spent in a scope, run when the scope is left
+ */
+static inline void profile_scope_end(profile_scope_t* scope) {
+    profile_record(scope->counter, rdtsc() - scope->start);
+}
+
+// Measure the rest of the enclosing block, including every return path
+#define PROFILE_SCOPE(label)                                                   \
+    static profile_counter_t profile_counter_##label = { .name = #label };    \
+    profile_scope_t profile_scope_##label                                      \
+        __attribute__((cleanup(profile_scope_end))) =                          \
+        { &profile_counter_##label, rdtsc() }
+
+#else
+
+#define PROFILE_SCOPE(label) do { } while (0)
+
+#endif /* NKOF_PROFILE */
+
+#endif /* NKOF_PROFILE_H */
\ No newline at end of file
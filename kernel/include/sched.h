@@ -0,0 +1,93 @@
+/**
+ * NKOF Scheduler
+ *
+ * This file declares kernel tasks and the scheduler. Each CPU has its own
+ * run queue with one FIFO per priority and a bitmap of non-empty
+ * priorities, so picking the next task is O(1). CPUs that run out of
+ * work steal tasks from the busiest other run queue.
+ */
+
+#ifndef NKOF_SCHED_H
+#define NKOF_SCHED_H
+
+#include "types.h"
+#include "pmm.h"
+#include "timer.h"
+#include "spinlock.h"
+
+// Number of priority levels (0 is the highest)
+#define SCHED_PRIORITIES 32
+
+// Priority for ordinary tasks
+#define SCHED_DEFAULT_PRIORITY 16
+
+// Kernel stack size of each task
+#define TASK_STACK_SIZE (4 * PAGE_SIZE)
+
+// Time a task runs before a task of the same priority gets the CPU
+#define SCHED_TIMESLICE_NS (10 * NSEC_PER_MSEC)
+
+// Task states
+typedef enum {
+    TASK_RUNNING,                  // On the CPU
+    TASK_READY,                    // On a run queue
+    TASK_SLEEPING,                 // Waiting for a wakeup
+    TASK_DEAD                      // Finished, waiting to be freed
+} task_state_t;
+
+// Kernel task
+typedef struct task {
+    uint32_t esp;                  // Saved stack pointer (used by context_switch)
+    uint32_t id;                   // Task ID
+    const char* name;              // Name for diagnostics
+    task_state_t state;            // Scheduling state
+    uint32_t priority;             // 0 (highest) to SCHED_PRIORITIES - 1
+    uint32_t cpu;                  // CPU whose run queue owns the task
+    void* stack;                   // Base of the kernel stack (NULL for boot tasks)
+    void (*entry)(void* arg);      // Task function
+    void* arg;                     // Argument for the task function
+    struct task* next;             // Next task in the run queue
+    timer_event_t sleep_timer;     // Wakes the task from task_sleep
+    uint64_t runtime_ns;           // Total time spent on the CPU
+    uint64_t switched_in_ns;       // When the task last got the CPU
+    uint8_t fpu_state[512] __attribute__((aligned(16)));  // FXSAVE area
+} task_t;
+
+// Set up the scheduler on the boot CPU, the boot context becomes the "main" task
+void sched_init(void);
+
+// Set up the run queue of another CPU, its boot context becomes the idle task
+void sched_init_cpu(uint32_t cpu);
+
+// Create a task and make it runnable
+task_t* task_create(const char* name, void (*entry)(void* arg), void* arg, uint32_t priority);
+
+// Get the running task
+task_t* task_current(void);
+
+// End the running task
+void task_exit(void);
+
+// Give up the CPU to another ready task of the same or higher priority
+void task_yield(void);
+
+// Sleep for at least the given number of nanoseconds
+void task_sleep(uint64_t ns);
+
+// Sleep until task_wake, releasing a lock taken with spin_lock_irqsave (flags from it)
+// A waker holding the same lock can't slip in between the caller's check and the sleep
+void task_block(spinlock_t* lock, uint32_t flags);
+
+// Make a sleeping task runnable
+void task_wake(task_t* task);
+
+// Pick the next task and switch to it
+void schedule(void);
+
+// Called on the way out of an interrupt, switches if the time slice ran out
+void sched_irq_exit(void);
+
+// Run the idle loop on this CPU (never returns)
+void sched_idle(void);
+
+#endif /* NKOF_SCHED_H */
\ No newline at end of file
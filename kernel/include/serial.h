@@ -0,0 +1,28 @@
+/**
+ * NKOF 16550 UART Driver
+ *
+ * This file declares the serial port interface. COM1 carries the kernel
+ * log, so Bochs and QEMU can capture it to a file.
+ */
+
+#ifndef NKOF_SERIAL_H
+#define NKOF_SERIAL_H
+
+#include "types.h"
+
+// I/O base of the first serial port
+#define SERIAL_COM1 0x3F8
+
+// Line speed the port is programmed for
+#define SERIAL_BAUD 115200
+
+// Program COM1 for 8N1 with FIFOs, returns false if no UART answers
+bool serial_init(void);
+
+// Check if serial_init found a working UART
+bool serial_present(void);
+
+// Write bytes to COM1, expanding "\n" to "\r\n" (no-op without a UART)
+void serial_write(const char* data, size_t length);
+
+#endif /* NKOF_SERIAL_H */
\ No newline at end of file
@@ -0,0 +1,95 @@
+/**
+ * NKOF Slab Allocator
+ *
+ * This file declares the slab cache interface for fixed-size kernel objects.
+ * Each cache hands out objects of one size from slabs of pages taken from
+ * the kernel heap's page area.
+ */
+
+#ifndef NKOF_SLAB_H
+#define NKOF_SLAB_H
+
+#include "types.h"
+#include "pmm.h"
+#include "smp.h"
+
+// Size of one slab (naturally aligned, so an object's slab is found by masking)
+#define SLAB_SIZE (4 * PAGE_SIZE)
+
+// Largest object a slab cache can hold
+#define SLAB_MAX_OBJECT_SIZE (SLAB_SIZE / 8)
+
+// Most objects cached per CPU in front of each cache (the default depth)
+// Half of a magazine's depth moves per refill or drain
+#define SLAB_MAGAZINE_SIZE 16
+
+// Per-CPU stack of free objects, only touched by its CPU with interrupts disabled
+typedef struct {
+    uint32_t count;
+    void* objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+// Slab header, stored at the start of every slab
+typedef struct slab {
+    uint32_t magic;                // Magic number for integrity checking
+    struct kmem_cache* cache;      // Cache this slab belongs to
+    struct slab* next;             // Next slab in the cache's list
+    struct slab* prev;             // Previous slab in the cache's list
+    void* free_list;               // First free object in this slab
+    uint32_t in_use;               // Number of allocated objects
+} slab_t;
+
+// Cache of fixed-size objects
+typedef struct kmem_cache {
+    const char* name;              // Name for statistics output
+    size_t object_size;            // Size of each object (after alignment)
+    size_t align;                  // Object alignment
+    uint32_t objects_per_slab;     // Objects that fit in one slab
+    slab_t* partial;               // Slabs with at least one free object
+    slab_t* full;                  // Slabs with no free objects
+    uint32_t slab_count;           // Number of slabs owned by the cache
+    uint32_t objects_in_use;       // Number of objects out of the slabs (including magazines)
+    bool retired;                  // No longer in demand: no magazines, empty slabs are released
+    struct kmem_cache* next;       // Next cache in the global list
+    slab_magazine_t magazines[SMP_MAX_CPUS];
+} kmem_cache_t;
+
+// Initialize the slab allocator
+void slab_init(void);
+
+// Create a cache for objects of the given size and alignment (0 = default)
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+// Return an object to its cache
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Find the cache that owns an object, NULL if it's not a slab object
+kmem_cache_t* kmem_cache_of(const void* obj);
+
+// Retire a cache that is no longer in demand, or bring it back. A retired
+// cache still serves and frees objects, but without magazines, and gives its
+// slabs back to the heap's page area as they empty
+void kmem_cache_set_retired(kmem_cache_t* cache, bool retired);
+
+// Empty this CPU's magazines of retired caches (the idle task calls it)
+void slab_reap(void);
+
+// Set how many objects each per-CPU magazine holds (2 to SLAB_MAGAZINE_SIZE)
+void slab_set_magazine_depth(uint32_t depth);
+
+// Get the per-CPU magazine depth
+uint32_t slab_get_magazine_depth(void);
+
+// Get the running totals of magazine refills and drains (they wrap)
+void slab_get_activity(uint32_t* refills, uint32_t* drains);
+
+// Get slab memory statistics (bytes in slabs, bytes in allocated objects)
+void slab_get_stats(size_t* total, size_t* used);
+
+// Print slab cache statistics
+void slab_print_stats(void);
+
+#endif /* NKOF_SLAB_H */
\ No newline at end of file
@@ -0,0 +1,60 @@
+/**
+ * NKOF Multiprocessor Support
+ *
+ * This file declares the per-CPU data and the bring-up of the application
+ * processors (APs). The CPUs are found in the ACPI MADT and started with
+ * INIT-SIPI-SIPI through a real-mode trampoline. CPUs are numbered from 0
+ * (the boot CPU) in MADT order, and per-CPU data is indexed by that number.
+ */
+
+#ifndef NKOF_SMP_H
+#define NKOF_SMP_H
+
+#include "types.h"
+
+// Most CPUs the kernel brings up
+#define SMP_MAX_CPUS 16
+
+// Physical address the AP trampoline is copied to (below stage 2 at 0x8000)
+#define SMP_TRAMPOLINE_BASE 0x7000
+
+// Kernel stack size of each AP's boot context
+#define SMP_AP_STACK_SIZE 16384
+
+// Inter-processor interrupt vectors
+#define SMP_RESCHEDULE_VECTOR 0xF0
+#define SMP_TLB_VECTOR        0xF1
+
+// Per-CPU data
+typedef struct {
+    uint32_t index;                // CPU number
+    uint32_t apic_id;              // Local APIC ID
+    void* stack;                   // Boot context stack (NULL on the boot CPU)
+    volatile bool online;          // Running the kernel
+} cpu_info_t;
+
+// Find and start the application processors (needs the heap, timer and scheduler)
+void smp_init(void);
+
+// Get the number of the calling CPU
+uint32_t smp_cpu_index(void);
+
+// Get the number of CPUs found
+uint32_t smp_cpu_count(void);
+
+// Get the number of CPUs running the kernel
+uint32_t smp_cpus_online(void);
+
+// Get a CPU's per-CPU data, NULL if there is no such CPU
+cpu_info_t* smp_cpu(uint32_t index);
+
+// Ask another CPU to run the scheduler
+void smp_send_reschedule(uint32_t index);
+
+// Flush the TLBs of all other CPUs and wait for them (caller holds the paging lock)
+void smp_tlb_shootdown(void);
+
+// Carry out a shootdown requested of this CPU, used while spinning on a lock
+void smp_tlb_service(void);
+
+#endif /* NKOF_SMP_H */
\ No newline at end of file
@@ -0,0 +1,84 @@
+/**
+ * NKOF Spinlocks
+ *
+ * This file contains ticket spinlocks. Each locker takes a ticket and
+ * spins until it is served, so waiters get the lock in FIFO order.
+ */
+
+#ifndef NKOF_SPINLOCK_H
+#define NKOF_SPINLOCK_H
+
+#include "types.h"
+#include "interrupts.h"
+
+// Ticket lock: owner is the ticket being served, next is the next ticket to hand out
+typedef union {
+    uint32_t value;
+    struct {
+        uint16_t owner;
+        uint16_t next;
+    } tickets;
+} spinlock_t;
+
+// Initializer for an unlocked spinlock
+#define SPINLOCK_INIT { .value = 0 }
+
+/**
+ * Initialize a spinlock
+ */
+static inline void spin_init(spinlock_t* lock) {
+    lock->value = 0;
+}
+
+/**
+ * Acquire a spinlock
+ */
+static inline void spin_lock(spinlock_t* lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->tickets.next, 1, __ATOMIC_RELAXED);
+    
+    while (__atomic_load_n(&lock->tickets.owner, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile ("pause");
+    }
+}
+
+/**
+ * Acquire a spinlock only if it is free, returns true on success
+ */
+static inline bool spin_trylock(spinlock_t* lock) {
+    spinlock_t old;
+    old.value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+    if (old.tickets.owner != old.tickets.next) {
+        return false;
+    }
+    
+    spinlock_t taken = old;
+    taken.tickets.next++;
+    return __atomic_compare_exchange_n(&lock->value, &old.value, taken.value, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Release a spinlock
+ */
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->tickets.owner, lock->tickets.owner + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Disable interrupts and acquire a spinlock, returns the saved flags
+ */
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = interrupts_save();
+    spin_lock(lock);
+    return flags;
+}
+
+/**
+ * Release a spinlock and restore the interrupt state
+ */
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    interrupts_restore(flags);
+}
+
+#endif /* NKOF_SPINLOCK_H */
\ No newline at end of file
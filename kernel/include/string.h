@@ -0,0 +1,39 @@
+/**
+ * NKOF Memory Primitives
+ *
+ * This file declares the kernel's memory fill and copy routines,
+ * plus the few string helpers the kernel needs.
+ * Fills and copies use rep stos/movs, and SSE2 for large buffers when the CPU has it.
+ */
+
+#ifndef NKOF_STRING_H
+#define NKOF_STRING_H
+
+#include "types.h"
+
+// Select the fastest routines for this CPU (enables SSE if present)
+void string_init(void);
+
+// Fill memory with a byte value
+void* memset(void* dest, int value, size_t count);
+
+// Fill memory with a 16-bit value (count is in 16-bit units)
+void* memset16(void* dest, uint16_t value, size_t count);
+
+// Zero memory with non-temporal stores, leaving the cache alone
+// Meant for memory that won't be read soon (such as frames zeroed ahead of time)
+void memzero_nt(void* dest, size_t count);
+
+// Copy memory between non-overlapping buffers
+void* memcpy(void* dest, const void* src, size_t count);
+
+// Copy memory between buffers that may overlap
+void* memmove(void* dest, const void* src, size_t count);
+
+// Compare memory, returns <0, 0 or >0 like the C library's memcmp
+int memcmp(const void* a, const void* b, size_t count);
+
+// Get the length of a NUL-terminated string
+size_t strlen(const char* str);
+
+#endif /* NKOF_STRING_H */
\ No newline at end of file
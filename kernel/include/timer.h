@@ -0,0 +1,48 @@
+/**
+ * NKOF Timekeeping and Timer Events
+ *
+ * This file declares the monotonic clock and the one-shot timer API.
+ * The clock is the TSC, calibrated against the PIT at boot. Timer events
+ * are kept sorted by deadline and the hardware timer is programmed for
+ * the earliest one only, so there is no periodic tick.
+ */
+
+#ifndef NKOF_TIMER_H
+#define NKOF_TIMER_H
+
+#include "types.h"
+
+// Nanoseconds per time unit
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC  1000000000ULL
+
+// One-shot timer event
+typedef struct timer_event {
+    uint64_t deadline;                              // Absolute time in ns
+    void (*callback)(struct timer_event* event);    // Called from the timer interrupt
+    void* data;                                     // Owner's data
+    struct timer_event* next;                       // Next event by deadline
+    uint32_t cpu;                                   // CPU whose queue holds the event
+    bool pending;                                   // Queued and not yet fired
+} timer_event_t;
+
+// Calibrate the clock and set up the one-shot timer hardware
+void timer_init(void);
+
+// Get the time since boot in nanoseconds
+uint64_t timer_now_ns(void);
+
+// Get the calibrated TSC frequency in kHz (0 if there is no clock)
+uint32_t timer_tsc_khz(void);
+
+// Queue an event on this CPU to fire at an absolute deadline (re-queues a pending event)
+void timer_add(timer_event_t* event, uint64_t deadline);
+
+// Remove a pending event
+void timer_cancel(timer_event_t* event);
+
+// Halt until the next interrupt (the next timer deadline or a device)
+void timer_idle(void);
+
+#endif /* NKOF_TIMER_H */
\ No newline at end of file
@@ -0,0 +1,52 @@
+/**
+ * NKOF Kernel Virtual Areas
+ *
+ * This file declares the allocator for kernel virtual address space.
+ * Areas are carved out of the vmalloc window and are either mapped up
+ * front (vmalloc) or left to be committed on first touch (vm_area_alloc,
+ * used by the heap for its arenas, slabs and large allocations).
+ */
+
+#ifndef NKOF_VMALLOC_H
+#define NKOF_VMALLOC_H
+
+#include "types.h"
+
+// Kernel virtual window handed out by this allocator (512MB)
+// The benchmark scratch mapping starts at VMALLOC_END
+#define VMALLOC_START 0xC0000000
+#define VMALLOC_END   0xE0000000
+
+// Most free ranges and live areas tracked at once
+#define VMALLOC_MAX_RANGES 1024
+
+// Initialize the allocator and reserve the window with the paging system
+void vmalloc_init(void);
+
+// Reserve pages of virtual space, aligned to a power of 2 (at least a page)
+// Nothing is mapped: pages are committed when first touched
+// Returns the start address, 0 if the window is exhausted
+uint32_t vm_area_alloc(uint32_t pages, uint32_t alignment);
+
+// Release an area from vm_area_alloc (its pages must already be unmapped)
+void vm_area_free(uint32_t start);
+
+// Get the size in pages of the area starting at start, 0 if there is none
+uint32_t vm_area_pages(uint32_t start);
+
+// Grow an area in place by taking the free pages right above it
+bool vm_area_extend(uint32_t start, uint32_t extra_pages);
+
+// Shrink an area in place, the pages past the new size must already be unmapped
+bool vm_area_shrink(uint32_t start, uint32_t pages);
+
+// Allocate and map virtually contiguous memory, NULL on failure
+void* vmalloc(size_t size);
+
+// Unmap and free memory from vmalloc
+void vfree(void* ptr);
+
+// Get the window's page counts: reserved by areas, free, and the largest free range
+void vmalloc_get_stats(uint32_t* used_pages, uint32_t* free_pages, uint32_t* largest_free);
+
+#endif /* NKOF_VMALLOC_H */
\ No newline at end of file
@@ -6,77 +6,166 @@
  */
 
 #include "include/types.h"
+#include "include/string.h"
 #include "include/console.h"
+#include "include/klog.h"
 #include "include/pmm.h"
 #include "include/paging.h"
+#include "include/vmalloc.h"
 #include "include/kheap.h"
+#include "include/interrupts.h"
+#include "include/cpu.h"
+#include "include/timer.h"
+#include "include/sched.h"
+#include "include/smp.h"
+#include "include/profile.h"
+#include "include/bench.h"
+#include "include/neural.h"
+#include "include/block.h"
+#include "include/ata.h"
+#include "include/multiboot.h"
 
-// Memory map passed from bootloader
-extern memory_map_entry_t* boot_memory_map;
+// Registers the boot loader passed to kernel_entry (EAX, EBX, ECX)
+extern uint32_t boot_magic;
+extern uint32_t boot_info_addr;
 extern uint32_t boot_memory_map_count;
 
 /**
  * Initialize memory subsystems
  */
 static void memory_init(void) {
+    // Copy the loader's memory map and modules while memory is still unclaimed
+    const boot_info_t* boot = boot_info_init(boot_magic, boot_info_addr, boot_memory_map_count);
+    
     // Initialize physical memory manager with boot memory map
-    pmm_init(boot_memory_map, boot_memory_map_count);
+    pmm_init(boot->memory_map, boot->memory_map_count);
+    profile_mark("pmm");
     
     // Initialize paging system
     paging_init();
+    profile_mark("paging");
+    
+    // Kernel virtual space for the heap and vmalloc
+    vmalloc_init();
     
     // Initialize kernel heap for dynamic memory allocation
     kheap_init();
+    profile_mark("kheap");
+}
+
+/**
+ * Find the disks and check that the first one reads
+ */
+static void storage_init(void) {
+    if (ata_init() == 0) {
+        return;
+    }
+    
+    // The boot sector ends with the 0xAA55 signature
+    block_device_t* disk = block_first();
+    uint16_t* sector = kmalloc(BLOCK_SECTOR_SIZE);
+    if (!sector) {
+        return;
+    }
+    if (block_read(disk, 0, 1, sector)) {
+        kprintf("- Disk %s: boot signature %s\n", disk->name, sector[255] == 0xAA55 ? "present" : "missing");
+    } else {
+        kprintf("ERROR: Can't read the first sector of %s\n", disk->name);
+    }
+    kfree(sector);
 }
 
 /**
  * Main kernel function - entry point from assembly
  */
 void kernel_main(void) {
+    // First milestone of the boot timeline, later ones are relative to it
+    profile_mark("kernel_main");
+    
+    // Pick memset/memcpy routines for this CPU before anything uses them
+    string_init();
+    
     // Initialize the console for output
     console_init();
     
+    // Start the kernel log, copied to COM1 as well as the screen
+    klog_init();
+    profile_mark("console");
+    
     // Display welcome message
-    console_write_string("Neural Kernel Optimization Framework (NKOF)\n");
-    console_write_string("---------------------------------------\n");
-    console_write_string("Kernel initialized successfully!\n\n");
+    kprintf("Neural Kernel Optimization Framework (NKOF)\n");
+    kprintf("---------------------------------------\n");
+    kprintf("Kernel initialized successfully!\n\n");
+    
+    // Install exception handlers (the heap relies on page faults)
+    interrupts_init();
+    profile_mark("interrupts");
     
     // Initialize memory management subsystems
     memory_init();
     
+    // Calibrate the clock and set up one-shot timers
+    timer_init();
+    profile_mark("timer");
+    
+    // Start the scheduler, this context continues as the "main" task
+    sched_init();
+    profile_mark("sched");
+    
+    // Start the other CPUs, each becomes the idle task of its own run queue
+    smp_init();
+    profile_mark("smp");
+    
     // Output system information
-    console_write_string("\nSystem Information:\n");
-    console_write_string("- 32-bit Protected Mode\n");
-    console_write_string("- Paging enabled\n");
-    console_write_string("- Neural resource optimization: Initializing\n");
+    kprintf("\nSystem Information:\n");
+    kprintf("- 32-bit Protected Mode\n");
+    if (cpu_ext_features_edx() & CPUID_EXT_EDX_LM) {
+        kprintf("- CPU supports long mode (not used yet)\n");
+    }
+    if (pmm_get_untracked_memory() > 0) {
+        kprintf("- Memory above 64GB present but not usable (not tracked by the PMM)\n");
+    }
+    kprintf("- Paging enabled (PAE, 2MB large pages)\n");
+    
+    // Start the allocator tuner, it retunes the heap and PMM from their telemetry
+    neural_init();
+    kprintf("- Neural resource optimization: %s policy, every %u ms\n", neural_get_policy(), NEURAL_PERIOD_MS);
     
-    // Initialize kernel subsystems
-    // These functions will be implemented as we develop the OS
-    // interrupts_init();
-    // neural_init();
+    // Disks, their interrupts complete requests while the main task sleeps
+    storage_init();
     
     // Perform a test allocation to verify the heap
-    console_write_string("\nPerforming test heap allocations:\n");
+    kprintf("\nPerforming test heap allocations:\n");
     void* test_ptr1 = kmalloc(1024);
     void* test_ptr2 = kmalloc(2048);
     
-    console_write_string("Allocated 1024 bytes at: ");
-    console_write_hex((uint32_t)test_ptr1);
-    console_write_string("\n");
+    kprintf("Allocated 1024 bytes at: %p\n", test_ptr1);
     
-    console_write_string("Allocated 2048 bytes at: ");
-    console_write_hex((uint32_t)test_ptr2);
-    console_write_string("\n");
+    kprintf("Allocated 2048 bytes at: %p\n", test_ptr2);
     
     kfree(test_ptr1);
-    console_write_string("Freed first allocation\n");
+    kprintf("Freed first allocation\n");
     
     kheap_print_stats();
+    kheap_print_detailed_stats();
+#ifdef NKOF_HEAP_TAGS
+    kheap_print_top_sites(8);
+#endif
+    block_print_stats();
     
-    // Main kernel loop - halt the CPU when idle
-    console_write_string("\nKernel initialized and running.\n");
-    while (1) {
-        // This will be replaced with proper process scheduling later
-        __asm__ volatile("hlt");
-    }
+    // Hand the CPU to the scheduler, the idle task sleeps until the next timer deadline or device
+    kprintf("\nKernel initialized and running.\n");
+    profile_mark("running");
+
+#ifdef NKOF_PROFILE
+    profile_dump();
+#endif
+
+#ifdef NKOF_BENCHMARK
+    // Benchmark kernels measure, report over COM1 and leave the emulator
+    bench_exit(bench_run());
+#endif
+    
+    interrupts_enable();
+    task_exit();
 }
\ No newline at end of file
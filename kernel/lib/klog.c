@@ -0,0 +1,417 @@
+/**
+ * NKOF Kernel Log Implementation
+ *
+ * Messages are formatted on the caller's stack and copied into a ring of
+ * fixed-size entries. The ring is a bounded multi-producer queue: each
+ * entry's sequence number tells producers whether it is free and the
+ * consumer whether it is complete, so writers only need one compare and
+ * swap on the write position. When the ring is full new messages are
+ * dropped and counted. One CPU at a time drains the ring to the serial
+ * port and the console.
+ */
+
+#include "../include/klog.h"
+#include "../include/console.h"
+#include "../include/serial.h"
+#include "../include/spinlock.h"
+#include "../include/interrupts.h"
+#include "../include/smp.h"
+#include "../include/string.h"
+#include "../include/math.h"
+
+// Drain synchronously once this many messages are waiting
+#define KLOG_DRAIN_THRESHOLD (KLOG_ENTRIES / 2)
+
+// One ring entry
+// sequence == position: free for the producer of that position
+// sequence == position + 1: holds the message written at that position
+typedef struct {
+    uint32_t sequence;
+    uint32_t length;
+    char text[KLOG_MESSAGE_SIZE];
+} klog_entry_t;
+
+static klog_entry_t ring[KLOG_ENTRIES];
+
+// Next position producers claim, and next position the drain reads
+static uint32_t write_pos = 0;
+static uint32_t read_pos = 0;
+
+// Messages lost because the ring was full
+static uint32_t dropped = 0;
+
+// Held by the CPU draining the ring
+static spinlock_t drain_lock = SPINLOCK_INIT;
+static uint32_t drain_cpu = 0xFFFFFFFF;
+
+// Set by klog_init, before that messages go straight to the console
+static bool ready = false;
+
+/**
+ * Set up the ring and the serial port
+ */
+void klog_init(void) {
+    for (uint32_t i = 0; i < KLOG_ENTRIES; i++) {
+        ring[i].sequence = i;
+    }
+    
+    write_pos = 0;
+    read_pos = 0;
+    
+    serial_init();
+    __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy a piece of text into one ring entry
+ * Returns false if the ring is full
+ */
+static bool ring_push(const char* text, uint32_t length) {
+    uint32_t pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+    klog_entry_t* entry;
+    
+    // Claim the entry at the write position
+    for (;;) {
+        entry = &ring[pos & (KLOG_ENTRIES - 1)];
+        int32_t diff = (int32_t)(__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) - pos);
+        
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&write_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The drain hasn't freed this entry since the last lap
+            return false;
+        } else {
+            pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    memcpy(entry->text, text, length);
+    entry->text[length] = '\0';
+    entry->length = length;
+    
+    // Publish the message
+    __atomic_store_n(&entry->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Write a message to its destinations
+ */
+static void klog_output(const char* text, uint32_t length) {
+    serial_write(text, length);
+    console_write_string(text);
+}
+
+/**
+ * Write pending messages out, caller holds drain_lock
+ */
+static void drain_locked(void) {
+    uint32_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        char notice[48];
+        int length = ksnprintf(notice, sizeof(notice), "klog: %u messages dropped\n", lost);
+        klog_output(notice, length);
+    }
+    
+    for (;;) {
+        klog_entry_t* entry = &ring[read_pos & (KLOG_ENTRIES - 1)];
+        
+        // Stop at the first entry that is still being written
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != read_pos + 1) {
+            break;
+        }
+        
+        klog_output(entry->text, entry->length);
+        
+        // Free the entry for the producer one lap ahead
+        __atomic_store_n(&entry->sequence, read_pos + KLOG_ENTRIES, __ATOMIC_RELEASE);
+        read_pos++;
+    }
+}
+
+/**
+ * Write pending messages out, unless another CPU is already doing it
+ */
+void klog_drain(void) {
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    
+    // Never spin: an interrupt handler's kprintf may find its own CPU draining
+    // Interrupts stay on, writing to the UART is slow
+    if (spin_trylock(&drain_lock)) {
+        drain_cpu = smp_cpu_index();
+        drain_locked();
+        drain_cpu = 0xFFFFFFFF;
+        spin_unlock(&drain_lock);
+    }
+}
+
+/**
+ * Write all pending messages out
+ */
+void klog_flush(void) {
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    
+    uint32_t flags = interrupts_save();
+    uint32_t cpu = smp_cpu_index();
+    
+    while (!spin_trylock(&drain_lock)) {
+        // This CPU was interrupted mid-drain, e.g. by a fatal exception
+        // Finish the job here, the interrupted drain won't run again
+        if (__atomic_load_n(&drain_cpu, __ATOMIC_RELAXED) == cpu) {
+            drain_locked();
+            interrupts_restore(flags);
+            return;
+        }
+        asm volatile ("pause");
+    }
+    
+    drain_cpu = cpu;
+    drain_locked();
+    drain_cpu = 0xFFFFFFFF;
+    spin_unlock(&drain_lock);
+    interrupts_restore(flags);
+}
+
+/**
+ * Format a message into the log
+ */
+int kprintf(const char* format, ...) {
+    char line[KLOG_LINE_MAX];
+    va_list args;
+    
+    va_start(args, format);
+    int length = kvsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    
+    if (length >= (int)sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    
+    // Before klog_init there is no ring yet
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        console_write_string(line);
+        return length;
+    }
+    
+    // Store the message in as many entries as it needs
+    for (int offset = 0; offset < length; offset += KLOG_MESSAGE_SIZE - 1) {
+        uint32_t piece = length - offset;
+        if (piece > KLOG_MESSAGE_SIZE - 1) {
+            piece = KLOG_MESSAGE_SIZE - 1;
+        }
+        
+        if (!ring_push(line + offset, piece)) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    
+    // Don't let a busy system fill the ring before an idle CPU gets to it
+    uint32_t waiting = __atomic_load_n(&write_pos, __ATOMIC_RELAXED) - __atomic_load_n(&read_pos, __ATOMIC_RELAXED);
+    if (waiting >= KLOG_DRAIN_THRESHOLD) {
+        klog_drain();
+    }
+    
+    return length;
+}
+
+// Output state for kvsnprintf
+typedef struct {
+    char* buffer;
+    size_t size;
+    size_t length;                 // Length of the full output, even past size
+} format_out_t;
+
+/**
+ * Append a character, keeping room for the terminator
+ */
+static inline void out_char(format_out_t* out, char c) {
+    if (out->length + 1 < out->size) {
+        out->buffer[out->length] = c;
+    }
+    out->length++;
+}
+
+/**
+ * Append a string padded to a width
+ */
+static void out_padded(format_out_t* out, const char* text, size_t length,
+                       uint32_t width, bool left, char pad) {
+    // Zero padding goes after the sign of a negative number
+    if (pad == '0' && length > 0 && text[0] == '-') {
+        out_char(out, '-');
+        text++;
+        length--;
+        if (width > 0) {
+            width--;
+        }
+    }
+    
+    if (!left) {
+        for (size_t i = length; i < width; i++) {
+            out_char(out, pad);
+        }
+    }
+    
+    for (size_t i = 0; i < length; i++) {
+        out_char(out, text[i]);
+    }
+    
+    if (left) {
+        for (size_t i = length; i < width; i++) {
+            out_char(out, ' ');
+        }
+    }
+}
+
+/**
+ * Convert a number to text, returns the length
+ * digits must hold 21 characters (a 64-bit value in decimal with a sign)
+ */
+static size_t format_number(char* digits, uint64_t value, uint32_t base, bool negative, bool upper) {
+    const char* symbols = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char reversed[20];
+    size_t count = 0;
+    
+    do {
+        uint64_t quotient = base == 16 ? value >> 4 : div64_32(value, base);
+        reversed[count++] = symbols[value - quotient * base];
+        value = quotient;
+    } while (value > 0);
+    
+    size_t length = 0;
+    if (negative) {
+        digits[length++] = '-';
+    }
+    while (count > 0) {
+        digits[length++] = reversed[--count];
+    }
+    
+    return length;
+}
+
+/**
+ * Format into a buffer
+ */
+int kvsnprintf(char* buffer, size_t size, const char* format, va_list args) {
+    format_out_t out = { buffer, size, 0 };
+    
+    for (const char* p = format; *p; p++) {
+        if (*p != '%') {
+            out_char(&out, *p);
+            continue;
+        }
+        p++;
+        
+        // Flags
+        bool left = false;
+        char pad = ' ';
+        for (;; p++) {
+            if (*p == '-') {
+                left = true;
+            } else if (*p == '0') {
+                pad = '0';
+            } else {
+                break;
+            }
+        }
+        
+        // Width
+        uint32_t width = 0;
+        while (*p >= '0' && *p <= '9') {
+            width = width * 10 + (*p - '0');
+            p++;
+        }
+        
+        // Length: only ll changes the argument size on 32-bit x86
+        int longs = 0;
+        while (*p == 'l' || *p == 'z') {
+            if (*p == 'l') {
+                longs++;
+            }
+            p++;
+        }
+        
+        char digits[24];
+        size_t length;
+        
+        switch (*p) {
+            case 'd':
+            case 'i': {
+                int64_t value = longs >= 2 ? va_arg(args, int64_t) : va_arg(args, int32_t);
+                bool negative = value < 0;
+                uint64_t magnitude = negative ? 0 - (uint64_t)value : (uint64_t)value;
+                length = format_number(digits, magnitude, 10, negative, false);
+                out_padded(&out, digits, length, width, left, pad);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X': {
+                uint64_t value = longs >= 2 ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+                length = format_number(digits, value, *p == 'u' ? 10 : 16, false, *p == 'X');
+                out_padded(&out, digits, length, width, left, pad);
+                break;
+            }
+            case 'p': {
+                // Pointers print as 0x and all 8 hex digits
+                uint32_t value = (uint32_t)va_arg(args, void*);
+                out_char(&out, '0');
+                out_char(&out, 'x');
+                length = format_number(digits, value, 16, false, true);
+                out_padded(&out, digits, length, 8, false, '0');
+                break;
+            }
+            case 's': {
+                const char* text = va_arg(args, const char*);
+                if (!text) {
+                    text = "(null)";
+                }
+                out_padded(&out, text, strlen(text), width, left, ' ');
+                break;
+            }
+            case 'c':
+                digits[0] = (char)va_arg(args, int);
+                out_padded(&out, digits, 1, width, left, ' ');
+                break;
+            case '%':
+                out_char(&out, '%');
+                break;
+            case '\0':
+                // Lone '%' at the end of the format
+                p--;
+                break;
+            default:
+                // Unknown conversion, print it as is
+                out_char(&out, '%');
+                out_char(&out, *p);
+                break;
+        }
+    }
+    
+    if (size > 0) {
+        buffer[out.length < size ? out.length : size - 1] = '\0';
+    }
+    
+    return (int)out.length;
+}
+
+/**
+ * Format into a buffer
+ */
+int ksnprintf(char* buffer, size_t size, const char* format, ...) {
+    va_list args;
+    
+    va_start(args, format);
+    int length = kvsnprintf(buffer, size, format, args);
+    va_end(args);
+    
+    return length;
+}
\ No newline at end of file
@@ -0,0 +1,238 @@
+/**
+ * NKOF Profiling Implementation
+ *
+ * Counters register themselves on their first measurement, with a lock-free
+ * push onto a global list. Measurements go into the recording CPU's slot
+ * with interrupts disabled, so an interrupt that hits the same counter
+ * can't tear an update. The dump is one key=value line per timeline mark
+ * and counter, written straight to COM1 so scripts can parse the capture.
+ */
+
+#include "../include/profile.h"
+#include "../include/interrupts.h"
+#include "../include/serial.h"
+#include "../include/timer.h"
+#include "../include/klog.h"
+#include "../include/math.h"
+#include "../include/string.h"
+
+// Registered counters
+static profile_counter_t* counters = NULL;
+
+// Boot milestones
+typedef struct {
+    const char* name;
+    uint64_t tsc;
+} profile_mark_t;
+
+static profile_mark_t timeline[PROFILE_TIMELINE_MAX];
+static uint32_t timeline_count = 0;
+
+/**
+ * Put a counter on the list the first time it records
+ */
+static void counter_register(profile_counter_t* counter) {
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&counter->registered, &expected, 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    counter->next = __atomic_load_n(&counters, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&counters, &counter->next, counter, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Get the histogram bucket for a measurement (floor of log2)
+ */
+static inline uint32_t cycles_bucket(uint64_t cycles) {
+    // Split by hand, a 64-bit count leading zeros would need libgcc
+    uint32_t high = (uint32_t)(cycles >> 32);
+    uint32_t low = (uint32_t)cycles;
+    uint32_t bucket;
+    
+    if (high) {
+        bucket = 63 - __builtin_clz(high);
+    } else if (low) {
+        bucket = 31 - __builtin_clz(low);
+    } else {
+        bucket = 0;
+    }
+    
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+/**
+ * Add one measurement to a counter
+ */
+void profile_record(profile_counter_t* counter, uint64_t cycles) {
+    if (!__atomic_load_n(&counter->registered, __ATOMIC_ACQUIRE)) {
+        counter_register(counter);
+    }
+    
+    uint32_t flags = interrupts_save();
+    profile_stats_t* stats = &counter->cpu[smp_cpu_index()];
+    
+    if (stats->calls == 0 || cycles < stats->min_cycles) {
+        stats->min_cycles = cycles;
+    }
+    if (cycles > stats->max_cycles) {
+        stats->max_cycles = cycles;
+    }
+    stats->calls++;
+    stats->total_cycles += cycles;
+    stats->histogram[cycles_bucket(cycles)]++;
+    
+    interrupts_restore(flags);
+}
+
+/**
+ * Sum a counter's per-CPU statistics
+ */
+void profile_get_stats(profile_counter_t* counter, profile_stats_t* stats) {
+    memset(stats, 0, sizeof(profile_stats_t));
+    
+    // Other CPUs may be recording, the sum is a snapshot
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        profile_stats_t* part = &counter->cpu[cpu];
+        if (part->calls == 0) {
+            continue;
+        }
+        
+        if (stats->calls == 0 || part->min_cycles < stats->min_cycles) {
+            stats->min_cycles = part->min_cycles;
+        }
+        if (part->max_cycles > stats->max_cycles) {
+            stats->max_cycles = part->max_cycles;
+        }
+        stats->calls += part->calls;
+        stats->total_cycles += part->total_cycles;
+        for (uint32_t i = 0; i < PROFILE_BUCKETS; i++) {
+            stats->histogram[i] += part->histogram[i];
+        }
+    }
+}
+
+/**
+ * Clear the statistics of every registered counter
+ */
+void profile_reset(void) {
+    for (profile_counter_t* counter = __atomic_load_n(&counters, __ATOMIC_ACQUIRE);
+         counter; counter = counter->next) {
+        memset(counter->cpu, 0, sizeof(counter->cpu));
+    }
+}
+
+/**
+ * Record a boot milestone
+ */
+void profile_mark(const char* name) {
+    uint32_t index = __atomic_fetch_add(&timeline_count, 1, __ATOMIC_RELAXED);
+    if (index >= PROFILE_TIMELINE_MAX) {
+        return;
+    }
+    
+    timeline[index].name = name;
+    timeline[index].tsc = rdtsc();
+}
+
+/**
+ * Write a line of dump output
+ */
+void profile_write(const char* line) {
+    if (serial_present()) {
+        serial_write(line, strlen(line));
+    } else {
+        kprintf("%s", line);
+    }
+}
+
+/**
+ * Convert cycles to microseconds, 0 before the TSC is calibrated
+ */
+static uint64_t cycles_to_us(uint64_t cycles, uint32_t khz) {
+    return khz ? div64_32(cycles * 1000, khz) : 0;
+}
+
+/**
+ * Get the mean cycles per call
+ */
+static uint64_t average_cycles(profile_stats_t* stats) {
+    uint64_t total = stats->total_cycles;
+    uint64_t calls = stats->calls;
+    
+    // div64_32 needs a 32-bit divisor, scale both down past 2^32 calls
+    while (calls > 0xFFFFFFFF) {
+        total >>= 1;
+        calls >>= 1;
+    }
+    
+    return calls ? div64_32(total, (uint32_t)calls) : 0;
+}
+
+/**
+ * Write one counter as a COUNTER line
+ */
+void profile_dump_counter(profile_counter_t* counter) {
+    char line[KLOG_LINE_MAX];
+    
+    profile_stats_t stats;
+    profile_get_stats(counter, &stats);
+    
+    uint64_t average = average_cycles(&stats);
+    int length = ksnprintf(line, sizeof(line),
+                           "COUNTER name=%s calls=%llu total=%llu min=%llu max=%llu avg=%llu hist=",
+                           counter->name, stats.calls, stats.total_cycles,
+                           stats.min_cycles, stats.max_cycles, average);
+    
+    // Non-empty buckets as log2:count pairs
+    bool first = true;
+    for (uint32_t i = 0; i < PROFILE_BUCKETS && length < (int)sizeof(line); i++) {
+        if (stats.histogram[i] == 0) {
+            continue;
+        }
+        length += ksnprintf(line + length, sizeof(line) - length, "%s%u:%u",
+                            first ? "" : ",", i, stats.histogram[i]);
+        first = false;
+    }
+    
+    // Keep the newline even if the histogram was cut off
+    if (length > (int)sizeof(line) - 2) {
+        length = sizeof(line) - 2;
+    }
+    line[length++] = '\n';
+    line[length] = '\0';
+    
+    profile_write(line);
+}
+
+/**
+ * Write the timeline and all counters out
+ */
+void profile_dump(void) {
+    char line[KLOG_LINE_MAX];
+    uint32_t khz = timer_tsc_khz();
+    
+    // Earlier log messages go first, the dump bypasses the ring
+    klog_flush();
+    
+    ksnprintf(line, sizeof(line), "PROFILE BEGIN tsc_khz=%u cpus=%u\n", khz, smp_cpu_count());
+    profile_write(line);
+    
+    uint32_t marks = timeline_count < PROFILE_TIMELINE_MAX ? timeline_count : PROFILE_TIMELINE_MAX;
+    for (uint32_t i = 0; i < marks; i++) {
+        uint64_t cycles = timeline[i].tsc - timeline[0].tsc;
+        ksnprintf(line, sizeof(line), "TIMELINE name=%s cycles=%llu us=%llu\n",
+                  timeline[i].name, cycles, cycles_to_us(cycles, khz));
+        profile_write(line);
+    }
+    
+    for (profile_counter_t* counter = __atomic_load_n(&counters, __ATOMIC_ACQUIRE);
+         counter; counter = counter->next) {
+        profile_dump_counter(counter);
+    }
+    
+    profile_write("PROFILE END\n");
+}
\ No newline at end of file
@@ -0,0 +1,304 @@
+/**
+ * NKOF Memory Primitives Implementation
+ *
+ * This file implements memset, memcpy, memmove, memcmp and strlen for the kernel.
+ * Small and medium buffers use rep stosl/movsl with byte fix-ups.
+ * Large buffers use 16-byte SSE2 stores when string_init found SSE2.
+ * memzero_nt clears memory with streaming stores that bypass the cache.
+ */
+
+#include "../include/string.h"
+#include "../include/cpu.h"
+
+// Buffers at least this large take the SSE2 path
+#define SSE2_THRESHOLD 256
+
+// Set by string_init when SSE2 is available and enabled
+static bool use_sse2 = false;
+
+/**
+ * Select the fastest routines for this CPU
+ */
+void string_init(void) {
+    uint32_t features = cpu_features_edx();
+    
+    if (!(features & CPUID_EDX_SSE2) || !(features & CPUID_EDX_FXSR)) {
+        use_sse2 = false;
+        return;
+    }
+    
+    // Enable SSE: no x87 emulation, monitor coprocessor, OS supports FXSR and SSE exceptions
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    
+    use_sse2 = true;
+}
+
+/**
+ * Fill with rep stosl and rep stosb
+ */
+static inline void fill_rep(uint8_t* dest, uint32_t pattern, size_t count) {
+    uint32_t words = count / 4;
+    uint32_t bytes = count % 4;
+    
+    asm volatile (
+        "rep stosl\n\t"
+        "mov %3, %%ecx\n\t"
+        "rep stosb"
+        : "+D" (dest), "+c" (words)
+        : "a" (pattern), "r" (bytes)
+        : "memory"
+    );
+}
+
+/**
+ * Copy forwards with rep movsl and rep movsb
+ */
+static inline void copy_rep(uint8_t* dest, const uint8_t* src, size_t count) {
+    uint32_t words = count / 4;
+    uint32_t bytes = count % 4;
+    
+    asm volatile (
+        "rep movsl\n\t"
+        "mov %3, %%ecx\n\t"
+        "rep movsb"
+        : "+D" (dest), "+S" (src), "+c" (words)
+        : "r" (bytes)
+        : "memory"
+    );
+}
+
+/**
+ * Fill 64 bytes at a time with aligned SSE2 stores
+ */
+__attribute__((target("sse2")))
+static void fill_sse2(uint8_t* dest, uint32_t pattern, size_t count) {
+    // Bring the destination to a 16-byte boundary
+    size_t head = (16 - ((uint32_t)dest & 15)) & 15;
+    fill_rep(dest, pattern, head);
+    dest += head;
+    count -= head;
+    
+    size_t blocks = count / 64;
+    if (blocks) {
+        asm volatile (
+            "movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n"
+            "1:\n\t"
+            "movdqa %%xmm0, (%0)\n\t"
+            "movdqa %%xmm0, 16(%0)\n\t"
+            "movdqa %%xmm0, 32(%0)\n\t"
+            "movdqa %%xmm0, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b"
+            : "+r" (dest), "+r" (blocks)
+            : "r" (pattern)
+            : "memory", "xmm0"
+        );
+    }
+    
+    fill_rep(dest, pattern, count % 64);
+}
+
+/**
+ * Copy 64 bytes at a time with SSE2, aligned stores and unaligned loads
+ */
+__attribute__((target("sse2")))
+static void copy_sse2(uint8_t* dest, const uint8_t* src, size_t count) {
+    // Bring the destination to a 16-byte boundary
+    size_t head = (16 - ((uint32_t)dest & 15)) & 15;
+    copy_rep(dest, src, head);
+    dest += head;
+    src += head;
+    count -= head;
+    
+    size_t blocks = count / 64;
+    if (blocks) {
+        asm volatile (
+            "1:\n\t"
+            "movdqu (%1), %%xmm0\n\t"
+            "movdqu 16(%1), %%xmm1\n\t"
+            "movdqu 32(%1), %%xmm2\n\t"
+            "movdqu 48(%1), %%xmm3\n\t"
+            "movdqa %%xmm0, (%0)\n\t"
+            "movdqa %%xmm1, 16(%0)\n\t"
+            "movdqa %%xmm2, 32(%0)\n\t"
+            "movdqa %%xmm3, 48(%0)\n\t"
+            "add $64, %1\n\t"
+            "add $64, %0\n\t"
+            "dec %2\n\t"
+            "jnz 1b"
+            : "+r" (dest), "+r" (src), "+r" (blocks)
+            :
+            : "memory", "xmm0", "xmm1", "xmm2", "xmm3"
+        );
+    }
+    
+    copy_rep(dest, src, count % 64);
+}
+
+/**
+ * Zero whole 64-byte blocks with non-temporal SSE2 stores
+ */
+__attribute__((target("sse2")))
+static void zero_sse2_nt(uint8_t* dest, size_t blocks) {
+    asm volatile (
+        "pxor %%xmm0, %%xmm0\n"
+        "1:\n\t"
+        "movntdq %%xmm0, (%0)\n\t"
+        "movntdq %%xmm0, 16(%0)\n\t"
+        "movntdq %%xmm0, 32(%0)\n\t"
+        "movntdq %%xmm0, 48(%0)\n\t"
+        "add $64, %0\n\t"
+        "dec %1\n\t"
+        "jnz 1b\n\t"
+        "sfence"
+        : "+r" (dest), "+r" (blocks)
+        :
+        : "memory", "xmm0"
+    );
+}
+
+/**
+ * Zero memory without pulling it into the cache
+ */
+void memzero_nt(void* dest, size_t count) {
+    uint8_t* ptr = (uint8_t*)dest;
+    
+    if (!use_sse2) {
+        fill_rep(ptr, 0, count);
+        return;
+    }
+    
+    // Streaming stores need a 16-byte aligned destination
+    size_t head = (16 - ((uint32_t)ptr & 15)) & 15;
+    if (head > count) {
+        head = count;
+    }
+    fill_rep(ptr, 0, head);
+    ptr += head;
+    count -= head;
+    
+    if (count >= 64) {
+        zero_sse2_nt(ptr, count / 64);
+        ptr += count & ~63u;
+    }
+    
+    fill_rep(ptr, 0, count % 64);
+}
+
+/**
+ * Fill memory with a byte value
+ */
+void* memset(void* dest, int value, size_t count) {
+    uint32_t pattern = (uint8_t)value * 0x01010101;
+    
+    if (use_sse2 && count >= SSE2_THRESHOLD) {
+        fill_sse2((uint8_t*)dest, pattern, count);
+    } else {
+        fill_rep((uint8_t*)dest, pattern, count);
+    }
+    
+    return dest;
+}
+
+/**
+ * Fill memory with a 16-bit value
+ */
+void* memset16(void* dest, uint16_t value, size_t count) {
+    uint32_t pattern = value | ((uint32_t)value << 16);
+    uint16_t* ptr = (uint16_t*)dest;
+    
+    // Fill ends on 4-byte boundaries so the 32-bit pattern keeps its phase
+    if (((uint32_t)ptr & 3) != 0 && count > 0) {
+        *ptr++ = value;
+        count--;
+    }
+    if (count & 1) {
+        ptr[count - 1] = value;
+        count--;
+    }
+    
+    if (use_sse2 && count * 2 >= SSE2_THRESHOLD) {
+        fill_sse2((uint8_t*)ptr, pattern, count * 2);
+    } else {
+        fill_rep((uint8_t*)ptr, pattern, count * 2);
+    }
+    
+    return dest;
+}
+
+/**
+ * Copy memory between non-overlapping buffers
+ */
+void* memcpy(void* dest, const void* src, size_t count) {
+    if (use_sse2 && count >= SSE2_THRESHOLD) {
+        copy_sse2((uint8_t*)dest, (const uint8_t*)src, count);
+    } else {
+        copy_rep((uint8_t*)dest, (const uint8_t*)src, count);
+    }
+    
+    return dest;
+}
+
+/**
+ * Copy memory between buffers that may overlap
+ */
+void* memmove(void* dest, const void* src, size_t count) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    
+    // Forward copy is safe unless dest starts inside src
+    if (d <= s || d >= s + count) {
+        return memcpy(dest, src, count);
+    }
+    
+    // Copy backwards: trailing bytes first, then whole words
+    uint32_t words = count / 4;
+    uint32_t bytes = count % 4;
+    uint8_t* d_end = d + count - 1;
+    const uint8_t* s_end = s + count - 1;
+    
+    asm volatile (
+        "std\n\t"
+        "rep movsb\n\t"
+        "sub $3, %%edi\n\t"
+        "sub $3, %%esi\n\t"
+        "mov %3, %%ecx\n\t"
+        "rep movsl\n\t"
+        "cld"
+        : "+D" (d_end), "+S" (s_end), "+c" (bytes)
+        : "r" (words)
+        : "memory"
+    );
+    
+    return dest;
+}
+
+/**
+ * Compare memory
+ */
+int memcmp(const void* a, const void* b, size_t count) {
+    const uint8_t* pa = (const uint8_t*)a;
+    const uint8_t* pb = (const uint8_t*)b;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (pa[i] != pb[i]) {
+            return pa[i] - pb[i];
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Get the length of a NUL-terminated string
+ */
+size_t strlen(const char* str) {
+    const char* end = str;
+    while (*end) {
+        end++;
+    }
+    return end - str;
+}
\ No newline at end of file
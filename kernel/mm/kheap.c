@@ -2,95 +2,639 @@
  * NKOF Kernel Heap Implementation
  *
  * This file implements a simple heap for dynamic memory allocation in the kernel.
- * It uses a linked list of free blocks with first-fit allocation strategy.
+ * Small requests are served by slab caches, one per size class. The classes
+ * start out as powers of two and can be replaced at run time (the tuner
+ * fits them to the sizes actually requested). Larger ones use
+ * boundary-tagged blocks: every block has a header and a footer holding its
+ * size, so kfree can merge with both physical neighbours in constant time.
+ * Free blocks are also kept on a doubly linked free list, searched first-fit.
+ *
+ * Large requests skip the blocks and get whole pages mapped on their own,
+ * which are unmapped and returned to the PMM when freed. The paging layer
+ * maps whole 2MB-aligned stretches of such ranges with 2MB pages.
+ *
+ * All virtual space comes from the vmalloc window. Blocks live in arenas:
+ * naturally aligned areas sized to physical memory, each growing up from
+ * its base until it's full, when the next arena is opened wherever the
+ * window has room. Slabs and large allocations get areas of their own.
+ * Physical frames are only committed when a page is first touched.
+ *
+ * The heap and the slab allocator call into each other and into paging,
+ * so they all share the recursive paging lock.
+ *
+ * Builds with NKOF_HEAP_TAGS also record the call site of every live
+ * allocation in a pointer hash, so the biggest consumers can be listed.
  */
 
 #include "../include/kheap.h"
 #include "../include/pmm.h"
 #include "../include/paging.h"
-#include "../include/console.h"
+#include "../include/vmalloc.h"
+#include "../include/slab.h"
+#include "../include/string.h"
+#include "../include/klog.h"
+#include "../include/profile.h"
+#include "../include/spinlock.h"
+#include "../include/neural.h"
 
 // Memory block header
 typedef struct block_header {
-    size_t size;                   // Size of the block (including header)
+    size_t size;                   // Size of the block (including header and footer)
     uint32_t magic;                // Magic number for integrity checking
-    uint8_t is_free;               // 1 if the block is free, 0 if allocated
-    struct block_header* next;     // Pointer to the next block
+    uint32_t is_free;              // 1 if the block is free, 0 if allocated
+    uint32_t reserved;             // Pads the header so payloads stay 8-byte aligned
+    struct block_header* next_free; // Next block in the free list (free blocks only)
+    struct block_header* prev_free; // Previous block in the free list (free blocks only)
 } block_header_t;
 
+// Memory block footer, at the very end of every block
+typedef struct block_footer {
+    size_t size;                   // Copy of the header's size
+} block_footer_t;
+
 // Magic number for block headers
 #define HEAP_MAGIC 0x1BADB002
 
-// Minimum block size (including header)
-#define MIN_BLOCK_SIZE (sizeof(block_header_t) + 4)
+// Block sizes are a multiple of this
+#define BLOCK_ALIGN 8
+
+// Bytes of a block not available to the caller
+#define BLOCK_OVERHEAD (sizeof(block_header_t) + sizeof(block_footer_t))
+
+// Minimum block size (including header and footer)
+#define MIN_BLOCK_SIZE ((BLOCK_OVERHEAD + 8 + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1))
 
 // Heap statistics
 static size_t heap_total = 0;
 static size_t heap_used = 0;
 static size_t heap_free = 0;
 
-// Start and end of the heap
-static uint32_t heap_start = 0;
-static uint32_t heap_end = 0;
-static uint32_t heap_max = 0;
+// Block arena, at the base of its area and followed by its blocks
+typedef struct heap_arena {
+    uint32_t start;                // First block
+    uint32_t end;                  // End of the blocks, grows up to limit
+    uint32_t limit;                // End of the arena's virtual space
+    struct heap_arena* next;       // Older arenas
+} heap_arena_t;
+
+// Arenas are heap_arena_size bytes and aligned to it, so a block's arena is
+// found by masking its address
+#define HEAP_ARENA_MIN  LARGE_PAGE_SIZE
+#define HEAP_ARENA_MAX  (16 * LARGE_PAGE_SIZE)
+static uint32_t heap_arena_size = HEAP_ARENA_MIN;
+
+// Newest arena, the one the heap grows
+static heap_arena_t* heap_arenas = NULL;
+static uint32_t heap_arena_count = 0;
+
+// Head of the free block list
+static block_header_t* free_list = NULL;
+
+// A large allocation
+typedef struct page_range {
+    uint32_t start;                // First virtual address
+    uint32_t pages;                // Number of pages
+    struct page_range* next;       // Next range in the list
+} page_range_t;
+
+// Cache for page_range_t records
+static kmem_cache_t* page_range_cache = NULL;
+
+// Live large allocations, hashed by start address
+#define LARGE_HASH_SIZE 64
+static page_range_t* large_allocs[LARGE_HASH_SIZE];
+
+// Bytes mapped for large allocations, and how many there are
+static size_t large_total = 0;
+static uint32_t large_count = 0;
+
+// Bytes held in areas from kheap_map_pages (slabs and large allocations)
+static size_t page_bytes = 0;
+
+// Most bytes held at once by blocks and kheap_map_pages areas
+static size_t peak_footprint = 0;
+
+// Requests of this size or more, or any whole number of pages, map pages directly
+#define KMALLOC_LARGE_MIN (4 * PAGE_SIZE)
+
+// Caches ever created for size classes. A class that is dropped keeps its
+// cache so objects already handed out can still be freed, but the cache is
+// retired: its slabs go back to the page area as they empty. The descriptor
+// stays, a racing kmalloc may still be about to use it, so once all are
+// taken only sizes that have a cache can become classes
+#define KMALLOC_MAX_CACHES 32
+
+static kmem_cache_t* kmalloc_caches[KMALLOC_MAX_CACHES];
+static char kmalloc_cache_names[KMALLOC_MAX_CACHES][16];
+static uint32_t kmalloc_cache_count = 0;
+
+// Size classes in use, ascending, the last is always KMALLOC_MAX_SMALL
+static uint32_t kmalloc_classes[KHEAP_MAX_CLASSES];
+static uint32_t kmalloc_class_count = 0;
+
+// Cache serving each request size, by KHEAP_CLASS_GRANULE steps
+static kmem_cache_t* kmalloc_class_cache[KMALLOC_MAX_SMALL / KHEAP_CLASS_GRANULE + 1];
+
+// Default classes: powers of two from 16 bytes
+static const uint32_t kmalloc_default_classes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+
+// Pages the heap grows by at least, and how many times it has grown
+static uint32_t heap_expand_pages = KHEAP_EXPAND_PAGES;
+static uint32_t heap_expansions = 0;
+
+/**
+ * Get the footer of a block
+ */
+static inline block_footer_t* block_footer(block_header_t* block) {
+    return (block_footer_t*)((uint32_t)block + block->size - sizeof(block_footer_t));
+}
+
+/**
+ * Set a block's size in both its header and footer
+ */
+static inline void block_set_size(block_header_t* block, size_t size) {
+    block->size = size;
+    block_footer(block)->size = size;
+}
+
+/**
+ * Get the arena holding a block
+ */
+static inline heap_arena_t* block_arena(block_header_t* block) {
+    return (heap_arena_t*)((uint32_t)block & ~(heap_arena_size - 1));
+}
+
+/**
+ * Get the block physically after this one, NULL at the end of its arena
+ */
+static inline block_header_t* block_next(block_header_t* block) {
+    uint32_t next = (uint32_t)block + block->size;
+    return next < block_arena(block)->end ? (block_header_t*)next : NULL;
+}
+
+/**
+ * Get the block physically before this one, NULL at the start of its arena
+ */
+static inline block_header_t* block_prev(block_header_t* block) {
+    if ((uint32_t)block <= block_arena(block)->start) {
+        return NULL;
+    }
+    
+    block_footer_t* footer = (block_footer_t*)((uint32_t)block - sizeof(block_footer_t));
+    return (block_header_t*)((uint32_t)block - footer->size);
+}
+
+/**
+ * Get the last block of an arena through its footer, NULL if it's empty
+ */
+static inline block_header_t* arena_last_block(heap_arena_t* arena) {
+    if (!arena || arena->end <= arena->start) {
+        return NULL;
+    }
+    
+    block_footer_t* footer = (block_footer_t*)(arena->end - sizeof(block_footer_t));
+    return (block_header_t*)(arena->end - footer->size);
+}
+
+/**
+ * Add a block to the free list
+ */
+static void free_list_insert(block_header_t* block) {
+    block->is_free = 1;
+    block->prev_free = NULL;
+    block->next_free = free_list;
+    
+    if (free_list) {
+        free_list->prev_free = block;
+    }
+    
+    free_list = block;
+}
+
+/**
+ * Remove a block from the free list
+ */
+static void free_list_remove(block_header_t* block) {
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_list = block->next_free;
+    }
+    
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    
+    block->is_free = 0;
+}
+
+/**
+ * Update the peak footprint after the heap has grown
+ */
+static inline void note_footprint(void) {
+    size_t footprint = heap_used + page_bytes;
+    if (footprint > peak_footprint) {
+        peak_footprint = footprint;
+    }
+}
+
+#ifdef NKOF_HEAP_TAGS
+// Live allocations tracked, a power of 2 (open addressing, kept under 3/4 full)
+#define TAG_TABLE_SIZE 8192
+
+// Distinct call sites tracked, a power of 2
+#define TAG_SITES 256
+
+// Live allocation: pointer, requested size and index of its call site
+typedef struct {
+    uint32_t ptr;                  // 0 for an empty slot
+    uint32_t size;
+    uint32_t site;                 // TAG_SITES when the site table was full
+} heap_tag_t;
+
+static heap_tag_t tag_table[TAG_TABLE_SIZE];
+static uint32_t tag_count = 0;
+static kheap_site_t tag_sites[TAG_SITES];
+
+// Allocations that found the pointer table full and weren't tracked
+static uint32_t tags_dropped = 0;
+
+// Leaf lock, taken by every tagged kmalloc and kfree
+static spinlock_t tag_lock = SPINLOCK_INIT;
+
+// Call site of the public function using it
+#define KHEAP_CALLER __builtin_return_address(0)
+
+/**
+ * Hash a pointer or site address into a power-of-2 table
+ */
+static inline uint32_t tag_hash(uint32_t value, uint32_t size) {
+    return ((value >> 3) * 2654435761u) & (size - 1);
+}
+
+/**
+ * Find or add a call site, TAG_SITES if the table is full
+ */
+static uint32_t tag_site_index(void* site) {
+    uint32_t index = tag_hash((uint32_t)site, TAG_SITES);
+    
+    for (uint32_t probe = 0; probe < TAG_SITES; probe++) {
+        kheap_site_t* entry = &tag_sites[index];
+        if (entry->site == site) {
+            return index;
+        }
+        if (entry->site == NULL) {
+            entry->site = site;
+            return index;
+        }
+        index = (index + 1) & (TAG_SITES - 1);
+    }
+    
+    return TAG_SITES;
+}
 
-// First block in the heap
-static block_header_t* first_block = NULL;
+/**
+ * Record a new allocation and its call site
+ */
+static void heap_tag(void* ptr, size_t size, void* site) {
+    if (!ptr) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&tag_lock);
+    
+    if (tag_count >= TAG_TABLE_SIZE / 4 * 3) {
+        tags_dropped++;
+        spin_unlock_irqrestore(&tag_lock, flags);
+        return;
+    }
+    
+    uint32_t site_index = tag_site_index(site);
+    if (site_index < TAG_SITES) {
+        tag_sites[site_index].live_count++;
+        tag_sites[site_index].live_bytes += size;
+        tag_sites[site_index].total_count++;
+    }
+    
+    uint32_t index = tag_hash((uint32_t)ptr, TAG_TABLE_SIZE);
+    while (tag_table[index].ptr != 0) {
+        index = (index + 1) & (TAG_TABLE_SIZE - 1);
+    }
+    tag_table[index].ptr = (uint32_t)ptr;
+    tag_table[index].size = size;
+    tag_table[index].site = site_index;
+    tag_count++;
+    
+    spin_unlock_irqrestore(&tag_lock, flags);
+}
 
 /**
- * Expand the heap by a given number of pages
+ * Forget a freed allocation
  */
-static void expand_heap(size_t pages) {
-    if (heap_end + pages * PAGE_SIZE > heap_max) {
-        console_write_string("ERROR: Cannot expand heap beyond maximum limit\n");
+static void heap_untag(void* ptr) {
+    if (!ptr) {
         return;
     }
     
-    // Map new pages
-    for (uint32_t addr = heap_end; addr < heap_end + pages * PAGE_SIZE; addr += PAGE_SIZE) {
-        paging_alloc_and_map(addr, PAGE_PRESENT | PAGE_WRITABLE);
+    uint32_t flags = spin_lock_irqsave(&tag_lock);
+    
+    uint32_t index = tag_hash((uint32_t)ptr, TAG_TABLE_SIZE);
+    while (tag_table[index].ptr != 0 && tag_table[index].ptr != (uint32_t)ptr) {
+        index = (index + 1) & (TAG_TABLE_SIZE - 1);
     }
     
-    // Update heap_end
-    uint32_t old_end = heap_end;
-    heap_end += pages * PAGE_SIZE;
+    // Untracked allocations (table was full) aren't found
+    if (tag_table[index].ptr == 0) {
+        spin_unlock_irqrestore(&tag_lock, flags);
+        return;
+    }
     
-    // Create a new free block for the expanded region
-    block_header_t* new_block = (block_header_t*)old_end;
-    new_block->size = pages * PAGE_SIZE;
-    new_block->magic = HEAP_MAGIC;
-    new_block->is_free = 1;
+    heap_tag_t* tag = &tag_table[index];
+    if (tag->site < TAG_SITES) {
+        tag_sites[tag->site].live_count--;
+        tag_sites[tag->site].live_bytes -= tag->size;
+    }
+    tag_count--;
+    
+    // Backward-shift deletion: pull later entries of the probe run into the hole
+    uint32_t hole = index;
+    uint32_t next = (hole + 1) & (TAG_TABLE_SIZE - 1);
+    while (tag_table[next].ptr != 0) {
+        uint32_t home = tag_hash(tag_table[next].ptr, TAG_TABLE_SIZE);
+        
+        // Move the entry unless its home lies cyclically in (hole, next]
+        if (((next - home) & (TAG_TABLE_SIZE - 1)) >= ((next - hole) & (TAG_TABLE_SIZE - 1))) {
+            tag_table[hole] = tag_table[next];
+            hole = next;
+        }
+        next = (next + 1) & (TAG_TABLE_SIZE - 1);
+    }
+    tag_table[hole].ptr = 0;
+    
+    spin_unlock_irqrestore(&tag_lock, flags);
+}
+#else
+#define KHEAP_CALLER NULL
+#define heap_tag(ptr, size, site) ((void)(site))
+#define heap_untag(ptr) ((void)0)
+#endif
+
+/**
+ * Record a new allocation with the tag table and the tuner's telemetry
+ */
+static inline void heap_note_alloc(void* ptr, size_t size, void* site) {
+    heap_tag(ptr, size, site);
+    neural_note_alloc(ptr, size);
+}
+
+/**
+ * Record a free with the tag table and the tuner's telemetry
+ */
+static inline void heap_note_free(void* ptr) {
+    heap_untag(ptr);
+    neural_note_free(ptr);
+}
+
+/**
+ * Open a new arena, it becomes the one the heap grows
+ */
+static heap_arena_t* arena_create(void) {
+    uint32_t base = vm_area_alloc(heap_arena_size / PAGE_SIZE, heap_arena_size);
+    if (!base) {
+        kprintf("ERROR: No virtual space for a new heap arena\n");
+        return NULL;
+    }
+    
+    // Blocks start after the header, keeping payloads 8-byte aligned
+    heap_arena_t* arena = (heap_arena_t*)base;
+    arena->start = base + ((sizeof(heap_arena_t) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1));
+    arena->end = arena->start;
+    arena->limit = base + heap_arena_size;
+    arena->next = heap_arenas;
+    heap_arenas = arena;
+    heap_arena_count++;
+    
+    return arena;
+}
+
+/**
+ * Grow an arena by a given number of pages
+ * Returns the free block at the tail of the arena, NULL if it's full
+ */
+static block_header_t* arena_expand(heap_arena_t* arena, size_t pages) {
+    if (!arena || pages * PAGE_SIZE > arena->limit - arena->end) {
+        return NULL;
+    }
+    
+    // No mapping needed: the window is reserved and pages are committed on first touch
+    
+    // Find the current last block before moving the end
+    block_header_t* last = arena_last_block(arena);
+    
+    // Update the arena end
+    uint32_t old_end = arena->end;
+    arena->end += pages * PAGE_SIZE;
     
     // Update heap statistics
     heap_total += pages * PAGE_SIZE;
     heap_free += pages * PAGE_SIZE;
     
-    // Insert the new block into the linked list
-    block_header_t* current = first_block;
-    if (!current) {
-        // If this is the first block
-        first_block = new_block;
-        new_block->next = NULL;
-        return;
+    // Grow the last block if it's free, it stays in the free list
+    if (last && last->is_free) {
+        block_set_size(last, last->size + pages * PAGE_SIZE);
+        return last;
+    }
+    
+    // Otherwise create a new free block for the expanded region
+    block_header_t* new_block = (block_header_t*)old_end;
+    new_block->magic = HEAP_MAGIC;
+    new_block->reserved = 0;
+    block_set_size(new_block, pages * PAGE_SIZE);
+    free_list_insert(new_block);
+    
+    return new_block;
+}
+
+/**
+ * Expand the heap until its tail is a free block of at least needed bytes
+ * Grows the newest arena, or opens another when that one is full
+ * Returns the free block at the tail of the heap, NULL on failure
+ */
+static block_header_t* expand_heap(size_t needed) {
+    // A free tail block counts towards the new space
+    block_header_t* last = arena_last_block(heap_arenas);
+    size_t tail = (last && last->is_free) ? last->size : 0;
+    size_t pages = needed > tail ? (needed - tail + PAGE_SIZE - 1) / PAGE_SIZE : 1;
+    
+    heap_expansions++;
+    
+    // Grow by the step when the arena has room for it, else by what's needed
+    block_header_t* block = NULL;
+    if (pages < heap_expand_pages) {
+        block = arena_expand(heap_arenas, heap_expand_pages);
+    }
+    if (!block) {
+        block = arena_expand(heap_arenas, pages);
+    }
+    if (block) {
+        return block;
     }
     
-    // Find the last block
-    while (current->next) {
-        current = current->next;
+    // Too large for any arena, such requests are served with pages instead
+    if (needed + sizeof(heap_arena_t) + BLOCK_ALIGN > heap_arena_size) {
+        kprintf("ERROR: Cannot expand heap beyond the arena size\n");
+        return NULL;
     }
     
-    current->next = new_block;
-    new_block->next = NULL;
+    // A new arena starts empty, so it needs the whole amount
+    pages = (needed + PAGE_SIZE - 1) / PAGE_SIZE;
+    return arena_expand(arena_create(), pages > heap_expand_pages ? pages : heap_expand_pages);
+}
+
+/**
+ * Unmap pages and return their frames to the PMM
+ */
+static void unmap_pages(uint32_t start, uint32_t pages) {
+    paging_unmap_range(start, pages, true);
+}
+
+/**
+ * Prepare a page area range for use
+ * Small ranges are committed on first touch. Ranges with room for a 2MB
+ * page are mapped up front so they get one.
+ * Returns false (with nothing left mapped) if physical memory runs out
+ */
+static bool map_pages(uint32_t start, uint32_t pages) {
+    if (pages < LARGE_PAGE_SIZE / PAGE_SIZE || !paging_large_pages_supported()) {
+        return true;
+    }
     
-    // Try to merge with the previous block if it's free
-    if (current->is_free) {
-        current->size += new_block->size;
-        current->next = NULL;
+    return paging_alloc_and_map_range(start, pages, PAGE_KERNEL) != 0;
+}
+
+/**
+ * Map whole pages in a virtual area of their own, aligned to the given power of 2
+ */
+void* kheap_map_pages(size_t pages, size_t alignment) {
+    paging_lock();
+    
+    if (alignment < PAGE_SIZE) {
+        alignment = PAGE_SIZE;
+    }
+    
+    uint32_t start = vm_area_alloc(pages, alignment);
+    if (!start) {
+        paging_unlock();
+        return NULL;
     }
+    
+    if (!map_pages(start, pages)) {
+        vm_area_free(start);
+        paging_unlock();
+        return NULL;
+    }
+    
+    page_bytes += pages * PAGE_SIZE;
+    note_footprint();
+    
+    paging_unlock();
+    return (void*)start;
 }
 
 /**
- * Split a block into two parts
+ * Unmap pages from kheap_map_pages
+ */
+void kheap_unmap_pages(void* ptr, size_t pages) {
+    paging_lock();
+    
+    unmap_pages((uint32_t)ptr, pages);
+    vm_area_free((uint32_t)ptr);
+    page_bytes -= pages * PAGE_SIZE;
+    
+    paging_unlock();
+}
+
+/**
+ * Allocate a large request as its own run of mapped pages
+ */
+static void* kmalloc_large(size_t size, uint32_t alignment) {
+    paging_lock();
+    
+    page_range_t* record = (page_range_t*)kmem_cache_alloc(page_range_cache);
+    if (!record) {
+        paging_unlock();
+        return NULL;
+    }
+    
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    // Whole 2MB multiples are placed so they can be mapped with 2MB pages
+    if (size % LARGE_PAGE_SIZE == 0 && alignment < LARGE_PAGE_SIZE && paging_large_pages_supported()) {
+        alignment = LARGE_PAGE_SIZE;
+    }
+    
+    void* ptr = kheap_map_pages(pages, alignment);
+    if (!ptr) {
+        kmem_cache_free(page_range_cache, record);
+        paging_unlock();
+        return NULL;
+    }
+    
+    // Remember the size for kfree
+    uint32_t bucket = ((uint32_t)ptr / PAGE_SIZE) % LARGE_HASH_SIZE;
+    record->start = (uint32_t)ptr;
+    record->pages = pages;
+    record->next = large_allocs[bucket];
+    large_allocs[bucket] = record;
+    
+    large_total += pages * PAGE_SIZE;
+    large_count++;
+    paging_unlock();
+    return ptr;
+}
+
+/**
+ * Find the record of a large allocation, NULL if ptr isn't one
+ */
+static page_range_t* large_find(const void* ptr) {
+    if ((uint32_t)ptr & (PAGE_SIZE - 1)) {
+        return NULL;
+    }
+    
+    uint32_t bucket = ((uint32_t)ptr / PAGE_SIZE) % LARGE_HASH_SIZE;
+    for (page_range_t* record = large_allocs[bucket]; record; record = record->next) {
+        if (record->start == (uint32_t)ptr) {
+            return record;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Free a large allocation, returning its frames to the PMM
+ */
+static void kfree_large(page_range_t* record) {
+    uint32_t bucket = (record->start / PAGE_SIZE) % LARGE_HASH_SIZE;
+    
+    // Unlink the record
+    page_range_t** link = &large_allocs[bucket];
+    while (*link != record) {
+        link = &(*link)->next;
+    }
+    *link = record->next;
+    
+    unmap_pages(record->start, record->pages);
+    vm_area_free(record->start);
+    
+    large_total -= record->pages * PAGE_SIZE;
+    large_count--;
+    page_bytes -= record->pages * PAGE_SIZE;
+    kmem_cache_free(page_range_cache, record);
+}
+
+/**
+ * Split a block into two parts, the tail becoming a free block
  */
 static void split_block(block_header_t* block, size_t size) {
     // Check if the block is large enough to split
@@ -100,171 +644,294 @@ static void split_block(block_header_t* block, size_t size) {
     
     // Create a new block after the current one
     block_header_t* new_block = (block_header_t*)((uint32_t)block + size);
-    new_block->size = block->size - size;
     new_block->magic = HEAP_MAGIC;
-    new_block->is_free = 1;
-    new_block->next = block->next;
+    new_block->reserved = 0;
+    block_set_size(new_block, block->size - size);
     
     // Update the current block
-    block->size = size;
-    block->next = new_block;
+    block_set_size(block, size);
     
-    // Update heap statistics
-    heap_free += sizeof(block_header_t);
+    free_list_insert(new_block);
+}
+
+/**
+ * Merge a free block with its free physical neighbours
+ * The block must not be on the free list; returns the merged block
+ */
+static block_header_t* coalesce_block(block_header_t* block) {
+    block_header_t* next = block_next(block);
+    if (next && next->is_free) {
+        free_list_remove(next);
+        block_set_size(block, block->size + next->size);
+    }
+    
+    block_header_t* prev = block_prev(block);
+    if (prev && prev->is_free) {
+        free_list_remove(prev);
+        block_set_size(prev, prev->size + block->size);
+        block = prev;
+    }
+    
+    return block;
 }
 
 /**
  * Initialize the kernel heap
  */
 void kheap_init(void) {
-    console_write_string("Initializing kernel heap...\n");
+    kprintf("Initializing kernel heap...\n");
+    
+    // An eighth of physical memory per arena, as a power of 2 in [2MB, 32MB]
+    uint64_t target = pmm_get_total_memory() / 8;
+    heap_arena_size = HEAP_ARENA_MIN;
+    while (heap_arena_size < HEAP_ARENA_MAX && heap_arena_size < target) {
+        heap_arena_size <<= 1;
+    }
     
-    // Set heap boundaries (4MB initial, 16MB maximum)
-    heap_start = 0x400000;  // 4MB (above identity-mapped kernel area)
-    heap_end = heap_start;
-    heap_max = 0x1000000;   // 16MB
+    heap_arenas = NULL;
+    heap_arena_count = 0;
+    large_total = 0;
+    large_count = 0;
+    page_bytes = 0;
+    peak_footprint = 0;
+    for (uint32_t i = 0; i < LARGE_HASH_SIZE; i++) {
+        large_allocs[i] = NULL;
+    }
     
     // Start with no blocks
-    first_block = NULL;
+    free_list = NULL;
     
-    // Expand the initial heap
-    expand_heap(16);  // 16 pages = 64KB initial heap
+    // Expand the initial heap, which opens the first arena
+    if (!expand_heap(heap_expand_pages * PAGE_SIZE)) {
+        kprintf("ERROR: Cannot create the first heap arena\n");
+        return;
+    }
     
-    console_write_string("Kernel heap initialized.\n");
+    // Set up the small-object caches
+    slab_init();
+    kmalloc_cache_count = 0;
+    kheap_set_size_classes(kmalloc_default_classes,
+                           sizeof(kmalloc_default_classes) / sizeof(kmalloc_default_classes[0]));
+    page_range_cache = kmem_cache_create("page_range", sizeof(page_range_t), 0);
+    
+    kprintf("Kernel heap initialized.\n");
     kheap_print_stats();
 }
 
 /**
- * Allocate memory of a specified size
+ * Front padding needed for a block's payload to be aligned
+ * Non-zero padding is always large enough to become a free block itself
  */
-void* kmalloc(size_t size) {
-    // Adjust size to include header and ensure minimum size
-    size_t total_size = size + sizeof(block_header_t);
+static uint32_t block_align_pad(block_header_t* block, uint32_t alignment) {
+    uint32_t payload = (uint32_t)block + sizeof(block_header_t);
+    uint32_t aligned = (payload + alignment - 1) & ~(alignment - 1);
+    
+    while (aligned != payload && aligned - payload < MIN_BLOCK_SIZE) {
+        aligned += alignment;
+    }
+    
+    return aligned - payload;
+}
+
+/**
+ * Allocate from the block list with the payload aligned to a power of 2
+ */
+static void* heap_alloc(size_t size, uint32_t alignment) {
+    paging_lock();
+    
+    // Adjust size to include header and footer and ensure minimum size
+    size_t total_size = size + BLOCK_OVERHEAD;
     if (total_size < MIN_BLOCK_SIZE) {
         total_size = MIN_BLOCK_SIZE;
     }
     
-    // Align to 4 bytes
-    total_size = (total_size + 3) & ~3;
+    // Align to 8 bytes
+    total_size = (total_size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
     
-    // Find a suitable free block
-    block_header_t* current = first_block;
+    // Find a suitable free block, only free blocks are on the list
+    block_header_t* current = free_list;
     block_header_t* best_fit = NULL;
+    uint32_t pad = 0;
     
     while (current) {
         // Check magic number
         if (current->magic != HEAP_MAGIC) {
-            console_write_string("ERROR: Heap corruption detected\n");
+            kprintf("ERROR: Heap corruption detected\n");
+            paging_unlock();
             return NULL;
         }
         
-        // Check if the block is free and large enough
-        if (current->is_free && current->size >= total_size) {
+        // Check if the block is large enough once aligned
+        pad = block_align_pad(current, alignment);
+        if (current->size >= total_size + pad) {
             best_fit = current;
             break;
         }
         
-        current = current->next;
+        current = current->next_free;
     }
     
     // If no suitable block was found, expand the heap
     if (!best_fit) {
-        // Calculate how many pages we need
-        size_t pages = (total_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        // Worst-case padding
+        size_t needed = total_size;
+        if (alignment > BLOCK_ALIGN) {
+            needed += alignment + MIN_BLOCK_SIZE;
+        }
         
-        // Expand the heap
-        expand_heap(pages);
+        // Expand the heap, the tail block is then large enough
+        best_fit = expand_heap(needed);
+        if (!best_fit) {
+            paging_unlock();
+            return NULL;
+        }
+        pad = block_align_pad(best_fit, alignment);
+    }
+    
+    // Take it off the free list
+    free_list_remove(best_fit);
+    
+    // Split the front padding off as a free block of its own
+    if (pad) {
+        block_header_t* aligned_block = (block_header_t*)((uint32_t)best_fit + pad);
+        aligned_block->magic = HEAP_MAGIC;
+        aligned_block->reserved = 0;
+        aligned_block->is_free = 0;
+        block_set_size(aligned_block, best_fit->size - pad);
         
-        // Try allocation again
-        return kmalloc(size);
+        block_set_size(best_fit, pad);
+        free_list_insert(best_fit);
+        best_fit = aligned_block;
     }
     
     // Split the block if it's too large
     split_block(best_fit, total_size);
     
-    // Mark the block as allocated
-    best_fit->is_free = 0;
-    
     // Update heap statistics
     heap_used += best_fit->size;
     heap_free -= best_fit->size;
+    note_footprint();
+    
+    paging_unlock();
     
     // Return a pointer to the data section
     return (void*)((uint32_t)best_fit + sizeof(block_header_t));
 }
 
 /**
- * Allocate aligned memory
+ * Allocate memory without recording a call site
  */
-void* kmalloc_aligned(size_t size, uint32_t alignment) {
-    // Ensure alignment is a power of 2
-    if (alignment & (alignment - 1)) {
-        return NULL;
+static void* kmalloc_untagged(size_t size) {
+    // Small requests come from the size-class caches
+    if (size <= KMALLOC_MAX_SMALL) {
+        kmem_cache_t* cache = kmalloc_class_cache[(size + KHEAP_CLASS_GRANULE - 1) / KHEAP_CLASS_GRANULE];
+        if (cache) {
+            return kmem_cache_alloc(cache);
+        }
     }
     
-    // Allocate more memory to ensure alignment can be satisfied
-    size_t padding = alignment + sizeof(void*);
-    uint8_t* raw_mem = (uint8_t*)kmalloc(size + padding);
+    // Large requests get their own pages
+    if (size >= KMALLOC_LARGE_MIN || (size % PAGE_SIZE) == 0) {
+        return kmalloc_large(size, PAGE_SIZE);
+    }
     
-    if (!raw_mem) {
+    return heap_alloc(size, BLOCK_ALIGN);
+}
+
+/**
+ * Allocate memory of a specified size
+ */
+void* kmalloc(size_t size) {
+    PROFILE_SCOPE(kmalloc);
+    
+    void* ptr = kmalloc_untagged(size);
+    heap_note_alloc(ptr, size, KHEAP_CALLER);
+    return ptr;
+}
+
+/**
+ * Allocate aligned memory without recording a call site
+ */
+static void* kmalloc_aligned_untagged(size_t size, uint32_t alignment) {
+    // Ensure alignment is a power of 2
+    if (alignment & (alignment - 1)) {
         return NULL;
     }
     
-    // Calculate aligned address
-    uint8_t* aligned_mem = (uint8_t*)(((uint32_t)raw_mem + sizeof(void*) + alignment - 1) & ~(alignment - 1));
+    // Every allocation is at least 8-byte aligned
+    if (alignment <= BLOCK_ALIGN) {
+        return kmalloc_untagged(size);
+    }
     
-    // Store the original pointer just before the aligned memory
-    *((uint8_t**)aligned_mem - 1) = raw_mem;
+    // Page-aligned and large requests map pages at the alignment directly,
+    // so a 4KB-aligned page costs exactly one page
+    if (alignment >= PAGE_SIZE || size >= KMALLOC_LARGE_MIN || (size % PAGE_SIZE) == 0) {
+        return kmalloc_large(size, alignment < PAGE_SIZE ? PAGE_SIZE : alignment);
+    }
     
-    return aligned_mem;
+    // Otherwise pick a block where the aligned payload fits
+    return heap_alloc(size, alignment);
+}
+
+/**
+ * Allocate aligned memory
+ */
+void* kmalloc_aligned(size_t size, uint32_t alignment) {
+    void* ptr = kmalloc_aligned_untagged(size, alignment);
+    heap_note_alloc(ptr, size, KHEAP_CALLER);
+    return ptr;
 }
 
 /**
  * Allocate zeroed memory
  */
 void* kzalloc(size_t size) {
-    void* ptr = kmalloc(size);
+    void* ptr = kmalloc_untagged(size);
     
     if (ptr) {
         // Zero out the allocated memory
-        uint8_t* byte_ptr = (uint8_t*)ptr;
-        for (size_t i = 0; i < size; i++) {
-            byte_ptr[i] = 0;
-        }
+        memset(ptr, 0, size);
     }
     
+    heap_note_alloc(ptr, size, KHEAP_CALLER);
     return ptr;
 }
 
 /**
- * Merge adjacent free blocks
+ * Free memory without touching its tag
  */
-static void merge_free_blocks(void) {
-    block_header_t* current = first_block;
+static void kfree_untagged(void* ptr) {
+    if (!ptr) {
+        return;
+    }
     
-    while (current && current->next) {
-        // Check magic numbers
-        if (current->magic != HEAP_MAGIC || current->next->magic != HEAP_MAGIC) {
-            console_write_string("ERROR: Heap corruption detected during merge\n");
+    // Slab objects skip the paging lock, their cache has a per-CPU fast path
+    // (kmem_cache_of only reads the header of a slab in the slab map, and a
+    // slab holding a live object is never released)
+    // Large allocations are page aligned, so an unaligned pointer is never one
+    if ((uint32_t)ptr & (PAGE_SIZE - 1)) {
+        kmem_cache_t* cache = kmem_cache_of(ptr);
+        if (cache) {
+            kmem_cache_free(cache, ptr);
             return;
         }
-        
-        // If both blocks are free, merge them
-        if (current->is_free && current->next->is_free) {
-            current->size += current->next->size;
-            current->next = current->next->next;
-            continue;  // Check if we can merge again
-        }
-        
-        current = current->next;
     }
-}
-
-/**
- * Free allocated memory
- */
-void kfree(void* ptr) {
-    if (!ptr) {
+    
+    paging_lock();
+    
+    // Large allocations are unmapped
+    page_range_t* record = large_find(ptr);
+    if (record) {
+        kfree_large(record);
+        paging_unlock();
+        return;
+    }
+    
+    // Slab objects go back to their cache
+    kmem_cache_t* cache = kmem_cache_of(ptr);
+    if (cache) {
+        kmem_cache_free(cache, ptr);
+        paging_unlock();
         return;
     }
     
@@ -273,116 +940,549 @@ void kfree(void* ptr) {
     
     // Check magic number
     if (block->magic != HEAP_MAGIC) {
-        console_write_string("ERROR: Attempt to free invalid memory block\n");
+        kprintf("ERROR: Attempt to free invalid memory block\n");
+        paging_unlock();
         return;
     }
     
     // Check if the block is already free
     if (block->is_free) {
-        console_write_string("WARNING: Attempt to free already freed memory\n");
+        kprintf("WARNING: Attempt to free already freed memory\n");
+        paging_unlock();
         return;
     }
     
-    // Mark the block as free
-    block->is_free = 1;
-    
     // Update heap statistics
     heap_used -= block->size;
     heap_free += block->size;
     
-    // Merge adjacent free blocks
-    merge_free_blocks();
+    // Merge with free neighbours and put the result on the free list
+    free_list_insert(coalesce_block(block));
+    
+    paging_unlock();
+}
+
+/**
+ * Free allocated memory
+ */
+void kfree(void* ptr) {
+    PROFILE_SCOPE(kfree);
+    
+    heap_note_free(ptr);
+    kfree_untagged(ptr);
 }
 
 /**
  * Free aligned memory
  */
-static void kfree_aligned(void* ptr) {
-    if (!ptr) {
+void kfree_aligned(void* ptr) {
+    // Aligned allocations are ordinary blocks or pages
+    kfree(ptr);
+}
+
+/**
+ * Shrink an allocated block to total_size, returning the tail to the free list
+ */
+static void block_trim(block_header_t* block, size_t total_size) {
+    if (block->size < total_size + MIN_BLOCK_SIZE) {
         return;
     }
     
-    // Get the original pointer
-    void* original = *((void**)ptr - 1);
+    size_t old_size = block->size;
+    split_block(block, total_size);
+    
+    // The tail may now touch a free block
+    block_header_t* tail = block_next(block);
+    free_list_remove(tail);
+    free_list_insert(coalesce_block(tail));
     
-    // Free the original allocation
-    kfree(original);
+    // Update heap statistics
+    heap_used -= old_size - block->size;
+    heap_free += old_size - block->size;
 }
 
 /**
- * Reallocate memory to a new size
+ * Resize a block list allocation in place
+ * Returns false if the block has to move
  */
-void* krealloc(void* ptr, size_t size) {
+static bool krealloc_block(block_header_t* block, size_t size) {
+    // Same size calculation as heap_alloc
+    size_t total_size = size + BLOCK_OVERHEAD;
+    if (total_size < MIN_BLOCK_SIZE) {
+        total_size = MIN_BLOCK_SIZE;
+    }
+    total_size = (total_size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    
+    if (total_size > block->size) {
+        block_header_t* next = block_next(block);
+        
+        // The last block of an arena can grow by expanding the arena behind it
+        if (!next) {
+            if (!arena_expand(block_arena(block), (total_size - block->size + PAGE_SIZE - 1) / PAGE_SIZE)) {
+                return false;
+            }
+            next = block_next(block);
+        }
+        
+        // Absorb a free successor that is large enough
+        if (!next || !next->is_free || block->size + next->size < total_size) {
+            return false;
+        }
+        
+        free_list_remove(next);
+        block_set_size(block, block->size + next->size);
+        
+        // Update heap statistics
+        heap_used += next->size;
+        heap_free -= next->size;
+        note_footprint();
+    }
+    
+    // Give back what's left over
+    block_trim(block, total_size);
+    return true;
+}
+
+/**
+ * Resize a large allocation in place
+ * Returns false if it has to move
+ */
+static bool krealloc_large(page_range_t* record, size_t size) {
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t end_addr = record->start + record->pages * PAGE_SIZE;
+    
+    if (pages < record->pages) {
+        // Unmap the tail
+        uint32_t extra = record->pages - pages;
+        unmap_pages(end_addr - extra * PAGE_SIZE, extra);
+        if (!vm_area_shrink(record->start, pages)) {
+            // Without a free-range record the tail stays reserved, but unmapped, until kfree
+            return true;
+        }
+        
+        record->pages = pages;
+        large_total -= extra * PAGE_SIZE;
+        page_bytes -= extra * PAGE_SIZE;
+    } else if (pages > record->pages) {
+        // Grow into free virtual space directly above
+        uint32_t extra = pages - record->pages;
+        if (!vm_area_extend(record->start, extra)) {
+            return false;
+        }
+        
+        if (!map_pages(end_addr, extra)) {
+            vm_area_shrink(record->start, record->pages);
+            return false;
+        }
+        
+        record->pages = pages;
+        large_total += extra * PAGE_SIZE;
+        page_bytes += extra * PAGE_SIZE;
+        note_footprint();
+    }
+    
+    return true;
+}
+
+/**
+ * Reallocate memory without touching its tag
+ */
+static void* krealloc_untagged(void* ptr, size_t size) {
     if (!ptr) {
-        return kmalloc(size);
+        return kmalloc_untagged(size);
     }
     
     if (size == 0) {
-        kfree(ptr);
+        kfree_untagged(ptr);
         return NULL;
     }
     
-    // Get the block header
-    block_header_t* block = (block_header_t*)((uint32_t)ptr - sizeof(block_header_t));
+    paging_lock();
     
-    // Check magic number
-    if (block->magic != HEAP_MAGIC) {
-        console_write_string("ERROR: Attempt to reallocate invalid memory block\n");
+    size_t current_size;
+    page_range_t* record = large_find(ptr);
+    kmem_cache_t* cache = record ? NULL : kmem_cache_of(ptr);
+    
+    if (record) {
+        // Large allocations own whole pages, small results move to a slab
+        current_size = record->pages * PAGE_SIZE;
+        if (size > KMALLOC_MAX_SMALL && krealloc_large(record, size)) {
+            paging_unlock();
+            return ptr;
+        }
+    } else if (cache) {
+        // Usable size of a slab object is its class size
+        current_size = cache->object_size;
+        if (size <= current_size) {
+            paging_unlock();
+            return ptr;
+        }
+    } else {
+        // Get the block header
+        block_header_t* block = (block_header_t*)((uint32_t)ptr - sizeof(block_header_t));
+        
+        // Check magic number
+        if (block->magic != HEAP_MAGIC) {
+            kprintf("ERROR: Attempt to reallocate invalid memory block\n");
+            paging_unlock();
+            return NULL;
+        }
+        
+        // Calculate usable size in the current block
+        current_size = block->size - BLOCK_OVERHEAD;
+        if (krealloc_block(block, size)) {
+            paging_unlock();
+            return ptr;
+        }
+    }
+    
+    // Need to move the allocation
+    void* new_ptr = kmalloc_untagged(size);
+    if (!new_ptr) {
+        paging_unlock();
         return NULL;
     }
     
-    // Calculate usable size in the current block
-    size_t current_size = block->size - sizeof(block_header_t);
+    // Copy data from the old allocation to the new one
+    memcpy(new_ptr, ptr, size < current_size ? size : current_size);
+    
+    // Free the old allocation
+    kfree_untagged(ptr);
+    
+    paging_unlock();
+    return new_ptr;
+}
+
+/**
+ * Reallocate memory to a new size
+ * Blocks are resized in place when possible; a moved allocation is only
+ * guaranteed the default 8-byte alignment
+ */
+void* krealloc(void* ptr, size_t size) {
+    void* new_ptr = krealloc_untagged(ptr, size);
     
-    // If the new size is smaller, we can just return the same block
-    if (size <= current_size) {
-        // We could split the block here, but for simplicity we'll skip that
-        return ptr;
+    // On failure the old allocation is still live and keeps its tag
+    if (new_ptr || size == 0) {
+        heap_note_free(ptr);
+        heap_note_alloc(new_ptr, size, KHEAP_CALLER);
     }
     
-    // Need to allocate a larger block
-    void* new_ptr = kmalloc(size);
-    if (!new_ptr) {
+    return new_ptr;
+}
+
+/**
+ * Find or create the cache for a size class
+ * Caller holds the paging lock
+ */
+static kmem_cache_t* class_cache(uint32_t size) {
+    for (uint32_t i = 0; i < kmalloc_cache_count; i++) {
+        if (kmalloc_caches[i]->object_size == size) {
+            return kmalloc_caches[i];
+        }
+    }
+    
+    if (kmalloc_cache_count >= KMALLOC_MAX_CACHES) {
+        kprintf("ERROR: Too many kmalloc size classes created\n");
         return NULL;
     }
     
-    // Copy data from the old block to the new one
-    uint8_t* src = (uint8_t*)ptr;
-    uint8_t* dst = (uint8_t*)new_ptr;
-    for (size_t i = 0; i < current_size; i++) {
-        dst[i] = src[i];
+    char* name = kmalloc_cache_names[kmalloc_cache_count];
+    ksnprintf(name, sizeof(kmalloc_cache_names[0]), "kmalloc-%u", size);
+    kmem_cache_t* cache = kmem_cache_create(name, size, 0);
+    if (cache) {
+        kmalloc_caches[kmalloc_cache_count++] = cache;
+    }
+    return cache;
+}
+
+/**
+ * Replace the size classes of small allocations
+ */
+bool kheap_set_size_classes(const uint32_t* sizes, uint32_t count) {
+    if (count == 0 || count > KHEAP_MAX_CLASSES || sizes[count - 1] != KMALLOC_MAX_SMALL) {
+        kprintf("ERROR: Size classes must end at %u bytes, at most %u of them\n",
+                KMALLOC_MAX_SMALL, KHEAP_MAX_CLASSES);
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (sizes[i] % KHEAP_CLASS_GRANULE != 0 || sizes[i] == 0 || (i > 0 && sizes[i] <= sizes[i - 1])) {
+            kprintf("ERROR: Size classes must be ascending multiples of %u bytes\n", KHEAP_CLASS_GRANULE);
+            return false;
+        }
     }
     
-    // Free the old block
-    kfree(ptr);
+    paging_lock();
     
-    return new_ptr;
+    kmem_cache_t* caches[KHEAP_MAX_CLASSES];
+    for (uint32_t i = 0; i < count; i++) {
+        caches[i] = class_cache(sizes[i]);
+        if (!caches[i]) {
+            paging_unlock();
+            return false;
+        }
+    }
+    
+    // Each slot switches on its own, a racing kmalloc gets the old or the new class
+    uint32_t class = 0;
+    for (uint32_t slot = 0; slot <= KMALLOC_MAX_SMALL / KHEAP_CLASS_GRANULE; slot++) {
+        while (sizes[class] < slot * KHEAP_CLASS_GRANULE) {
+            class++;
+        }
+        kmalloc_class_cache[slot] = caches[class];
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        kmalloc_classes[i] = sizes[i];
+    }
+    kmalloc_class_count = count;
+    
+    // Caches no class uses any more give their memory back as their objects are freed
+    for (uint32_t i = 0; i < kmalloc_cache_count; i++) {
+        bool used = false;
+        for (uint32_t j = 0; j < count; j++) {
+            used |= caches[j] == kmalloc_caches[i];
+        }
+        kmem_cache_set_retired(kmalloc_caches[i], !used);
+    }
+    
+    paging_unlock();
+    return true;
+}
+
+/**
+ * Get the size classes of small allocations
+ */
+uint32_t kheap_get_size_classes(uint32_t* sizes, uint32_t max) {
+    paging_lock();
+    uint32_t count = kmalloc_class_count < max ? kmalloc_class_count : max;
+    for (uint32_t i = 0; i < count; i++) {
+        sizes[i] = kmalloc_classes[i];
+    }
+    paging_unlock();
+    
+    return count;
+}
+
+/**
+ * Check whether a size class already has a cache
+ */
+bool kheap_has_class_cache(uint32_t size) {
+    paging_lock();
+    bool found = false;
+    for (uint32_t i = 0; i < kmalloc_cache_count; i++) {
+        found |= kmalloc_caches[i]->object_size == size;
+    }
+    paging_unlock();
+    
+    return found;
+}
+
+/**
+ * Get how many more size class caches can be created
+ */
+uint32_t kheap_class_caches_left(void) {
+    return KMALLOC_MAX_CACHES - kmalloc_cache_count;
+}
+
+/**
+ * Set the least number of pages the block heap grows by
+ */
+void kheap_set_expand_step(uint32_t pages) {
+    if (pages == 0 || pages > KHEAP_EXPAND_MAX_PAGES) {
+        kprintf("ERROR: Heap expansion step must be 1 to %u pages\n", KHEAP_EXPAND_MAX_PAGES);
+        return;
+    }
+    
+    heap_expand_pages = pages;
+}
+
+/**
+ * Get the least number of pages the block heap grows by
+ */
+uint32_t kheap_get_expand_step(void) {
+    return heap_expand_pages;
+}
+
+/**
+ * Get how many times the block heap has grown
+ */
+uint32_t kheap_get_expansions(void) {
+    return heap_expansions;
 }
 
 /**
  * Get heap statistics
  */
 void kheap_get_stats(size_t* total, size_t* used, size_t* free) {
-    if (total) *total = heap_total;
-    if (used) *used = heap_used;
-    if (free) *free = heap_free;
+    paging_lock();
+    
+    size_t slab_total, slab_used;
+    slab_get_stats(&slab_total, &slab_used);
+    
+    if (total) *total = heap_total + slab_total + large_total;
+    if (used) *used = heap_used + slab_used + large_total;
+    if (free) *free = heap_free + (slab_total - slab_used);
+    
+    paging_unlock();
 }
 
 /**
  * Print heap statistics
  */
 void kheap_print_stats(void) {
-    console_write_string("Kernel Heap Statistics:\n");
+    size_t total, used, free;
+    kheap_get_stats(&total, &used, &free);
+    
+    kprintf("Kernel Heap Statistics:\n");
+    
+    kprintf("  Total heap size: %d KB\n", (int)(total / 1024));
+    
+    kprintf("  Used heap size:  %d KB\n", (int)(used / 1024));
     
-    console_write_string("  Total heap size: ");
-    console_write_int((int)(heap_total / 1024));
-    console_write_string(" KB\n");
+    kprintf("  Free heap size:  %d KB\n", (int)(free / 1024));
     
-    console_write_string("  Used heap size:  ");
-    console_write_int((int)(heap_used / 1024));
-    console_write_string(" KB\n");
+    kprintf("  Block arenas:    %u x %u KB\n", heap_arena_count, heap_arena_size / 1024);
     
-    console_write_string("  Free heap size:  ");
-    console_write_int((int)(heap_free / 1024));
-    console_write_string(" KB\n");
+    slab_print_stats();
+}
+/**
+ * Get the histogram bucket of a free block size
+ */
+static inline uint32_t free_bucket(size_t size) {
+    uint32_t bucket = 0;
+    while (bucket < KHEAP_FREE_BUCKETS - 1 && size >= (64u << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * Get detailed heap statistics
+ */
+void kheap_get_detailed_stats(kheap_detailed_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    
+    paging_lock();
+    
+    kheap_get_stats(&stats->total, &stats->used, &stats->free);
+    slab_get_stats(&stats->slab_total, &stats->slab_used);
+    
+    for (block_header_t* block = free_list; block; block = block->next_free) {
+        stats->free_blocks++;
+        stats->block_free += block->size;
+        stats->free_histogram[free_bucket(block->size)]++;
+        if (block->size > stats->largest_free_block) {
+            stats->largest_free_block = block->size;
+        }
+    }
+    
+    // Scale both down so the per-mille product fits in 32 bits
+    size_t largest = stats->largest_free_block;
+    size_t free = stats->block_free;
+    while (free > 0x3FFFFF) {
+        free >>= 1;
+        largest >>= 1;
+    }
+    stats->fragmentation = free ? 1000 - (uint32_t)(largest * 1000 / free) : 0;
+    
+    stats->peak_footprint = peak_footprint;
+    stats->large_total = large_total;
+    stats->large_count = large_count;
+    stats->arenas = heap_arena_count;
+    stats->arena_size = heap_arena_size;
+    stats->expansions = heap_expansions;
+    stats->expand_step = heap_expand_pages;
+    
+    paging_unlock();
+}
+
+/**
+ * Print detailed heap statistics
+ */
+void kheap_print_detailed_stats(void) {
+    kheap_detailed_stats_t stats;
+    kheap_get_detailed_stats(&stats);
+    
+    kprintf("Kernel Heap Details:\n");
+    kprintf("  Peak footprint:  %u KB\n", stats.peak_footprint / 1024);
+    kprintf("  Free blocks:     %u (%u KB, largest %u bytes)\n",
+            stats.free_blocks, stats.block_free / 1024, stats.largest_free_block);
+    kprintf("  Fragmentation:   %u.%u%%\n", stats.fragmentation / 10, stats.fragmentation % 10);
+    kprintf("  Slabs:           %u KB, %u KB in use\n", stats.slab_total / 1024, stats.slab_used / 1024);
+    kprintf("  Large:           %u allocations, %u KB\n", stats.large_count, stats.large_total / 1024);
+    kprintf("  Expansions:      %u (step %u pages)\n", stats.expansions, stats.expand_step);
+    
+    kprintf("  Free block sizes:");
+    for (uint32_t i = 0; i < KHEAP_FREE_BUCKETS; i++) {
+        if (stats.free_histogram[i]) {
+            kprintf(" %u+:%u", 32u << i, stats.free_histogram[i]);
+        }
+    }
+    kprintf("\n");
+}
+
+/**
+ * Get the allocation sites holding the most live bytes
+ */
+uint32_t kheap_top_sites(kheap_site_t* sites, uint32_t max) {
+#ifdef NKOF_HEAP_TAGS
+    uint32_t count = 0;
+    uint32_t flags = spin_lock_irqsave(&tag_lock);
+    
+    // Insertion into the sorted output, the site table is small
+    for (uint32_t i = 0; i < TAG_SITES; i++) {
+        kheap_site_t* site = &tag_sites[i];
+        if (site->site == NULL || site->live_count == 0) {
+            continue;
+        }
+        
+        uint32_t pos = count < max ? count : max;
+        while (pos > 0 && sites[pos - 1].live_bytes < site->live_bytes) {
+            if (pos < max) {
+                sites[pos] = sites[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < max) {
+            sites[pos] = *site;
+            if (count < max) {
+                count++;
+            }
+        }
+    }
+    
+    uint32_t dropped = tags_dropped;
+    spin_unlock_irqrestore(&tag_lock, flags);
+    
+    if (dropped) {
+        kprintf("WARNING: %u allocations were not tagged, the tag table was full\n", dropped);
+    }
+    return count;
+#else
+    (void)sites;
+    (void)max;
+    return 0;
+#endif
+}
+
+/**
+ * Print the allocation sites holding the most live bytes
+ */
+void kheap_print_top_sites(uint32_t max) {
+#ifdef NKOF_HEAP_TAGS
+    kheap_site_t sites[16];
+    if (max > 16) {
+        max = 16;
+    }
+    
+    uint32_t count = kheap_top_sites(sites, max);
+    kprintf("Top allocation sites:\n");
+    for (uint32_t i = 0; i < count; i++) {
+        kprintf("  %p: %u live, %u bytes (%u allocations in total)\n",
+                sites[i].site, sites[i].live_count, sites[i].live_bytes, sites[i].total_count);
+    }
+#else
+    (void)max;
+    kprintf("Allocation site tags are off (build with \"./build.sh tags\")\n");
+#endif
 }
\ No newline at end of file
@@ -2,23 +2,414 @@
  * NKOF Paging Implementation
  *
  * This file implements the paging system for virtual memory management.
+ * Paging uses PAE, which the kernel requires: entries are 64-bit, so any
+ * frame the PMM hands out can be mapped, including those above 4GB.
+ * An address space is a PDPT and four page directories, which are handled
+ * as one directory of 2048 entries. The CPU reads the PDPT when CR3 is
+ * loaded, so its entries are set when the address space is made and never
+ * change. The kernel and the PMM's metadata are identity mapped with 2MB
+ * pages, and callers can map other 2MB-aligned ranges the same way.
+ * A 4KB operation on part of a 2MB page first splits it into a page table.
+ * Kernel mappings are global when the CPU supports PGE, so they stay in the
+ * TLB across CR3 loads. Reserved ranges get frames from the page fault
+ * handler the first time each page is touched.
+ *
+ * All CPUs share the kernel page directory. Changes are made under the
+ * paging lock, and removing a present translation shoots it down on the
+ * other CPUs. The lock is recursive because the public functions call
+ * each other and the heap takes demand-paging faults while holding it.
+ *
+ * Once paging is on, page tables are reached through the recursive entries
+ * of the loaded directory, which point at its four directories. Another
+ * directory is edited by pointing the FOREIGN_INDEX entries at it, which
+ * gives it a recursive window of its own. Every directory shares the
+ * kernel's page tables (the identity map and everything from
+ * KERNEL_PDE_START up), and a change to a kernel PDE is
+ * written into all of them. paging_clone_directory copies only the user
+ * page tables: the pages themselves are shared read-only and copied by
+ * the fault handler when one side writes to them.
  */
 
 #include "../include/paging.h"
 #include "../include/pmm.h"
-#include "../include/console.h"
+#include "../include/klog.h"
+#include "../include/profile.h"
+#include "../include/string.h"
+#include "../include/cpu.h"
+#include "../include/smp.h"
+#include "../include/spinlock.h"
+#include "../include/interrupts.h"
+
+// Most address spaces alive at once, each needs its kernel entries kept in sync
+#define PAGING_MAX_DIRECTORIES 64
+
+// PDPTs live in the kernel image, CR3 can only point below 4GB
+// A slot is free while its first entry is clear
+static page_pdpt_t pdpts[PAGING_MAX_DIRECTORIES];
+
+// Address space loaded on each CPU
+static page_pdpt_t* current_directory[SMP_MAX_CPUS];
+
+// Address space built by paging_init, loaded until another one is
+static page_pdpt_t* kernel_directory = NULL;
+
+// First of the four recursive entries (they map the four directories onto themselves)
+#define RECURSIVE_INDEX 2044
+
+// Page tables and directory of the loaded address space, through the recursive entries
+#define ACTIVE_TABLES    ((page_table_t*)0xFF800000)
+#define ACTIVE_DIRECTORY ((page_directory_t*)0xFFFFC000)
+
+// First of the four directory entries pointed at another address space to edit it
+#define FOREIGN_INDEX 2040
+#define FOREIGN_TABLES    ((page_table_t*)0xFF000000)
+#define FOREIGN_DIRECTORY ((page_directory_t*)0xFF7FC000)
+
+// Page for reaching a frame that isn't mapped anywhere, under the paging lock
+#define SCRATCH_PAGE 0xFEA00000
+
+// Per-CPU pages for the same without the lock, one per CPU right above it
+#define TEMPORARY_PAGES (SCRATCH_PAGE + PAGE_SIZE)
+
+// Directory entries from here up (and the identity map) map the kernel in every address space
+#define KERNEL_PDE_START 1536
+
+// Directory entries of the low identity map, which covers the kernel and the PMM's metadata
+static uint32_t identity_pdes = 2;
+
+static page_pdpt_t* directories[PAGING_MAX_DIRECTORIES];
+static uint32_t directory_count = 0;
+
+// Set once CR0.PG is on, before that tables are reached by physical address
+static bool paging_enabled = false;
+
+// Set when CR4.PGE is enabled and global pages survive CR3 loads
+static bool pge_enabled = false;
+
+// Maximum number of reserved (demand-paged) ranges
+#define PAGING_MAX_RESERVED 8
+
+// Virtual range whose pages are committed on first access
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;                // Flags for pages mapped on fault
+    bool zero_fill;                // Zero committed pages
+} reserved_range_t;
+
+static reserved_range_t reserved_ranges[PAGING_MAX_RESERVED];
+static uint32_t reserved_count = 0;
+
+// Paging lock, also taken by the heap and slab allocator
+static spinlock_t mm_lock = SPINLOCK_INIT;
+static volatile uint32_t mm_lock_owner = 0xFFFFFFFF;  // CPU holding the lock
+static uint32_t mm_lock_depth = 0;
+static uint32_t mm_lock_flags = 0;                     // Interrupt state to restore
+
+// Most pages a TLB batch flushes one by one before falling back to a full flush
+#define TLB_BATCH_MAX 32
+
+// Stale translations collected while changing a range of mappings
+typedef struct {
+    uint32_t addrs[TLB_BATCH_MAX];
+    uint32_t count;
+    bool global;                   // A stale entry was global
+} tlb_batch_t;
+
+/**
+ * Record a replaced entry that may still be cached in the TLB
+ */
+static inline void tlb_batch_add(tlb_batch_t* batch, uint32_t virtual_addr, uint64_t old_entry) {
+    // Non-present entries are never cached
+    if (!(old_entry & PAGE_PRESENT)) {
+        return;
+    }
+    
+    if (old_entry & PAGE_GLOBAL) {
+        batch->global = true;
+    }
+    if (batch->count < TLB_BATCH_MAX) {
+        batch->addrs[batch->count] = virtual_addr;
+    }
+    batch->count++;
+}
 
-// Current page directory
-static page_directory_t* current_directory = NULL;
+/**
+ * Invalidate everything collected in a TLB batch
+ */
+static void tlb_batch_flush(tlb_batch_t* batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    
+    if (batch->count <= TLB_BATCH_MAX) {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            paging_flush_tlb_page(batch->addrs[i]);
+        }
+    } else if (batch->global) {
+        paging_flush_tlb_global();
+    } else {
+        paging_flush_tlb();
+    }
+    
+    batch->count = 0;
+    batch->global = false;
+    
+    smp_tlb_shootdown();
+}
+
+/**
+ * Take the paging lock
+ * Interrupts stay off while it's held. Waiting CPUs service TLB shootdowns
+ * so the holder can finish one.
+ */
+void paging_lock(void) {
+    uint32_t flags = interrupts_save();
+    uint32_t cpu = smp_cpu_index();
+    
+    if (mm_lock_owner == cpu) {
+        mm_lock_depth++;
+        return;
+    }
+    
+    while (!spin_trylock(&mm_lock)) {
+        smp_tlb_service();
+        asm volatile ("pause");
+    }
+    
+    mm_lock_owner = cpu;
+    mm_lock_depth = 1;
+    mm_lock_flags = flags;
+}
 
-// Recursive mapping index (maps the page directory to itself)
-#define RECURSIVE_INDEX 1023
+/**
+ * Release the paging lock
+ */
+void paging_unlock(void) {
+    if (--mm_lock_depth > 0) {
+        return;
+    }
+    
+    uint32_t flags = mm_lock_flags;
+    mm_lock_owner = 0xFFFFFFFF;
+    spin_unlock(&mm_lock);
+    interrupts_restore(flags);
+}
+
+// Half of a 64-bit entry, for writing one without a 64-bit store
+typedef uint32_t __attribute__((may_alias)) entry_half_t;
+
+/**
+ * Write a table or directory entry so the CPU never walks a half-written one
+ * A present entry gets its low half (the present bit) last when it's made
+ * and first when it's removed
+ */
+static inline void set_entry(uint64_t* entry, uint64_t value) {
+    volatile entry_half_t* half = (volatile entry_half_t*)entry;
+    uint64_t old = *entry;
+    
+    if ((uint32_t)(old >> 32) == (uint32_t)(value >> 32)) {
+        half[0] = (uint32_t)value;
+    } else if (!(old & PAGE_PRESENT)) {
+        half[1] = (uint32_t)(value >> 32);
+        half[0] = (uint32_t)value;
+    } else if (!(value & PAGE_PRESENT)) {
+        half[0] = (uint32_t)value;
+        half[1] = (uint32_t)(value >> 32);
+    } else {
+        // Present to present with another frame: one locked 8-byte exchange
+        __atomic_exchange_n(entry, value, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Check if a directory entry maps a 2MB page
+ */
+static inline bool pde_is_large(uint64_t pde) {
+    return (pde & (PAGE_PRESENT | PAGE_SIZE_BIT)) == (PAGE_PRESENT | PAGE_SIZE_BIT);
+}
+
+/**
+ * Get the frame a 2MB page directory entry maps
+ */
+static inline uint64_t large_frame(uint64_t pde) {
+    return pde & PAGE_FRAME_MASK & ~(uint64_t)(LARGE_PAGE_SIZE - 1);
+}
+
+/**
+ * Check if a directory entry belongs to the kernel and is the same in every directory
+ * The last eight entries are the foreign window and the recursive entries, which are not
+ */
+static inline bool pde_is_kernel(uint32_t pd_index) {
+    return pd_index < identity_pdes || (pd_index >= KERNEL_PDE_START && pd_index < FOREIGN_INDEX);
+}
+
+/**
+ * Get the address space loaded on this CPU
+ */
+static inline page_pdpt_t* loaded_directory(void) {
+    page_pdpt_t* dir = current_directory[smp_cpu_index()];
+    return dir ? dir : kernel_directory;
+}
+
+/**
+ * Get the directories of an address space by physical address (they are contiguous)
+ * Only usable before paging is on, when tables are low
+ */
+static inline page_directory_t* directory_frames(page_pdpt_t* pdpt) {
+    return (page_directory_t*)(uint32_t)(pdpt->entries[0] & PAGE_FRAME_MASK);
+}
+
+/**
+ * Get a pointer to the loaded directory's entries
+ */
+static inline page_directory_t* active_directory(void) {
+    return paging_enabled ? ACTIVE_DIRECTORY : directory_frames(loaded_directory());
+}
+
+/**
+ * Get a pointer to the page table behind a present, non-2MB directory entry
+ * dir is the loaded or the foreign directory, as returned by active_directory or foreign_attach
+ */
+static inline page_table_t* table_of(page_directory_t* dir, uint32_t pd_index) {
+    if (!paging_enabled) {
+        return (page_table_t*)(uint32_t)(dir->entries[pd_index] & PAGE_FRAME_MASK);
+    }
+    return dir == FOREIGN_DIRECTORY ? &FOREIGN_TABLES[pd_index] : &ACTIVE_TABLES[pd_index];
+}
+
+/**
+ * Make another address space reachable through the foreign window
+ * Caller holds the paging lock, one address space is attached at a time
+ */
+static page_directory_t* foreign_attach(page_pdpt_t* pdpt) {
+    if (!paging_enabled) {
+        return directory_frames(pdpt);
+    }
+    if (pdpt == loaded_directory()) {
+        return ACTIVE_DIRECTORY;
+    }
+    
+    // The window's translations are not global, a plain flush drops the last address space
+    for (uint32_t i = 0; i < 4; i++) {
+        set_entry(&ACTIVE_DIRECTORY->entries[FOREIGN_INDEX + i],
+                  (pdpt->entries[i] & PAGE_FRAME_MASK) | PAGE_PRESENT | PAGE_WRITABLE);
+    }
+    paging_flush_tlb();
+    return FOREIGN_DIRECTORY;
+}
+
+/**
+ * Close the foreign window
+ */
+static void foreign_detach(void) {
+    // Stale translations are harmless, the next attach flushes them
+    if (paging_enabled) {
+        for (uint32_t i = 0; i < 4; i++) {
+            set_entry(&ACTIVE_DIRECTORY->entries[FOREIGN_INDEX + i], 0);
+        }
+    }
+}
+
+/**
+ * Map a frame at the scratch page and return a pointer to it
+ * Caller holds the paging lock
+ */
+static void* scratch_map(uint64_t phys) {
+    if (!paging_enabled) {
+        return (void*)(uint32_t)phys;
+    }
+    
+    set_entry(&table_of(ACTIVE_DIRECTORY, PD_INDEX(SCRATCH_PAGE))->entries[PT_INDEX(SCRATCH_PAGE)],
+              phys | PAGE_PRESENT | PAGE_WRITABLE);
+    paging_flush_tlb_page(SCRATCH_PAGE);
+    return (void*)SCRATCH_PAGE;
+}
+
+/**
+ * Map a frame at this CPU's temporary page
+ */
+void* paging_map_temporary(uint64_t physical_addr) {
+    if (!paging_enabled) {
+        return (void*)(uint32_t)physical_addr;
+    }
+    
+    // The page is this CPU's alone and interrupts are off, so no lock is needed
+    uint32_t page = TEMPORARY_PAGES + smp_cpu_index() * PAGE_SIZE;
+    set_entry(&table_of(ACTIVE_DIRECTORY, PD_INDEX(page))->entries[PT_INDEX(page)],
+              (physical_addr & PAGE_FRAME_MASK) | PAGE_PRESENT | PAGE_WRITABLE);
+    paging_flush_tlb_page(page);
+    return (void*)(page + (uint32_t)(physical_addr & 0xFFF));
+}
+
+/**
+ * Remove this CPU's temporary mapping
+ */
+void paging_unmap_temporary(void* addr) {
+    if (!paging_enabled) {
+        return;
+    }
+    
+    uint32_t page = (uint32_t)addr & 0xFFFFF000;
+    set_entry(&table_of(ACTIVE_DIRECTORY, PD_INDEX(page))->entries[PT_INDEX(page)], 0);
+    paging_flush_tlb_page(page);
+}
+
+/**
+ * Allocate a cleared frame for a page table
+ */
+static uint64_t alloc_table_frame(void) {
+    // Before paging is on, tables are reached by physical address and must be low
+    if (!paging_enabled) {
+        uint32_t low = pmm_alloc_low_pages(0);
+        if (low != 0) {
+            memset((void*)low, 0, PAGE_SIZE);
+        }
+        return low;
+    }
+    
+    uint64_t frame = pmm_take_zeroed_page();
+    if (frame != 0) {
+        return frame;
+    }
+    
+    frame = pmm_alloc_page();
+    if (frame != 0) {
+        memset(scratch_map(frame), 0, PAGE_SIZE);
+    }
+    return frame;
+}
+
+/**
+ * Set an entry of the loaded directory
+ * Kernel entries are written into every directory so all address spaces see them
+ */
+static void set_pde(page_directory_t* dir, uint32_t pd_index, uint64_t value) {
+    uint64_t old = dir->entries[pd_index];
+    set_entry(&dir->entries[pd_index], value);
+    
+    if (pde_is_kernel(pd_index)) {
+        page_pdpt_t* loaded = loaded_directory();
+        for (uint32_t i = 0; i < directory_count; i++) {
+            if (directories[i] != loaded) {
+                set_entry(&foreign_attach(directories[i])->entries[pd_index], value);
+            }
+        }
+        foreign_detach();
+    }
+    
+    // What the old entry pointed at may still be cached at its recursive address
+    if (paging_enabled && (old & PAGE_PRESENT)) {
+        paging_flush_tlb_page((uint32_t)&ACTIVE_TABLES[pd_index]);
+        smp_tlb_shootdown();
+    }
+}
 
 /**
  * Enable paging on the CPU
  */
-static void enable_paging(page_directory_t* directory) {
-    // Load page directory
+static void enable_paging(page_pdpt_t* directory) {
+    // Load the PDPT, CR4.PAE is already set
     asm volatile (
         "mov %0, %%cr3" : : "r" (directory)
     );
@@ -28,33 +419,99 @@ static void enable_paging(page_directory_t* directory) {
     asm volatile (
         "mov %%cr0, %0" : "=r" (cr0)
     );
-    cr0 |= 0x80000000; // Set PG bit
+    cr0 |= CR0_PG | CR0_WP; // Paging, and read-only pages bind the kernel too (for copy-on-write)
     asm volatile (
         "mov %0, %%cr0" : : "r" (cr0)
     );
 }
 
 /**
- * Create a page directory
+ * Create an address space: a PDPT and four cleared, contiguous directories
+ * The recursive entries are filled in, everything else is empty
+ * Caller holds the paging lock
+ */
+static page_pdpt_t* create_page_directory(void) {
+    page_pdpt_t* pdpt = NULL;
+    for (uint32_t i = 0; i < PAGING_MAX_DIRECTORIES && !pdpt; i++) {
+        if (pdpts[i].entries[0] == 0) {
+            pdpt = &pdpts[i];
+        }
+    }
+    if (!pdpt) {
+        return NULL;
+    }
+    
+    // Before paging is on, directories are reached by physical address and must be low
+    uint64_t phys = paging_enabled ? pmm_alloc_pages(2) : pmm_alloc_low_pages(2);
+    if (phys == 0) {
+        return NULL;
+    }
+    
+    for (uint32_t i = 0; i < 4; i++) {
+        memset(scratch_map(phys + i * PAGE_SIZE), 0, PAGE_SIZE);
+    }
+    
+    // The recursive entries are in the last directory
+    page_table_t* last = (page_table_t*)scratch_map(phys + 3 * PAGE_SIZE);
+    for (uint32_t i = 0; i < 4; i++) {
+        last->entries[RECURSIVE_INDEX - 3 * PAGE_TABLE_ENTRIES + i] =
+            (phys + i * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    
+    // PDPT entries only take the present bit, the others are reserved
+    for (uint32_t i = 0; i < 4; i++) {
+        pdpt->entries[i] = (phys + i * PAGE_SIZE) | PAGE_PRESENT;
+    }
+    return pdpt;
+}
+
+/**
+ * Free the directories and the PDPT of an address space whose user tables are gone
+ */
+static void destroy_page_directory(page_pdpt_t* pdpt) {
+    pmm_free_pages(pdpt->entries[0] & PAGE_FRAME_MASK, 2);
+    memset(pdpt, 0, sizeof(page_pdpt_t));
+}
+
+/**
+ * Split a 2MB page into a page table mapping the same frames
  */
-static page_directory_t* create_page_directory(void) {
-    // Allocate a page for the directory
-    uint32_t phys_addr = pmm_alloc_page();
-    page_directory_t* dir = (page_directory_t*)phys_addr;
+static page_table_t* split_large_page(page_directory_t* dir, uint32_t pd_index) {
+    uint64_t pde = dir->entries[pd_index];
     
-    // Clear the directory
-    for (int i = 0; i < 1024; i++) {
-        dir->entries[i] = 0;
+    uint64_t pt_phys = alloc_table_frame();
+    if (pt_phys == 0) {
+        kprintf("ERROR: Out of memory splitting a 2MB page\n");
+        return NULL;
     }
     
-    return dir;
+    // Same frames and flags, minus the size bit
+    // The table is filled before it's installed, the region may hold the running code
+    page_table_t* fill = (page_table_t*)scratch_map(pt_phys);
+    uint64_t base = large_frame(pde);
+    uint32_t flags = (uint32_t)pde & 0x17F;
+    for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        fill->entries[i] = (base + i * PAGE_SIZE) | flags;
+    }
+    
+    set_pde(dir, pd_index, pt_phys | (pde & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)));
+    
+    // A 2MB page uses a single TLB entry
+    paging_flush_tlb_page(pd_index << 21);
+    
+    return table_of(dir, pd_index);
 }
 
 /**
  * Get a page table, creating it if it doesn't exist
+ * A 2MB page covering the address is split into a page table
  */
 static page_table_t* get_or_create_page_table(page_directory_t* dir, uint32_t virtual_addr, bool create) {
-    uint32_t pd_index = (virtual_addr >> 22) & 0x3FF;
+    uint32_t pd_index = PD_INDEX(virtual_addr);
+    
+    if (pde_is_large(dir->entries[pd_index])) {
+        return split_large_page(dir, pd_index);
+    }
     
     // Check if the page table exists
     if (!(dir->entries[pd_index] & PAGE_PRESENT)) {
@@ -62,109 +519,156 @@ static page_table_t* get_or_create_page_table(page_directory_t* dir, uint32_t vi
             return NULL;
         }
         
-        // Create a new page table
-        uint32_t pt_phys = pmm_alloc_page();
-        dir->entries[pd_index] = pt_phys | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Clear the new page table
-        page_table_t* pt = (page_table_t*)pt_phys;
-        for (int i = 0; i < 1024; i++) {
-            pt->entries[i] = 0;
+        // Create a new page table, already cleared
+        uint64_t pt_phys = alloc_table_frame();
+        if (pt_phys == 0) {
+            kprintf("ERROR: Out of memory for page table\n");
+            return NULL;
         }
+        set_pde(dir, pd_index, pt_phys | PAGE_PRESENT | PAGE_WRITABLE);
     }
     
     // Return the page table
-    return (page_table_t*)(dir->entries[pd_index] & 0xFFFFF000);
+    return table_of(dir, pd_index);
 }
 
 /**
  * Initialize the paging system
  */
 void paging_init(void) {
-    console_write_string("Initializing paging...\n");
+    kprintf("Initializing paging...\n");
     
-    // Create kernel page directory
-    page_directory_t* kernel_dir = create_page_directory();
+    // Frames may be above 4GB and every table is built with 64-bit entries
+    uint32_t features = cpu_features_edx();
+    if (!(features & CPUID_EDX_PAE)) {
+        kprintf("ERROR: The CPU doesn't support PAE, which paging requires\n");
+        klog_flush();
+        for (;;) {
+            asm volatile ("hlt");
+        }
+    }
     
-    // Identity map the first 4MB (kernel space)
-    for (uint32_t addr = 0; addr < 0x400000; addr += PAGE_SIZE) {
-        paging_map_page(addr, addr, PAGE_PRESENT | PAGE_WRITABLE);
+    // Use global pages if the CPU supports them
+    if (features & CPUID_EDX_PGE) {
+        write_cr4(read_cr4() | CR4_PGE);
+        pge_enabled = true;
     }
     
-    // Set up recursive mapping for easier page table manipulation
-    // This maps the page directory to itself at RECURSIVE_INDEX
-    kernel_dir->entries[RECURSIVE_INDEX] = (uint32_t)kernel_dir | PAGE_PRESENT | PAGE_WRITABLE;
+    // The identity map covers the kernel and the PMM's metadata, and at least the first 4MB
+    identity_pdes = (pmm_get_metadata_end() + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+    if (identity_pdes < 2) {
+        identity_pdes = 2;
+    }
     
-    // Save current directory
-    current_directory = kernel_dir;
+    // Create the kernel address space
+    page_pdpt_t* kernel_pdpt = create_page_directory();
+    kernel_directory = kernel_pdpt;
+    directories[directory_count++] = kernel_pdpt;
+    
+    // Identity map low memory with 2MB pages
+    page_directory_t* kernel_dir = directory_frames(kernel_pdpt);
+    for (uint32_t i = 0; i < identity_pdes; i++) {
+        kernel_dir->entries[i] = ((uint64_t)i * LARGE_PAGE_SIZE) | PAGE_KERNEL | PAGE_SIZE_BIT;
+    }
+    
+    // Table for the scratch page, created now so every clone shares it
+    get_or_create_page_table(kernel_dir, SCRATCH_PAGE, true);
     
     // Enable paging
-    enable_paging(kernel_dir);
+    write_cr4(read_cr4() | CR4_PAE);
+    enable_paging(kernel_pdpt);
+    paging_enabled = true;
     
-    console_write_string("Paging initialized.\n");
+    kprintf("Paging initialized.\n");
 }
 
 /**
  * Map a virtual page to a physical page
  */
-void paging_map_page(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
+void paging_map_page(uint32_t virtual_addr, uint64_t physical_addr, uint32_t flags) {
+    PROFILE_SCOPE(paging_map_page);
+    
+    paging_lock();
+    
     // Align addresses to page boundaries
     virtual_addr &= 0xFFFFF000;
-    physical_addr &= 0xFFFFF000;
+    physical_addr &= PAGE_FRAME_MASK;
     
-    // Get directory indices
-    uint32_t pd_index = (virtual_addr >> 22) & 0x3FF;
-    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    // Get the table entry index
+    uint32_t pt_index = PT_INDEX(virtual_addr);
     
     // Get page table (create if necessary)
-    page_table_t* pt = get_or_create_page_table(current_directory, virtual_addr, true);
+    page_table_t* pt = get_or_create_page_table(active_directory(), virtual_addr, true);
+    if (!pt) {
+        paging_unlock();
+        return;
+    }
     
     // Map page
-    pt->entries[pt_index] = physical_addr | flags;
+    uint64_t old_entry = pt->entries[pt_index];
+    set_entry(&pt->entries[pt_index], physical_addr | flags);
     
-    // Flush TLB for this page
+    // Flush TLB for this page, other CPUs only cache a replaced translation
     paging_flush_tlb_page(virtual_addr);
+    if ((old_entry & PAGE_PRESENT) && old_entry != pt->entries[pt_index]) {
+        smp_tlb_shootdown();
+    }
+    
+    paging_unlock();
 }
 
 /**
  * Unmap a virtual page
  */
 void paging_unmap_page(uint32_t virtual_addr) {
+    paging_lock();
+    
     // Align address to page boundary
     virtual_addr &= 0xFFFFF000;
     
-    // Get directory indices
-    uint32_t pd_index = (virtual_addr >> 22) & 0x3FF;
-    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    // Get the table entry index
+    uint32_t pt_index = PT_INDEX(virtual_addr);
     
     // Get page table (if it exists)
-    page_table_t* pt = get_or_create_page_table(current_directory, virtual_addr, false);
+    page_table_t* pt = get_or_create_page_table(active_directory(), virtual_addr, false);
     if (pt) {
         // Unmap page
-        pt->entries[pt_index] = 0;
+        uint64_t old_entry = pt->entries[pt_index];
+        set_entry(&pt->entries[pt_index], 0);
         
         // Flush TLB for this page
         paging_flush_tlb_page(virtual_addr);
+        if (old_entry & PAGE_PRESENT) {
+            smp_tlb_shootdown();
+        }
     }
+    
+    paging_unlock();
 }
 
 /**
  * Get the physical address mapped to a virtual address
  */
-uint32_t paging_get_physical_address(uint32_t virtual_addr) {
+uint64_t paging_get_physical_address(uint32_t virtual_addr) {
     // Get directory indices
-    uint32_t pd_index = (virtual_addr >> 22) & 0x3FF;
-    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    uint32_t pd_index = PD_INDEX(virtual_addr);
+    uint32_t pt_index = PT_INDEX(virtual_addr);
     uint32_t offset = virtual_addr & 0xFFF;
     
+    // 2MB page
+    uint64_t pde = active_directory()->entries[pd_index];
+    if (pde_is_large(pde)) {
+        return large_frame(pde) + (virtual_addr & (LARGE_PAGE_SIZE - 1));
+    }
+    
     // Get page table (if it exists)
-    page_table_t* pt = get_or_create_page_table(current_directory, virtual_addr, false);
+    page_table_t* pt = get_or_create_page_table(active_directory(), virtual_addr, false);
     if (!pt || !(pt->entries[pt_index] & PAGE_PRESENT)) {
         return 0;
     }
     
     // Get physical address
-    uint32_t physical_addr = pt->entries[pt_index] & 0xFFFFF000;
+    uint64_t physical_addr = pt->entries[pt_index] & PAGE_FRAME_MASK;
     return physical_addr + offset;
 }
 
@@ -173,11 +677,16 @@ uint32_t paging_get_physical_address(uint32_t virtual_addr) {
  */
 bool paging_is_page_present(uint32_t virtual_addr) {
     // Get directory indices
-    uint32_t pd_index = (virtual_addr >> 22) & 0x3FF;
-    uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
+    uint32_t pd_index = PD_INDEX(virtual_addr);
+    uint32_t pt_index = PT_INDEX(virtual_addr);
+    
+    // 2MB page
+    if (pde_is_large(active_directory()->entries[pd_index])) {
+        return true;
+    }
     
     // Get page table (if it exists)
-    page_table_t* pt = get_or_create_page_table(current_directory, virtual_addr, false);
+    page_table_t* pt = get_or_create_page_table(active_directory(), virtual_addr, false);
     if (!pt) {
         return false;
     }
@@ -190,77 +699,629 @@ bool paging_is_page_present(uint32_t virtual_addr) {
  * Allocate a page and map it
  */
 uint32_t paging_alloc_and_map(uint32_t virtual_addr, uint32_t flags) {
+    paging_lock();
+    
     // Align address to page boundary
     virtual_addr &= 0xFFFFF000;
     
     // Allocate a physical page
-    uint32_t physical_addr = pmm_alloc_page();
+    uint64_t physical_addr = pmm_alloc_page();
     if (physical_addr == 0) {
+        paging_unlock();
         return 0;  // Out of memory
     }
     
     // Map the page
     paging_map_page(virtual_addr, physical_addr, flags);
+    if (paging_get_physical_address(virtual_addr) != physical_addr) {
+        pmm_free_page(physical_addr);
+        paging_unlock();
+        return 0;
+    }
     
+    paging_unlock();
     return virtual_addr;
 }
 
+/**
+ * Check if 2MB pages are available
+ * They are part of PAE, which paging_init requires
+ */
+bool paging_large_pages_supported(void) {
+    return true;
+}
+
+/**
+ * Map a 2MB virtual page to a 2MB physical page
+ */
+bool paging_map_large_page(uint32_t virtual_addr, uint64_t physical_addr, uint32_t flags) {
+    paging_lock();
+    
+    if ((virtual_addr & (LARGE_PAGE_SIZE - 1)) || (physical_addr & (LARGE_PAGE_SIZE - 1))) {
+        kprintf("ERROR: Unaligned 2MB page mapping\n");
+        paging_unlock();
+        return false;
+    }
+    
+    uint32_t pd_index = PD_INDEX(virtual_addr);
+    page_directory_t* dir = active_directory();
+    uint64_t pde = dir->entries[pd_index];
+    
+    // An existing page table can only be replaced if it maps nothing
+    if ((pde & PAGE_PRESENT) && !pde_is_large(pde)) {
+        page_table_t* pt = table_of(dir, pd_index);
+        for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+            if (pt->entries[i] & PAGE_PRESENT) {
+                kprintf("ERROR: 2MB page would replace existing mappings\n");
+                paging_unlock();
+                return false;
+            }
+        }
+    }
+    
+    set_pde(dir, pd_index, physical_addr | flags | PAGE_PRESENT | PAGE_SIZE_BIT);
+    if ((pde & PAGE_PRESENT) && !pde_is_large(pde)) {
+        pmm_free_page(pde & PAGE_FRAME_MASK);
+    }
+    paging_flush_tlb_page(virtual_addr);
+    
+    paging_unlock();
+    return true;
+}
+
+/**
+ * Unmap a 2MB page
+ */
+void paging_unmap_large_page(uint32_t virtual_addr) {
+    paging_lock();
+    
+    uint32_t pd_index = PD_INDEX(virtual_addr);
+    
+    page_directory_t* dir = active_directory();
+    if (pde_is_large(dir->entries[pd_index])) {
+        set_pde(dir, pd_index, 0);
+        paging_flush_tlb_page(virtual_addr);
+        smp_tlb_shootdown();
+    }
+    
+    paging_unlock();
+}
+
+/**
+ * Check if a virtual address is mapped by a 2MB page
+ */
+bool paging_is_large_page(uint32_t virtual_addr) {
+    return pde_is_large(active_directory()->entries[PD_INDEX(virtual_addr)]);
+}
+
+/**
+ * Map a range of virtual pages to contiguous physical pages
+ * Each page table is looked up once and the TLB is flushed once at the end
+ */
+bool paging_map_range(uint32_t virtual_addr, uint64_t physical_addr, uint32_t count, uint32_t flags) {
+    paging_lock();
+    
+    virtual_addr &= 0xFFFFF000;
+    physical_addr &= PAGE_FRAME_MASK;
+    
+    tlb_batch_t batch = { .count = 0, .global = false };
+    uint32_t done = 0;
+    
+    while (done < count) {
+        uint32_t virt = virtual_addr + done * PAGE_SIZE;
+        page_table_t* pt = get_or_create_page_table(active_directory(), virt, true);
+        if (!pt) {
+            tlb_batch_flush(&batch);
+            paging_unmap_range(virtual_addr, done, false);
+            paging_unlock();
+            return false;
+        }
+        
+        // Fill this table up to its end or the end of the range
+        for (uint32_t pt_index = PT_INDEX(virt); pt_index < PAGE_TABLE_ENTRIES && done < count; pt_index++) {
+            tlb_batch_add(&batch, virtual_addr + done * PAGE_SIZE, pt->entries[pt_index]);
+            set_entry(&pt->entries[pt_index], (physical_addr + (uint64_t)done * PAGE_SIZE) | flags);
+            done++;
+        }
+    }
+    
+    tlb_batch_flush(&batch);
+    paging_unlock();
+    return true;
+}
+
+/**
+ * Unmap a range of virtual pages, optionally returning their frames to the PMM
+ * 2MB pages fully inside the range are removed whole, others are split
+ */
+void paging_unmap_range(uint32_t virtual_addr, uint32_t count, bool free_frames) {
+    paging_lock();
+    
+    virtual_addr &= 0xFFFFF000;
+    
+    tlb_batch_t batch = { .count = 0, .global = false };
+    uint32_t done = 0;
+    
+    while (done < count) {
+        uint32_t virt = virtual_addr + done * PAGE_SIZE;
+        uint32_t pd_index = PD_INDEX(virt);
+        uint64_t pde = active_directory()->entries[pd_index];
+        
+        // Nothing mapped in this 2MB region
+        if (!(pde & PAGE_PRESENT)) {
+            done += PAGE_TABLE_ENTRIES - PT_INDEX(virt);
+            continue;
+        }
+        
+        // Whole 2MB page
+        if (pde_is_large(pde) && (virt & (LARGE_PAGE_SIZE - 1)) == 0 && count - done >= PAGE_TABLE_ENTRIES) {
+            set_pde(active_directory(), pd_index, 0);
+            tlb_batch_add(&batch, virt, pde);
+            if (free_frames) {
+                pmm_free_pages(large_frame(pde), PMM_MAX_ORDER);
+            }
+            done += PAGE_TABLE_ENTRIES;
+            continue;
+        }
+        
+        page_table_t* pt = get_or_create_page_table(active_directory(), virt, false);
+        if (!pt) {
+            // Splitting a 2MB page failed, leave the rest of it mapped
+            done += PAGE_TABLE_ENTRIES - PT_INDEX(virt);
+            continue;
+        }
+        
+        for (uint32_t pt_index = PT_INDEX(virt); pt_index < PAGE_TABLE_ENTRIES && done < count; pt_index++) {
+            uint64_t entry = pt->entries[pt_index];
+            set_entry(&pt->entries[pt_index], 0);
+            tlb_batch_add(&batch, virtual_addr + done * PAGE_SIZE, entry);
+            
+            // Safe before the flush: nothing touches the range until we return
+            if (free_frames && (entry & PAGE_PRESENT)) {
+                pmm_free_page(entry & PAGE_FRAME_MASK);
+            }
+            done++;
+        }
+    }
+    
+    tlb_batch_flush(&batch);
+    
+    paging_unlock();
+}
+
+/**
+ * Allocate frames for a range of virtual pages and map them
+ * Frames come from the PMM in the largest blocks available
+ */
+uint32_t paging_alloc_and_map_range(uint32_t virtual_addr, uint32_t count, uint32_t flags) {
+    paging_lock();
+    
+    virtual_addr &= 0xFFFFF000;
+    
+    uint32_t done = 0;
+    
+    while (done < count) {
+        uint32_t virt = virtual_addr + done * PAGE_SIZE;
+        uint32_t remaining = count - done;
+        int largest = pmm_largest_free_order();
+        
+        if (largest < 0) {
+            // Out of memory
+            kprintf("ERROR: Out of physical memory!\n");
+            paging_unmap_range(virtual_addr, done, true);
+            paging_unlock();
+            return 0;
+        }
+        
+        // A whole 2MB-aligned stretch gets a 2MB page
+        if (largest == PMM_MAX_ORDER && (virt & (LARGE_PAGE_SIZE - 1)) == 0 &&
+            remaining >= PAGE_TABLE_ENTRIES) {
+            // The largest order is only a hint, other CPUs may have taken the block since
+            uint64_t phys = pmm_alloc_pages(PMM_MAX_ORDER);
+            if (phys != 0) {
+                if (paging_map_large_page(virt, phys, flags)) {
+                    done += PAGE_TABLE_ENTRIES;
+                    continue;
+                }
+                pmm_free_pages(phys, PMM_MAX_ORDER);
+            }
+        }
+        
+        // Largest free block that fits the rest of the range and the current page table
+        uint32_t table_left = PAGE_TABLE_ENTRIES - PT_INDEX(virt);
+        uint32_t want = remaining < table_left ? remaining : table_left;
+        uint32_t order = (uint32_t)largest;
+        while (order > 0 && (1u << order) > want) {
+            order--;
+        }
+        
+        // Smaller blocks if that one went in the meantime
+        uint64_t phys = pmm_alloc_pages(order);
+        while (phys == 0 && order > 0) {
+            order--;
+            phys = pmm_alloc_pages(order);
+        }
+        if (phys == 0) {
+            kprintf("ERROR: Out of physical memory!\n");
+            paging_unmap_range(virtual_addr, done, true);
+            paging_unlock();
+            return 0;
+        }
+        if (!paging_map_range(virt, phys, 1u << order, flags)) {
+            pmm_free_pages(phys, order);
+            paging_unmap_range(virtual_addr, done, true);
+            paging_unlock();
+            return 0;
+        }
+        done += 1u << order;
+    }
+    
+    paging_unlock();
+    return virtual_addr;
+}
+
+/**
+ * Reserve a virtual range whose pages are committed on first access
+ */
+bool paging_reserve_range(uint32_t start, uint32_t end, uint32_t flags, bool zero_fill) {
+    paging_lock();
+    
+    if (reserved_count >= PAGING_MAX_RESERVED) {
+        kprintf("ERROR: Too many reserved ranges\n");
+        paging_unlock();
+        return false;
+    }
+    
+    reserved_range_t* range = &reserved_ranges[reserved_count++];
+    range->start = start & 0xFFFFF000;
+    range->end = (end + PAGE_SIZE - 1) & 0xFFFFF000;
+    range->flags = flags | PAGE_PRESENT;
+    range->zero_fill = zero_fill;
+    
+    paging_unlock();
+    return true;
+}
+
+/**
+ * Commit a frame for a not-present page inside a reserved range
+ * Returns false if the address isn't reserved or memory is exhausted
+ */
+static bool commit_reserved_page(uint32_t fault_addr) {
+    for (uint32_t i = 0; i < reserved_count; i++) {
+        reserved_range_t* range = &reserved_ranges[i];
+        if (fault_addr < range->start || fault_addr >= range->end) {
+            continue;
+        }
+        
+        // Another CPU may have committed the page while we waited for the lock
+        uint32_t page = fault_addr & 0xFFFFF000;
+        if (paging_is_page_present(page)) {
+            return true;
+        }
+        
+        // Zero-fill ranges take a frame cleared ahead of time when one is ready
+        uint64_t phys = range->zero_fill ? pmm_take_zeroed_page() : 0;
+        bool zeroed = phys != 0;
+        if (!zeroed) {
+            phys = pmm_alloc_page();
+        }
+        if (phys == 0) {
+            return false;
+        }
+        
+        paging_map_page(page, phys, range->flags);
+        if (paging_get_physical_address(page) != phys) {
+            pmm_free_page(phys);
+            return false;
+        }
+        
+        if (range->zero_fill && !zeroed) {
+            memset((void*)page, 0, PAGE_SIZE);
+        }
+        return true;
+    }
+    
+    return false;
+}
+
+/**
+ * Give the writer of a copy-on-write page its own copy
+ * Returns false if the page isn't copy-on-write or memory is exhausted
+ */
+static bool resolve_cow_fault(uint32_t fault_addr) {
+    uint32_t page = fault_addr & 0xFFFFF000;
+    uint32_t pd_index = PD_INDEX(page);
+    uint32_t pt_index = PT_INDEX(page);
+    
+    page_directory_t* dir = active_directory();
+    uint64_t pde = dir->entries[pd_index];
+    if (!(pde & PAGE_PRESENT) || pde_is_large(pde)) {
+        return false;
+    }
+    
+    page_table_t* pt = table_of(dir, pd_index);
+    uint64_t entry = pt->entries[pt_index];
+    if (!(entry & PAGE_PRESENT)) {
+        return false;
+    }
+    
+    // Another CPU resolved it first, only this TLB was stale
+    if (entry & PAGE_WRITABLE) {
+        paging_flush_tlb_page(page);
+        return true;
+    }
+    if (!(entry & PAGE_COW)) {
+        return false;
+    }
+    
+    uint64_t old_frame = entry & PAGE_FRAME_MASK;
+    uint32_t flags = ((uint32_t)entry & 0xFFF & ~PAGE_COW) | PAGE_WRITABLE;
+    
+    // The last sharer keeps the frame
+    if (pmm_page_refs(old_frame) <= 1) {
+        set_entry(&pt->entries[pt_index], old_frame | flags);
+        paging_flush_tlb_page(page);
+        return true;
+    }
+    
+    uint64_t new_frame = pmm_alloc_page();
+    if (new_frame == 0) {
+        return false;
+    }
+    
+    // Copy through the read-only mapping, which stays valid until the entry changes
+    memcpy(scratch_map(new_frame), (const void*)page, PAGE_SIZE);
+    set_entry(&pt->entries[pt_index], new_frame | flags);
+    
+    // Other CPUs in this address space may still read the shared frame
+    paging_flush_tlb_page(page);
+    smp_tlb_shootdown();
+    pmm_free_page(old_frame);
+    return true;
+}
+
+/**
+ * Drop the user mappings of an attached directory, returning page tables and frames
+ */
+static void free_user_tables(page_directory_t* dir) {
+    for (uint32_t pd_index = 0; pd_index < KERNEL_PDE_START; pd_index++) {
+        uint64_t pde = dir->entries[pd_index];
+        if (pde_is_kernel(pd_index) || !(pde & PAGE_PRESENT)) {
+            continue;
+        }
+        
+        // 2MB pages are split before they're shared, so this one has a single owner
+        if (pde_is_large(pde)) {
+            pmm_free_pages(large_frame(pde), PMM_MAX_ORDER);
+        } else {
+            page_table_t* pt = table_of(dir, pd_index);
+            for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+                if (pt->entries[i] & PAGE_PRESENT) {
+                    pmm_free_page(pt->entries[i] & PAGE_FRAME_MASK);
+                }
+            }
+            pmm_free_page(pde & PAGE_FRAME_MASK);
+        }
+        set_entry(&dir->entries[pd_index], 0);
+    }
+}
+
+/**
+ * Remove a directory from the list kept in sync with the kernel entries
+ */
+static void directory_unregister(page_pdpt_t* dir) {
+    for (uint32_t i = 0; i < directory_count; i++) {
+        if (directories[i] == dir) {
+            directories[i] = directories[--directory_count];
+            return;
+        }
+    }
+}
+
+/**
+ * Clone the loaded address space
+ * User pages are shared copy-on-write, only their page tables are copied
+ */
+page_pdpt_t* paging_clone_directory(void) {
+    paging_lock();
+    
+    if (directory_count >= PAGING_MAX_DIRECTORIES) {
+        kprintf("ERROR: Too many page directories\n");
+        paging_unlock();
+        return NULL;
+    }
+    
+    page_pdpt_t* clone = create_page_directory();
+    if (!clone) {
+        kprintf("ERROR: Out of memory for a page directory\n");
+        paging_unlock();
+        return NULL;
+    }
+    
+    // Nothing below changes kernel entries, so the window stays on the clone
+    page_directory_t* parent = active_directory();
+    page_directory_t* child = foreign_attach(clone);
+    bool failed = false;
+    
+    // The foreign and recursive entries at the end are the clone's own
+    for (uint32_t pd_index = 0; pd_index < FOREIGN_INDEX && !failed; pd_index++) {
+        uint64_t pde = parent->entries[pd_index];
+        
+        if (!(pde & PAGE_PRESENT)) {
+            continue;
+        }
+        if (pde_is_kernel(pd_index)) {
+            set_entry(&child->entries[pd_index], pde);
+            continue;
+        }
+        
+        // Frames are shared one page at a time
+        if (pde_is_large(pde) && !split_large_page(parent, pd_index)) {
+            failed = true;
+            continue;
+        }
+        pde = parent->entries[pd_index];
+        
+        uint64_t pt_phys = alloc_table_frame();
+        if (pt_phys == 0) {
+            kprintf("ERROR: Out of memory for page table\n");
+            failed = true;
+            continue;
+        }
+        
+        set_entry(&child->entries[pd_index], pt_phys | (pde & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)));
+        
+        // Writable pages turn read-only on both sides until one of them writes
+        page_table_t* src = table_of(parent, pd_index);
+        page_table_t* dst = table_of(child, pd_index);
+        for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+            uint64_t entry = src->entries[i];
+            if (!(entry & PAGE_PRESENT)) {
+                continue;
+            }
+            if (!pmm_share_page(entry & PAGE_FRAME_MASK)) {
+                failed = true;
+                break;
+            }
+            if (entry & (PAGE_WRITABLE | PAGE_COW)) {
+                entry = (entry & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+                set_entry(&src->entries[i], entry);
+            }
+            dst->entries[i] = entry;
+        }
+    }
+    
+    // Every CPU in the parent may hold writable translations of the now shared pages
+    paging_flush_tlb_global();
+    smp_tlb_shootdown();
+    
+    if (failed) {
+        // The parent's pages stay copy-on-write, its next write just takes them back
+        free_user_tables(child);
+        foreign_detach();
+        destroy_page_directory(clone);
+        paging_unlock();
+        return NULL;
+    }
+    
+    foreign_detach();
+    
+    // From now on kernel entries are kept in sync in the clone too
+    directories[directory_count++] = clone;
+    
+    paging_unlock();
+    return clone;
+}
+
+/**
+ * Free an address space made by paging_clone_directory
+ */
+void paging_free_directory(page_pdpt_t* directory) {
+    paging_lock();
+    
+    if (directory == kernel_directory) {
+        kprintf("ERROR: Attempt to free the kernel page directory\n");
+        paging_unlock();
+        return;
+    }
+    
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (current_directory[cpu] == directory) {
+            kprintf("ERROR: Attempt to free a page directory that is loaded\n");
+            paging_unlock();
+            return;
+        }
+    }
+    
+    free_user_tables(foreign_attach(directory));
+    foreign_detach();
+    directory_unregister(directory);
+    destroy_page_directory(directory);
+    
+    paging_unlock();
+}
+
 /**
  * Handle a page fault
  */
 void paging_handle_fault(uint32_t fault_addr, uint32_t error_code) {
+    // First touch of a reserved page
+    if (!(error_code & 0x1)) {
+        paging_lock();
+        bool committed = commit_reserved_page(fault_addr);
+        paging_unlock();
+        
+        if (committed) {
+            return;
+        }
+    }
+    
+    // Write to a copy-on-write page
+    if ((error_code & 0x3) == 0x3) {
+        paging_lock();
+        bool copied = resolve_cow_fault(fault_addr);
+        paging_unlock();
+        
+        if (copied) {
+            return;
+        }
+    }
+    
     // Print fault information
-    console_write_string("Page fault at address: ");
-    console_write_hex(fault_addr);
-    console_write_string("\nError code: ");
-    console_write_hex(error_code);
-    console_write_string("\n");
+    kprintf("Page fault at address: 0x%X\n", fault_addr);
+    kprintf("Error code: 0x%X\n", error_code);
     
     // Decode error code
-    console_write_string("Fault details: ");
+    kprintf("Fault details: ");
     if (!(error_code & 0x1)) {
-        console_write_string("Page not present, ");
+        kprintf("Page not present, ");
     }
     if (error_code & 0x2) {
-        console_write_string("Write operation, ");
+        kprintf("Write operation, ");
     } else {
-        console_write_string("Read operation, ");
+        kprintf("Read operation, ");
     }
     if (error_code & 0x4) {
-        console_write_string("User mode, ");
+        kprintf("User mode, ");
     } else {
-        console_write_string("Kernel mode, ");
+        kprintf("Kernel mode, ");
     }
     if (error_code & 0x8) {
-        console_write_string("Reserved bits overwritten, ");
+        kprintf("Reserved bits overwritten, ");
     }
     if (error_code & 0x10) {
-        console_write_string("Instruction fetch");
+        kprintf("Instruction fetch");
     }
-    console_write_string("\n");
+    kprintf("\n");
     
     // Halt the system on unhandled page fault
-    console_write_string("System halted due to unhandled page fault.\n");
+    kprintf("System halted due to unhandled page fault.\n");
+    
+    // Nothing will drain the log once this CPU stops
+    klog_flush();
     for (;;) {
         asm volatile ("hlt");
     }
 }
 
 /**
- * Get the current page directory
+ * Get the current address space
  */
-page_directory_t* paging_get_directory(void) {
-    return current_directory;
+page_pdpt_t* paging_get_directory(void) {
+    return loaded_directory();
 }
 
 /**
- * Load a new page directory
+ * Load a new address space
  */
-void paging_load_directory(page_directory_t* directory) {
-    current_directory = directory;
+void paging_load_directory(page_pdpt_t* directory) {
+    // Faults taken in between would look up the wrong directory
+    uint32_t flags = interrupts_save();
+    current_directory[smp_cpu_index()] = directory;
     asm volatile (
         "mov %0, %%cr3" : : "r" (directory)
     );
+    interrupts_restore(flags);
 }
 
 /**
@@ -283,4 +1344,19 @@ void paging_flush_tlb(void) {
     asm volatile (
         "mov %0, %%cr3" : : "r" (cr3)
     );
+}
+
+/**
+ * Flush the entire TLB, including global entries
+ */
+void paging_flush_tlb_global(void) {
+    if (!pge_enabled) {
+        paging_flush_tlb();
+        return;
+    }
+    
+    // Toggling CR4.PGE drops every TLB entry
+    uint32_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
 }
\ No newline at end of file
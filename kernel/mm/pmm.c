@@ -2,24 +2,122 @@
  * NKOF Physical Memory Manager Implementation
  *
  * This file implements functions for managing physical memory pages.
+ * Free memory is kept by a binary buddy allocator: one free-block bitset
+ * per order, each with a summary layer so the first free block of an
+ * order can be found with a couple of find-first-set instructions.
+ * Pages shared copy-on-write carry a reference count, and freeing one
+ * only drops a reference until the last sharer lets go.
+ *
+ * Page numbers fit 32 bits, physical addresses are 64-bit: memory up to
+ * PMM_MAX_ADDRESS is tracked, whether it's below 4GB or not. Blocks are
+ * taken lowest first, and low allocations only take blocks that end
+ * below PMM_LOW_ADDRESS. The metadata is placed in low memory, which
+ * paging identity-maps up to pmm_get_metadata_end.
  */
 
 #include "../include/pmm.h"
-#include "../include/console.h"
+#include "../include/klog.h"
+#include "../include/profile.h"
+#include "../include/spinlock.h"
+#include "../include/interrupts.h"
+#include "../include/smp.h"
+#include "../include/string.h"
+#include "../include/paging.h"
+
+// Protects the bitmaps, free areas and statistics
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Per-CPU cache of single frames in front of the buddy allocator
+// Frames in a magazine are marked used in the bitmap and cached in the cached bitmap
+typedef struct {
+    uint32_t count;
+    uint32_t allocs;               // Frames handed out through this magazine
+    uint32_t frees;                // Frames returned through this magazine
+    uint64_t frames[PMM_MAGAZINE_MAX];
+} pmm_magazine_t;
+
+// Only touched by the owning CPU with interrupts disabled
+static pmm_magazine_t magazines[SMP_MAX_CPUS];
+
+// Frames a magazine holds before draining, half of them move per refill or drain
+static uint32_t magazine_depth = PMM_MAGAZINE_DEPTH;
+
+// Trips to the buddy allocator to refill or drain a magazine (under pmm_lock)
+static uint32_t magazine_refills = 0;
+static uint32_t magazine_drains = 0;
+
+// Pool of frames that are already zeroed, refilled from the idle task
+// Pool frames are marked used and cached, like magazine frames
+static spinlock_t zero_lock = SPINLOCK_INIT;
+static uint64_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_count = 0;
+static uint32_t zero_watermark = PMM_ZERO_WATERMARK;
+
+// Requests served from the pool and ones that had to zero on the spot
+static uint32_t zero_hits = 0;
+static uint32_t zero_misses = 0;
 
 // Bitmap to track free/used pages
 // Each bit represents one page (1 = used, 0 = free)
 static uint32_t* bitmap = NULL;
 static uint32_t bitmap_size = 0;
 
+// Frames parked in a magazine or the zeroed pool (1 = cached), so freeing one again is caught
+// Magazines update it without pmm_lock, so every change is atomic
+static uint32_t* cached = NULL;
+
+// Free blocks of one buddy order
+// Each bit represents one naturally aligned block of 2^order pages
+// (1 = the block is free and not part of a larger free block)
+typedef struct {
+    uint32_t* bits;            // Free block bitset
+    uint32_t* summary;         // 1 bit per bits word (1 = word is non-zero)
+    uint32_t words;            // Number of words in bits
+    uint32_t summary_words;    // Number of words in summary
+    uint32_t hint;             // No bits word below this index is non-zero
+    uint32_t count;            // Number of free blocks of this order
+} free_area_t;
+
+static free_area_t free_area[PMM_MAX_ORDER + 1];
+
+// References to each page beyond the first, kept for copy-on-write sharing
+// A page is only returned to the allocator once its count is back to zero
+static uint16_t* page_shares = NULL;
+
+// Maximum number of usable memory regions tracked during init
+#define PMM_MAX_REGIONS 32
+
+// Pages tracked, and pages below PMM_LOW_ADDRESS
+#define PMM_MAX_PAGES ((uint32_t)(PMM_MAX_ADDRESS / PAGE_SIZE))
+#define PMM_LOW_PAGES ((uint32_t)(PMM_LOW_ADDRESS / PAGE_SIZE))
+
+// The metadata must end below this, the identity map covering it shares directory entries with user space
+#define PMM_METADATA_LIMIT 0x40000000
+
+// Usable memory region, in pages [start, end)
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} pmm_region_t;
+
+// Sorted, merged list of usable regions built from the memory map
+static pmm_region_t regions[PMM_MAX_REGIONS];
+static uint32_t region_count = 0;
+
 // Memory statistics
 static uint64_t total_memory = 0;
 static uint64_t used_memory = 0;
 static uint64_t free_memory = 0;
 
+// Available memory above PMM_MAX_ADDRESS, counted but never allocated
+static uint64_t untracked_memory = 0;
+
 // Number of pages
 static uint32_t total_pages = 0;
 
+// Physical address where the metadata ends
+static uint32_t metadata_end = 0;
+
 // The physical address where our kernel ends
 // This is defined by the linker
 extern uint32_t end;
@@ -32,207 +130,1042 @@ static void bitmap_set(uint32_t bit) {
 }
 
 /**
- * Clear a bit in the bitmap
+ * Test if a bit is set in the bitmap
  */
-static void bitmap_clear(uint32_t bit) {
-    bitmap[bit / 32] &= ~(1 << (bit % 32));
+static bool bitmap_test(uint32_t bit) {
+    return (bitmap[bit / 32] & (1 << (bit % 32))) != 0;
 }
 
 /**
- * Test if a bit is set in the bitmap
+ * Get the page number of a physical address, total_pages if it is past the tracked memory
  */
-static bool bitmap_test(uint32_t bit) {
-    return (bitmap[bit / 32] & (1 << (bit % 32))) != 0;
+static inline uint32_t page_index(uint64_t addr) {
+    uint64_t page = addr / PAGE_SIZE;
+    return page < total_pages ? (uint32_t)page : total_pages;
 }
 
 /**
- * Initialize the physical memory manager using the memory map
+ * Mask of bits [first, last] within a bitmap word
  */
-void pmm_init(memory_map_entry_t* memory_map, uint32_t entry_count) {
-    console_write_string("Initializing Physical Memory Manager...\n");
+static inline uint32_t bitmap_word_mask(uint32_t first, uint32_t last) {
+    return (0xFFFFFFFF << first) & (0xFFFFFFFF >> (31 - last));
+}
+
+/**
+ * Mark a run of pages as used in the bitmap
+ */
+static void bitmap_set_range(uint32_t start, uint32_t count) {
+    uint32_t bit = start;
+    uint32_t end_bit = start + count;
     
-    // If we don't have a valid memory map, use default conservative values
-    if (memory_map == NULL || entry_count == 0) {
-        console_write_string("Warning: No memory map provided. Using conservative defaults.\n");
+    // Leading partial word
+    if (bit < end_bit && (bit % 32) != 0) {
+        uint32_t last = (end_bit - bit < 32 - bit % 32) ? (end_bit - 1) % 32 : 31;
+        bitmap[bit / 32] |= bitmap_word_mask(bit % 32, last);
+        bit += last - bit % 32 + 1;
+    }
+    
+    // Whole words
+    while (bit + 32 <= end_bit) {
+        bitmap[bit / 32] = 0xFFFFFFFF;
+        bit += 32;
+    }
+    
+    // Trailing partial word
+    if (bit < end_bit) {
+        bitmap[bit / 32] |= bitmap_word_mask(0, (end_bit - 1) % 32);
+    }
+}
+
+/**
+ * Mark a run of pages as free in the bitmap
+ */
+static void bitmap_clear_range(uint32_t start, uint32_t count) {
+    uint32_t bit = start;
+    uint32_t end_bit = start + count;
+    
+    // Leading partial word
+    if (bit < end_bit && (bit % 32) != 0) {
+        uint32_t last = (end_bit - bit < 32 - bit % 32) ? (end_bit - 1) % 32 : 31;
+        bitmap[bit / 32] &= ~bitmap_word_mask(bit % 32, last);
+        bit += last - bit % 32 + 1;
+    }
+    
+    // Whole words
+    while (bit + 32 <= end_bit) {
+        bitmap[bit / 32] = 0;
+        bit += 32;
+    }
+    
+    // Trailing partial word
+    if (bit < end_bit) {
+        bitmap[bit / 32] &= ~bitmap_word_mask(0, (end_bit - 1) % 32);
+    }
+}
+
+/**
+ * Check that every page of a run is marked as used in the bitmap
+ */
+static bool bitmap_range_used(uint32_t start, uint32_t count) {
+    uint32_t bit = start;
+    uint32_t end_bit = start + count;
+    
+    while (bit < end_bit) {
+        uint32_t last = (end_bit - bit < 32 - bit % 32) ? (end_bit - 1) % 32 : 31;
+        uint32_t mask = bitmap_word_mask(bit % 32, last);
         
-        // Assume a conservative memory size (16MB)
-        total_memory = 16 * 1024 * 1024;
-        total_pages = total_memory / PAGE_SIZE;
+        if ((bitmap[bit / 32] & mask) != mask) {
+            return false;
+        }
         
-        // Place bitmap at 1MB
-        bitmap_size = (total_pages + 7) / 8;
-        bitmap_size = (bitmap_size + 3) & ~3;
-        bitmap = (uint32_t*)0x100000;
+        bit += last - bit % 32 + 1;
+    }
+    
+    return true;
+}
+
+/**
+ * Mark a frame as cached, returns true if it already was
+ */
+static bool cached_mark(uint32_t page) {
+    uint32_t bit = 1u << (page % 32);
+    return (__atomic_fetch_or(&cached[page / 32], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/**
+ * Clear a frame's cached mark as it leaves a magazine or the pool
+ */
+static void cached_clear(uint32_t page) {
+    __atomic_fetch_and(&cached[page / 32], ~(1u << (page % 32)), __ATOMIC_RELAXED);
+}
+
+/**
+ * Check whether any page of a run is cached
+ */
+static bool cached_range_any(uint32_t start, uint32_t count) {
+    uint32_t bit = start;
+    uint32_t end_bit = start + count;
+    
+    while (bit < end_bit) {
+        uint32_t last = (end_bit - bit < 32 - bit % 32) ? (end_bit - 1) % 32 : 31;
+        uint32_t mask = bitmap_word_mask(bit % 32, last);
         
-        // Initialize all as used initially
-        for (uint32_t i = 0; i < bitmap_size / 4; i++) {
-            bitmap[i] = 0xFFFFFFFF;
+        if (__atomic_load_n(&cached[bit / 32], __ATOMIC_RELAXED) & mask) {
+            return true;
         }
         
-        // Mark a safe region as free (4MB to 8MB)
-        uint32_t safe_start = 4 * 1024 * 1024;
-        uint32_t safe_end = 8 * 1024 * 1024;
-        uint32_t start_page = safe_start / PAGE_SIZE;
-        uint32_t end_page = safe_end / PAGE_SIZE;
+        bit += last - bit % 32 + 1;
+    }
+    
+    return false;
+}
+
+/**
+ * Mark a free block in a free area
+ */
+static void free_area_set(uint32_t order, uint32_t index) {
+    free_area_t* area = &free_area[order];
+    uint32_t word = index / 32;
+    
+    area->bits[word] |= (1 << (index % 32));
+    area->summary[word / 32] |= (1 << (word % 32));
+    area->count++;
+    
+    if (word < area->hint) {
+        area->hint = word;
+    }
+}
+
+/**
+ * Remove a free block from a free area
+ */
+static void free_area_clear(uint32_t order, uint32_t index) {
+    free_area_t* area = &free_area[order];
+    uint32_t word = index / 32;
+    
+    area->bits[word] &= ~(1 << (index % 32));
+    area->count--;
+    
+    // Word became empty: drop it from the summary
+    if (area->bits[word] == 0) {
+        area->summary[word / 32] &= ~(1 << (word % 32));
+    }
+}
+
+/**
+ * Test if a block is free in a free area
+ */
+static bool free_area_test(uint32_t order, uint32_t index) {
+    free_area_t* area = &free_area[order];
+    
+    if (index / 32 >= area->words) {
+        return false;
+    }
+    
+    return (area->bits[index / 32] & (1 << (index % 32))) != 0;
+}
+
+/**
+ * Find the lowest free block in a free area
+ * Returns 0xFFFFFFFF if the area is empty
+ */
+static uint32_t free_area_find(uint32_t order) {
+    free_area_t* area = &free_area[order];
+    
+    if (area->count == 0) {
+        return 0xFFFFFFFF;
+    }
+    
+    // Jump straight to the first non-zero bits word via the summary
+    uint32_t index = area->hint / 32;
+    uint32_t bits = area->summary[index] & (0xFFFFFFFF << (area->hint % 32));
+    
+    while (bits == 0) {
+        bits = area->summary[++index];
+    }
+    
+    uint32_t word = index * 32 + __builtin_ctz(bits);
+    area->hint = word;
+    
+    return word * 32 + __builtin_ctz(area->bits[word]);
+}
+
+/**
+ * Return a block of 2^order pages to the buddy allocator,
+ * merging it with its buddy for as long as the buddy is free
+ */
+static void buddy_insert(uint32_t page, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = page ^ (1 << order);
         
-        for (uint32_t page = start_page; page < end_page; page++) {
-            bitmap_clear(page);
+        if (!free_area_test(order, buddy >> order)) {
+            break;
         }
         
-        // Mark bitmap itself as used
-        uint32_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-        uint32_t bitmap_start_page = ((uint32_t)bitmap) / PAGE_SIZE;
+        // Take the buddy out and continue with the combined block
+        free_area_clear(order, buddy >> order);
+        page &= ~(1 << order);
+        order++;
+    }
+    
+    free_area_set(order, page >> order);
+}
+
+/**
+ * Add a run of free pages to the buddy allocator as the largest
+ * naturally aligned blocks that fit
+ */
+static void buddy_add_range(uint32_t start, uint32_t end_page) {
+    uint32_t page = start;
+    
+    while (page < end_page) {
+        uint32_t order = PMM_MAX_ORDER;
         
-        for (uint32_t page = bitmap_start_page; page < bitmap_start_page + bitmap_pages; page++) {
-            bitmap_set(page);
+        // Shrink the block until it is aligned and fits in the run
+        while ((page & ((1 << order) - 1)) != 0 || page + (1 << order) > end_page) {
+            order--;
         }
         
-        // Calculate free and used memory
-        free_memory = safe_end - safe_start;
-        used_memory = total_memory - free_memory;
+        free_area_set(order, page >> order);
+        page += 1 << order;
+    }
+}
+
+/**
+ * Take a single page out of the free block that contains it
+ * Returns false if the page is not part of any free block
+ */
+static bool buddy_remove_page(uint32_t page) {
+    // Find the order of the free block containing the page
+    uint32_t order = 0;
+    uint32_t base = page;
+    
+    while (!free_area_test(order, base >> order)) {
+        if (++order > PMM_MAX_ORDER) {
+            return false;
+        }
+        base = page & ~((1 << order) - 1);
+    }
+    
+    free_area_clear(order, base >> order);
+    
+    // Split down to the page, freeing the halves that don't contain it
+    while (order > 0) {
+        order--;
+        uint32_t half = 1 << order;
         
-        console_write_string("Initialized with default memory configuration.\n");
-        pmm_print_stats();
+        if (page >= base + half) {
+            free_area_set(order, base >> order);
+            base += half;
+        } else {
+            free_area_set(order, (base + half) >> order);
+        }
+    }
+    
+    return true;
+}
+
+/**
+ * Add a usable region (in pages) to the region list
+ */
+static void region_add(uint32_t start, uint32_t end_page) {
+    if (start >= end_page) {
         return;
     }
     
-    // First, calculate total memory and find largest free block for the bitmap
-    uint64_t highest_addr = 0;
-    uint64_t largest_free_block = 0;
-    uint64_t largest_free_addr = 0;
+    if (region_count >= PMM_MAX_REGIONS) {
+        kprintf("WARNING: Too many memory regions, ignoring the rest\n");
+        return;
+    }
     
-    for (uint32_t i = 0; i < entry_count; i++) {
-        memory_map_entry_t* entry = &memory_map[i];
+    regions[region_count].start = start;
+    regions[region_count].end = end_page;
+    region_count++;
+}
+
+/**
+ * Sort the region list by start page and merge overlapping entries
+ */
+static void region_sort_and_merge(void) {
+    // Insertion sort, the list is short
+    for (uint32_t i = 1; i < region_count; i++) {
+        pmm_region_t key = regions[i];
+        uint32_t j = i;
         
-        // Find the highest memory address
-        uint64_t end_addr = entry->base_addr + entry->length;
-        if (end_addr > highest_addr) {
-            highest_addr = end_addr;
+        while (j > 0 && regions[j - 1].start > key.start) {
+            regions[j] = regions[j - 1];
+            j--;
         }
+        regions[j] = key;
+    }
+    
+    // Merge overlapping and touching regions
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < region_count; i++) {
+        if (merged > 0 && regions[i].start <= regions[merged - 1].end) {
+            if (regions[i].end > regions[merged - 1].end) {
+                regions[merged - 1].end = regions[i].end;
+            }
+        } else {
+            regions[merged++] = regions[i];
+        }
+    }
+    region_count = merged;
+}
+
+/**
+ * Remove a range of pages from the region list
+ */
+static void region_exclude(uint32_t start, uint32_t end_page) {
+    for (uint32_t i = 0; i < region_count; i++) {
+        pmm_region_t* region = &regions[i];
         
-        // Count available memory
-        if (entry->type == MEMORY_REGION_AVAILABLE) {
-            total_memory += entry->length;
+        if (end_page <= region->start || start >= region->end) {
+            continue;
+        }
+        
+        if (start <= region->start && end_page >= region->end) {
+            // Region fully covered: remove it
+            for (uint32_t j = i; j + 1 < region_count; j++) {
+                regions[j] = regions[j + 1];
+            }
+            region_count--;
+            i--;
+        } else if (start <= region->start) {
+            // Trim the head
+            region->start = end_page;
+        } else if (end_page >= region->end) {
+            // Trim the tail
+            region->end = start;
+        } else {
+            // Split in two, keeping the list sorted
+            if (region_count >= PMM_MAX_REGIONS) {
+                kprintf("WARNING: Too many memory regions, dropping a split\n");
+                region->end = start;
+                continue;
+            }
             
-            // Find largest free block for bitmap
-            if (entry->length > largest_free_block) {
-                largest_free_block = entry->length;
-                largest_free_addr = entry->base_addr;
+            for (uint32_t j = region_count; j > i + 1; j--) {
+                regions[j] = regions[j - 1];
             }
+            region_count++;
+            
+            regions[i + 1].start = end_page;
+            regions[i + 1].end = region->end;
+            region->end = start;
+            i++;
         }
     }
+}
+
+/**
+ * Calculate the size of the bitmap and buddy free areas in bytes
+ */
+static uint32_t pmm_metadata_size(void) {
+    // Bitmap and cached bitmap, rounded up to 4 bytes (1 bit per page each)
+    uint32_t words = 2 * (((total_pages + 7) / 8 + 3) / 4);
     
-    // Calculate number of pages
-    total_pages = (uint32_t)(highest_addr / PAGE_SIZE);
-    if (highest_addr % PAGE_SIZE != 0) {
-        total_pages += 1;
+    // Free area bitsets and their summaries
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint32_t blocks = (total_pages + (1 << order) - 1) >> order;
+        uint32_t area_words = (blocks + 31) / 32;
+        
+        words += area_words + (area_words + 31) / 32;
     }
     
+    // Share counts, 16 bits per page
+    words += (total_pages + 1) / 2;
+    
+    return words * 4;
+}
+
+/**
+ * Lay out the bitmap and buddy free areas at the given address
+ */
+static void pmm_setup_metadata(uint32_t* base) {
     // Calculate bitmap size in bytes (1 bit per page)
     bitmap_size = (total_pages + 7) / 8;
     
     // Round up to next 4 bytes for alignment
     bitmap_size = (bitmap_size + 3) & ~3;
     
-    // Place bitmap at the start of the largest free memory block
-    // Explicit cast to prevent warning about different size
-    bitmap = (uint32_t*)((uint32_t)largest_free_addr);
+    bitmap = base;
+    uint32_t* next = bitmap + bitmap_size / 4;
     
     // Initialize bitmap: mark all pages as used initially
     for (uint32_t i = 0; i < bitmap_size / 4; i++) {
         bitmap[i] = 0xFFFFFFFF;
     }
     
-    // Mark available regions as free in the bitmap
-    for (uint32_t i = 0; i < entry_count; i++) {
-        memory_map_entry_t* entry = &memory_map[i];
+    // No frame is cached yet
+    cached = next;
+    next += bitmap_size / 4;
+    for (uint32_t i = 0; i < bitmap_size / 4; i++) {
+        cached[i] = 0;
+    }
+    
+    // Free areas follow the bitmap, all empty initially
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_area_t* area = &free_area[order];
+        uint32_t blocks = (total_pages + (1 << order) - 1) >> order;
+        
+        area->words = (blocks + 31) / 32;
+        area->summary_words = (area->words + 31) / 32;
+        area->bits = next;
+        area->summary = next + area->words;
+        area->hint = area->words;
+        area->count = 0;
+        next += area->words + area->summary_words;
+        
+        for (uint32_t i = 0; i < area->words + area->summary_words; i++) {
+            area->bits[i] = 0;
+        }
+    }
+    
+    // Share counts follow the free areas, no page is shared yet
+    page_shares = (uint16_t*)next;
+    for (uint32_t i = 0; i < total_pages; i++) {
+        page_shares[i] = 0;
+    }
+}
+
+/**
+ * Initialize the physical memory manager using the memory map
+ */
+void pmm_init(memory_map_entry_t* memory_map, uint32_t entry_count) {
+    kprintf("Initializing Physical Memory Manager...\n");
+    
+    region_count = 0;
+    total_memory = 0;
+    untracked_memory = 0;
+    
+    // If we don't have a valid memory map, use default conservative values
+    if (memory_map == NULL || entry_count == 0) {
+        kprintf("Warning: No memory map provided. Using conservative defaults.\n");
         
-        if (entry->type == MEMORY_REGION_AVAILABLE) {
-            uint32_t start_page = (uint32_t)(entry->base_addr / PAGE_SIZE);
-            uint32_t end_page = (uint32_t)((entry->base_addr + entry->length) / PAGE_SIZE);
+        // Assume a conservative memory size (16MB) with a safe free region (4MB to 8MB)
+        total_memory = 16 * 1024 * 1024;
+        region_add((4 * 1024 * 1024) / PAGE_SIZE, (8 * 1024 * 1024) / PAGE_SIZE);
+    } else {
+        // Collect available regions, shrunk to whole pages
+        for (uint32_t i = 0; i < entry_count; i++) {
+            memory_map_entry_t* entry = &memory_map[i];
+            
+            if (entry->type != MEMORY_REGION_AVAILABLE || entry->length == 0) {
+                continue;
+            }
             
-            for (uint32_t page = start_page; page < end_page; page++) {
-                bitmap_clear(page);
+            uint64_t start = (entry->base_addr + PAGE_SIZE - 1) / PAGE_SIZE;
+            uint64_t end_page = (entry->base_addr + entry->length) / PAGE_SIZE;
+            
+            // Pages beyond PMM_MAX_ADDRESS aren't tracked
+            if (end_page > PMM_MAX_PAGES) {
+                uint64_t untracked_start = start > PMM_MAX_PAGES ? start : PMM_MAX_PAGES;
+                untracked_memory += (end_page - untracked_start) * PAGE_SIZE;
+                end_page = PMM_MAX_PAGES;
+            }
+            if (start < end_page) {
+                region_add((uint32_t)start, (uint32_t)end_page);
             }
         }
+        
+        // Don't trust the BIOS order or that entries don't overlap
+        region_sort_and_merge();
+        
+        // Reserved entries win over overlapping available ones
+        for (uint32_t i = 0; i < entry_count; i++) {
+            memory_map_entry_t* entry = &memory_map[i];
+            
+            if (entry->type == MEMORY_REGION_AVAILABLE || entry->length == 0) {
+                continue;
+            }
+            
+            uint64_t start = entry->base_addr / PAGE_SIZE;
+            uint64_t end_page = (entry->base_addr + entry->length + PAGE_SIZE - 1) / PAGE_SIZE;
+            if (start < PMM_MAX_PAGES) {
+                region_exclude((uint32_t)start, end_page > PMM_MAX_PAGES ? PMM_MAX_PAGES : (uint32_t)end_page);
+            }
+        }
+        
+        for (uint32_t i = 0; i < region_count; i++) {
+            total_memory += (uint64_t)(regions[i].end - regions[i].start) * PAGE_SIZE;
+        }
+    }
+    
+    if (untracked_memory > 0) {
+        kprintf("WARNING: %d MB above 64GB is not usable, the PMM doesn't track it\n",
+                (int)(untracked_memory / 1024 / 1024));
     }
     
-    // Mark bitmap itself as used
-    uint32_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    uint32_t bitmap_start_page = (uint32_t)((uint32_t)bitmap / PAGE_SIZE);
+    if (region_count == 0) {
+        kprintf("ERROR: No usable physical memory!\n");
+        return;
+    }
     
-    for (uint32_t page = bitmap_start_page; page < bitmap_start_page + bitmap_pages; page++) {
-        bitmap_set(page);
+    // The bitmap only needs to cover pages up to the end of the last usable region
+    total_pages = regions[region_count - 1].end;
+    if (total_pages < total_memory / PAGE_SIZE) {
+        total_pages = (uint32_t)(total_memory / PAGE_SIZE);
     }
     
-    // Mark kernel and low memory (0-1MB) as used
+    // Kernel and low memory (0-1MB) are never handed out
     uint32_t kernel_end_page = ((uint32_t)&end + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint32_t page = 0; page < kernel_end_page; page++) {
-        bitmap_set(page);
+    region_exclude(0, kernel_end_page);
+    
+    // Place metadata in the lowest region that can hold it, which is normally
+    // right after the kernel. Paging identity-maps everything up to its end
+    uint32_t metadata_size = pmm_metadata_size();
+    uint32_t metadata_pages = (metadata_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t metadata_page = 0;
+    
+    for (uint32_t i = 0; i < region_count; i++) {
+        if (regions[i].end - regions[i].start >= metadata_pages) {
+            metadata_page = regions[i].start;
+            break;
+        }
     }
     
-    // Calculate free and used memory
+    if (metadata_page == 0 || metadata_page + metadata_pages > PMM_METADATA_LIMIT / PAGE_SIZE) {
+        kprintf("ERROR: No room for the physical memory bitmap!\n");
+        return;
+    }
+    
+    pmm_setup_metadata((uint32_t*)(metadata_page * PAGE_SIZE));
+    region_exclude(metadata_page, metadata_page + metadata_pages);
+    metadata_end = (metadata_page + metadata_pages) * PAGE_SIZE;
+    
+    // Free whole regions at once: a few word stores and buddy blocks each
     free_memory = 0;
-    for (uint32_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            free_memory += PAGE_SIZE;
-        }
+    for (uint32_t i = 0; i < region_count; i++) {
+        bitmap_clear_range(regions[i].start, regions[i].end - regions[i].start);
+        buddy_add_range(regions[i].start, regions[i].end);
+        free_memory += (uint64_t)(regions[i].end - regions[i].start) * PAGE_SIZE;
     }
     used_memory = total_memory - free_memory;
     
     // Print memory stats
-    console_write_string("Physical memory manager initialized.\n");
+    kprintf("Physical memory manager initialized.\n");
     pmm_print_stats();
 }
 
+/**
+ * Take a free block of 2^order pages ending at or below page limit, 0 if there is none
+ * Caller holds pmm_lock
+ */
+static uint64_t buddy_alloc(uint32_t order, uint32_t limit) {
+    // Find the smallest order that has a free block low enough, the lowest
+    // block of an order is its only candidate (the rest are higher still)
+    uint32_t current = order;
+    uint32_t index = 0xFFFFFFFF;
+    
+    while (current <= PMM_MAX_ORDER) {
+        index = free_area_find(current);
+        if (index != 0xFFFFFFFF && (index << current) + (1u << order) <= limit) {
+            break;
+        }
+        index = 0xFFFFFFFF;
+        current++;
+    }
+    
+    if (index == 0xFFFFFFFF) {
+        // No free block large enough
+        return 0;
+    }
+    
+    free_area_clear(current, index);
+    uint32_t page = index << current;
+    
+    // Split the block, returning the upper halves to the lower orders
+    while (current > order) {
+        current--;
+        free_area_set(current, (page + (1 << current)) >> current);
+    }
+    
+    // Mark the pages as used
+    bitmap_set_range(page, 1 << order);
+    
+    // Update stats
+    free_memory -= PAGE_SIZE << order;
+    used_memory += PAGE_SIZE << order;
+    
+    // Return the physical address
+    return (uint64_t)page * PAGE_SIZE;
+}
+
+/**
+ * Return a block of 2^order pages to the buddy allocator
+ * Caller holds pmm_lock
+ */
+static void buddy_free(uint64_t addr, uint32_t order) {
+    uint64_t page = addr / PAGE_SIZE;
+    
+    // Check if the block is valid
+    if (order > PMM_MAX_ORDER || (page & ((1 << order) - 1)) != 0 ||
+        page + (1 << order) > total_pages) {
+        kprintf("ERROR: Attempted to free invalid page!\n");
+        return;
+    }
+    
+    // Check if any page of the block is already free (cached frames are free too)
+    if (!bitmap_range_used((uint32_t)page, 1 << order) || cached_range_any((uint32_t)page, 1 << order)) {
+        kprintf("WARNING: Attempted to free already free page!\n");
+        return;
+    }
+    
+    // Mark the pages as free and merge with free buddies
+    bitmap_clear_range((uint32_t)page, 1 << order);
+    buddy_insert((uint32_t)page, order);
+    
+    // Update stats
+    free_memory += PAGE_SIZE << order;
+    used_memory -= PAGE_SIZE << order;
+}
+
+/**
+ * Allocate 2^order physically contiguous pages
+ */
+uint64_t pmm_alloc_pages(uint32_t order) {
+    PROFILE_SCOPE(pmm_alloc_pages);
+    
+    if (order > PMM_MAX_ORDER) {
+        kprintf("ERROR: Invalid allocation order!\n");
+        return 0;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t addr = buddy_alloc(order, total_pages);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (addr == 0) {
+        kprintf("ERROR: Out of physical memory!\n");
+    }
+    
+    return addr;
+}
+
+/**
+ * Allocate 2^order physically contiguous pages below PMM_LOW_ADDRESS
+ */
+uint32_t pmm_alloc_low_pages(uint32_t order) {
+    if (order > PMM_MAX_ORDER) {
+        kprintf("ERROR: Invalid allocation order!\n");
+        return 0;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t addr = (uint32_t)buddy_alloc(order, total_pages < PMM_LOW_PAGES ? total_pages : PMM_LOW_PAGES);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (addr == 0) {
+        kprintf("ERROR: Out of physical memory below 4GB!\n");
+    }
+    
+    return addr;
+}
+
+/**
+ * Free a block of 2^order pages
+ */
+void pmm_free_pages(uint64_t addr, uint32_t order) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    buddy_free(addr, order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/**
+ * Get the amount of available memory above PMM_MAX_ADDRESS
+ */
+uint64_t pmm_get_untracked_memory(void) {
+    return untracked_memory;
+}
+
+/**
+ * Get the physical address where the PMM's own data ends
+ */
+uint32_t pmm_get_metadata_end(void) {
+    return metadata_end;
+}
+
+/**
+ * Get the largest order with a free block
+ */
+int pmm_largest_free_order(void) {
+    // Unlocked: the answer is only a hint once the lock would be dropped anyway
+    for (int order = PMM_MAX_ORDER; order >= 0; order--) {
+        if (free_area[order].count > 0) {
+            return order;
+        }
+    }
+    
+    return -1;
+}
+
+/**
+ * Take a frame from this CPU's magazine, 0 if memory is exhausted
+ */
+static uint64_t magazine_alloc(void) {
+    uint32_t flags = interrupts_save();
+    pmm_magazine_t* mag = &magazines[smp_cpu_index()];
+    
+    // Refill an empty magazine with a batch of frames under a single lock
+    if (mag->count == 0) {
+        spin_lock(&pmm_lock);
+        uint32_t batch = magazine_depth / 2;
+        while (mag->count < batch) {
+            uint64_t frame = buddy_alloc(0, total_pages);
+            if (frame == 0) {
+                break;
+            }
+            cached_mark((uint32_t)(frame / PAGE_SIZE));
+            mag->frames[mag->count++] = frame;
+        }
+        magazine_refills++;
+        spin_unlock(&pmm_lock);
+    }
+    
+    uint64_t frame = 0;
+    if (mag->count > 0) {
+        frame = mag->frames[--mag->count];
+        cached_clear((uint32_t)(frame / PAGE_SIZE));
+        mag->allocs++;
+    }
+    interrupts_restore(flags);
+    
+    return frame;
+}
+
+/**
+ * Pop a frame from the zeroed pool, 0 if the pool is empty
+ */
+static uint64_t zero_pool_pop(bool count_request) {
+    uint32_t flags = spin_lock_irqsave(&zero_lock);
+    uint64_t frame = 0;
+    if (zero_count > 0) {
+        frame = zero_pool[--zero_count];
+        cached_clear((uint32_t)(frame / PAGE_SIZE));
+    }
+    if (count_request) {
+        if (frame != 0) {
+            zero_hits++;
+        } else {
+            zero_misses++;
+        }
+    }
+    spin_unlock_irqrestore(&zero_lock, flags);
+    
+    return frame;
+}
+
+/**
+ * Take a frame from the zeroed pool, 0 if the pool is empty
+ */
+uint64_t pmm_take_zeroed_page(void) {
+    return zero_pool_pop(true);
+}
+
 /**
  * Allocate a physical page
  */
-uint32_t pmm_alloc_page(void) {
-    // Find a free page
-    for (uint32_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            // Mark the page as used
-            bitmap_set(i);
-            
-            // Update stats
-            free_memory -= PAGE_SIZE;
-            used_memory += PAGE_SIZE;
-            
-            // Return the physical address
-            return i * PAGE_SIZE;
+uint64_t pmm_alloc_page(void) {
+    PROFILE_SCOPE(pmm_alloc_page);
+    
+    uint64_t frame = magazine_alloc();
+    
+    // Zeroed frames are still free memory, use them before giving up
+    if (frame == 0) {
+        frame = zero_pool_pop(false);
+    }
+    
+    if (frame == 0) {
+        kprintf("ERROR: Out of physical memory!\n");
+    }
+    
+    return frame;
+}
+
+/**
+ * Clear a frame through this CPU's temporary mapping, any frame can be cleared
+ * Streaming stores keep a background clear from evicting the running tasks' data
+ */
+static void zero_frame(uint64_t frame, bool streaming) {
+    uint32_t flags = interrupts_save();
+    void* page = paging_map_temporary(frame);
+    if (streaming) {
+        memzero_nt(page, PAGE_SIZE);
+    } else {
+        memset(page, 0, PAGE_SIZE);
+    }
+    paging_unmap_temporary(page);
+    interrupts_restore(flags);
+}
+
+/**
+ * Allocate a physical page filled with zeros
+ */
+uint64_t pmm_alloc_zeroed_page(void) {
+    uint64_t frame = pmm_take_zeroed_page();
+    if (frame != 0) {
+        return frame;
+    }
+    
+    // Pool is empty: clear a frame now
+    frame = pmm_alloc_page();
+    if (frame != 0) {
+        zero_frame(frame, false);
+    }
+    
+    return frame;
+}
+
+/**
+ * Top up the zeroed pool, clearing at most max_pages frames
+ */
+uint32_t pmm_refill_zeroed_pages(uint32_t max_pages) {
+    uint32_t zeroed = 0;
+    
+    // Hand back frames above a lowered watermark
+    while (zero_count > zero_watermark) {
+        uint64_t frame = zero_pool_pop(false);
+        if (frame == 0) {
+            break;
         }
+        pmm_free_page(frame);
     }
     
-    // No free pages available
-    console_write_string("ERROR: Out of physical memory!\n");
-    return 0;
+    while (zeroed < max_pages) {
+        // Unlocked reads: both are only hints, the push below rechecks the pool
+        if (zero_count >= zero_watermark || free_memory / PAGE_SIZE < 2 * zero_watermark) {
+            break;
+        }
+        
+        uint64_t frame = magazine_alloc();
+        if (frame == 0) {
+            break;
+        }
+        
+        zero_frame(frame, true);
+        
+        uint32_t flags = spin_lock_irqsave(&zero_lock);
+        bool pooled = zero_count < zero_watermark;
+        if (pooled) {
+            cached_mark((uint32_t)(frame / PAGE_SIZE));
+            zero_pool[zero_count++] = frame;
+        }
+        spin_unlock_irqrestore(&zero_lock, flags);
+        
+        if (!pooled) {
+            pmm_free_page(frame);
+            break;
+        }
+        zeroed++;
+    }
+    
+    return zeroed;
+}
+
+/**
+ * Set how many zeroed frames the idle task keeps ready
+ */
+void pmm_set_zero_watermark(uint32_t pages) {
+    if (pages > PMM_ZERO_POOL_SIZE) {
+        kprintf("WARNING: Zeroed pool watermark clamped to %u pages\n", PMM_ZERO_POOL_SIZE);
+        pages = PMM_ZERO_POOL_SIZE;
+    }
+    
+    // Excess frames are released by the next refill
+    zero_watermark = pages;
+}
+
+/**
+ * Get the zeroed pool's state
+ */
+void pmm_get_zero_pool_stats(uint32_t* count, uint32_t* watermark, uint32_t* hits, uint32_t* misses) {
+    uint32_t flags = spin_lock_irqsave(&zero_lock);
+    *count = zero_count;
+    *watermark = zero_watermark;
+    *hits = zero_hits;
+    *misses = zero_misses;
+    spin_unlock_irqrestore(&zero_lock, flags);
 }
 
 /**
  * Free a physical page
  */
-void pmm_free_page(uint32_t page_addr) {
-    uint32_t page = page_addr / PAGE_SIZE;
+void pmm_free_page(uint64_t page_addr) {
+    PROFILE_SCOPE(pmm_free_page);
     
-    // Check if the page is valid
-    if (page >= total_pages) {
-        console_write_string("ERROR: Attempted to free invalid page!\n");
+    // Invalid or already free frames go to the buddy allocator, which reports them
+    // (frames already sitting in a magazine or the zeroed pool are caught below)
+    if ((page_addr & (PAGE_SIZE - 1)) != 0 || page_addr / PAGE_SIZE >= total_pages ||
+        !bitmap_test((uint32_t)(page_addr / PAGE_SIZE))) {
+        pmm_free_pages(page_addr, 0);
+        return;
+    }
+    uint32_t page = (uint32_t)(page_addr / PAGE_SIZE);
+    
+    // A shared page just loses a reference
+    if (page_shares[page] != 0) {
+        uint32_t lock_flags = spin_lock_irqsave(&pmm_lock);
+        bool shared = page_shares[page] != 0;
+        if (shared) {
+            page_shares[page]--;
+        }
+        spin_unlock_irqrestore(&pmm_lock, lock_flags);
+        
+        if (shared) {
+            return;
+        }
+    }
+    
+    // A frame that is already cached was freed twice
+    if (cached_mark(page)) {
+        kprintf("WARNING: Attempted to free already free page!\n");
         return;
     }
     
-    // Check if the page is already free
-    if (!bitmap_test(page)) {
-        console_write_string("WARNING: Attempted to free already free page!\n");
+    uint32_t flags = interrupts_save();
+    pmm_magazine_t* mag = &magazines[smp_cpu_index()];
+    
+    // Drain a full magazine back to the buddy allocator in one batch
+    // (a magazine above a lowered depth drains down to it)
+    if (mag->count >= magazine_depth) {
+        spin_lock(&pmm_lock);
+        while (mag->count > magazine_depth - magazine_depth / 2) {
+            uint64_t frame = mag->frames[--mag->count];
+            cached_clear((uint32_t)(frame / PAGE_SIZE));
+            buddy_free(frame, 0);
+        }
+        magazine_drains++;
+        spin_unlock(&pmm_lock);
+    }
+    
+    mag->frames[mag->count++] = page_addr;
+    mag->frees++;
+    interrupts_restore(flags);
+}
+
+/**
+ * Set how many frames each per-CPU magazine holds
+ */
+void pmm_set_magazine_depth(uint32_t depth) {
+    if (depth < 2 || depth > PMM_MAGAZINE_MAX) {
+        kprintf("ERROR: PMM magazine depth must be 2 to %u frames\n", PMM_MAGAZINE_MAX);
         return;
     }
     
-    // Mark the page as free
-    bitmap_clear(page);
+    // Fuller magazines drain down the next time a frame is freed into them
+    magazine_depth = depth;
+}
+
+/**
+ * Get the per-CPU magazine depth
+ */
+uint32_t pmm_get_magazine_depth(void) {
+    return magazine_depth;
+}
+
+/**
+ * Get the running totals of single-frame traffic
+ */
+void pmm_get_activity(pmm_activity_t* activity) {
+    // Unlocked: the counters only grow, a slightly stale sum is fine
+    activity->allocs = 0;
+    activity->frees = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        activity->allocs += magazines[cpu].allocs;
+        activity->frees += magazines[cpu].frees;
+    }
+    activity->refills = magazine_refills;
+    activity->drains = magazine_drains;
+}
+
+/**
+ * Add a reference to an allocated page
+ */
+bool pmm_share_page(uint64_t page_addr) {
+    uint32_t page = page_index(page_addr);
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    
+    if (page >= total_pages || !bitmap_test(page) || cached_range_any(page, 1)) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        kprintf("ERROR: Attempted to share a free page!\n");
+        return false;
+    }
+    
+    if (page_shares[page] == 0xFFFF) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        kprintf("ERROR: Too many references to a shared page\n");
+        return false;
+    }
     
-    // Update stats
-    free_memory += PAGE_SIZE;
-    used_memory -= PAGE_SIZE;
+    page_shares[page]++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return true;
+}
+
+/**
+ * Get the number of references to a page
+ */
+uint32_t pmm_page_refs(uint64_t page_addr) {
+    uint32_t page = page_index(page_addr);
+    if (page >= total_pages || !bitmap_test(page)) {
+        return 0;
+    }
+    
+    // Unlocked: only a snapshot unless the caller keeps the sharers from changing
+    return 1 + page_shares[page];
+}
+
+/**
+ * Count the frames sitting in per-CPU magazines
+ */
+static uint32_t magazine_frames(void) {
+    // Unlocked: other CPUs' counts can change underneath, so this is a snapshot
+    uint32_t frames = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        frames += magazines[cpu].count;
+    }
+    return frames;
 }
 
 /**
@@ -246,73 +1179,82 @@ uint64_t pmm_get_total_memory(void) {
  * Get the amount of free physical memory
  */
 uint64_t pmm_get_free_memory(void) {
-    return free_memory;
+    // Frames cached in magazines or the zeroed pool are free, just not in the buddy allocator
+    return free_memory + (uint64_t)(magazine_frames() + zero_count) * PAGE_SIZE;
 }
 
 /**
  * Get the amount of used physical memory
  */
 uint64_t pmm_get_used_memory(void) {
-    return used_memory;
+    return used_memory - (uint64_t)(magazine_frames() + zero_count) * PAGE_SIZE;
 }
 
 /**
  * Print memory statistics
  */
 void pmm_print_stats(void) {
-    console_write_string("Memory Statistics:\n");
+    kprintf("Memory Statistics:\n");
     
-    console_write_string("  Total memory: ");
-    console_write_int((int)(total_memory / 1024 / 1024));
-    console_write_string(" MB\n");
+    kprintf("  Total memory: %d MB\n", (int)(total_memory / 1024 / 1024));
     
-    console_write_string("  Used memory:  ");
-    console_write_int((int)(used_memory / 1024 / 1024));
-    console_write_string(" MB\n");
+    kprintf("  Used memory:  %d MB\n", (int)(pmm_get_used_memory() / 1024 / 1024));
     
-    console_write_string("  Free memory:  ");
-    console_write_int((int)(free_memory / 1024 / 1024));
-    console_write_string(" MB\n");
+    kprintf("  Free memory:  %d MB\n", (int)(pmm_get_free_memory() / 1024 / 1024));
     
-    console_write_string("  Total pages:  ");
-    console_write_int(total_pages);
-    console_write_string("\n");
+    kprintf("  Total pages:  %u\n", total_pages);
+    
+    kprintf("  Zeroed pool:  %u/%u pages (%u hits, %u misses)\n",
+            zero_count, zero_watermark, zero_hits, zero_misses);
+    
+    if (untracked_memory > 0) {
+        kprintf("  Above 64GB:   %d MB (not tracked)\n", (int)(untracked_memory / 1024 / 1024));
+    }
 }
 
 /**
  * Mark a specific page as used
  */
-void pmm_mark_page_used(uint32_t page_addr) {
-    uint32_t page = page_addr / PAGE_SIZE;
+void pmm_mark_page_used(uint64_t page_addr) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    
+    uint32_t page = page_index(page_addr);
     
     // Check if the page is valid
     if (page >= total_pages) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
         return;
     }
     
     // Check if the page is already marked as used
     if (bitmap_test(page)) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
         return;
     }
     
+    // Take the page out of its free block
+    buddy_remove_page(page);
+    
     // Mark the page as used
     bitmap_set(page);
     
     // Update stats
     free_memory -= PAGE_SIZE;
     used_memory += PAGE_SIZE;
+    
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
 /**
  * Check if a specific page is free
  */
-bool pmm_is_page_free(uint32_t page_addr) {
-    uint32_t page = page_addr / PAGE_SIZE;
+bool pmm_is_page_free(uint64_t page_addr) {
+    uint32_t page = page_index(page_addr);
     
     // Check if the page is valid
     if (page >= total_pages) {
         return false;
     }
     
-    return !bitmap_test(page);
+    return !bitmap_test(page) || cached_range_any(page, 1);
 }
\ No newline at end of file
@@ -0,0 +1,518 @@
+/**
+ * NKOF Slab Allocator Implementation
+ *
+ * This file implements slab caches for fixed-size kernel objects.
+ * Every slab is SLAB_SIZE bytes, aligned to SLAB_SIZE, with a slab_t header
+ * at its start followed by the objects. Free objects are chained through
+ * their first word, so allocation and free are O(1).
+ * Caches are protected by the paging lock, shared with the heap.
+ * Each CPU keeps a small magazine of free objects per cache, so most
+ * allocations and frees only disable interrupts and take no lock.
+ * Retired caches skip the magazines and release slabs once they are empty,
+ * each CPU emptying its own magazines of them from its idle task.
+ */
+
+#include "../include/slab.h"
+#include "../include/kheap.h"
+#include "../include/paging.h"
+#include "../include/vmalloc.h"
+#include "../include/klog.h"
+#include "../include/interrupts.h"
+#include "../include/string.h"
+
+// Magic number for slab headers
+#define SLAB_MAGIC 0x51AB51AB
+
+// Default object alignment
+#define SLAB_DEFAULT_ALIGN 8
+
+// Cache of kmem_cache_t descriptors, so creating a cache needs no kmalloc
+static kmem_cache_t cache_cache;
+
+// All caches, for statistics
+static kmem_cache_t* cache_list = NULL;
+
+// Objects a magazine holds before draining, half of them move per refill or drain
+static uint32_t magazine_depth = SLAB_MAGAZINE_SIZE;
+
+// Trips to the slabs to refill or drain a magazine (under the paging lock)
+static uint32_t magazine_refills = 0;
+static uint32_t magazine_drains = 0;
+
+// Bumped each time a cache is retired, a CPU reaps its magazines when it falls behind
+static uint32_t retire_generation = 0;
+static uint32_t reaped_generation[SMP_MAX_CPUS];
+
+// Slabs in the vmalloc window (1 = a slab lives there), set under the paging lock
+// kmem_cache_of reads it without the lock, so a pointer is only followed into a
+// header that exists instead of into a released or never committed area
+#define SLAB_MAP_BITS ((VMALLOC_END - VMALLOC_START) / SLAB_SIZE)
+
+static uint32_t slab_map[SLAB_MAP_BITS / 32];
+
+/**
+ * Record that a slab lives at an address, or no longer does
+ */
+static void slab_map_set(slab_t* slab, bool live) {
+    uint32_t index = ((uint32_t)slab - VMALLOC_START) / SLAB_SIZE;
+    uint32_t bit = 1u << (index % 32);
+    if (live) {
+        __atomic_fetch_or(&slab_map[index / 32], bit, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&slab_map[index / 32], ~bit, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Remove a slab from a list
+ */
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/**
+ * Push a slab onto the front of a list
+ */
+static void slab_list_push(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    
+    *list = slab;
+}
+
+/**
+ * Offset of the first object in a slab
+ */
+static inline uint32_t slab_first_object(kmem_cache_t* cache) {
+    return (sizeof(slab_t) + cache->align - 1) & ~(cache->align - 1);
+}
+
+/**
+ * Get a new slab for a cache and chain its objects into a free list
+ */
+static slab_t* slab_grow(kmem_cache_t* cache) {
+    slab_t* slab = (slab_t*)kheap_map_pages(SLAB_SIZE / PAGE_SIZE, SLAB_SIZE);
+    if (!slab) {
+        kprintf("ERROR: Out of memory for slab cache %s\n", cache->name);
+        return NULL;
+    }
+    
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->in_use = 0;
+    
+    // Chain the objects, lowest address first
+    uint8_t* obj = (uint8_t*)slab + slab_first_object(cache);
+    slab->free_list = obj;
+    
+    for (uint32_t i = 0; i + 1 < cache->objects_per_slab; i++) {
+        *(void**)obj = obj + cache->object_size;
+        obj += cache->object_size;
+    }
+    *(void**)obj = NULL;
+    
+    slab_map_set(slab, true);
+    cache->slab_count++;
+    return slab;
+}
+
+/**
+ * Give an empty slab back to the heap's page area
+ * Caller holds the paging lock
+ */
+static void slab_release(kmem_cache_t* cache, slab_t* slab) {
+    slab_list_remove(&cache->partial, slab);
+    slab_map_set(slab, false);
+    slab->magic = 0;
+    cache->slab_count--;
+    kheap_unmap_pages(slab, SLAB_SIZE / PAGE_SIZE);
+}
+
+/**
+ * Release every empty slab of a cache
+ * Caller holds the paging lock
+ */
+static void cache_release_empty(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    while (slab) {
+        slab_t* next = slab->next;
+        if (slab->in_use == 0) {
+            slab_release(cache, slab);
+        }
+        slab = next;
+    }
+}
+
+/**
+ * Set up a cache descriptor
+ */
+static void cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align) {
+    if (align < SLAB_DEFAULT_ALIGN) {
+        align = SLAB_DEFAULT_ALIGN;
+    }
+    
+    // Objects must be able to hold the free list link
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    
+    cache->name = name;
+    cache->align = align;
+    cache->object_size = (size + align - 1) & ~(align - 1);
+    cache->objects_per_slab = (SLAB_SIZE - slab_first_object(cache)) / cache->object_size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->slab_count = 0;
+    cache->objects_in_use = 0;
+    cache->retired = false;
+    memset(cache->magazines, 0, sizeof(cache->magazines));
+    
+    cache->next = cache_list;
+    cache_list = cache;
+}
+
+/**
+ * Initialize the slab allocator
+ */
+void slab_init(void) {
+    cache_list = NULL;
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0);
+}
+
+/**
+ * Create a cache for objects of the given size and alignment
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+    // Alignment must be a power of 2
+    if (align & (align - 1)) {
+        return NULL;
+    }
+    
+    if (size == 0 || size > SLAB_MAX_OBJECT_SIZE || align > SLAB_MAX_OBJECT_SIZE) {
+        kprintf("ERROR: Unsupported slab object size\n");
+        return NULL;
+    }
+    
+    paging_lock();
+    
+    kmem_cache_t* cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        paging_unlock();
+        return NULL;
+    }
+    
+    cache_setup(cache, name, size, align);
+    paging_unlock();
+    return cache;
+}
+
+/**
+ * Take an object from the slabs, NULL if the cache can't grow
+ * Caller holds the paging lock
+ */
+static void* slab_alloc_object(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    
+    // No partially used slab left: grow the cache
+    if (!slab) {
+        slab = slab_grow(cache);
+        if (!slab) {
+            return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+    
+    // Pop the first free object
+    void* obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    slab->in_use++;
+    cache->objects_in_use++;
+    
+    // Slab is now full, move it out of the way
+    if (!slab->free_list) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    
+    return obj;
+}
+
+/**
+ * Put an object back in its slab
+ * Caller holds the paging lock
+ */
+static void slab_free_object(kmem_cache_t* cache, void* obj) {
+    slab_t* slab = (slab_t*)((uint32_t)obj & ~(SLAB_SIZE - 1));
+    
+    // Slab was full, it has a free object again
+    if (!slab->free_list) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    
+    // Push the object
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->objects_in_use--;
+}
+
+/**
+ * Allocate an object from a cache
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    // Fast path: pop from this CPU's magazine
+    uint32_t flags = interrupts_save();
+    slab_magazine_t* mag = &cache->magazines[smp_cpu_index()];
+    if (mag->count > 0) {
+        void* obj = mag->objects[--mag->count];
+        interrupts_restore(flags);
+        return obj;
+    }
+    interrupts_restore(flags);
+    
+    // Slow path: refill the magazine with a batch from the slabs
+    // The paging lock disables interrupts, so the CPU can't change until it's dropped
+    paging_lock();
+    
+    // Retired caches only see allocations that raced with their retirement
+    if (cache->retired) {
+        void* obj = slab_alloc_object(cache);
+        paging_unlock();
+        return obj;
+    }
+    
+    mag = &cache->magazines[smp_cpu_index()];
+    uint32_t batch = magazine_depth / 2;
+    while (mag->count < batch) {
+        void* obj = slab_alloc_object(cache);
+        if (!obj) {
+            break;
+        }
+        mag->objects[mag->count++] = obj;
+    }
+    magazine_refills++;
+    
+    void* obj = mag->count > 0 ? mag->objects[--mag->count] : NULL;
+    
+    paging_unlock();
+    return obj;
+}
+
+/**
+ * Return an object to its cache
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!obj) {
+        return;
+    }
+    
+    slab_t* slab = (slab_t*)((uint32_t)obj & ~(SLAB_SIZE - 1));
+    
+    // Check the slab header (never changes while the slab holds objects)
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        kprintf("ERROR: Attempt to free object to the wrong slab cache\n");
+        return;
+    }
+    
+    // Fast path: push onto this CPU's magazine
+    // (checked with interrupts off, so this CPU's reap can't slip in before the push)
+    uint32_t flags = interrupts_save();
+    slab_magazine_t* mag = &cache->magazines[smp_cpu_index()];
+    if (!cache->retired && mag->count < magazine_depth) {
+        mag->objects[mag->count++] = obj;
+        interrupts_restore(flags);
+        return;
+    }
+    interrupts_restore(flags);
+    
+    // Slow path: drain a batch back to the slabs to make room
+    paging_lock();
+    
+    // Objects of a retired cache go straight back, the last one out releases the slab
+    if (cache->retired) {
+        slab_free_object(cache, obj);
+        if (slab->in_use == 0) {
+            slab_release(cache, slab);
+        }
+        paging_unlock();
+        return;
+    }
+    
+    // A magazine above a lowered depth drains down to it
+    mag = &cache->magazines[smp_cpu_index()];
+    while (mag->count > magazine_depth - magazine_depth / 2) {
+        slab_free_object(cache, mag->objects[--mag->count]);
+    }
+    mag->objects[mag->count++] = obj;
+    magazine_drains++;
+    
+    paging_unlock();
+}
+
+/**
+ * Retire a cache, or bring it back into use
+ */
+void kmem_cache_set_retired(kmem_cache_t* cache, bool retired) {
+    paging_lock();
+    
+    if (retired && !cache->retired) {
+        cache->retired = true;
+        retire_generation++;
+        
+        // This CPU's magazine empties now, the others from their idle tasks
+        slab_magazine_t* mag = &cache->magazines[smp_cpu_index()];
+        while (mag->count > 0) {
+            slab_free_object(cache, mag->objects[--mag->count]);
+        }
+        cache_release_empty(cache);
+    } else if (!retired) {
+        cache->retired = false;
+    }
+    
+    paging_unlock();
+}
+
+/**
+ * Empty this CPU's magazines of retired caches
+ */
+void slab_reap(void) {
+    // Unlocked check: nothing was retired since this CPU last looked
+    uint32_t cpu = smp_cpu_index();
+    if (__atomic_load_n(&retire_generation, __ATOMIC_RELAXED) == reaped_generation[cpu]) {
+        return;
+    }
+    
+    paging_lock();
+    
+    // The paging lock keeps interrupts off, so this CPU can't change underneath
+    cpu = smp_cpu_index();
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        if (!cache->retired) {
+            continue;
+        }
+        
+        slab_magazine_t* mag = &cache->magazines[cpu];
+        while (mag->count > 0) {
+            slab_free_object(cache, mag->objects[--mag->count]);
+        }
+        cache_release_empty(cache);
+    }
+    reaped_generation[cpu] = retire_generation;
+    
+    paging_unlock();
+}
+
+/**
+ * Set how many objects each per-CPU magazine holds
+ */
+void slab_set_magazine_depth(uint32_t depth) {
+    if (depth < 2 || depth > SLAB_MAGAZINE_SIZE) {
+        kprintf("ERROR: Slab magazine depth must be 2 to %u objects\n", SLAB_MAGAZINE_SIZE);
+        return;
+    }
+    
+    magazine_depth = depth;
+}
+
+/**
+ * Get the per-CPU magazine depth
+ */
+uint32_t slab_get_magazine_depth(void) {
+    return magazine_depth;
+}
+
+/**
+ * Get how often magazines went to the slabs
+ */
+void slab_get_activity(uint32_t* refills, uint32_t* drains) {
+    *refills = magazine_refills;
+    *drains = magazine_drains;
+}
+
+/**
+ * Count the objects a cache has handed out, excluding those cached in magazines
+ */
+static uint32_t cache_objects_in_use(kmem_cache_t* cache) {
+    // Other CPUs' magazines are read without their interrupts off, so this is a snapshot
+    uint32_t cached = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cached += cache->magazines[cpu].count;
+    }
+    return cache->objects_in_use - cached;
+}
+
+/**
+ * Find the cache that owns an object
+ */
+kmem_cache_t* kmem_cache_of(const void* obj) {
+    uint32_t addr = (uint32_t)obj;
+    
+    // Only read headers of slabs that exist, obj may be anything
+    if (addr < VMALLOC_START || addr >= VMALLOC_END) {
+        return NULL;
+    }
+    uint32_t index = (addr - VMALLOC_START) / SLAB_SIZE;
+    if (!(__atomic_load_n(&slab_map[index / 32], __ATOMIC_ACQUIRE) & (1u << (index % 32)))) {
+        return NULL;
+    }
+    
+    slab_t* slab = (slab_t*)(addr & ~(SLAB_SIZE - 1));
+    if (slab->magic != SLAB_MAGIC || addr < (uint32_t)slab + sizeof(slab_t)) {
+        return NULL;
+    }
+    
+    return slab->cache;
+}
+
+/**
+ * Get slab memory statistics
+ */
+void slab_get_stats(size_t* total, size_t* used) {
+    paging_lock();
+    
+    size_t slab_bytes = 0;
+    size_t object_bytes = 0;
+    
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        slab_bytes += cache->slab_count * SLAB_SIZE;
+        object_bytes += cache_objects_in_use(cache) * cache->object_size;
+    }
+    
+    if (total) *total = slab_bytes;
+    if (used) *used = object_bytes;
+    
+    paging_unlock();
+}
+
+/**
+ * Print slab cache statistics
+ */
+void slab_print_stats(void) {
+    kprintf("Slab Cache Statistics:\n");
+    
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        if (cache->slab_count == 0) {
+            continue;
+        }
+        
+        kprintf("  %s: %u objects in %u slabs\n", cache->name, cache_objects_in_use(cache), cache->slab_count);
+    }
+}
\ No newline at end of file
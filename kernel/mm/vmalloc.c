@@ -0,0 +1,562 @@
+/**
+ * NKOF Kernel Virtual Areas Implementation
+ *
+ * Free space in the vmalloc window is kept in a treap keyed by start
+ * address. Every node also records the largest free range in its subtree,
+ * so the lowest range that fits a request is found in O(log n) without
+ * visiting ranges that are too small. Freed areas merge with the free
+ * ranges either side of them.
+ *
+ * Live areas are hashed by start address, so vfree and the heap can look
+ * their size up. Records for both come from a static pool rather than a
+ * slab cache: the slab allocator gets its pages from here, so it can't be
+ * asked for records while the tree is being changed.
+ *
+ * The whole window is reserved with the paging system, so areas that
+ * aren't mapped up front get frames on first touch. State is protected
+ * by the recursive paging lock, which the heap already holds when it
+ * calls in.
+ */
+
+#include "../include/vmalloc.h"
+#include "../include/paging.h"
+#include "../include/klog.h"
+
+// Live areas hash buckets
+#define VM_HASH_SIZE 256
+
+// Area flag: mapped by vmalloc, may be released with vfree
+#define VM_AREA_VMALLOC 0x1
+
+// A free range in the treap, or a live area in the hash
+typedef struct vm_range {
+    uint32_t start;                // First virtual address
+    uint32_t pages;                // Number of pages
+    uint32_t max_pages;            // Largest free range in this subtree (free ranges only)
+    uint32_t priority;             // Treap priority, parents are higher (free ranges only)
+    uint32_t flags;                // VM_AREA_ flags (live areas only)
+    struct vm_range* left;         // Lower addresses, or next in the pool's free list
+    struct vm_range* right;        // Higher addresses
+    struct vm_range* next;         // Next area in the hash bucket
+} vm_range_t;
+
+static vm_range_t range_pool[VMALLOC_MAX_RANGES];
+static vm_range_t* range_free_list = NULL;
+
+// Root of the free range treap
+static vm_range_t* free_root = NULL;
+
+// Live areas, hashed by start address
+static vm_range_t* area_hash[VM_HASH_SIZE];
+
+// Pages held by live areas and pages left in the window
+static uint32_t used_pages = 0;
+static uint32_t free_pages = 0;
+
+// Treap priorities only need to be spread out, not unpredictable
+static uint32_t priority_seed = 0x9E3779B9;
+
+/**
+ * Get the next treap priority (xorshift32)
+ */
+static inline uint32_t next_priority(void) {
+    priority_seed ^= priority_seed << 13;
+    priority_seed ^= priority_seed >> 17;
+    priority_seed ^= priority_seed << 5;
+    return priority_seed;
+}
+
+/**
+ * Take a record from the pool, NULL if it's empty
+ */
+static vm_range_t* range_get(void) {
+    vm_range_t* range = range_free_list;
+    if (!range) {
+        kprintf("ERROR: Out of vmalloc range records\n");
+        return NULL;
+    }
+    
+    range_free_list = range->left;
+    range->left = NULL;
+    range->right = NULL;
+    range->next = NULL;
+    range->flags = 0;
+    range->priority = next_priority();
+    return range;
+}
+
+/**
+ * Return a record to the pool
+ */
+static void range_put(vm_range_t* range) {
+    range->left = range_free_list;
+    range_free_list = range;
+}
+
+/**
+ * Get the end address of a range
+ */
+static inline uint32_t range_end(const vm_range_t* range) {
+    return range->start + range->pages * PAGE_SIZE;
+}
+
+/**
+ * Recompute a node's subtree maximum from its children
+ */
+static inline void tree_update(vm_range_t* node) {
+    uint32_t max = node->pages;
+    if (node->left && node->left->max_pages > max) {
+        max = node->left->max_pages;
+    }
+    if (node->right && node->right->max_pages > max) {
+        max = node->right->max_pages;
+    }
+    node->max_pages = max;
+}
+
+/**
+ * Split a treap into ranges starting below key and ranges starting at or above it
+ */
+static void tree_split(vm_range_t* node, uint32_t key, vm_range_t** below, vm_range_t** above) {
+    if (!node) {
+        *below = NULL;
+        *above = NULL;
+        return;
+    }
+    
+    if (node->start < key) {
+        tree_split(node->right, key, &node->right, above);
+        tree_update(node);
+        *below = node;
+    } else {
+        tree_split(node->left, key, below, &node->left);
+        tree_update(node);
+        *above = node;
+    }
+}
+
+/**
+ * Join two treaps, every range in low starting below every range in high
+ */
+static vm_range_t* tree_merge(vm_range_t* low, vm_range_t* high) {
+    if (!low) {
+        return high;
+    }
+    if (!high) {
+        return low;
+    }
+    
+    if (low->priority > high->priority) {
+        low->right = tree_merge(low->right, high);
+        tree_update(low);
+        return low;
+    }
+    
+    high->left = tree_merge(low, high->left);
+    tree_update(high);
+    return high;
+}
+
+/**
+ * Take the range starting exactly at start out of the free treap
+ */
+static vm_range_t* tree_remove(uint32_t start) {
+    vm_range_t *below, *rest, *match;
+    tree_split(free_root, start, &below, &rest);
+    tree_split(rest, start + 1, &match, &rest);
+    free_root = tree_merge(below, rest);
+    return match;
+}
+
+/**
+ * Add a range to the free treap (it must not touch an existing one)
+ */
+static void tree_insert(vm_range_t* range) {
+    vm_range_t *below, *above;
+    range->left = NULL;
+    range->right = NULL;
+    tree_update(range);
+    
+    tree_split(free_root, range->start, &below, &above);
+    free_root = tree_merge(tree_merge(below, range), above);
+}
+
+/**
+ * First address in a free range where an aligned run of pages fits, 0 if none
+ */
+static inline uint32_t range_fit(const vm_range_t* range, uint32_t pages, uint32_t alignment) {
+    uint32_t start = (range->start + alignment - 1) & ~(alignment - 1);
+    if (start < range->start || start >= range_end(range)) {
+        return 0;
+    }
+    return (range_end(range) - start) / PAGE_SIZE >= pages ? start : 0;
+}
+
+/**
+ * Find the lowest free range where an aligned run of pages fits
+ * Subtrees without a range of the size are skipped
+ */
+static vm_range_t* tree_find_fit(vm_range_t* node, uint32_t pages, uint32_t alignment) {
+    if (!node || node->max_pages < pages) {
+        return NULL;
+    }
+    
+    vm_range_t* found = tree_find_fit(node->left, pages, alignment);
+    if (found) {
+        return found;
+    }
+    
+    if (node->pages >= pages && range_fit(node, pages, alignment)) {
+        return node;
+    }
+    
+    return tree_find_fit(node->right, pages, alignment);
+}
+
+/**
+ * Get the bucket of an area
+ */
+static inline vm_range_t** area_bucket(uint32_t start) {
+    return &area_hash[(start / PAGE_SIZE) % VM_HASH_SIZE];
+}
+
+/**
+ * Find a live area by its start address
+ */
+static vm_range_t* area_find(uint32_t start) {
+    for (vm_range_t* area = *area_bucket(start); area; area = area->next) {
+        if (area->start == start) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return pages to the free treap, merging with the ranges either side
+ * The record is reused for the merged range
+ */
+static void free_range_add(vm_range_t* record, uint32_t start, uint32_t pages) {
+    vm_range_t *below, *above, *neighbour;
+    tree_split(free_root, start, &below, &above);
+    
+    // Absorb the range ending at start (the highest one below)
+    neighbour = below;
+    while (neighbour && neighbour->right) {
+        neighbour = neighbour->right;
+    }
+    if (neighbour && range_end(neighbour) == start) {
+        tree_split(below, neighbour->start, &below, &neighbour);
+        start = neighbour->start;
+        pages += neighbour->pages;
+        range_put(neighbour);
+    }
+    
+    // Absorb the range starting at the end (the lowest one above)
+    neighbour = above;
+    while (neighbour && neighbour->left) {
+        neighbour = neighbour->left;
+    }
+    if (neighbour && neighbour->start == start + pages * PAGE_SIZE) {
+        tree_split(above, neighbour->start + 1, &neighbour, &above);
+        pages += neighbour->pages;
+        range_put(neighbour);
+    }
+    
+    record->start = start;
+    record->pages = pages;
+    record->left = NULL;
+    record->right = NULL;
+    record->priority = next_priority();
+    tree_update(record);
+    free_root = tree_merge(tree_merge(below, record), above);
+}
+
+/**
+ * Initialize the allocator and reserve the window with the paging system
+ */
+void vmalloc_init(void) {
+    range_free_list = NULL;
+    for (uint32_t i = VMALLOC_MAX_RANGES; i > 0; i--) {
+        range_put(&range_pool[i - 1]);
+    }
+    for (uint32_t i = 0; i < VM_HASH_SIZE; i++) {
+        area_hash[i] = NULL;
+    }
+    
+    free_root = range_get();
+    free_root->start = VMALLOC_START;
+    free_root->pages = (VMALLOC_END - VMALLOC_START) / PAGE_SIZE;
+    tree_update(free_root);
+    free_pages = free_root->pages;
+    used_pages = 0;
+    
+    // Frames are committed by the page fault handler
+    if (!paging_reserve_range(VMALLOC_START, VMALLOC_END, PAGE_KERNEL, false)) {
+        kprintf("ERROR: Cannot reserve the vmalloc window\n");
+    }
+    
+    kprintf("vmalloc window: 0x%X-0x%X (%u MB)\n", VMALLOC_START, VMALLOC_END,
+            (VMALLOC_END - VMALLOC_START) / 1024 / 1024);
+}
+
+/**
+ * Reserve pages of virtual space, aligned to a power of 2
+ */
+uint32_t vm_area_alloc(uint32_t pages, uint32_t alignment) {
+    if (pages == 0 || (alignment & (alignment - 1))) {
+        return 0;
+    }
+    if (alignment < PAGE_SIZE) {
+        alignment = PAGE_SIZE;
+    }
+    
+    paging_lock();
+    
+    // Worst case needs records for the area and for a free tail, the
+    // range found is reused for the space below the area
+    vm_range_t* area = range_get();
+    vm_range_t* tail = area ? range_get() : NULL;
+    if (!tail) {
+        if (area) {
+            range_put(area);
+        }
+        paging_unlock();
+        return 0;
+    }
+    
+    vm_range_t* range = tree_find_fit(free_root, pages, alignment);
+    if (!range) {
+        range_put(area);
+        range_put(tail);
+        kprintf("ERROR: vmalloc window exhausted (%u pages requested)\n", pages);
+        paging_unlock();
+        return 0;
+    }
+    
+    uint32_t start = range_fit(range, pages, alignment);
+    uint32_t end_addr = start + pages * PAGE_SIZE;
+    uint32_t range_end_addr = range_end(range);
+    
+    tree_remove(range->start);
+    
+    // Space below the area keeps the old record
+    if (start > range->start) {
+        range->pages = (start - range->start) / PAGE_SIZE;
+        tree_insert(range);
+    } else {
+        range_put(range);
+    }
+    
+    // Space above gets the spare one
+    if (range_end_addr > end_addr) {
+        tail->start = end_addr;
+        tail->pages = (range_end_addr - end_addr) / PAGE_SIZE;
+        tree_insert(tail);
+    } else {
+        range_put(tail);
+    }
+    
+    area->start = start;
+    area->pages = pages;
+    area->next = *area_bucket(start);
+    *area_bucket(start) = area;
+    
+    used_pages += pages;
+    free_pages -= pages;
+    
+    paging_unlock();
+    return start;
+}
+
+/**
+ * Unlink a live area from the hash, NULL if there is none at start
+ */
+static vm_range_t* area_unlink(uint32_t start) {
+    for (vm_range_t** link = area_bucket(start); *link; link = &(*link)->next) {
+        vm_range_t* area = *link;
+        if (area->start == start) {
+            *link = area->next;
+            return area;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Release an area from vm_area_alloc
+ */
+void vm_area_free(uint32_t start) {
+    paging_lock();
+    
+    vm_range_t* area = area_unlink(start);
+    if (!area) {
+        kprintf("WARNING: No vmalloc area at 0x%X\n", start);
+        paging_unlock();
+        return;
+    }
+    
+    used_pages -= area->pages;
+    free_pages += area->pages;
+    free_range_add(area, area->start, area->pages);
+    
+    paging_unlock();
+}
+
+/**
+ * Get the size in pages of the area starting at start
+ */
+uint32_t vm_area_pages(uint32_t start) {
+    paging_lock();
+    vm_range_t* area = area_find(start);
+    uint32_t pages = area ? area->pages : 0;
+    paging_unlock();
+    return pages;
+}
+
+/**
+ * Grow an area in place by taking the free pages right above it
+ */
+bool vm_area_extend(uint32_t start, uint32_t extra_pages) {
+    paging_lock();
+    
+    vm_range_t* area = area_find(start);
+    if (!area) {
+        paging_unlock();
+        return false;
+    }
+    
+    uint32_t end_addr = range_end(area);
+    vm_range_t* range = tree_remove(end_addr);
+    if (!range) {
+        paging_unlock();
+        return false;
+    }
+    
+    if (range->pages < extra_pages) {
+        tree_insert(range);
+        paging_unlock();
+        return false;
+    }
+    
+    range->start += extra_pages * PAGE_SIZE;
+    range->pages -= extra_pages;
+    if (range->pages) {
+        tree_insert(range);
+    } else {
+        range_put(range);
+    }
+    
+    area->pages += extra_pages;
+    used_pages += extra_pages;
+    free_pages -= extra_pages;
+    
+    paging_unlock();
+    return true;
+}
+
+/**
+ * Shrink an area in place
+ */
+bool vm_area_shrink(uint32_t start, uint32_t pages) {
+    paging_lock();
+    
+    vm_range_t* area = area_find(start);
+    if (!area || pages == 0 || pages > area->pages) {
+        paging_unlock();
+        return false;
+    }
+    
+    uint32_t extra = area->pages - pages;
+    if (extra == 0) {
+        paging_unlock();
+        return true;
+    }
+    
+    vm_range_t* record = range_get();
+    if (!record) {
+        paging_unlock();
+        return false;
+    }
+    
+    area->pages = pages;
+    used_pages -= extra;
+    free_pages += extra;
+    free_range_add(record, range_end(area), extra);
+    
+    paging_unlock();
+    return true;
+}
+
+/**
+ * Allocate and map virtually contiguous memory
+ */
+void* vmalloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    // Areas of 2MB or more are placed so whole 2MB pages can back them
+    uint32_t alignment = PAGE_SIZE;
+    if (pages >= LARGE_PAGE_SIZE / PAGE_SIZE && paging_large_pages_supported()) {
+        alignment = LARGE_PAGE_SIZE;
+    }
+    
+    paging_lock();
+    
+    uint32_t start = vm_area_alloc(pages, alignment);
+    if (!start) {
+        paging_unlock();
+        return NULL;
+    }
+    
+    // Frames need not be contiguous, the paging layer uses the largest blocks it can
+    if (!paging_alloc_and_map_range(start, pages, PAGE_KERNEL)) {
+        vm_area_free(start);
+        paging_unlock();
+        return NULL;
+    }
+    
+    area_find(start)->flags |= VM_AREA_VMALLOC;
+    
+    paging_unlock();
+    return (void*)start;
+}
+
+/**
+ * Unmap and free memory from vmalloc
+ */
+void vfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    
+    paging_lock();
+    
+    vm_range_t* area = area_find((uint32_t)ptr);
+    if (!area || !(area->flags & VM_AREA_VMALLOC)) {
+        kprintf("ERROR: vfree of memory vmalloc didn't return: %p\n", ptr);
+        paging_unlock();
+        return;
+    }
+    
+    paging_unmap_range(area->start, area->pages, true);
+    vm_area_free(area->start);
+    
+    paging_unlock();
+}
+
+/**
+ * Get the window's page counts
+ */
+void vmalloc_get_stats(uint32_t* used, uint32_t* free, uint32_t* largest_free) {
+    paging_lock();
+    
+    if (used) *used = used_pages;
+    if (free) *free = free_pages;
+    if (largest_free) *largest_free = free_root ? free_root->max_pages : 0;
+    
+    paging_unlock();
+}
\ No newline at end of file
@@ -0,0 +1,772 @@
+/**
+ * NKOF Neural Resource Optimization Implementation
+ *
+ * The heap reports every kmalloc family allocation and kfree here. Counts
+ * and a request size histogram are kept per CPU, so the hot path takes no
+ * lock. One allocation in NEURAL_LIFETIME_SAMPLE is entered in a small
+ * direct mapped table with its TSC timestamp, and when it is freed its
+ * lifetime goes into a log4 histogram. Entries that outlive the longest
+ * bucket are retired by the tuner so they don't hold their slot forever.
+ *
+ * Every NEURAL_PERIOD_MS the tuner task turns the running totals of the
+ * heap, slab and page allocators into a per-period sample and hands it to
+ * the active policy. Whatever the policy changes is applied through the
+ * allocators' setters. Periods without allocator traffic are skipped.
+ *
+ * The "adaptive" policy keeps a decaying histogram of request sizes and
+ * fits size classes to it with a dynamic program over the granule slots,
+ * minimizing the bytes lost to rounding up plus a cost per class. The
+ * other settings follow feedback rules on the magazine, heap and zeroed
+ * pool traffic. The "static" policy restores the boot defaults.
+ */
+
+#include "../include/neural.h"
+#include "../include/slab.h"
+#include "../include/sched.h"
+#include "../include/timer.h"
+#include "../include/smp.h"
+#include "../include/cpu.h"
+#include "../include/interrupts.h"
+#include "../include/spinlock.h"
+#include "../include/string.h"
+#include "../include/klog.h"
+
+// Lifetime sample table slots (direct mapped by pointer hash, a power of 2)
+#define LIFETIME_SLOTS 256
+#define LIFETIME_SHIFT 24
+
+// Periods with too little traffic to judge a setting by
+#define NEURAL_MIN_OPS 64
+
+// Request samples the size model needs before classes are refitted
+#define NEURAL_MIN_SAMPLES 256
+
+// Quiet periods before a setting is scaled back
+#define NEURAL_SHRINK_PERIODS 10
+
+// Bounds the adaptive policy keeps the settings in
+#define NEURAL_PMM_MIN_DEPTH   8
+#define NEURAL_SLAB_MIN_DEPTH  4
+#define NEURAL_ZERO_MIN        16
+#define NEURAL_HEAP_GROW_COUNT 4
+
+// Per-CPU running totals, padded so CPUs don't share cache lines
+typedef struct neural_cpu {
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t large_allocs;
+    uint32_t countdown;                     // Allocations since the last lifetime sample
+    uint32_t sizes[NEURAL_SIZE_SLOTS];
+} __attribute__((aligned(64))) neural_cpu_t;
+
+// Allocation whose lifetime is being measured
+typedef struct lifetime_entry {
+    uint32_t ptr;                           // 0 when the slot is free
+    uint64_t start;                         // TSC at allocation
+} lifetime_entry_t;
+
+static neural_cpu_t cpu_stats[SMP_MAX_CPUS];
+
+// Lifetime samples and the running lifetime histogram
+static lifetime_entry_t lifetime_table[LIFETIME_SLOTS];
+static uint32_t lifetime_counts[NEURAL_LIFETIME_BUCKETS];
+static spinlock_t lifetime_lock = SPINLOCK_INIT;
+
+// Registered policies, the active one and statistics, protected by stats_lock
+static neural_policy_t* policies = NULL;
+static neural_policy_t* active_policy = NULL;
+static bool policy_selected = false;       // Active policy not yet run since it was selected
+static uint32_t tuner_periods = 0;
+static uint32_t tuner_decisions = 0;
+static uint32_t tuner_changes = 0;
+static neural_params_t last_params;
+static neural_sample_t last_sample;
+static spinlock_t stats_lock = SPINLOCK_INIT;
+
+// One tuning period runs at a time, the totals it started from
+static spinlock_t tune_lock = SPINLOCK_INIT;
+static neural_sample_t previous_totals;
+
+// Boot size classes, restored by the static policy
+static const uint32_t default_classes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define DEFAULT_CLASS_COUNT (sizeof(default_classes) / sizeof(default_classes[0]))
+
+// Adaptive policy state, only touched by the tuner under tune_lock
+static uint32_t size_model[NEURAL_SIZE_SLOTS];     // Decaying request counts by size slot
+static uint64_t fit_cost[KHEAP_MAX_CLASSES + 1][NEURAL_SIZE_SLOTS];
+static uint8_t fit_choice[KHEAP_MAX_CLASSES + 1][NEURAL_SIZE_SLOTS];
+static uint32_t pmm_quiet = 0;
+static uint32_t slab_quiet = 0;
+static uint32_t heap_quiet = 0;
+static uint32_t zero_quiet = 0;
+
+/**
+ * Get the lifetime table slot of an allocation
+ */
+static inline uint32_t lifetime_slot(void* ptr) {
+    return (((uint32_t)ptr >> 4) * 2654435761u) >> LIFETIME_SHIFT;
+}
+
+/**
+ * Get the lifetime bucket of a number of TSC cycles (floor of log4)
+ */
+static uint32_t lifetime_bucket(uint64_t cycles) {
+    uint32_t high = (uint32_t)(cycles >> 32);
+    uint32_t low = (uint32_t)cycles;
+    uint32_t bits;
+    
+    // Bit length without 64-bit count leading zeros, there is no libgcc
+    if (high) {
+        bits = 64 - __builtin_clz(high);
+    } else if (low) {
+        bits = 32 - __builtin_clz(low);
+    } else {
+        return 0;
+    }
+    
+    uint32_t bucket = (bits - 1) / 2;
+    return bucket < NEURAL_LIFETIME_BUCKETS ? bucket : NEURAL_LIFETIME_BUCKETS - 1;
+}
+
+/**
+ * Record a kmalloc family allocation
+ */
+void neural_note_alloc(void* ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    
+    // Interrupts off keeps the task on this CPU's counters
+    uint32_t flags = interrupts_save();
+    neural_cpu_t* cpu = &cpu_stats[smp_cpu_index()];
+    cpu->allocs++;
+    if (size <= KMALLOC_MAX_SMALL) {
+        cpu->sizes[(size + KHEAP_CLASS_GRANULE - 1) / KHEAP_CLASS_GRANULE]++;
+    } else {
+        cpu->large_allocs++;
+    }
+    
+    bool sample = ++cpu->countdown >= NEURAL_LIFETIME_SAMPLE;
+    if (sample) {
+        cpu->countdown = 0;
+    }
+    interrupts_restore(flags);
+    
+    if (!sample) {
+        return;
+    }
+    
+    // A slot already measuring another allocation keeps it
+    lifetime_entry_t* entry = &lifetime_table[lifetime_slot(ptr)];
+    flags = spin_lock_irqsave(&lifetime_lock);
+    if (entry->ptr == 0) {
+        entry->ptr = (uint32_t)ptr;
+        entry->start = rdtsc();
+    }
+    spin_unlock_irqrestore(&lifetime_lock, flags);
+}
+
+/**
+ * Record a kfree
+ */
+void neural_note_free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    
+    uint32_t flags = interrupts_save();
+    cpu_stats[smp_cpu_index()].frees++;
+    interrupts_restore(flags);
+    
+    // Unlocked look first, almost every free isn't being measured
+    lifetime_entry_t* entry = &lifetime_table[lifetime_slot(ptr)];
+    if (entry->ptr != (uint32_t)ptr) {
+        return;
+    }
+    
+    flags = spin_lock_irqsave(&lifetime_lock);
+    if (entry->ptr == (uint32_t)ptr) {
+        lifetime_counts[lifetime_bucket(rdtsc() - entry->start)]++;
+        entry->ptr = 0;
+    }
+    spin_unlock_irqrestore(&lifetime_lock, flags);
+}
+
+/**
+ * Count the measured allocations that outlived the last bucket and free their slots
+ */
+static void lifetime_retire(void) {
+    uint64_t now = rdtsc();
+    uint64_t limit = 1ULL << (2 * (NEURAL_LIFETIME_BUCKETS - 1));
+    
+    uint32_t flags = spin_lock_irqsave(&lifetime_lock);
+    for (uint32_t i = 0; i < LIFETIME_SLOTS; i++) {
+        if (lifetime_table[i].ptr && now - lifetime_table[i].start >= limit) {
+            lifetime_counts[NEURAL_LIFETIME_BUCKETS - 1]++;
+            lifetime_table[i].ptr = 0;
+        }
+    }
+    spin_unlock_irqrestore(&lifetime_lock, flags);
+}
+
+/**
+ * Read the running totals of the allocators (period_ns holds the time)
+ */
+static void read_totals(neural_sample_t* totals) {
+    memset(totals, 0, sizeof(*totals));
+    
+    // Per-CPU counters are read unlocked, a count in flight lands in the next period
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        neural_cpu_t* cpu = &cpu_stats[i];
+        totals->allocs += cpu->allocs;
+        totals->frees += cpu->frees;
+        totals->large_allocs += cpu->large_allocs;
+        for (uint32_t s = 0; s < NEURAL_SIZE_SLOTS; s++) {
+            totals->sizes[s] += cpu->sizes[s];
+        }
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&lifetime_lock);
+    memcpy(totals->lifetimes, lifetime_counts, sizeof(lifetime_counts));
+    spin_unlock_irqrestore(&lifetime_lock, flags);
+    
+    uint32_t zero_count, zero_watermark;
+    pmm_get_activity(&totals->pmm);
+    slab_get_activity(&totals->slab_refills, &totals->slab_drains);
+    pmm_get_zero_pool_stats(&zero_count, &zero_watermark, &totals->zero_hits, &totals->zero_misses);
+    totals->heap_expansions = kheap_get_expansions();
+    totals->tsc_khz = timer_tsc_khz();
+    totals->period_ns = timer_now_ns();
+}
+
+/**
+ * Turn two sets of running totals into the sample of the period between them
+ */
+static void sample_delta(neural_sample_t* sample, const neural_sample_t* now, const neural_sample_t* then) {
+    // Unsigned differences stay right when a counter wraps
+    sample->period_ns = now->period_ns - then->period_ns;
+    sample->tsc_khz = now->tsc_khz;
+    sample->allocs = now->allocs - then->allocs;
+    sample->frees = now->frees - then->frees;
+    sample->large_allocs = now->large_allocs - then->large_allocs;
+    for (uint32_t s = 0; s < NEURAL_SIZE_SLOTS; s++) {
+        sample->sizes[s] = now->sizes[s] - then->sizes[s];
+    }
+    for (uint32_t b = 0; b < NEURAL_LIFETIME_BUCKETS; b++) {
+        sample->lifetimes[b] = now->lifetimes[b] - then->lifetimes[b];
+    }
+    sample->pmm.allocs = now->pmm.allocs - then->pmm.allocs;
+    sample->pmm.frees = now->pmm.frees - then->pmm.frees;
+    sample->pmm.refills = now->pmm.refills - then->pmm.refills;
+    sample->pmm.drains = now->pmm.drains - then->pmm.drains;
+    sample->slab_refills = now->slab_refills - then->slab_refills;
+    sample->slab_drains = now->slab_drains - then->slab_drains;
+    sample->zero_hits = now->zero_hits - then->zero_hits;
+    sample->zero_misses = now->zero_misses - then->zero_misses;
+    sample->heap_expansions = now->heap_expansions - then->heap_expansions;
+}
+
+/**
+ * Read the allocator settings in effect
+ */
+static void read_params(neural_params_t* params) {
+    uint32_t zero_count, zero_hits, zero_misses;
+    
+    memset(params, 0, sizeof(*params));
+    params->class_count = kheap_get_size_classes(params->classes, KHEAP_MAX_CLASSES);
+    params->pmm_magazine_depth = pmm_get_magazine_depth();
+    params->slab_magazine_depth = slab_get_magazine_depth();
+    params->heap_expand_pages = kheap_get_expand_step();
+    pmm_get_zero_pool_stats(&zero_count, &params->zero_watermark, &zero_hits, &zero_misses);
+}
+
+/**
+ * Apply the settings that differ from the ones in effect, returns how many took
+ */
+static uint32_t apply_params(const neural_params_t* current, const neural_params_t* next, neural_params_t* result) {
+    // The setters reject bad values with an error, so the outcome is read back
+    if (next->class_count != current->class_count ||
+        memcmp(next->classes, current->classes, next->class_count * sizeof(uint32_t)) != 0) {
+        kheap_set_size_classes(next->classes, next->class_count);
+    }
+    if (next->pmm_magazine_depth != current->pmm_magazine_depth) {
+        pmm_set_magazine_depth(next->pmm_magazine_depth);
+    }
+    if (next->slab_magazine_depth != current->slab_magazine_depth) {
+        slab_set_magazine_depth(next->slab_magazine_depth);
+    }
+    if (next->heap_expand_pages != current->heap_expand_pages) {
+        kheap_set_expand_step(next->heap_expand_pages);
+    }
+    if (next->zero_watermark != current->zero_watermark) {
+        pmm_set_zero_watermark(next->zero_watermark);
+    }
+    
+    read_params(result);
+    uint32_t changes = 0;
+    if (result->class_count != current->class_count ||
+        memcmp(result->classes, current->classes, result->class_count * sizeof(uint32_t)) != 0) {
+        changes++;
+    }
+    changes += result->pmm_magazine_depth != current->pmm_magazine_depth;
+    changes += result->slab_magazine_depth != current->slab_magazine_depth;
+    changes += result->heap_expand_pages != current->heap_expand_pages;
+    changes += result->zero_watermark != current->zero_watermark;
+    return changes;
+}
+
+/**
+ * Run one tuning period now
+ */
+void neural_tune(void) {
+    // A period already being tuned covers this call
+    if (!spin_trylock(&tune_lock)) {
+        return;
+    }
+    
+    neural_sample_t totals;
+    neural_sample_t sample;
+    lifetime_retire();
+    read_totals(&totals);
+    sample_delta(&sample, &totals, &previous_totals);
+    previous_totals = totals;
+    
+    uint32_t flags = spin_lock_irqsave(&stats_lock);
+    neural_policy_t* policy = active_policy;
+    bool selected = policy_selected;
+    policy_selected = false;
+    spin_unlock_irqrestore(&stats_lock, flags);
+    
+    if (selected && policy && policy->reset) {
+        policy->reset();
+    }
+    
+    // A newly selected policy runs once even when idle, so it takes over right away
+    neural_params_t params;
+    uint32_t changes = 0;
+    bool idle = sample.allocs == 0 && sample.pmm.allocs == 0 && sample.pmm.frees == 0;
+    bool decided = policy && (!idle || selected);
+    read_params(&params);
+    if (decided) {
+        neural_params_t next = params;
+        neural_params_t result;
+        policy->decide(&sample, &next);
+        changes = apply_params(&params, &next, &result);
+        params = result;
+    }
+    
+    flags = spin_lock_irqsave(&stats_lock);
+    tuner_periods++;
+    tuner_decisions += decided;
+    tuner_changes += changes;
+    last_params = params;
+    last_sample = sample;
+    spin_unlock_irqrestore(&stats_lock, flags);
+    
+    spin_unlock(&tune_lock);
+}
+
+/**
+ * Static policy: the boot defaults
+ */
+static void static_decide(const neural_sample_t* sample, neural_params_t* params) {
+    (void)sample;
+    
+    memcpy(params->classes, default_classes, sizeof(default_classes));
+    params->class_count = DEFAULT_CLASS_COUNT;
+    params->pmm_magazine_depth = PMM_MAGAZINE_DEPTH;
+    params->slab_magazine_depth = SLAB_MAGAZINE_SIZE;
+    params->heap_expand_pages = KHEAP_EXPAND_PAGES;
+    params->zero_watermark = PMM_ZERO_WATERMARK;
+}
+
+/**
+ * Get the bytes lost to rounding up when slots first + 1 to last share the class of slot last
+ */
+static inline uint64_t class_waste(const uint64_t* counts, const uint64_t* moments, uint32_t first, uint32_t last) {
+    // Sum of count * (last - slot) granules, from prefix sums of count and count * slot
+    uint64_t count = counts[last] - counts[first];
+    uint64_t moment = moments[last] - moments[first];
+    return (count * last - moment) * KHEAP_CLASS_GRANULE;
+}
+
+/**
+ * Fit classes ending at the last slot, using only allowed slots as class sizes
+ * Returns the number of classes (0 if none fit) and leaves the choices in fit_choice
+ */
+static uint32_t fit_classes(const uint64_t* counts, const uint64_t* moments, const bool* allowed,
+                            uint64_t class_price, uint64_t* best_cost) {
+    uint32_t last = NEURAL_SIZE_SLOTS - 1;
+    
+    // fit_cost[k][j]: least waste serving slots 1 to j with k classes, the largest being slot j
+    // No class is over twice the one below it (the first at most 2 granules), so sizes
+    // the model hasn't seen lose no more than they would to powers of 2
+    for (uint32_t j = 1; j <= last; j++) {
+        fit_cost[1][j] = j <= 2 && allowed[j] ? class_waste(counts, moments, 0, j) : ~0ULL;
+        fit_choice[1][j] = 0;
+    }
+    for (uint32_t k = 2; k <= KHEAP_MAX_CLASSES; k++) {
+        for (uint32_t j = k; j <= last; j++) {
+            uint64_t best = ~0ULL;
+            uint32_t best_from = 0;
+            if (!allowed[j]) {
+                fit_cost[k][j] = best;
+                fit_choice[k][j] = best_from;
+                continue;
+            }
+            
+            for (uint32_t i = (j + 1) / 2 > k - 1 ? (j + 1) / 2 : k - 1; i < j; i++) {
+                if (fit_cost[k - 1][i] == ~0ULL) {
+                    continue;
+                }
+                
+                uint64_t cost = fit_cost[k - 1][i] + class_waste(counts, moments, i, j);
+                if (cost < best) {
+                    best = cost;
+                    best_from = i;
+                }
+            }
+            fit_cost[k][j] = best;
+            fit_choice[k][j] = best_from;
+        }
+    }
+    
+    // The largest class is always KMALLOC_MAX_SMALL, pick the count of classes
+    uint32_t best_count = 0;
+    *best_cost = ~0ULL;
+    for (uint32_t k = 1; k <= KHEAP_MAX_CLASSES; k++) {
+        if (fit_cost[k][last] == ~0ULL) {
+            continue;
+        }
+        
+        uint64_t cost = fit_cost[k][last] + k * class_price;
+        if (cost < *best_cost) {
+            *best_cost = cost;
+            best_count = k;
+        }
+    }
+    
+    return best_count;
+}
+
+/**
+ * Read the classes of a fit back from fit_choice
+ */
+static void fitted_classes(uint32_t count, uint32_t* classes) {
+    uint32_t slot = NEURAL_SIZE_SLOTS - 1;
+    for (uint32_t k = count; k > 0; k--) {
+        classes[k - 1] = slot * KHEAP_CLASS_GRANULE;
+        slot = fit_choice[k][slot];
+    }
+}
+
+/**
+ * Refit the size classes to the size model when that saves enough
+ */
+static void adapt_classes(neural_params_t* params) {
+    uint64_t counts[NEURAL_SIZE_SLOTS];
+    uint64_t moments[NEURAL_SIZE_SLOTS];
+    
+    // Empty requests are served by the smallest class like 1 byte ones
+    counts[0] = 0;
+    moments[0] = 0;
+    for (uint32_t s = 1; s < NEURAL_SIZE_SLOTS; s++) {
+        uint64_t weight = size_model[s] + (s == 1 ? size_model[0] : 0);
+        counts[s] = counts[s - 1] + weight;
+        moments[s] = moments[s - 1] + weight * s;
+    }
+    
+    uint32_t last = NEURAL_SIZE_SLOTS - 1;
+    uint64_t total = counts[last];
+    if (total < NEURAL_MIN_SAMPLES) {
+        return;
+    }
+    
+    // Each class has to save an eighth of a granule per request to pay for its slabs and magazines
+    uint64_t class_price = total * (KHEAP_CLASS_GRANULE / 8);
+    
+    // Cost of the classes in effect: each slot goes to the smallest class that fits it
+    uint64_t current_cost = params->class_count * class_price;
+    uint32_t from = 0;
+    for (uint32_t c = 0; c < params->class_count; c++) {
+        uint32_t slot = params->classes[c] / KHEAP_CLASS_GRANULE;
+        current_cost += class_waste(counts, moments, from, slot);
+        from = slot;
+    }
+    
+    bool allowed[NEURAL_SIZE_SLOTS];
+    for (uint32_t j = 0; j <= last; j++) {
+        allowed[j] = true;
+    }
+    
+    uint64_t best_cost;
+    uint32_t classes[KHEAP_MAX_CLASSES];
+    uint32_t best_count = fit_classes(counts, moments, allowed, class_price, &best_cost);
+    fitted_classes(best_count, classes);
+    
+    // Every new size takes a cache for good, once they run out only sizes with one are fitted
+    uint32_t new_caches = 0;
+    for (uint32_t c = 0; c < best_count; c++) {
+        new_caches += !kheap_has_class_cache(classes[c]);
+    }
+    if (new_caches > kheap_class_caches_left()) {
+        for (uint32_t j = 1; j < last; j++) {
+            allowed[j] = kheap_has_class_cache(j * KHEAP_CLASS_GRANULE);
+        }
+        best_count = fit_classes(counts, moments, allowed, class_price, &best_cost);
+        fitted_classes(best_count, classes);
+    }
+    
+    // Only a clear improvement is worth new caches, within an eighth is noise
+    if (best_count == 0 || best_cost + best_cost / 8 >= current_cost) {
+        return;
+    }
+    
+    memcpy(params->classes, classes, best_count * sizeof(uint32_t));
+    params->class_count = best_count;
+}
+
+/**
+ * Get the next magazine depth from a period's traffic through a magazine layer
+ */
+static uint32_t adapt_depth(uint32_t depth, uint32_t ops, uint32_t trips, uint32_t min, uint32_t max, uint32_t* quiet) {
+    // Each trip moves half a magazine, over half the traffic taking them means bursts outrun it
+    if (ops >= NEURAL_MIN_OPS && trips * depth > ops) {
+        *quiet = 0;
+        return depth * 2 < max ? depth * 2 : max;
+    }
+    
+    // Light traffic doesn't need the objects a deep magazine holds on to
+    if (ops >= depth) {
+        *quiet = 0;
+        return depth;
+    }
+    if (++*quiet >= NEURAL_SHRINK_PERIODS && depth / 2 >= min) {
+        *quiet = 0;
+        return depth / 2;
+    }
+    return depth;
+}
+
+/**
+ * Check whether most of a period's measured allocations lived longer than the period
+ */
+static bool mostly_long_lived(const neural_sample_t* sample) {
+    uint32_t mhz = sample->tsc_khz / 1000;
+    if (mhz == 0) {
+        return false;
+    }
+    
+    uint32_t period_bucket = lifetime_bucket((uint64_t)mhz * 1000 * NEURAL_PERIOD_MS);
+    uint32_t total = 0;
+    uint32_t longer = 0;
+    for (uint32_t b = 0; b < NEURAL_LIFETIME_BUCKETS; b++) {
+        total += sample->lifetimes[b];
+        if (b >= period_bucket) {
+            longer += sample->lifetimes[b];
+        }
+    }
+    return total > 0 && longer * 2 > total;
+}
+
+/**
+ * Adaptive policy: fit the classes to the request sizes, follow the traffic for the rest
+ */
+static void adaptive_decide(const neural_sample_t* sample, neural_params_t* params) {
+    // Fold the period into the size model, older periods fade by a quarter each
+    for (uint32_t s = 0; s < NEURAL_SIZE_SLOTS; s++) {
+        size_model[s] = size_model[s] - (size_model[s] >> 2) + sample->sizes[s];
+    }
+    adapt_classes(params);
+    
+    params->pmm_magazine_depth = adapt_depth(params->pmm_magazine_depth,
+                                             sample->pmm.allocs + sample->pmm.frees,
+                                             sample->pmm.refills + sample->pmm.drains,
+                                             NEURAL_PMM_MIN_DEPTH, PMM_MAGAZINE_MAX, &pmm_quiet);
+    params->slab_magazine_depth = adapt_depth(params->slab_magazine_depth,
+                                              sample->allocs - sample->large_allocs + sample->frees,
+                                              sample->slab_refills + sample->slab_drains,
+                                              NEURAL_SLAB_MIN_DEPTH, SLAB_MAGAZINE_SIZE, &slab_quiet);
+    
+    // Grow the heap in bigger steps when it keeps growing, or when what it grows for stays
+    uint32_t step = params->heap_expand_pages;
+    if (sample->heap_expansions >= NEURAL_HEAP_GROW_COUNT ||
+        (sample->heap_expansions > 0 && mostly_long_lived(sample))) {
+        heap_quiet = 0;
+        step = step * 2 < KHEAP_EXPAND_MAX_PAGES ? step * 2 : KHEAP_EXPAND_MAX_PAGES;
+    } else if (sample->heap_expansions > 0) {
+        heap_quiet = 0;
+    } else if (++heap_quiet >= NEURAL_SHRINK_PERIODS && step / 2 >= KHEAP_EXPAND_PAGES) {
+        heap_quiet = 0;
+        step /= 2;
+    }
+    params->heap_expand_pages = step;
+    
+    // Keep enough zeroed frames to cover the misses, let the pool shrink when it is barely used
+    uint32_t watermark = params->zero_watermark;
+    if (sample->zero_misses > 0) {
+        zero_quiet = 0;
+        watermark += (sample->zero_misses + NEURAL_ZERO_MIN - 1) & ~(NEURAL_ZERO_MIN - 1);
+        watermark = watermark < PMM_ZERO_POOL_SIZE ? watermark : PMM_ZERO_POOL_SIZE;
+    } else if (sample->zero_hits >= watermark / 4) {
+        zero_quiet = 0;
+    } else if (++zero_quiet >= NEURAL_SHRINK_PERIODS && watermark > NEURAL_ZERO_MIN) {
+        zero_quiet = 0;
+        watermark -= watermark / 4;
+        watermark = watermark > NEURAL_ZERO_MIN ? watermark : NEURAL_ZERO_MIN;
+    }
+    params->zero_watermark = watermark;
+}
+
+/**
+ * Adaptive policy: start learning from scratch
+ */
+static void adaptive_reset(void) {
+    memset(size_model, 0, sizeof(size_model));
+    pmm_quiet = 0;
+    slab_quiet = 0;
+    heap_quiet = 0;
+    zero_quiet = 0;
+}
+
+static neural_policy_t static_policy = { "static", static_decide, NULL, NULL };
+static neural_policy_t adaptive_policy = { "adaptive", adaptive_decide, adaptive_reset, NULL };
+
+/**
+ * Check whether a policy has the given name
+ */
+static bool policy_named(const neural_policy_t* policy, const char* name) {
+    size_t length = strlen(name);
+    return strlen(policy->name) == length && memcmp(policy->name, name, length) == 0;
+}
+
+/**
+ * Register a policy
+ */
+bool neural_register_policy(neural_policy_t* policy) {
+    if (!policy || !policy->name || !policy->decide) {
+        kprintf("ERROR: Tuning policy needs a name and a decide function\n");
+        return false;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&stats_lock);
+    for (neural_policy_t* p = policies; p; p = p->next) {
+        if (p == policy || policy_named(p, policy->name)) {
+            spin_unlock_irqrestore(&stats_lock, flags);
+            kprintf("ERROR: Tuning policy %s is already registered\n", policy->name);
+            return false;
+        }
+    }
+    
+    policy->next = policies;
+    policies = policy;
+    spin_unlock_irqrestore(&stats_lock, flags);
+    return true;
+}
+
+/**
+ * Select a policy by name
+ */
+bool neural_set_policy(const char* name) {
+    uint32_t flags = spin_lock_irqsave(&stats_lock);
+    for (neural_policy_t* p = policies; p; p = p->next) {
+        if (policy_named(p, name)) {
+            active_policy = p;
+            policy_selected = true;
+            spin_unlock_irqrestore(&stats_lock, flags);
+            return true;
+        }
+    }
+    spin_unlock_irqrestore(&stats_lock, flags);
+    
+    kprintf("ERROR: No tuning policy named %s\n", name);
+    return false;
+}
+
+/**
+ * Get the name of the active policy
+ */
+const char* neural_get_policy(void) {
+    neural_policy_t* policy = active_policy;
+    return policy ? policy->name : "none";
+}
+
+/**
+ * Tuner task: run a period every NEURAL_PERIOD_MS
+ */
+static void neural_task(void* arg) {
+    (void)arg;
+    
+    for (;;) {
+        task_sleep(NEURAL_PERIOD_MS * NSEC_PER_MSEC);
+        neural_tune();
+    }
+}
+
+/**
+ * Register the built-in policies and start the tuner task
+ */
+void neural_init(void) {
+    neural_register_policy(&static_policy);
+    neural_register_policy(&adaptive_policy);
+    neural_set_policy("adaptive");
+    
+    // The first period starts now, boot time allocations are left out
+    spin_lock(&tune_lock);
+    read_totals(&previous_totals);
+    read_params(&last_params);
+    spin_unlock(&tune_lock);
+    
+    if (!task_create("neural", neural_task, NULL, SCHED_DEFAULT_PRIORITY)) {
+        kprintf("ERROR: Failed to start the allocator tuner\n");
+    }
+}
+
+/**
+ * Get the tuner statistics
+ */
+void neural_get_stats(neural_stats_t* stats) {
+    uint32_t flags = spin_lock_irqsave(&stats_lock);
+    stats->policy = active_policy ? active_policy->name : "none";
+    stats->periods = tuner_periods;
+    stats->decisions = tuner_decisions;
+    stats->changes = tuner_changes;
+    stats->params = last_params;
+    stats->last = last_sample;
+    spin_unlock_irqrestore(&stats_lock, flags);
+}
+
+/**
+ * Print the tuner statistics
+ */
+void neural_print_stats(void) {
+    neural_stats_t stats;
+    neural_get_stats(&stats);
+    
+    kprintf("Neural Resource Optimization:\n");
+    kprintf("  Policy:          %s (%u periods, %u tuned, %u changes)\n",
+            stats.policy, stats.periods, stats.decisions, stats.changes);
+    
+    kprintf("  Size classes:   ");
+    for (uint32_t c = 0; c < stats.params.class_count; c++) {
+        kprintf(" %u", stats.params.classes[c]);
+    }
+    kprintf("\n");
+    
+    kprintf("  Magazines:       %u frames, %u objects\n",
+            stats.params.pmm_magazine_depth, stats.params.slab_magazine_depth);
+    kprintf("  Heap step:       %u pages\n", stats.params.heap_expand_pages);
+    kprintf("  Zeroed pool:     %u frames\n", stats.params.zero_watermark);
+    kprintf("  Last period:     %u allocs (%u large), %u frees, %u heap expansions\n",
+            stats.last.allocs, stats.last.large_allocs, stats.last.frees, stats.last.heap_expansions);
+    kprintf("  Magazine trips:  PMM %u/%u, slab %u/%u (refills/drains)\n",
+            stats.last.pmm.refills, stats.last.pmm.drains, stats.last.slab_refills, stats.last.slab_drains);
+    
+    kprintf("  Lifetimes:");
+    for (uint32_t b = 0; b < NEURAL_LIFETIME_BUCKETS; b++) {
+        if (stats.last.lifetimes[b]) {
+            kprintf(" 4^%u+:%u", b, stats.last.lifetimes[b]);
+        }
+    }
+    kprintf(" (TSC cycles)\n");
+}
\ No newline at end of file
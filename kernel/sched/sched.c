@@ -0,0 +1,568 @@
+/**
+ * NKOF Scheduler Implementation
+ *
+ * Every CPU has a run queue holding a FIFO per priority and a bitmap with
+ * one bit per non-empty FIFO. The next task is the head of the FIFO for
+ * the lowest set bit. A CPU with an empty queue steals the head of the
+ * highest-priority FIFO from the busiest other queue, using trylock so
+ * two stealing CPUs can never deadlock.
+ *
+ * Preemption is driven by a one-shot time slice timer per CPU, armed only
+ * while other tasks are waiting. It sets need_resched, and the switch
+ * happens on the way out of the interrupt. A CPU that makes work for
+ * another one (a wakeup, or a new task while others sit idle) sends it a
+ * reschedule IPI.
+ *
+ * A run queue's lock is held across a switch and released by the task
+ * switched to, so a task going to sleep can't be woken, and a preempted
+ * task can't be stolen, while it's still on its old stack.
+ */
+
+#include "../include/sched.h"
+#include "../include/slab.h"
+#include "../include/kheap.h"
+#include "../include/spinlock.h"
+#include "../include/interrupts.h"
+#include "../include/string.h"
+#include "../include/cpu.h"
+#include "../include/klog.h"
+#include "../include/smp.h"
+#include "../include/pmm.h"
+
+// Frames the idle task zeroes between checks for work
+#define IDLE_ZERO_BATCH 4
+
+// Per-CPU run queue
+typedef struct {
+    spinlock_t lock;
+    uint32_t bitmap;                        // Bit n set: ready[n] is non-empty
+    task_t* ready_head[SCHED_PRIORITIES];   // FIFO of ready tasks per priority
+    task_t* ready_tail[SCHED_PRIORITIES];
+    uint32_t nr_ready;                      // Tasks on the FIFOs
+    task_t* current;                        // Running task
+    task_t* idle;                           // Runs when nothing else is ready
+    task_t* prev;                           // Task switched away from, for schedule_tail
+    timer_event_t slice_timer;              // Ends the current time slice
+    bool need_resched;                      // Switch at the next interrupt exit
+    bool online;                            // Run queue is in use
+} runqueue_t;
+
+// Assembly context switch
+extern void context_switch(uint32_t* old_esp, uint32_t new_esp);
+
+static runqueue_t runqueues[SMP_MAX_CPUS];
+static kmem_cache_t* task_cache = NULL;
+static uint32_t next_task_id = 0;
+
+// Tasks carry FXSAVE state when SSE is enabled
+static bool save_fpu = false;
+
+static inline runqueue_t* this_rq(void) {
+    return &runqueues[smp_cpu_index()];
+}
+
+/**
+ * Add a task to the tail of its priority's FIFO
+ */
+static void rq_enqueue(runqueue_t* rq, task_t* task) {
+    uint32_t prio = task->priority;
+    
+    task->next = NULL;
+    if (rq->ready_tail[prio]) {
+        rq->ready_tail[prio]->next = task;
+    } else {
+        rq->ready_head[prio] = task;
+    }
+    rq->ready_tail[prio] = task;
+    
+    rq->bitmap |= 1u << prio;
+    rq->nr_ready++;
+    task->cpu = rq - runqueues;
+    task->state = TASK_READY;
+}
+
+/**
+ * Take the first task of the highest non-empty priority, NULL if empty
+ */
+static task_t* rq_dequeue(runqueue_t* rq) {
+    if (!rq->bitmap) {
+        return NULL;
+    }
+    
+    uint32_t prio = __builtin_ctz(rq->bitmap);
+    task_t* task = rq->ready_head[prio];
+    
+    rq->ready_head[prio] = task->next;
+    if (!task->next) {
+        rq->ready_tail[prio] = NULL;
+        rq->bitmap &= ~(1u << prio);
+    }
+    rq->nr_ready--;
+    task->next = NULL;
+    
+    return task;
+}
+
+/**
+ * Steal a ready task from the busiest other run queue
+ */
+static task_t* rq_steal(runqueue_t* rq) {
+    runqueue_t* victim = NULL;
+    uint32_t most = 0;
+    
+    // Unlocked scan: a stale count only makes stealing less precise
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        runqueue_t* other = &runqueues[i];
+        if (other != rq && other->online && other->nr_ready > most) {
+            most = other->nr_ready;
+            victim = other;
+        }
+    }
+    
+    if (!victim || !spin_trylock(&victim->lock)) {
+        return NULL;
+    }
+    
+    task_t* task = rq_dequeue(victim);
+    spin_unlock(&victim->lock);
+    
+    if (task) {
+        task->cpu = rq - runqueues;
+    }
+    return task;
+}
+
+/**
+ * End of a time slice: switch at the interrupt exit
+ */
+static void slice_expired(timer_event_t* event) {
+    runqueue_t* rq = (runqueue_t*)event->data;
+    rq->need_resched = true;
+    
+    // The slice may have been started by another CPU's wakeup
+    if (rq != this_rq()) {
+        smp_send_reschedule(rq - runqueues);
+    }
+}
+
+/**
+ * Ask a run queue's CPU to reschedule
+ */
+static void rq_resched(runqueue_t* rq) {
+    rq->need_resched = true;
+    if (rq != this_rq()) {
+        smp_send_reschedule(rq - runqueues);
+    }
+}
+
+/**
+ * Wake an idle CPU so it steals the work just queued on rq
+ */
+static void rq_kick_idle(runqueue_t* rq) {
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        runqueue_t* other = &runqueues[i];
+        if (other != rq && other->online && other->current == other->idle) {
+            smp_send_reschedule(i);
+            return;
+        }
+    }
+}
+
+/**
+ * Make sure the running task's slice ends now that another task is waiting
+ */
+static void rq_start_slice(runqueue_t* rq) {
+    if (rq->current != rq->idle && !rq->slice_timer.pending) {
+        timer_add(&rq->slice_timer, timer_now_ns() + SCHED_TIMESLICE_NS);
+    }
+}
+
+/**
+ * Finish a switch in the context of the task switched to
+ */
+static void schedule_tail(void) {
+    runqueue_t* rq = this_rq();
+    task_t* prev = rq->prev;
+    rq->prev = NULL;
+    
+    spin_unlock(&rq->lock);
+    
+    // A finished task can only be freed once we're off its stack
+    if (prev && prev->state == TASK_DEAD) {
+        if (prev->stack) {
+            kfree(prev->stack);
+        }
+        kmem_cache_free(task_cache, prev);
+    }
+}
+
+/**
+ * Pick the next task and switch to it
+ * Called with the run queue locked and interrupts off, returns with the
+ * lock released and the interrupt state restored to flags
+ */
+static void schedule_locked(runqueue_t* rq, uint32_t flags) {
+    task_t* current = rq->current;
+    rq->need_resched = false;
+    
+    // A task that is still runnable goes to the back of its FIFO
+    if (current->state == TASK_RUNNING && current != rq->idle) {
+        rq_enqueue(rq, current);
+    }
+    
+    task_t* next = rq_dequeue(rq);
+    if (!next) {
+        next = rq_steal(rq);
+    }
+    if (!next) {
+        next = rq->idle;
+    }
+    
+    next->state = TASK_RUNNING;
+    
+    // Slice the CPU only while someone else is waiting for it
+    if (rq->nr_ready > 0 && next != rq->idle) {
+        timer_add(&rq->slice_timer, timer_now_ns() + SCHED_TIMESLICE_NS);
+    } else {
+        timer_cancel(&rq->slice_timer);
+    }
+    
+    if (next == current) {
+        spin_unlock(&rq->lock);
+        interrupts_restore(flags);
+        return;
+    }
+    
+    // Account the time the outgoing task ran
+    uint64_t now = timer_now_ns();
+    current->runtime_ns += now - current->switched_in_ns;
+    next->switched_in_ns = now;
+    
+    rq->current = next;
+    rq->prev = current;
+    
+    if (save_fpu) {
+        asm volatile ("fxsave %0" : "=m" (current->fpu_state));
+        asm volatile ("fxrstor %0" : : "m" (next->fpu_state));
+    }
+    
+    context_switch(&current->esp, next->esp);
+    
+    // Running again, possibly much later
+    schedule_tail();
+    interrupts_restore(flags);
+}
+
+/**
+ * Pick the next task and switch to it
+ */
+void schedule(void) {
+    uint32_t flags = interrupts_save();
+    runqueue_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    
+    schedule_locked(rq, flags);
+}
+
+/**
+ * First code a new task runs, entered from context_switch's ret
+ */
+static void task_bootstrap(void) {
+    schedule_tail();
+    interrupts_enable();
+    
+    task_t* task = task_current();
+    task->entry(task->arg);
+    
+    task_exit();
+}
+
+/**
+ * Allocate and fill in a task structure
+ */
+static task_t* task_alloc(const char* name, uint32_t priority) {
+    task_t* task = (task_t*)kmem_cache_alloc(task_cache);
+    if (!task) {
+        return NULL;
+    }
+    
+    memset(task, 0, sizeof(task_t));
+    task->id = next_task_id++;
+    task->name = name;
+    task->priority = priority < SCHED_PRIORITIES ? priority : SCHED_PRIORITIES - 1;
+    task->sleep_timer.data = task;
+    
+    // Start from a valid FPU image
+    if (save_fpu) {
+        asm volatile ("fxsave %0" : "=m" (task->fpu_state));
+    }
+    
+    return task;
+}
+
+/**
+ * Give a task a stack that starts in task_bootstrap
+ */
+static bool task_setup_stack(task_t* task) {
+    task->stack = kmalloc(TASK_STACK_SIZE);
+    if (!task->stack) {
+        return false;
+    }
+    
+    // Commit every page now: a fault on an absent stack page can't be handled
+    memset(task->stack, 0, TASK_STACK_SIZE);
+    
+    // Frame popped by context_switch: EFLAGS, EDI, ESI, EBX, EBP, return address
+    uint32_t* sp = (uint32_t*)((uint8_t*)task->stack + TASK_STACK_SIZE);
+    *--sp = (uint32_t)task_bootstrap;
+    *--sp = 0;                 // EBP
+    *--sp = 0;                 // EBX
+    *--sp = 0;                 // ESI
+    *--sp = 0;                 // EDI
+    *--sp = 0x002;             // EFLAGS: interrupts off until schedule_tail
+    task->esp = (uint32_t)sp;
+    
+    return true;
+}
+
+/**
+ * Wake a sleeping task from its timer
+ */
+static void sleep_expired(timer_event_t* event) {
+    task_wake((task_t*)event->data);
+}
+
+/**
+ * Create a task and make it runnable
+ */
+task_t* task_create(const char* name, void (*entry)(void* arg), void* arg, uint32_t priority) {
+    task_t* task = task_alloc(name, priority);
+    if (!task) {
+        return NULL;
+    }
+    
+    if (!task_setup_stack(task)) {
+        kprintf("ERROR: Out of memory for task stack\n");
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    
+    task->entry = entry;
+    task->arg = arg;
+    task->sleep_timer.callback = sleep_expired;
+    
+    // New tasks start on the creating CPU, idle CPUs steal them from there
+    runqueue_t* rq = this_rq();
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
+    rq_enqueue(rq, task);
+    if (task->priority < rq->current->priority || rq->current == rq->idle) {
+        rq->need_resched = true;
+    } else {
+        rq_start_slice(rq);
+        rq_kick_idle(rq);
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    return task;
+}
+
+/**
+ * Get the running task
+ */
+task_t* task_current(void) {
+    return this_rq()->current;
+}
+
+/**
+ * End the running task
+ */
+void task_exit(void) {
+    uint32_t flags = interrupts_save();
+    runqueue_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    
+    rq->current->state = TASK_DEAD;
+    schedule_locked(rq, flags);
+    
+    // Not reached: dead tasks are never picked again
+    for (;;) {
+        asm volatile ("hlt");
+    }
+}
+
+/**
+ * Give up the CPU to another ready task
+ */
+void task_yield(void) {
+    schedule();
+}
+
+/**
+ * Sleep for at least the given number of nanoseconds
+ */
+void task_sleep(uint64_t ns) {
+    uint32_t flags = interrupts_save();
+    runqueue_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    
+    // The wakeup needs this lock, so it can't run before we're off the CPU
+    task_t* task = rq->current;
+    task->state = TASK_SLEEPING;
+    timer_add(&task->sleep_timer, timer_now_ns() + ns);
+    
+    schedule_locked(rq, flags);
+}
+
+/**
+ * Sleep until task_wake, releasing the caller's lock
+ */
+void task_block(spinlock_t* lock, uint32_t flags) {
+    runqueue_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    
+    // Asleep before the caller's lock goes, so its waker finds us sleeping or waits for the switch
+    rq->current->state = TASK_SLEEPING;
+    spin_unlock(lock);
+    
+    schedule_locked(rq, flags);
+}
+
+/**
+ * Make a sleeping task runnable
+ */
+void task_wake(task_t* task) {
+    runqueue_t* rq = &runqueues[task->cpu];
+    uint32_t flags = spin_lock_irqsave(&rq->lock);
+    
+    if (task->state == TASK_SLEEPING) {
+        timer_cancel(&task->sleep_timer);
+        rq_enqueue(rq, task);
+        
+        // Preempt a lower-priority task or the idle loop
+        if (task->priority < rq->current->priority || rq->current == rq->idle) {
+            rq_resched(rq);
+        } else {
+            rq_start_slice(rq);
+            rq_kick_idle(rq);
+        }
+    }
+    
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+/**
+ * Called on the way out of an interrupt
+ */
+void sched_irq_exit(void) {
+    runqueue_t* rq = this_rq();
+    
+    if (rq->current && rq->need_resched) {
+        schedule();
+    }
+}
+
+/**
+ * Run the idle loop on this CPU
+ */
+void sched_idle(void) {
+    for (;;) {
+        schedule();
+        
+        // Idle time is when the kernel log gets written out
+        klog_drain();
+        
+        // Magazines of retired slab caches are emptied by their own CPU
+        slab_reap();
+        
+        // It's also when free frames get zeroed ahead of time, a batch per pass
+        bool zeroing = pmm_refill_zeroed_pages(IDLE_ZERO_BATCH) > 0;
+        
+        // Check for work and halt atomically, a wakeup re-enables interrupts
+        // Keep going instead while the zeroed pool is still filling
+        interrupts_disable();
+        if (this_rq()->nr_ready == 0 && !zeroing) {
+            timer_idle();
+        } else {
+            interrupts_enable();
+        }
+    }
+}
+
+/**
+ * Entry point of the boot CPU's idle task
+ */
+static void idle_entry(void* arg) {
+    (void)arg;
+    sched_idle();
+}
+
+/**
+ * Prepare a run queue
+ */
+static void rq_init(runqueue_t* rq) {
+    memset(rq, 0, sizeof(runqueue_t));
+    spin_init(&rq->lock);
+    rq->slice_timer.callback = slice_expired;
+    rq->slice_timer.data = rq;
+}
+
+/**
+ * Set up the run queue of another CPU
+ */
+void sched_init_cpu(uint32_t cpu) {
+    if (cpu >= SMP_MAX_CPUS) {
+        kprintf("ERROR: CPU index beyond SMP_MAX_CPUS\n");
+        return;
+    }
+    
+    runqueue_t* rq = &runqueues[cpu];
+    rq_init(rq);
+    
+    // The CPU's boot context is its idle task, its stack belongs to the caller
+    task_t* idle = task_alloc("idle", SCHED_PRIORITIES - 1);
+    if (!idle) {
+        kprintf("ERROR: Cannot create idle task\n");
+        return;
+    }
+    idle->cpu = cpu;
+    idle->state = TASK_RUNNING;
+    idle->switched_in_ns = timer_now_ns();
+    
+    rq->current = idle;
+    rq->idle = idle;
+    rq->online = true;
+}
+
+/**
+ * Set up the scheduler on the boot CPU
+ */
+void sched_init(void) {
+    kprintf("Initializing scheduler...\n");
+    
+    save_fpu = (read_cr4() & CR4_OSFXSR) != 0;
+    task_cache = kmem_cache_create("task", sizeof(task_t), 16);
+    if (!task_cache) {
+        kprintf("ERROR: Cannot create task cache\n");
+        return;
+    }
+    
+    runqueue_t* rq = &runqueues[0];
+    rq_init(rq);
+    
+    // The boot context carries on as the "main" task
+    task_t* main_task = task_alloc("main", SCHED_DEFAULT_PRIORITY);
+    task_t* idle = task_alloc("idle", SCHED_PRIORITIES - 1);
+    if (!main_task || !idle || !task_setup_stack(idle)) {
+        kprintf("ERROR: Cannot create boot tasks\n");
+        return;
+    }
+    idle->entry = idle_entry;
+    
+    main_task->state = TASK_RUNNING;
+    main_task->switched_in_ns = timer_now_ns();
+    rq->current = main_task;
+    rq->idle = idle;
+    rq->online = true;
+    
+    kprintf("Scheduler initialized.\n");
+}
\ No newline at end of file
@@ -0,0 +1,275 @@
+/**
+ * NKOF Timekeeping and Timer Events Implementation
+ *
+ * The TSC and the local APIC timer are both calibrated against a 10 ms
+ * PIT busy-wait. Time since boot is the TSC delta scaled by a fixed-point
+ * multiplier, so reading the clock needs no division.
+ *
+ * Every CPU has its own list of pending events sorted by deadline, and
+ * events are queued on the CPU that adds them. Whenever the head changes,
+ * that CPU's local APIC timer (or PIT channel 0 when there is no APIC) is
+ * programmed as a one-shot for the head's deadline. An event cancelled
+ * from another CPU can leave its old queue's timer armed early, which
+ * costs one interrupt that finds nothing to do.
+ */
+
+#include "../include/timer.h"
+#include "../include/apic.h"
+#include "../include/pic.h"
+#include "../include/pit.h"
+#include "../include/interrupts.h"
+#include "../include/cpu.h"
+#include "../include/math.h"
+#include "../include/klog.h"
+#include "../include/smp.h"
+#include "../include/spinlock.h"
+
+// Fixed-point shift of the TSC to ns multiplier
+#define TSC_MULT_SHIFT 22
+
+// Calibration window
+#define CALIBRATION_MS 10
+
+// Longest single hardware programming, longer waits are re-armed
+#define MAX_ONESHOT_NS (1000 * NSEC_PER_SEC)
+#define MAX_PIT_ONESHOT_NS (50 * NSEC_PER_MSEC)
+
+// Clock state
+static uint64_t tsc_base = 0;
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_mult = 0;          // ns per TSC tick << TSC_MULT_SHIFT
+
+// One-shot hardware state
+static bool use_apic = false;
+static uint32_t apic_ticks_per_ms = 0;
+
+// Pending events of one CPU, earliest deadline first
+typedef struct {
+    spinlock_t lock;
+    timer_event_t* head;
+} timer_queue_t;
+
+static timer_queue_t timer_queues[SMP_MAX_CPUS];
+
+/**
+ * Get the time since boot in nanoseconds
+ */
+uint64_t timer_now_ns(void) {
+    if (tsc_mult == 0) {
+        return 0;
+    }
+    
+    // 96-bit product of the delta and the multiplier, shifted back down
+    uint64_t delta = rdtsc() - tsc_base;
+    uint64_t high = (uint64_t)(uint32_t)(delta >> 32) * tsc_mult;
+    uint64_t low = (uint64_t)(uint32_t)delta * tsc_mult;
+    
+    return (high << (32 - TSC_MULT_SHIFT)) + (low >> TSC_MULT_SHIFT);
+}
+
+/**
+ * Get the calibrated TSC frequency in kHz
+ */
+uint32_t timer_tsc_khz(void) {
+    return tsc_khz;
+}
+
+/**
+ * Program this CPU's hardware for the earliest deadline of its queue
+ */
+static void timer_program(timer_queue_t* queue) {
+    if (!queue->head) {
+        if (use_apic) {
+            apic_timer_stop();
+        }
+        return;
+    }
+    
+    uint64_t now = timer_now_ns();
+    uint64_t delta = queue->head->deadline > now ? queue->head->deadline - now : 0;
+    
+    if (use_apic) {
+        if (delta > MAX_ONESHOT_NS) {
+            delta = MAX_ONESHOT_NS;
+        }
+        
+        uint64_t ticks = div64_32(delta * apic_ticks_per_ms, (uint32_t)NSEC_PER_MSEC);
+        apic_timer_oneshot(ticks > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)ticks);
+    } else {
+        if (delta > MAX_PIT_ONESHOT_NS) {
+            delta = MAX_PIT_ONESHOT_NS;
+        }
+        
+        pit_set_oneshot((uint32_t)div64_32(delta * PIT_FREQUENCY, (uint32_t)NSEC_PER_SEC));
+    }
+}
+
+/**
+ * Unlink an event from the queue, returns true if it was the head
+ */
+static bool timer_unlink(timer_queue_t* queue, timer_event_t* event) {
+    for (timer_event_t** link = &queue->head; *link; link = &(*link)->next) {
+        if (*link == event) {
+            bool was_head = (link == &queue->head);
+            *link = event->next;
+            event->next = NULL;
+            event->pending = false;
+            return was_head;
+        }
+    }
+    
+    return false;
+}
+
+/**
+ * Queue an event to fire at an absolute deadline
+ */
+void timer_add(timer_event_t* event, uint64_t deadline) {
+    uint32_t flags = interrupts_save();
+    
+    // Take it off whichever queue it's on, possibly another CPU's
+    timer_cancel(event);
+    
+    uint32_t cpu = smp_cpu_index();
+    timer_queue_t* queue = &timer_queues[cpu];
+    spin_lock(&queue->lock);
+    
+    event->deadline = deadline;
+    event->cpu = cpu;
+    event->pending = true;
+    
+    // Insert after every event with an earlier or equal deadline
+    timer_event_t** link = &queue->head;
+    while (*link && (*link)->deadline <= deadline) {
+        link = &(*link)->next;
+    }
+    event->next = *link;
+    *link = event;
+    
+    // New earliest deadline: re-arm the hardware
+    if (queue->head == event) {
+        timer_program(queue);
+    }
+    
+    spin_unlock(&queue->lock);
+    interrupts_restore(flags);
+}
+
+/**
+ * Remove a pending event
+ */
+void timer_cancel(timer_event_t* event) {
+    if (!event->pending) {
+        return;
+    }
+    
+    timer_queue_t* queue = &timer_queues[event->cpu];
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    
+    // Only this CPU's own timer can be re-armed from here
+    if (event->pending && timer_unlink(queue, event) && event->cpu == smp_cpu_index()) {
+        timer_program(queue);
+    }
+    
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+/**
+ * Fire every expired event and re-arm for the next one
+ */
+static void timer_interrupt(interrupt_frame_t* frame) {
+    (void)frame;
+    
+    timer_queue_t* queue = &timer_queues[smp_cpu_index()];
+    spin_lock(&queue->lock);
+    
+    uint64_t now = timer_now_ns();
+    while (queue->head && queue->head->deadline <= now) {
+        timer_event_t* event = queue->head;
+        queue->head = event->next;
+        event->next = NULL;
+        event->pending = false;
+        
+        // Callbacks may queue new events, so they run without the lock
+        spin_unlock(&queue->lock);
+        if (event->callback) {
+            event->callback(event);
+        }
+        spin_lock(&queue->lock);
+        
+        // Callbacks may take a while
+        now = timer_now_ns();
+    }
+    
+    timer_program(queue);
+    spin_unlock(&queue->lock);
+    
+    if (use_apic) {
+        apic_eoi();
+    } else {
+        pic_send_eoi(PIT_IRQ);
+    }
+}
+
+/**
+ * Halt until the next interrupt
+ */
+void timer_idle(void) {
+    // sti takes effect after hlt starts, so no wakeup is lost in between
+    asm volatile ("sti; hlt" : : : "memory");
+}
+
+/**
+ * Calibrate the clock and set up the one-shot timer hardware
+ */
+void timer_init(void) {
+    kprintf("Initializing timers...\n");
+    
+    // Move the PIC off the exception vectors before interrupts are enabled
+    pic_init();
+    
+    if (!(cpu_features_edx() & CPUID_EDX_TSC)) {
+        kprintf("WARNING: No TSC, timers are unavailable\n");
+        return;
+    }
+    
+    use_apic = apic_init();
+    
+    // Measure the TSC and APIC timer rates over the same PIT interval
+    if (use_apic) {
+        apic_timer_start_free_running();
+    }
+    uint64_t start = rdtsc();
+    pit_wait_ms(CALIBRATION_MS);
+    uint64_t end = rdtsc();
+    if (use_apic) {
+        apic_ticks_per_ms = apic_timer_elapsed() / CALIBRATION_MS;
+        apic_timer_stop();
+    }
+    
+    tsc_khz = (uint32_t)div64_32(end - start, CALIBRATION_MS);
+    if (tsc_khz < 1000) {
+        kprintf("WARNING: TSC calibration failed, timers are unavailable\n");
+        tsc_khz = 0;
+        return;
+    }
+    tsc_mult = (uint32_t)div64_32(NSEC_PER_MSEC << TSC_MULT_SHIFT, tsc_khz);
+    tsc_base = rdtsc();
+    
+    // An APIC timer that didn't move is no use
+    if (use_apic && apic_ticks_per_ms == 0) {
+        use_apic = false;
+    }
+    
+    if (use_apic) {
+        interrupts_register_handler(APIC_TIMER_VECTOR, timer_interrupt);
+    } else {
+        interrupts_register_handler(PIC_IRQ_BASE + PIT_IRQ, timer_interrupt);
+        
+        // Leave the BIOS periodic mode: one last interrupt, then quiet
+        pit_set_oneshot(PIT_MAX_TICKS);
+        pic_unmask(PIT_IRQ);
+    }
+    
+    kprintf("TSC: %u MHz, one-shot timer: %s\n", (uint32_t)(tsc_khz / 1000), use_apic ? "local APIC" : "PIT");
+}
\ No newline at end of file